@@ -40,8 +40,13 @@
             esp0-bot
             (- esp0-max esp0-top)
             (value->string (value-field task "name") #:encoding "ascii")
-            (if (equal? 0 (value->integer (value-field task "is_blocked")))
-              "b" "B")
+            (let ((block-state (value->integer (value-field task "block_state"))))
+              (cond
+                ((equal? block-state (value->integer (parse-and-eval "TASK_BLOCKED")))
+                 "B")
+                ((equal? block-state (value->integer (parse-and-eval "TASK_BLOCKING")))
+                 "~")
+                (else "b")))
             (if (equal? 0 (value->integer (value-field task "is_terminating")))
               "t" "T")
             (if (equal? 0 (value->integer (value-field task "is_sleeping")))
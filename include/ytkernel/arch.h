@@ -34,6 +34,26 @@ void arch_get_ints_enabled(void);
 void arch_ack_int(void);
 void arch_map_irq(uint32_t irq, uint32_t vec);
 
+/**
+ * Reserves @a num_vecs consecutive MSI vectors.
+ *
+ * The first vector is aligned to @a num_vecs, because a device that sends
+ * multiple messages puts the message number into the low bits of the vector.
+ *
+ * @param num_vecs      Number of vectors, a power of two.
+ * @param out_first_vec Output, the first reserved vector.
+ *
+ * @returns `false` if there are no such free vectors.
+ */
+bool arch_alloc_msi_vecs(size_t num_vecs, uint8_t *out_first_vec);
+
+/**
+ * Sets the handler of MSI vector @a vec, reserved by #arch_alloc_msi_vecs().
+ * The handler is called in the interrupt context, the interrupt is
+ * acknowledged after it returns.
+ */
+void arch_set_msi_handler(uint8_t vec, void (*handler)(void *ctx), void *ctx);
+
 void arch_send_ipi(uint8_t proc_num, uint8_t vector);
 void arch_broadcast_ipi(uint8_t vector);
 void arch_ack_ipi(void);
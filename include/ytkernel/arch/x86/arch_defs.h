@@ -3,11 +3,19 @@
 #define ARCH_VEC_KSYSCALL      0x64
 /**
  * Interrupt number for the global AHCI interrupts.
- * IRQs of all AHCI controllers are mapped to this vector in the I/O APIC.
+ * IRQs of all AHCI controllers are mapped to this vector in the I/O APIC,
+ * until they are switched to MSI, see #ARCH_VEC_MSI_FIRST.
  */
 #define ARCH_VEC_AHCI_GLOBAL   0xA0
+/**
+ * First vector available to Message Signaled Interrupts.
+ * See #arch_alloc_msi_vecs().
+ */
+#define ARCH_VEC_MSI_FIRST     0xB0
+#define ARCH_NUM_MSI_VECS      16 //!< Number of MSI vectors.
 #define ARCH_VEC_HALT          0xF1 //!< Halt on panic.
 #define ARCH_VEC_TLB_SHOOTDOWN 0xF2 //!< TLB shootdown.
+#define ARCH_VEC_RESCHED       0xF3 //!< Reschedule, see #smp_send_resched().
 
 // physical/virtual (identity-mapped)
 #define ARCH_AP_TRAMPOLINE_ADDR 0x8000
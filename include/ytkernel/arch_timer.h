@@ -5,3 +5,29 @@
 void arch_timer_init(void);
 uint64_t arch_timer_current_ms(void);
 void arch_timer_busy_wait_ms(uint64_t msec);
+
+/**
+ * Stops the periodic scheduler tick of the running processor, and has it
+ * interrupt once after @a delay_ms instead.
+ *
+ * It is called with interrupts disabled. The tick is restarted with
+ * #arch_timer_start_tick().
+ */
+void arch_timer_stop_tick(uint32_t delay_ms);
+
+/// Restarts the periodic scheduler tick of the running processor.
+void arch_timer_start_tick(void);
+
+/**
+ * Calibrates the microsecond counter, see #arch_timer_current_us().
+ * Interrupts must be enabled, since it waits for #arch_timer_current_ms().
+ */
+void arch_timer_calib(void);
+
+/**
+ * Returns a high-resolution timestamp in microseconds.
+ *
+ * Only differences of timestamps are meaningful. It returns 0 until
+ * #arch_timer_calib() is called. It is safe to call it in an IRQ handler.
+ */
+uint64_t arch_timer_current_us(void);
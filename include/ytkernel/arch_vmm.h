@@ -42,5 +42,15 @@ void vmm_invlpg(uint32_t virt);
 bool vmm_is_paging_enabled(void);
 bool vmm_is_addr_mapped(uint32_t virt);
 
+/**
+ * Translates a virtual address in the current address space to a physical one.
+ *
+ * @param virt      Virtual address.
+ * @param out_phys  Physical address that @a virt is mapped to.
+ *
+ * @returns `false` if @a virt is not mapped.
+ */
+bool vmm_virt_to_phys(vaddr_t virt, paddr_t *out_phys);
+
 // Defined in vmm.s.
 void vmm_load_dir(void const *p_dir);
@@ -11,6 +11,7 @@ typedef enum {
     CHARDEV_SERIAL,
     CHARDEV_CONSOLE,
     CHARDEV_TTY,
+    CHARDEV_BLKTRACE,
 } chardev_type_t;
 
 typedef struct {
@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #include "blkdev/blkdev.h"
+#include "blkdev/blkmap.h"
 #include "blkdev/gpt.h"
 
 typedef enum {
@@ -20,6 +21,10 @@ typedef enum {
     DEVMGR_DRVIER_NONE,
     DEVMGR_DRIVER_AHCI_PORT,
     DEVMGR_DRIVER_BLKPART,
+    DEVMGR_DRIVER_RAMDISK,
+    DEVMGR_DRIVER_VIRTIO_BLK,
+    DEVMGR_DRIVER_NVME,
+    DEVMGR_DRIVER_BLKMAP,
 } devmgr_driver_t;
 
 typedef struct {
@@ -46,15 +51,42 @@ typedef struct {
 /// Enumerates devices and loads appropriate drivers.
 void devmgr_init(void);
 
+/**
+ * Probes the storage controllers found by #devmgr_init(), and registers their
+ * online ports as block devices. Then, registers the RAM disks requested on
+ * the kernel command line, see ramdisk.h.
+ *
+ * It must be called from a task, since the probe sleeps, and before
+ * #devmgr_start_blkdev_workers().
+ */
+void devmgr_probe_blkdevs(void);
+
+/**
+ * Starts the @ref blkdev_worker_entry "worker tasks" of block devices.
+ *
+ * It must be called from a task, after the task managers of all processors
+ * have been initialized.
+ */
+void devmgr_start_blkdev_workers(void);
+
 /**
  * Initializes partitions of block devices as separate devices.
  *
- * It should be called only when the @ref blkdev_task_entry "blkdev task" has
- * initialized its request queue. Otherwise, the GPT parser wouldn't be able to
- * read anything.
+ * It should be called only after #devmgr_start_blkdev_workers(). Otherwise, the
+ * GPT parser wouldn't be able to read anything.
  */
 void devmgr_init_blkdev_parts(void);
 
+/**
+ * Registers a mapped block device, starts its worker task, and initializes its
+ * partitions.
+ *
+ * @param map_ctx Mapped device, see blkmap.h.
+ *
+ * @returns The registered device, `NULL` if there are no free device slots.
+ */
+devmgr_dev_t *devmgr_add_blkmap(blkmap_ctx_t *map_ctx);
+
 /**
  * Returns the device with ID @a id.
  * @param id Device identifier, see #devmgr_dev_t.id.
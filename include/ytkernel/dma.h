@@ -0,0 +1,155 @@
+/**
+ * @file dma.h
+ * DMA mapping API.
+ *
+ * A device accesses memory by physical addresses, and it may not reach all of
+ * physical memory, e.g., an AHCI HBA without 64-bit addressing reaches only
+ * the first 4 GiB. The highest address a device reaches is its DMA mask.
+ *
+ * Memory that a device accesses for its whole lifetime, e.g., command rings,
+ * is allocated with #dma_alloc_coherent(). Data buffers are described as
+ * physical segments with #dma_buf_to_segs(), and mapped for one transfer with
+ * #dma_map_segs(). Segments that the device reaches are handed to it as is.
+ * Otherwise, the data is copied through a bounce buffer taken from a pool
+ * preallocated by #dma_init().
+ *
+ * x86 keeps DMA coherent with the processor caches, so no cache maintenance
+ * is done.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kerr.h"
+#include "types.h"
+
+/// DMA mask of a device that reaches the first 4 GiB.
+#define DMA_MASK_32BIT 0xFFFFFFFFull
+
+/// DMA mask of a device that reaches all of physical memory.
+#define DMA_MASK_ALL UINT64_MAX
+
+/// Number of pages in the bounce pool, see #dma_map_segs().
+#define DMA_BOUNCE_PAGES 128
+
+/// Physically contiguous memory segment.
+typedef struct {
+    paddr_t addr; ///< Physical address of the segment.
+    uint32_t len; ///< Length of the segment (bytes).
+} dma_seg_t;
+
+typedef enum {
+    DMA_TO_DEV,   ///< The device reads the memory.
+    DMA_FROM_DEV, ///< The device writes the memory.
+} dma_dir_t;
+
+/// Mapping of segments for one transfer, see #dma_map_segs().
+typedef struct {
+    /// Segments to hand to the device.
+    const dma_seg_t *segs;
+    /// Number of items in #dma_map_t.segs.
+    size_t num_segs;
+
+    /// Segments passed to #dma_map_segs().
+    const dma_seg_t *orig_segs;
+    /// Number of items in #dma_map_t.orig_segs.
+    size_t orig_num_segs;
+    dma_dir_t dir;
+    /// Bounce buffer, its length is zero if the segments are not bounced.
+    dma_seg_t bounce_seg;
+} dma_map_t;
+
+/**
+ * Allocates the bounce pool.
+ * It must be called before the first #dma_map_segs().
+ */
+void dma_init(void);
+
+/**
+ * Describes the physical memory of a virtual buffer as segments.
+ *
+ * Pages that are adjacent in physical memory are described by one segment.
+ *
+ * @param buf       Buffer mapped in the current address space.
+ * @param size      Size of @a buf (bytes).
+ * @param out_segs  Segments of @a buf.
+ * @param max_segs  Number of items in @a out_segs.
+ *
+ * @returns
+ * - The number of segments written to @a out_segs.
+ * - Zero if a part of @a buf is not mapped, or if @a buf consists of more than
+ *   @a max_segs segments.
+ */
+size_t dma_buf_to_segs(const void *buf, size_t size, dma_seg_t *out_segs,
+                       size_t max_segs);
+
+/**
+ * Maps segments for a transfer by a device with DMA mask @a mask.
+ *
+ * If the device reaches all segments, the mapping refers to them. Otherwise,
+ * the data is placed in a bounce buffer, copied there now if @a dir is
+ * #DMA_TO_DEV. The mapping must be released with #dma_unmap().
+ *
+ * It does not block, so it may be called with a spinlock held.
+ *
+ * @param map      Output, mapping. Its segments are valid until #dma_unmap().
+ * @param segs     Segments to map, identity mapped. They must stay valid until
+ *                 #dma_unmap().
+ * @param num_segs Number of items in @a segs.
+ * @param mask     DMA mask of the device.
+ * @param dir      Transfer direction.
+ *
+ * @returns
+ * - #KERR_NONE on success.
+ * - #KERR_IN_USE if the bounce pool has no room now, see #dma_wait_bounce().
+ * - #KERR_NO_SPACE if the segments are larger than the bounce pool.
+ * - #KERR_NOT_SUPP if the device does not reach the bounce pool either.
+ */
+kerr_t dma_map_segs(dma_map_t *map, const dma_seg_t *segs, size_t num_segs,
+                    paddr_t mask, dma_dir_t dir);
+
+/**
+ * Releases a mapping made by #dma_map_segs().
+ *
+ * If the mapping is bounced and its direction is #DMA_FROM_DEV, the data is
+ * copied back to the original segments, unless @a copy_back is `false`, e.g.,
+ * because the transfer has failed. It is safe to call it in an IRQ handler,
+ * even on the processor of a task in #dma_wait_bounce().
+ */
+void dma_unmap(dma_map_t *map, bool copy_back);
+
+/// Returns `true` if @a map uses a bounce buffer.
+bool dma_is_bounced(const dma_map_t *map);
+
+/**
+ * Sleeps until a bounce buffer is released.
+ *
+ * A task that got #KERR_IN_USE from #dma_map_segs() retries after it. It
+ * returns at once if a buffer has been released since the last failed
+ * mapping. The retry may still fail if another task takes the space first.
+ */
+void dma_wait_bounce(void);
+
+/**
+ * Allocates zeroed memory that is accessed both by the processor and by a
+ * device with DMA mask @a mask.
+ *
+ * @param size     Allocation size (bytes).
+ * @param align    Alignment of both the virtual and the physical address.
+ * @param mask     DMA mask of the device.
+ * @param out_addr Output, physical address to hand to the device.
+ *
+ * @returns The virtual address of the allocation.
+ *
+ * @warning
+ * This function panics if the allocation is not physically contiguous or is
+ * not reached by the device.
+ */
+void *dma_alloc_coherent(size_t size, size_t align, paddr_t mask,
+                         paddr_t *out_addr);
+
+/// Frees memory allocated with #dma_alloc_coherent().
+void dma_free_coherent(void *buf);
@@ -10,5 +10,16 @@ typedef struct {
 } semaphore_t;
 
 void semaphore_init(semaphore_t *p_sem);
+
+/**
+ * Increases @a p_sem and wakes up a task waiting for it, if any.
+ * It is safe to call it in an IRQ handler.
+ */
 void semaphore_increase(semaphore_t *p_sem);
 void semaphore_decrease(semaphore_t *p_sem);
+
+/**
+ * Decreases @a p_sem if it is greater than zero, without blocking.
+ * @returns `true` if the semaphore has been decreased.
+ */
+bool semaphore_try_decrease(semaphore_t *p_sem);
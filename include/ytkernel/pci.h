@@ -162,7 +162,9 @@ typedef enum {
     PCI_MASS_STORAGE_RAID_CTRL,
     PCI_MASS_STORAGE_ATA_CTRL,
     PCI_MASS_STORAGE_SATA_DPA, //!< Serial ATA Direct Port Access (DPA).
-    PCI_MASS_STORAGE_OTHER,
+    PCI_MASS_STORAGE_SAS_CTRL,
+    PCI_MASS_STORAGE_NVM_CTRL, //!< Non-Volatile Memory controller.
+    PCI_MASS_STORAGE_OTHER = 0x80,
 } pci_mass_storage_subclass_t;
 
 /// Sub class #PCI_MASS_STORAGE_SATA_DPA interfaces.
@@ -170,6 +172,21 @@ typedef enum {
     PCI_SATA_INTERFACE_AHCI = 0x01,
 } pci_sata_interface_t;
 
+/// Sub class #PCI_MASS_STORAGE_NVM_CTRL interfaces.
+typedef enum {
+    PCI_NVM_INTERFACE_NVME = 0x02,
+} pci_nvm_interface_t;
+
+/**
+ * Capability IDs.
+ * Refer to Appendix H Capability IDs.
+ */
+typedef enum {
+    PCI_CAP_MSI = 0x05,    //!< Message Signaled Interrupts.
+    PCI_CAP_VENDOR = 0x09, //!< Vendor Specific.
+    PCI_CAP_MSIX = 0x11,   //!< MSI-X.
+} pci_cap_id_t;
+
 /// Internal representation of a PCI device.
 typedef struct {
     uint8_t bus_num;
@@ -177,6 +194,17 @@ typedef struct {
     uint8_t fun_num;
 
     pci_header_00h_t header;
+
+    /**
+     * Offset of the #PCI_CAP_MSI capability in the configuration space, 0 if
+     * the device does not have it.
+     */
+    uint8_t msi_cap;
+    /**
+     * Offset of the #PCI_CAP_MSIX capability in the configuration space, 0 if
+     * the device does not have it.
+     */
+    uint8_t msix_cap;
 } pci_dev_t;
 
 /// Enumerate PCI devices.
@@ -199,3 +227,86 @@ void pci_dump_dev_short(const pci_dev_t *dev);
 
 /// Prints the full header of the device.
 void pci_dump_dev_header(const pci_dev_t *dev);
+
+/**
+ * Returns the number of MSI messages that device @a dev can send, 0 if the
+ * device does not support MSI.
+ */
+size_t pci_msi_max_vecs(const pci_dev_t *dev);
+
+/**
+ * Switches device @a dev from its INTx# pin to Message Signaled Interrupts.
+ *
+ * Message number N of the device raises vector @a first_vec + N on processor
+ * @a proc_num. All messages of a device target the same processor.
+ *
+ * @param dev       Device with the #PCI_CAP_MSI capability.
+ * @param proc_num  Processor to deliver the interrupts to.
+ * @param first_vec First vector, aligned to @a num_vecs.
+ * @param num_vecs  Number of messages to enable, a power of two that is not
+ *                  larger than #pci_msi_max_vecs().
+ *
+ * @returns `false` if the device does not support the requested messages.
+ */
+bool pci_enable_msi(const pci_dev_t *dev, uint8_t proc_num, uint8_t first_vec,
+                    size_t num_vecs);
+
+/**
+ * Walks the capability list of device @a dev.
+ *
+ * @param dev    PCI device.
+ * @param cap_id Capability ID, see #pci_cap_id_t.
+ * @param after  Offset of the capability to continue after, 0 to start from
+ *               the beginning of the list.
+ *
+ * @returns Offset of the next capability @a cap_id, 0 if there is none.
+ */
+uint8_t pci_find_cap(const pci_dev_t *dev, uint8_t cap_id, uint8_t after);
+
+/// Reads the configuration space dword at byte offset @a offset.
+uint32_t pci_read_config(const pci_dev_t *dev, uint8_t offset);
+
+/**
+ * Identity maps @a size bytes at @a offset in memory BAR @a bar_idx.
+ *
+ * @param dev      PCI device.
+ * @param bar_idx  BAR number (0..5).
+ * @param offset   Offset of the region in the BAR.
+ * @param size     Size of the region (bytes).
+ * @param out_addr Output, address of the region.
+ *
+ * @returns `false` if the BAR is not a memory BAR, or if it is located above
+ * 4 GiB.
+ */
+bool pci_map_bar(const pci_dev_t *dev, size_t bar_idx, uint32_t offset,
+                 uint32_t size, uintptr_t *out_addr);
+
+/// Enables memory space decoding and bus mastering (DMA) of device @a dev.
+void pci_enable_bus_master(const pci_dev_t *dev);
+
+/**
+ * Returns the number of MSI-X table entries of device @a dev, 0 if the device
+ * does not support MSI-X.
+ */
+size_t pci_msix_num_vecs(const pci_dev_t *dev);
+
+/**
+ * Switches device @a dev from its INTx# pin to MSI-X.
+ *
+ * All table entries are masked, see #pci_set_msix_vec().
+ *
+ * @returns `false` if the device does not support MSI-X, or its table cannot
+ * be mapped.
+ */
+bool pci_enable_msix(const pci_dev_t *dev);
+
+/**
+ * Points MSI-X table entry @a entry of device @a dev to vector @a vec on
+ * processor @a proc_num, and unmasks it.
+ *
+ * Unlike MSI, each entry of a device may target a different processor.
+ *
+ * @returns `false` if there is no such entry.
+ */
+bool pci_set_msix_vec(const pci_dev_t *dev, size_t entry, uint8_t proc_num,
+                      uint8_t vec);
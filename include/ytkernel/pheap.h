@@ -0,0 +1,79 @@
+/**
+ * @file pheap.h
+ * Intrusive pairing heap (min-heap).
+ *
+ * Nodes are embedded in their containers like #list_node_t, so the heap never
+ * allocates memory and may be used with a spinlock held. Insertion and
+ * peeking at the minimum are O(1), popping the minimum is amortized
+ * O(log n).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Converts @a p_node to a pointer to its container type @a struct_type.
+ * See #LIST_NODE_TO_STRUCT.
+ */
+#define PHEAP_NODE_TO_STRUCT(p_node, struct_type, node_name_in_struct)         \
+    ((struct_type *)(((unsigned char *)(p_node)) -                             \
+                     offsetof(struct_type, node_name_in_struct)))
+
+struct pheap_node;
+
+typedef struct pheap_node {
+    struct pheap_node *p_child;
+    struct pheap_node *p_sibling;
+} pheap_node_t;
+
+/**
+ * Node comparison function.
+ * @returns `true` if the container of @a p_a goes before the container of
+ * @a p_b.
+ */
+typedef bool (*pheap_less_t)(const pheap_node_t *p_a, const pheap_node_t *p_b);
+
+typedef struct {
+    pheap_node_t *p_root;
+    pheap_less_t f_less;
+} pheap_t;
+
+/**
+ * Initializes an empty heap.
+ * @param p_heap Heap pointer.
+ * @param f_less Node comparison function.
+ */
+void pheap_init(pheap_t *p_heap, pheap_less_t f_less);
+
+/**
+ * Adds @a p_node to @a p_heap.
+ * @param p_heap Heap pointer.
+ * @param p_node Node to add, it must not be in any heap.
+ */
+void pheap_insert(pheap_t *p_heap, pheap_node_t *p_node);
+
+/**
+ * Returns the minimum node of @a p_heap without removing it.
+ * @param p_heap Heap pointer.
+ * @returns
+ * - Minimum node if the heap has any.
+ * - `NULL` if the heap is empty.
+ */
+pheap_node_t *pheap_peek(const pheap_t *p_heap);
+
+/**
+ * Removes the minimum node from @a p_heap and returns it.
+ * @param p_heap Heap pointer.
+ * @returns
+ * - Minimum node if the heap had any.
+ * - `NULL` if the heap is empty.
+ */
+pheap_node_t *pheap_pop(pheap_t *p_heap);
+
+/**
+ * Returns `true` if @a p_heap is empty (has no nodes).
+ * @param p_heap Heap pointer.
+ */
+bool pheap_is_empty(const pheap_t *p_heap);
@@ -35,3 +35,10 @@ typedef struct {
 void queue_init(queue_t *p_queue, size_t max_items, size_t item_size);
 bool queue_write(queue_t *p_queue, void *p_data);
 void queue_read(queue_t *p_queue, void *p_buf, size_t item_size);
+
+/**
+ * Reads an item from @a p_queue if there is one, without blocking.
+ * @returns `true` if an item has been read to @a p_buf, `false` if the queue
+ * is empty.
+ */
+bool queue_try_read(queue_t *p_queue, void *p_buf, size_t item_size);
@@ -89,5 +89,15 @@ void smp_init_proc_taskmgr(void);
 void smp_send_tlb_shootdown(uint32_t addr);
 void smp_tlb_shootdown_handler(void);
 
+/**
+ * Makes the processor @a proc_num run its scheduler now, instead of at its
+ * next timer tick.
+ *
+ * It is used when a task becomes runnable on a processor that runs its idle
+ * task, which may be halted with the tick stopped.
+ */
+void smp_send_resched(uint8_t proc_num);
+void smp_resched_handler(void);
+
 [[gnu::noreturn]]
 void smp_ap_trampoline_c(void);
@@ -13,9 +13,20 @@
  * - Operating on the given task manager context (possibly, a task manager
  *   of another processor).
  *
- * If SMP is enabled, the data structures of a given task manager may be
- * simultaneously accessed and modified by different processors. To preclude
- * this, a scheduler lock and task list spinlocks are used.
+ * The runnable and sleeping tasks of a task manager are owned by its processor,
+ * which accesses them with interrupts disabled and without locks or atomic
+ * operations. Other processors push the tasks they make runnable to the
+ * lock-free @ref taskmgr_t.inbox "inbox" of the task manager, which its
+ * processor drains when it schedules. The scheduler lock prevents scheduling
+ * while the running task manipulates its own state.
+ *
+ * A task is not bound to the processor that has created it. A processor that
+ * is about to run its idle task asks the busiest task manager for a runnable
+ * task, and a busy processor does the same every #TASKMGR_BALANCE_PERIOD_MS if
+ * the imbalance is large. The busiest processor hands a task over through the
+ * inbox when it schedules next. Tasks that have run recently (see
+ * #TASKMGR_CACHE_HOT_MS) and @ref task_t.is_pinned "pinned tasks" are left in
+ * place. A blocked task that is woken up by a less busy processor moves to it.
  */
 
 #pragma once
@@ -25,6 +36,7 @@
 #include "fildes.h"
 #include "kspinlock.h"
 #include "list.h"
+#include "pheap.h"
 #include "stack.h"
 
 #define TASK_NAME_LEN 32
@@ -41,8 +53,27 @@
 /// Size of userspace stacks (pages).
 #define USER_STACK_PAGES 1
 
+/**
+ * Time since a task last ran during which it is considered cache-hot (ms).
+ * Cache-hot tasks are not migrated by the load balancer.
+ */
+#define TASKMGR_CACHE_HOT_MS 5
+
+/// Period of load balancing done by a busy processor (ms).
+#define TASKMGR_BALANCE_PERIOD_MS 100
+
 typedef struct taskmgr taskmgr_t;
 
+/**
+ * Blocking state of a task.
+ * See #task_t.block_state.
+ */
+typedef enum {
+    TASK_UNBLOCKED, ///< The task is not blocked.
+    TASK_BLOCKING,  ///< The task is blocked, but it is not switched from yet.
+    TASK_BLOCKED,   ///< The task is blocked and switched from.
+} task_block_t;
+
 /**
  * Thread control block.
  * @warning
@@ -52,12 +83,19 @@ typedef struct taskmgr taskmgr_t;
 typedef struct [[gnu::packed]] {
     uint32_t page_dir_phys;
     stack_t *p_kernel_stack;
+
+    /**
+     * Nonzero while a processor runs the task or still uses its kernel stack.
+     * It is set by the scheduler before switching to the task, and cleared by
+     * #taskmgr_switch_tasks() once the context of the task is saved.
+     */
+    volatile uint32_t on_cpu;
 } tcb_t;
 
 /**
  * Task context.
  */
-typedef struct {
+typedef struct task {
     /// Kernel-level unique task ID.
     uint32_t id;
 
@@ -74,14 +112,20 @@ typedef struct {
     tcb_t tcb;
 
     /**
-     * Blocked flag.
-     * If `true`, the task cannot be switched to, until it is unblocked by a
-     * mutex release or semaphore increase operation.
+     * Blocking state.
+     * If it is not #TASK_UNBLOCKED, the task cannot be switched to, until it is
+     * unblocked by a mutex release or semaphore increase operation.
+     *
+     * A blocked task may be unblocked by another processor before its own
+     * scheduler has switched from it. The scheduler changes #TASK_BLOCKING to
+     * #TASK_BLOCKED, and #taskmgr_unblock() changes it to #TASK_UNBLOCKED, both
+     * atomically. If the scheduler is late, it keeps the task runnable,
+     * otherwise #taskmgr_unblock() queues it. So the task is queued only once.
      * @note
      * If a task is blocked (e.g., by a mutex), it must not appear on the
      * runnable tasks list and cannot be terminated.
      */
-    bool is_blocked;
+    _Atomic task_block_t block_state;
 
     /**
      * Sleeping flag.
@@ -97,6 +141,13 @@ typedef struct {
      */
     _Atomic bool is_terminating;
 
+    /**
+     * Pinned flag.
+     * If `true`, the task always runs on the processor of #task_t.taskmgr and
+     * is never migrated by the load balancer.
+     */
+    bool is_pinned;
+
     /**
      * Number of owned mutexes.
      * This value is managed by #mutex_acquire(), #mutex_release().
@@ -118,6 +169,12 @@ typedef struct {
      */
     uint64_t sleep_until_counter_ms;
 
+    /**
+     * Timer counter value at the moment the task was last switched from.
+     * See #TASKMGR_CACHE_HOT_MS.
+     */
+    uint64_t last_ran_ms;
+
     /**
      * Array of open file descriptors.
      */
@@ -126,13 +183,18 @@ typedef struct {
     /**
      * Node in the task lists.
      * Each task (except the currently running one) is always in only one of the
-     * following lists:
+     * following lists, unless it is sleeping:
      * - Runnable tasks
-     * - Sleeping tasks
      * - @ref task_mutex_t.waiting_tasks "Mutex waiting tasks"
      */
     list_node_t list_node;
 
+    /// Node in @ref taskmgr_t.sleeping_tasks "the sleeping tasks heap".
+    pheap_node_t sleep_node;
+
+    /// Next task in @ref taskmgr_t.inbox "the inbox of a task manager".
+    struct task *inbox_next;
+
     /// Node in @ref g_taskmgr_all_tasks "the list of all tasks".
     list_node_t all_tasks_list_node;
 } task_t;
@@ -162,17 +224,51 @@ struct taskmgr {
      * List of tasks that the running task can switch to (node:
      * #task_t.list_node). The tasks in this list are not sleeping and are not
      * blocked.
+     * @warning
+     * Only the processor of the task manager accesses this list, with
+     * interrupts disabled. The others use #taskmgr_t.inbox.
      */
     list_t runnable_tasks;
 
     /**
-     * List of sleeping tasks (node: #task_t.list_node).
-     * See #taskmgr_local_sleep_ms().
+     * Number of tasks in #taskmgr_t.runnable_tasks.
+     * It is only stored by the processor of the task manager, and read by the
+     * other processors choosing the busiest task manager.
      */
-    list_t sleeping_tasks;
+    _Atomic size_t num_runnable;
 
-    spinlock_t runnable_tasks_lock;
-    spinlock_t sleeping_tasks_lock;
+    /**
+     * Tasks made runnable by other processors (node: #task_t.inbox_next).
+     * It is a lock-free stack, to which any processor pushes, and which the
+     * processor of the task manager empties into #taskmgr_t.runnable_tasks
+     * when it schedules.
+     */
+    _Atomic(task_t *) inbox;
+
+    /**
+     * Task manager that asks this one for a task, see
+     * #TASKMGR_BALANCE_PERIOD_MS. The task is pushed to its inbox.
+     */
+    _Atomic(taskmgr_t *) steal_req;
+
+    /// Timer counter value to do the next periodic load balancing at.
+    uint64_t next_balance_ms;
+
+    /**
+     * `true` if the periodic tick of the processor is stopped, because it runs
+     * the idle task with nothing else to do.
+     */
+    bool is_tick_stopped;
+
+    /**
+     * Sleeping tasks ordered by #task_t.sleep_until_counter_ms (node:
+     * #task_t.sleep_node), so that the scheduler only looks at the tasks that
+     * are due. See #taskmgr_local_sleep_ms().
+     * @warning
+     * Only the processor of the task manager accesses this heap, with
+     * interrupts disabled.
+     */
+    pheap_t sleeping_tasks;
 
     /**
      * Idle task.
@@ -250,6 +346,7 @@ void taskmgr_local_init([[gnu::noreturn]] void (*p_init_entry)(void));
 
 /**
  * Performs a scheduling step.
+ * Interrupts must be disabled, since the runnable tasks list is not locked.
  *
  * @returns `true` if returned from a subsequent rescheduling, `false` if no
  * rescheduling occurred.
@@ -292,7 +389,7 @@ task_t *taskmgr_local_running_task(void);
  * maps the user stack. The initial entry point is reached in kernel-mode. See
  * #taskmgr_local_go_usermode().
  *
- * The created task runs on the current processor.
+ * The created task starts on the current processor.
  *
  * @name  name  Task name (maximum length #TASK_NAME_LEN counting NUL).
  * @param p_dir Page directory to be used by the task.
@@ -306,7 +403,7 @@ task_t *taskmgr_local_new_user_task(const char *name, uint32_t *p_dir,
 /**
  * Creates a new runnable kernel-mode task.
  *
- * The created task runs on the current processor.
+ * The created task starts on the current processor.
  *
  * @param name  Task name (maximum length #TASK_NAME_LEN counting NUL).
  * @param entry Task entry point.
@@ -315,6 +412,24 @@ task_t *taskmgr_local_new_user_task(const char *name, uint32_t *p_dir,
  */
 task_t *taskmgr_local_new_kernel_task(const char *name, uint32_t entry);
 
+/**
+ * Creates a new runnable kernel-mode task on the task manager @a taskmgr.
+ *
+ * Unlike #taskmgr_local_new_kernel_task(), @a taskmgr may belong to another
+ * processor, and the entry point receives an argument. The task is
+ * @ref task_t.is_pinned "pinned" to the processor of @a taskmgr.
+ *
+ * @param taskmgr Task manager that will run the task.
+ * @param name    Task name (maximum length #TASK_NAME_LEN counting NUL).
+ * @param entry   Task entry point, `void entry(void *arg)`.
+ * @param arg     Argument passed to @a entry.
+ *
+ * @returns Task context pointer. The task is in the runnable tasks list of @a
+ * taskmgr.
+ */
+task_t *taskmgr_new_kernel_task(taskmgr_t *taskmgr, const char *name,
+                                uint32_t entry, void *arg);
+
 /**
  * Does a far return (_iret_) with usermode segments to address @a entry.
  * @param entry Userspace entry point.
@@ -332,7 +447,7 @@ void taskmgr_local_sleep_ms(uint32_t duration_ms);
 
 /**
  * Blocks the running task and appends it to the @a task_list list.
- * See #task_t.is_blocked.
+ * See #task_t.block_state.
  *
  * @param task_list Task list to append the running task to.
  *
@@ -347,7 +462,9 @@ void taskmgr_local_sleep_ms(uint32_t duration_ms);
 void taskmgr_block_running_task(list_t *task_list);
 
 /**
- * Unblocks the task @a p_task and appends it to the runnable tasks list.
+ * Unblocks the task @a p_task and makes it runnable on its task manager.
+ * If the task manager belongs to another processor, the task is pushed to its
+ * inbox, see #taskmgr_t.inbox.
  * @param task Task to unblock (must be blocked, see
  *             #taskmgr_block_running_task()).
  * @warning
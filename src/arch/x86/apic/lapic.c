@@ -18,6 +18,10 @@
 
 static lapic_regs_t *g_lapic_regs;
 static uint32_t g_lapic_tim_freq_hz;
+/// Initial count of the periodic timer, set by #lapic_init_tim().
+static uint32_t g_lapic_tim_init_cnt;
+
+static void prv_lapic_set_tim(lapic_tim_mode_t mode, uint32_t init_cnt);
 
 void lapic_init(bool is_bsp) {
     // Set the global APIC enable bit in the IA32_APIC_BASE MSR.
@@ -122,19 +126,42 @@ void lapic_init_tim(uint32_t period_ms) {
     LOG_DEBUG("LAPIC %u: timer initial count %" PRIu32
               ", reload frequency %" PRIu32 " Hz",
               lapic_get_id(), init_cnt_val, g_lapic_tim_freq_hz / init_cnt_val);
-    g_lapic_regs->icr = init_cnt_val;
+    g_lapic_tim_init_cnt = init_cnt_val;
+    prv_lapic_set_tim(LAPIC_TIM_MODE_PERIODIC, init_cnt_val);
+}
+
+void lapic_oneshot_tim(uint32_t delay_ms) {
+    uint64_t init_cnt = (uint64_t)g_lapic_tim_freq_hz * delay_ms / 1000;
+    if (init_cnt == 0) { init_cnt = 1; }
+    if (init_cnt > UINT32_MAX) { init_cnt = UINT32_MAX; }
+    prv_lapic_set_tim(LAPIC_TIM_MODE_ONE_SHOT, init_cnt);
+}
+
+void lapic_resume_tim(void) {
+    if (g_lapic_tim_init_cnt == 0) {
+        PANIC("cannot resume LAPIC Timer - not initialized");
+    }
+    prv_lapic_set_tim(LAPIC_TIM_MODE_PERIODIC, g_lapic_tim_init_cnt);
+}
 
+void lapic_tim_irq_handler(void) {
+    lapic_send_eoi();
+    taskmgr_local_schedule();
+}
+
+/**
+ * Programs the timer of the running processor.
+ * Writing the initial count starts counting, so the mode is set first.
+ */
+static void prv_lapic_set_tim(lapic_tim_mode_t mode, uint32_t init_cnt) {
     const lapic_lvt_tim_t lvt_tim = {
         .vector = LAPIC_VEC_TIM,
         .mask = 0,
-        .tim_mode = LAPIC_TIM_MODE_PERIODIC,
+        .tim_mode = mode,
     };
     uint32_t lvt_tim_val;
     kmemcpy(&lvt_tim_val, &lvt_tim, 4);
     g_lapic_regs->lvt_tim = lvt_tim_val;
-}
 
-void lapic_tim_irq_handler(void) {
-    lapic_send_eoi();
-    taskmgr_local_schedule();
+    g_lapic_regs->icr = init_cnt;
 }
@@ -57,4 +57,18 @@ void lapic_calib_tim(void);
  */
 void lapic_init_tim(uint32_t period_ms);
 
+/**
+ * Switches the Local APIC Timer of the current processor to one-shot mode.
+ * @param delay_ms Time until the interrupt (milliseconds), it is clamped to
+ *                 the longest delay the timer can count.
+ * See #lapic_resume_tim().
+ */
+void lapic_oneshot_tim(uint32_t delay_ms);
+
+/**
+ * Switches the Local APIC Timer of the current processor back to the periodic
+ * mode set up by #lapic_init_tim().
+ */
+void lapic_resume_tim(void);
+
 void lapic_tim_irq_handler(void);
@@ -8,6 +8,7 @@
 #include "kinttypes.h"
 #include "ksyscall.h"
 #include "log.h"
+#include "kspinlock.h"
 #include "panic.h"
 #include "smp.h"
 
@@ -22,7 +23,21 @@
 // See arch/x86/linker.ld.
 extern uint32_t ld_vmm_kernel_end;
 
+/// Handler of an MSI vector, see #arch_set_msi_handler().
+typedef struct {
+    void (*handler)(void *ctx);
+    void *ctx;
+} arch_msi_handler_t;
+
+static struct {
+    spinlock_t lock;
+    /// Number of reserved vectors, starting from #ARCH_VEC_MSI_FIRST.
+    size_t num_used;
+    arch_msi_handler_t handlers[ARCH_NUM_MSI_VECS];
+} g_arch_msi;
+
 void arch_entrypoint(uint32_t magic_num, uint32_t mbi_addr);
+void arch_msi_irq_handler(uint32_t msi_idx);
 extern int stacktrace_walk(uint32_t *arr_addr, uint32_t max_items,
                            uint32_t init_ebp);
 extern void main(void);
@@ -67,6 +82,7 @@ void arch_late_init(void) {
     LOG_DEBUG("interrupts enabled");
 
     lapic_calib_tim();
+    arch_timer_calib();
 }
 
 void arch_create_platform_tasks(void) {
@@ -148,6 +164,49 @@ void arch_map_irq(uint32_t irq, uint32_t vec) {
     ioapic_map_irq(irq, vec, lapic_id);
 }
 
+bool arch_alloc_msi_vecs(size_t num_vecs, uint8_t *out_first_vec) {
+    ASSERT(num_vecs > 0 && (num_vecs & (num_vecs - 1)) == 0);
+    static_assert(ARCH_VEC_MSI_FIRST % ARCH_NUM_MSI_VECS == 0,
+                  "MSI vectors must be aligned to their number");
+
+    spinlock_acquire(&g_arch_msi.lock);
+
+    const size_t first_idx =
+        (g_arch_msi.num_used + num_vecs - 1) & ~(num_vecs - 1);
+    const bool ok = first_idx + num_vecs <= ARCH_NUM_MSI_VECS;
+    if (ok) {
+        g_arch_msi.num_used = first_idx + num_vecs;
+        *out_first_vec = ARCH_VEC_MSI_FIRST + first_idx;
+    }
+
+    spinlock_release(&g_arch_msi.lock);
+    return ok;
+}
+
+void arch_set_msi_handler(uint8_t vec, void (*handler)(void *ctx), void *ctx) {
+    ASSERT(vec >= ARCH_VEC_MSI_FIRST &&
+           vec < ARCH_VEC_MSI_FIRST + g_arch_msi.num_used);
+    arch_msi_handler_t *const msi =
+        &g_arch_msi.handlers[vec - ARCH_VEC_MSI_FIRST];
+    msi->ctx = ctx;
+    msi->handler = handler;
+}
+
+/**
+ * Called by the ISR of MSI vector #ARCH_VEC_MSI_FIRST + @a msi_idx.
+ * See isrs.s.
+ */
+void arch_msi_irq_handler(uint32_t msi_idx) {
+    const arch_msi_handler_t *const msi = &g_arch_msi.handlers[msi_idx];
+    if (msi->handler) {
+        msi->handler(msi->ctx);
+    } else {
+        LOG_ERROR("unexpected MSI vector 0x%" PRIx32,
+                  ARCH_VEC_MSI_FIRST + msi_idx);
+    }
+    arch_ack_int();
+}
+
 void arch_send_ipi(uint8_t proc_num, uint8_t vector) {
     smp_proc_t *const proc = smp_get_proc(proc_num);
     ASSERT(proc != NULL);
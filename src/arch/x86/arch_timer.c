@@ -1,10 +1,18 @@
 #include "arch_timer.h"
+#include "log.h"
 #include "panic.h"
 
 #include "arch/x86/apic/ioapic.h"
 #include "arch/x86/apic/lapic.h"
 #include "arch/x86/pit.h"
 
+/// Time Stamp Counter ticks per millisecond, 0 until calibrated.
+static uint64_t g_tsc_per_ms;
+/// Time Stamp Counter value at the calibration.
+static uint64_t g_tsc_base;
+
+static uint64_t prv_arch_timer_rdtsc(void);
+
 void arch_timer_init(void) {
     pit_init(PIT_PERIOD_MS);
     if (!ioapic_map_irq(PIT_IRQ, 32 + PIT_IRQ, lapic_get_id())) {
@@ -19,3 +27,41 @@ uint64_t arch_timer_current_ms(void) {
 void arch_timer_busy_wait_ms(uint64_t msec) {
     pit_delay_ms(msec);
 }
+
+void arch_timer_stop_tick(uint32_t delay_ms) {
+    lapic_oneshot_tim(delay_ms);
+}
+
+void arch_timer_start_tick(void) {
+    lapic_resume_tim();
+}
+
+void arch_timer_calib(void) {
+    constexpr uint32_t calib_dur_ms = 50;
+
+    // Start right after a tick, so that the measured period is exact.
+    const uint64_t tick = pit_counter_ms();
+    while (pit_counter_ms() == tick) {
+        __asm__ volatile("pause" ::: "memory");
+    }
+
+    const uint64_t tsc_start = prv_arch_timer_rdtsc();
+    arch_timer_busy_wait_ms(calib_dur_ms);
+    const uint64_t tsc_end = prv_arch_timer_rdtsc();
+
+    g_tsc_base = tsc_start;
+    g_tsc_per_ms = (tsc_end - tsc_start) / calib_dur_ms;
+    LOG_DEBUG("TSC frequency is %llu kHz", g_tsc_per_ms);
+}
+
+uint64_t arch_timer_current_us(void) {
+    if (g_tsc_per_ms == 0) { return 0; }
+    return (prv_arch_timer_rdtsc() - g_tsc_base) * 1000 / g_tsc_per_ms;
+}
+
+static uint64_t prv_arch_timer_rdtsc(void) {
+    uint32_t lo;
+    uint32_t hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
@@ -305,6 +305,28 @@ bool vmm_is_addr_mapped(uint32_t virt) {
     return false;
 }
 
+bool vmm_virt_to_phys(vaddr_t virt, paddr_t *out_phys) {
+    if (!vmm_is_paging_enabled()) {
+        *out_phys = virt;
+        return true;
+    }
+
+    const uint32_t *const pgdir = (const uint32_t *)prv_vmm_read_cr3();
+    if (!pgdir) { return false; }
+
+    const uint32_t pgdir_entry = pgdir[VMM_ADDR_DIR_IDX(virt)];
+    if (!(pgdir_entry & VMM_TABLE_PRESENT)) { return false; }
+
+    const uint32_t *const pgtbl =
+        (const uint32_t *)(pgdir_entry & VMM_TABLE_ADDR_MASK);
+    const uint32_t pgtbl_entry = pgtbl[VMM_ADDR_TBL_IDX(virt)];
+    if (!(pgtbl_entry & VMM_PAGE_PRESENT)) { return false; }
+
+    *out_phys =
+        (pgtbl_entry & VMM_PAGE_ADDR_MASK) | (virt & ~VMM_PAGE_ADDR_MASK);
+    return true;
+}
+
 static void prv_vmm_copy_pgdir(void) {
     if (!vmm_is_paging_enabled()) {
         PANIC("paging was expected to be enabled");
@@ -94,9 +94,22 @@ void idt_init(void) {
 
     fill_entry(&gp_idt[ARCH_VEC_AHCI_GLOBAL], isr_irq_ahci);
 
+    static void (*const msi_isrs[])(void) = {
+        isr_msi_0,  isr_msi_1,  isr_msi_2,  isr_msi_3,
+        isr_msi_4,  isr_msi_5,  isr_msi_6,  isr_msi_7,
+        isr_msi_8,  isr_msi_9,  isr_msi_10, isr_msi_11,
+        isr_msi_12, isr_msi_13, isr_msi_14, isr_msi_15,
+    };
+    static_assert(sizeof(msi_isrs) / sizeof(msi_isrs[0]) == ARCH_NUM_MSI_VECS,
+                  "update the MSI ISRs");
+    for (size_t idx = 0; idx < ARCH_NUM_MSI_VECS; idx++) {
+        fill_entry(&gp_idt[ARCH_VEC_MSI_FIRST + idx], msi_isrs[idx]);
+    }
+
     fill_entry(&gp_idt[LAPIC_VEC_TIM], isr_lapic_tim);
     fill_entry(&gp_idt[ARCH_VEC_HALT], isr_ipi_halt);
     fill_entry(&gp_idt[ARCH_VEC_TLB_SHOOTDOWN], isr_ipi_tlb_shootdown);
+    fill_entry(&gp_idt[ARCH_VEC_RESCHED], isr_ipi_resched);
 
     fill_user_entry(&gp_idt[ARCH_VEC_KSYSCALL], isr_ksyscall);
 
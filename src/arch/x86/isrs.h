@@ -65,9 +65,27 @@ extern void isr_irq15(void);
 
 extern void isr_irq_ahci(void);
 
+extern void isr_msi_0(void);
+extern void isr_msi_1(void);
+extern void isr_msi_2(void);
+extern void isr_msi_3(void);
+extern void isr_msi_4(void);
+extern void isr_msi_5(void);
+extern void isr_msi_6(void);
+extern void isr_msi_7(void);
+extern void isr_msi_8(void);
+extern void isr_msi_9(void);
+extern void isr_msi_10(void);
+extern void isr_msi_11(void);
+extern void isr_msi_12(void);
+extern void isr_msi_13(void);
+extern void isr_msi_14(void);
+extern void isr_msi_15(void);
+
 extern void isr_lapic_tim(void);
 extern void isr_ipi_halt(void);
 extern void isr_ipi_tlb_shootdown(void);
+extern void isr_ipi_resched(void);
 
 extern void isr_ksyscall(void);
 
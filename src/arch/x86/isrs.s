@@ -252,6 +252,43 @@ isr_irq_ahci:   cli
                 iret
                 .size   isr_irq_ahci, . - isr_irq_ahci
 
+                ## ISR for MSI vector ARCH_VEC_MSI_FIRST + idx.
+                .macro  ISR_MSI idx
+                .global isr_msi_\idx
+                .type   isr_msi_\idx, @function
+isr_msi_\idx:   cli
+                push    %ebp
+                mov     %esp, %ebp
+
+                pusha
+                push    $\idx
+                cld
+                call    arch_msi_irq_handler
+                add     $4, %esp
+                popa
+
+                pop     %ebp
+                iret
+                .size   isr_msi_\idx, . - isr_msi_\idx
+                .endm
+
+                ISR_MSI 0
+                ISR_MSI 1
+                ISR_MSI 2
+                ISR_MSI 3
+                ISR_MSI 4
+                ISR_MSI 5
+                ISR_MSI 6
+                ISR_MSI 7
+                ISR_MSI 8
+                ISR_MSI 9
+                ISR_MSI 10
+                ISR_MSI 11
+                ISR_MSI 12
+                ISR_MSI 13
+                ISR_MSI 14
+                ISR_MSI 15
+
                 ## LAPIC Timer ISR.
                 .global isr_lapic_tim
                 .type   isr_lapic_tim, @function
@@ -294,6 +331,23 @@ isr_ipi_tlb_shootdown:
                 iret
                 .size   isr_ipi_tlb_shootdown, . - isr_ipi_tlb_shootdown
 
+                ## Reschedule ISR (inter-processor interrupt).
+                .global isr_ipi_resched
+                .type   isr_ipi_resched, @function
+isr_ipi_resched:
+                cli
+                push    %ebp
+                mov     %esp, %ebp
+
+                pusha
+                cld
+                call    smp_resched_handler
+                popa
+
+                pop     %ebp
+                iret
+                .size   isr_ipi_resched, . - isr_ipi_resched
+
                 ## Syscall ISR.
                 .global isr_ksyscall
                 .type   isr_ksyscall, @function
@@ -1,10 +1,22 @@
 #include "pci_arch.h"
 
+#include "assert.h"
+#include "smp.h"
+
+#include "arch/x86/arch_smp.h"
 #include "arch/x86/port.h"
 
 #define PCI_PORT_CAS_ADDR 0x0CF8
 #define PCI_PORT_CAS_DATA 0x0CFC
 
+/**
+ * MSI Message Address base: the interrupt is delivered to the Local APIC whose
+ * ID is in bits 19:12, physical destination mode, no redirection.
+ * Refer to Intel SDM Vol. 3, section 11.11 Message Signalled Interrupts.
+ */
+#define PCI_ARCH_MSI_ADDR_BASE    0xFEE00000
+#define PCI_ARCH_MSI_ADDR_DEST_SH 12
+
 void pci_arch_cas_read(uint32_t start_addr, void *v_buf, size_t num_dwords) {
     uint32_t *const buf_u32 = v_buf;
     for (size_t cnt_dword = 0; cnt_dword < num_dwords; cnt_dword++) {
@@ -12,3 +24,24 @@ void pci_arch_cas_read(uint32_t start_addr, void *v_buf, size_t num_dwords) {
         buf_u32[cnt_dword] = port_inl(PCI_PORT_CAS_DATA);
     }
 }
+
+void pci_arch_cas_write(uint32_t addr, uint32_t val) {
+    port_outl(PCI_PORT_CAS_ADDR, addr);
+    port_outl(PCI_PORT_CAS_DATA, val);
+}
+
+void pci_arch_msi_msg(uint8_t proc_num, uint8_t vec, uint32_t *out_addr,
+                      uint16_t *out_data) {
+    smp_proc_t *const proc = smp_get_proc(proc_num);
+    ASSERT(proc != NULL);
+
+    const arch_smp_proc_t *const arch_proc = proc->arch_ctx;
+    ASSERT(arch_proc != NULL);
+    ASSERT(arch_proc->acpi != NULL);
+
+    *out_addr = PCI_ARCH_MSI_ADDR_BASE |
+                ((uint32_t)arch_proc->acpi->lapic_id
+                 << PCI_ARCH_MSI_ADDR_DEST_SH);
+    // Fixed delivery mode, edge triggered.
+    *out_data = vec;
+}
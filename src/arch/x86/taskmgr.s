@@ -9,7 +9,9 @@
                 ##   3. tss_t       * p_tss
                 ##
                 ## Saves the context in p_from (if not NULL), loads the context
-                ## of p_to.  Updates p_tss->ESP0, kernel stack top.
+                ## of p_to.  Updates p_tss->ESP0, kernel stack top.  Clears
+                ## p_from->on_cpu once this task's stack is not used anymore,
+                ## so that another processor may switch to it.
                 ##
                 ## NOTE: the caller must disable interrupts before and enable
                 ## them after calling this function.  Before - because the stack
@@ -44,11 +46,17 @@ taskmgr_switch_tasks:
                 mov     %esp, (%eax)            # first field is the stack top
 
                 ## Load the other parameters.
-1:              mov     12(%ebp), %edi          # edi = p_to
+1:              mov     8(%ebp), %esi           # esi = p_from
+                mov     12(%ebp), %edi          # edi = p_to
                 mov     16(%ebp), %eax          # eax = p_tss
 
+                ## This is the last access to the stack of p_from.  Release it.
+                test    %esi, %esi
+                jz      3f
+                movl    $0, 8(%esi)             # p_from->on_cpu = 0
+
                 ## Load control block of the next task.
-                mov     0(%edi), %ebx           # ebx = cr3
+3:              mov     0(%edi), %ebx           # ebx = cr3
                 mov     4(%edi), %ecx           # ecx = stack_t struct ptr
                 mov     (%ecx), %esp            # esp = kernel stack top
 
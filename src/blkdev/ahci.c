@@ -8,17 +8,22 @@
 #include <stddef.h>
 
 #include "arch.h"
+#include "arch_timer.h"
 #include "arch_vmm.h"
 #include "assert.h"
 #include "blkdev/ahci.h"
 #include "blkdev/ahci_regs.h"
-#include "devmgr.h"
+#include "blkdev/blktrace.h"
+#include "cpu.h"
+#include "dma.h"
 #include "heap.h"
 #include "kinttypes.h"
+#include "kspinlock.h"
 #include "kstring.h"
 #include "log.h"
 #include "memfun.h"
 #include "pci.h"
+#include "taskmgr.h"
 
 /**
  * ABAR register, base address mask.
@@ -30,6 +35,45 @@
  */
 #define AHCI_ABAR_ADDR_MASK (~0xFFF)
 
+/// Maximum number of bytes described by one PRD (4 MiB).
+#define AHCI_PRD_MAX_LEN 0x400000
+
+/**
+ * Maximum number of sectors transferred by one read or write command.
+ * The sector count field is 16 bits wide, and zero means 65536 sectors.
+ */
+#define AHCI_MAX_CMD_SECTORS 65536
+
+/**
+ * Maximum number of 512-byte blocks of LBA Range Entries per TRIM command, see
+ * #ahci_port_ctx.p_trim_ranges. Eight blocks cover up to 16 GiB.
+ */
+#define AHCI_TRIM_MAX_BLOCKS 8
+
+/// Maximum number of AHCI controllers, see #g_ahci_ctrls.
+#define AHCI_MAX_CTRLS 8
+
+/// Period of polling the ports that are being probed (milliseconds).
+#define AHCI_PROBE_POLL_MS 1
+/**
+ * Time that COMRESET is asserted for (milliseconds).
+ * The minimum is 1 ms, one more covers the granularity of the timer.
+ */
+#define AHCI_COMRESET_MS 2
+/// Time for the Phy to establish communication after COMRESET (milliseconds).
+#define AHCI_LINK_TIMEOUT_MS 100
+/// Time for a device to spin up and clear BSY (milliseconds).
+#define AHCI_SPINUP_TIMEOUT_MS 10000
+/// Time for a DMA engine to start or stop, refer to section 10.1.2.
+#define AHCI_ENGINE_TIMEOUT_MS 500
+/// Time for #SATA_CMD_IDENTIFY_DEVICE to complete (milliseconds).
+#define AHCI_IDENTIFY_TIMEOUT_MS 5000
+/**
+ * Time for a port to clear BSY and DRQ before a non-queued command is issued
+ * (microseconds). The wait is done with interrupts disabled.
+ */
+#define AHCI_BUSY_TIMEOUT_US 10000
+
 /**
  * Maximum AHCI Controller name string size (bytes).
  *
@@ -78,15 +122,70 @@ struct ahci_port_ctx {
 
     /// Port index in the controller #ahci_port_ctx.ctrl_ctx.
     size_t port_num;
+    /// Port is implemented by the HBA, see #reg_ghc_t.pi.
+    bool implemented;
     /// Port is online and is a SATA device.
     bool online_sata;
     /// Port parameters have been identified using #SATA_CMD_IDENTIFY_DEVICE.
     bool identified;
 
+    /// Port has at least one outstanding command when #AHCI_PORT_ACTIVE.
     volatile _Atomic ahci_port_state_t state;
-    blkdev_req_t *blkdev_req;
-    volatile bool has_blkdev_req;
-    size_t req_cmd_slot;
+
+    /**
+     * Device and HBA support Native Command Queuing.
+     * If set, reads and writes are issued as FPDMA QUEUED commands.
+     */
+    bool ncq;
+    /**
+     * Maximum number of outstanding commands.
+     * It is 1 unless #ahci_port_ctx.ncq is set.
+     */
+    size_t queue_depth;
+
+    /**
+     * Device has an enabled volatile write cache, which is written to the
+     * media with #SATA_CMD_FLUSH_CACHE_EXT. Unless it is set, writes are
+     * never cached and #BLKDEV_REQ_FLAG_FUA is ignored.
+     */
+    bool write_cache;
+    /**
+     * Device supports #SATA_CMD_WRITE_DMA_FUA_EXT. Without NCQ and without
+     * it, a FUA write is followed by a flush before it completes, see
+     * #ahci_port_ctx.post_flush_slots.
+     */
+    bool fua_ext;
+    /// Number of blocks of #ahci_port_ctx.p_trim_ranges, zero if no TRIM.
+    size_t trim_blocks;
+    /**
+     * LBA Range Entries of #SATA_CMD_DATA_SET_MGMT, allocated as coherent DMA
+     * memory when the device is identified. Only one TRIM command is
+     * outstanding at a time, since it is not queued.
+     */
+    uint64_t *p_trim_ranges;
+    /// Physical address of #ahci_port_ctx.p_trim_ranges.
+    paddr_t trim_ranges_addr;
+
+    /**
+     * Lock guarding #ahci_port_ctx.active_slots and #ahci_port_ctx.slot_reqs.
+     * It is taken by the submitting task as well as by the IRQ handler, see
+     * #prv_ahci_port_lock().
+     */
+    spinlock_t slot_lock;
+    /// Bit mask of command slots that have an outstanding command.
+    uint32_t active_slots;
+    /// Requests of the outstanding commands, indexed by the command slot.
+    blkdev_req_t *slot_reqs[AHCI_CMD_LIST_LEN];
+    /**
+     * Bit mask of command slots with a FUA write that needs a flush before it
+     * completes, see #ahci_port_ctx.fua_ext.
+     */
+    uint32_t post_flush_slots;
+    /**
+     * Request whose write has completed and whose flush is to be issued, see
+     * #prv_ahci_port_post_flush().
+     */
+    blkdev_req_t *post_flush_req;
 
     /// Context pointer of the controller this port is a part of.
     ahci_ctrl_ctx_t *ctrl_ctx;
@@ -101,24 +200,36 @@ struct ahci_port_ctx {
 
     /**
      * Received FIS buffer.
-     * It is allocated on the heap during the port setup process, see
+     * It is allocated as coherent DMA memory when the port is probed, see
      * #prv_ahci_setup_port(). Refer to section 4.2.1, Received FIS Structure.
      */
     ahci_rfis_t *p_rfis;
     /**
      * Command List.
-     * It is allocated on the heap during the port setup process, see
+     * It is allocated as coherent DMA memory when the port is probed, see
      * #prv_ahci_setup_port().
      * Refer to section 4.2.2, Command List Structure.
      */
     ahci_cmd_hdr_t *p_cmd_list;
     /**
      * Command Table array.
-     * It is allocated on the heap during the port setup process, see
+     * It is allocated as coherent DMA memory when the port is probed, see
      * #prv_ahci_setup_port().
      * Refer to section 4.2.3, Command Table.
      */
     ahci_cmd_table_t *p_cmd_tables;
+
+    /// Port takes part in the remaining steps of #ahci_probe_ports().
+    bool probing;
+    /// #SATA_CMD_IDENTIFY_DEVICE data buffer, while the command is outstanding.
+    uint16_t *probe_ident;
+    /**
+     * Set by the IRQ handler when #SATA_CMD_IDENTIFY_DEVICE has completed,
+     * see #AHCI_PORT_PROBING.
+     */
+    volatile bool probe_done;
+    /// #SATA_CMD_IDENTIFY_DEVICE has completed with a Task File Error.
+    volatile bool probe_err;
 };
 
 /**
@@ -143,6 +254,22 @@ struct ahci_ctrl_ctx {
     /// Generic HBA Control register.
     reg_ghc_t *reg_ghc;
 
+    /**
+     * Highest physical address the HBA reaches, it depends on CAP.S64A.
+     * See #ahci_port_if_get_dma_mask().
+     */
+    paddr_t dma_mask;
+
+    /// HBA supports Command Completion Coalescing, see #ahci_ctrl_set_ccc().
+    bool ccc_supported;
+    /**
+     * Bit in #reg_ghc_t.is, and the MSI message number, of the coalesced
+     * completion interrupt. See #ahci_ghc_ccc_ctl_t.intr.
+     */
+    uint8_t ccc_int;
+    /// Bit mask of the ports whose completions are coalesced, 0 if disabled.
+    volatile uint32_t ccc_ports;
+
     /**
      * Port contexts.
      *
@@ -170,25 +297,75 @@ typedef struct {
     uint8_t command;
 } ata_cmd_t;
 
+/// Registered controllers, in the order of #ahci_ctrl_new() calls.
+static ahci_ctrl_ctx_t *g_ahci_ctrls[AHCI_MAX_CTRLS];
+static size_t g_ahci_num_ctrls;
+
 static void prv_ahci_set_ctrl_name(ahci_ctrl_ctx_t *ctrl_ctx);
 static bool prv_ahci_enter_ahci_mode(ahci_ctrl_ctx_t *ctrl_ctx);
 static void prv_ahci_enumerate_ports(ahci_ctrl_ctx_t *ctrl_ctx);
 
 static void prv_ahci_set_port_name(ahci_port_ctx_t *port_ctx);
+
+static void prv_ahci_probe_each(void (*f_step)(ahci_port_ctx_t *port_ctx));
+static void prv_ahci_probe_wait(bool (*f_ready)(ahci_port_ctx_t *port_ctx),
+                                uint32_t timeout_ms, const char *what);
+static void prv_ahci_probe_stop_cmd(ahci_port_ctx_t *port_ctx);
+static bool prv_ahci_probe_cmd_stopped(ahci_port_ctx_t *port_ctx);
+static void prv_ahci_probe_stop_fis(ahci_port_ctx_t *port_ctx);
+static bool prv_ahci_probe_fis_stopped(ahci_port_ctx_t *port_ctx);
+static void prv_ahci_probe_start_reset(ahci_port_ctx_t *port_ctx);
+static void prv_ahci_probe_end_reset(ahci_port_ctx_t *port_ctx);
+static bool prv_ahci_probe_link_up(ahci_port_ctx_t *port_ctx);
 static void prv_ahci_setup_port(ahci_port_ctx_t *port_ctx);
+static bool prv_ahci_probe_fis_running(ahci_port_ctx_t *port_ctx);
+static bool prv_ahci_probe_dev_ready(ahci_port_ctx_t *port_ctx);
+static void prv_ahci_probe_start_cmd(ahci_port_ctx_t *port_ctx);
+static bool prv_ahci_probe_cmd_running(ahci_port_ctx_t *port_ctx);
 static void prv_ahci_identify_port(ahci_port_ctx_t *port_ctx);
+static bool prv_ahci_probe_identified(ahci_port_ctx_t *port_ctx);
+static void prv_ahci_probe_parse_ident(ahci_port_ctx_t *port_ctx);
 
 static bool prv_ahci_port_check_sectors(ahci_port_ctx_t *port_ctx,
                                         uint64_t start_sector,
                                         uint32_t num_sectors);
+static bool prv_ahci_port_start_rw(ahci_port_ctx_t *port_ctx,
+                                   blkdev_req_t *req, bool dir_write, bool fua,
+                                   uint64_t start_sector, uint32_t num_sectors,
+                                   const blkdev_seg_t *segs, size_t num_segs);
+static bool prv_ahci_port_start_flush(ahci_port_ctx_t *port_ctx,
+                                      blkdev_req_t *req);
+static bool prv_ahci_port_start_trim(ahci_port_ctx_t *port_ctx,
+                                     blkdev_req_t *req, uint64_t start_sector,
+                                     uint64_t num_sectors);
+static bool prv_ahci_port_issue(ahci_port_ctx_t *port_ctx, blkdev_req_t *req,
+                                ata_cmd_t cmd, const blkdev_seg_t *segs,
+                                size_t num_segs, bool dir_write, bool queued,
+                                bool post_flush);
+static void prv_ahci_port_post_flush(ahci_port_ctx_t *port_ctx);
 static bool prv_ahci_send_ata_cmd(ahci_port_ctx_t *port_ctx, ata_cmd_t cmd,
-                                  uint32_t buf_addr, size_t num_sectors,
-                                  bool dir_write, size_t *p_cmd_slot);
-static bool prv_ahci_wait_for_cmd(ahci_port_ctx_t *port_ctx, size_t cmd_slot);
-static bool prv_ahci_find_cmd_slot(reg_port_t *reg_port, size_t *out_slot);
+                                  const blkdev_seg_t *segs, size_t num_segs,
+                                  bool dir_write, bool queued, size_t cmd_slot);
+static size_t prv_ahci_num_prds(uint32_t len);
+static size_t prv_ahci_req_num_prds(const blkdev_req_t *req);
+static bool prv_ahci_req_segs(const blkdev_req_t *req, blkdev_seg_t *out_segs,
+                              size_t max_segs, size_t *inout_num_segs);
+
+static bool prv_ahci_port_lock(ahci_port_ctx_t *port_ctx);
+static void prv_ahci_port_unlock(ahci_port_ctx_t *port_ctx, bool restore_int);
+static bool prv_ahci_port_alloc_slot(ahci_port_ctx_t *port_ctx,
+                                     size_t *out_slot);
+static size_t prv_ahci_port_reap_slots(ahci_port_ctx_t *port_ctx,
+                                       blkdev_req_t **out_reqs);
 
 static void prv_ahci_port_handle_tfe(ahci_port_ctx_t *port_ctx);
-static void prv_ahci_port_handle_dhr(ahci_port_ctx_t *port_ctx);
+static void prv_ahci_port_handle_done(ahci_port_ctx_t *port_ctx);
+
+static void prv_ahci_ctrl_handle_ccc(ahci_ctrl_ctx_t *ctrl_ctx);
+
+static void prv_ahci_msi_ctrl_handler(void *ctx);
+static void prv_ahci_msi_port_handler(void *ctx);
+static void prv_ahci_msi_ccc_handler(void *ctx);
 
 ahci_ctrl_ctx_t *ahci_ctrl_new(const pci_dev_t *pci_dev) {
     const uint32_t abar = pci_dev->header.bar5;
@@ -212,21 +389,92 @@ ahci_ctrl_ctx_t *ahci_ctrl_new(const pci_dev_t *pci_dev) {
         return NULL;
     }
 
-    prv_ahci_enumerate_ports(ctrl_ctx);
-    for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
-        ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
-        if (port_ctx->online_sata) {
-            prv_ahci_setup_port(port_ctx);
-            prv_ahci_identify_port(port_ctx);
-            port_ctx->state = AHCI_PORT_IDLE;
-        }
+    if (g_ahci_num_ctrls == AHCI_MAX_CTRLS) {
+        LOG_ERROR("%s: too many AHCI controllers", ctrl_ctx->name);
+        heap_free(ctrl_ctx);
+        return NULL;
     }
 
+    prv_ahci_enumerate_ports(ctrl_ctx);
+
     ctrl_ctx->irq = pci_dev->header.int_line;
 
+    ahci_cap_t ctrl_cap;
+    kmemread_v4(&ctrl_cap, &ctrl_ctx->reg_ghc->cap);
+    ctrl_ctx->dma_mask = ctrl_cap.s64a ? DMA_MASK_ALL : DMA_MASK_32BIT;
+    if (ctrl_cap.cccs) {
+        ahci_ghc_ccc_ctl_t ccc_ctl;
+        kmemread_v4(&ccc_ctl, &ctrl_ctx->reg_ghc->ccc_ctl);
+        ctrl_ctx->ccc_supported = true;
+        ctrl_ctx->ccc_int = ccc_ctl.intr;
+    }
+
+    g_ahci_ctrls[g_ahci_num_ctrls++] = ctrl_ctx;
     return ctrl_ctx;
 }
 
+size_t ahci_num_ctrls(void) {
+    return g_ahci_num_ctrls;
+}
+
+ahci_ctrl_ctx_t *ahci_get_ctrl(size_t ctrl_idx) {
+    if (ctrl_idx < g_ahci_num_ctrls) {
+        return g_ahci_ctrls[ctrl_idx];
+    } else {
+        return NULL;
+    }
+}
+
+void ahci_probe_ports(void) {
+    size_t num_probing = 0;
+    for (size_t ctrl_idx = 0; ctrl_idx < g_ahci_num_ctrls; ctrl_idx++) {
+        ahci_ctrl_ctx_t *const ctrl_ctx = g_ahci_ctrls[ctrl_idx];
+        for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+            ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+            port_ctx->probing = port_ctx->implemented;
+            if (port_ctx->probing) { num_probing++; }
+        }
+    }
+    if (num_probing == 0) { return; }
+
+    const uint64_t start_ms = arch_timer_current_ms();
+
+    // Each step is started on all ports before waiting for any of them, so
+    // that the slowest port, rather than the sum of all ports, determines how
+    // long the probe takes. Refer to section 10.1.2, System Software Specific
+    // Initialization.
+    prv_ahci_probe_each(prv_ahci_probe_stop_cmd);
+    prv_ahci_probe_wait(prv_ahci_probe_cmd_stopped, AHCI_ENGINE_TIMEOUT_MS,
+                        "command list DMA engine does not stop");
+    prv_ahci_probe_each(prv_ahci_probe_stop_fis);
+    prv_ahci_probe_wait(prv_ahci_probe_fis_stopped, AHCI_ENGINE_TIMEOUT_MS,
+                        "FIS receive DMA engine does not stop");
+
+    prv_ahci_probe_each(prv_ahci_probe_start_reset);
+    taskmgr_local_sleep_ms(AHCI_COMRESET_MS);
+    prv_ahci_probe_each(prv_ahci_probe_end_reset);
+    prv_ahci_probe_wait(prv_ahci_probe_link_up, AHCI_LINK_TIMEOUT_MS,
+                        "no device or no Phy communication");
+
+    prv_ahci_probe_each(prv_ahci_setup_port);
+    prv_ahci_probe_wait(prv_ahci_probe_fis_running, AHCI_ENGINE_TIMEOUT_MS,
+                        "FIS receive DMA engine does not start");
+    prv_ahci_probe_wait(prv_ahci_probe_dev_ready, AHCI_SPINUP_TIMEOUT_MS,
+                        "device stays busy");
+
+    prv_ahci_probe_each(prv_ahci_probe_start_cmd);
+    prv_ahci_probe_wait(prv_ahci_probe_cmd_running, AHCI_ENGINE_TIMEOUT_MS,
+                        "command list DMA engine does not start");
+
+    prv_ahci_probe_each(prv_ahci_identify_port);
+    prv_ahci_probe_wait(prv_ahci_probe_identified, AHCI_IDENTIFY_TIMEOUT_MS,
+                        "IDENTIFY_DEVICE timed out");
+    prv_ahci_probe_each(prv_ahci_probe_parse_ident);
+
+    LOG_INFO("probed %zu AHCI ports in %llu ms", num_probing,
+             arch_timer_current_ms() - start_ms);
+}
+
 ahci_port_ctx_t *ahci_ctrl_get_port(ahci_ctrl_ctx_t *ctrl_ctx,
                                     size_t port_idx) {
     if (port_idx < AHCI_PORTS_PER_CTRL) {
@@ -248,21 +496,158 @@ void ahci_ctrl_map_irq(ahci_ctrl_ctx_t *ctrl_ctx, uint8_t vec) {
 }
 
 void ahci_ctrl_irq_handler(void) {
-    // FIXME: lock the devmgr device list in case device hot plugging support is
-    // added.
+    // Ports are also being probed before they are registered as devices, so
+    // walk the controllers rather than the devmgr device list.
+    for (size_t ctrl_idx = 0; ctrl_idx < g_ahci_num_ctrls; ctrl_idx++) {
+        ahci_ctrl_ctx_t *const ctrl_ctx = g_ahci_ctrls[ctrl_idx];
+        for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+            ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+            if (port_ctx->implemented) { ahci_port_irq_handler(port_ctx); }
+        }
+        prv_ahci_ctrl_handle_ccc(ctrl_ctx);
+    }
 
-    devmgr_iter_t iter;
-    devmgr_iter_init(&iter, DEVMGR_CLASS_BLOCK);
+    arch_ack_int();
+}
 
-    devmgr_dev_t *dev;
-    while ((dev = devmgr_iter_next(&iter))) {
-        if (dev->driver_id == DEVMGR_DRIVER_AHCI_PORT) {
-            ahci_port_ctx_t *const port_ctx = dev->blkdev_dev.driver_ctx;
-            ahci_port_irq_handler(port_ctx);
+bool ahci_ctrl_enable_msi(ahci_ctrl_ctx_t *ctrl_ctx, uint8_t proc_num) {
+    const size_t max_vecs = pci_msi_max_vecs(ctrl_ctx->pci_dev);
+    if (max_vecs == 0) { return false; }
+
+    // Port N sends message N, so a vector per port takes as many messages as
+    // the highest online port number plus one. Coalesced completions are sent
+    // as message #ahci_ctrl_ctx.ccc_int.
+    size_t num_vecs = 1;
+    for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+        if (!ctrl_ctx->ports[port_idx].online_sata) { continue; }
+        while (num_vecs < port_idx + 1) { num_vecs *= 2; }
+    }
+    if (ctrl_ctx->ccc_supported) {
+        while (num_vecs < ctrl_ctx->ccc_int + 1u) { num_vecs *= 2; }
+    }
+    if (num_vecs > max_vecs) { num_vecs = 1; }
+
+    uint8_t first_vec;
+    if (!arch_alloc_msi_vecs(num_vecs, &first_vec)) {
+        if (num_vecs == 1 || !arch_alloc_msi_vecs(1, &first_vec)) {
+            LOG_ERROR("ctrl %s: no free MSI vectors", ctrl_ctx->name);
+            return false;
         }
+        num_vecs = 1;
     }
 
-    arch_ack_int();
+    if (num_vecs == 1) {
+        arch_set_msi_handler(first_vec, prv_ahci_msi_ctrl_handler, ctrl_ctx);
+    } else {
+        for (size_t idx = 0; idx < num_vecs; idx++) {
+            arch_set_msi_handler(first_vec + idx, prv_ahci_msi_port_handler,
+                                 &ctrl_ctx->ports[idx]);
+        }
+        if (ctrl_ctx->ccc_supported) {
+            arch_set_msi_handler(first_vec + ctrl_ctx->ccc_int,
+                                 prv_ahci_msi_ccc_handler, ctrl_ctx);
+        }
+    }
+
+    ahci_ctrl_set_int(ctrl_ctx, false);
+
+    if (!pci_enable_msi(ctrl_ctx->pci_dev, proc_num, first_vec, num_vecs)) {
+        ahci_ctrl_set_int(ctrl_ctx, true);
+        return false;
+    }
+
+    ahci_ghc_ghc_t ctrl_ghc;
+    kmemread_v4(&ctrl_ghc, &ctrl_ctx->reg_ghc->ghc);
+    if (num_vecs > 1 && ctrl_ghc.mrsm) {
+        // The controller sends all interrupts as message 0 anyway.
+        LOG_INFO("ctrl %s: reverted to single MSI message", ctrl_ctx->name);
+        arch_set_msi_handler(first_vec, prv_ahci_msi_ctrl_handler, ctrl_ctx);
+        num_vecs = 1;
+    }
+
+    ahci_ctrl_set_int(ctrl_ctx, true);
+
+    // Interrupts that were raised while switching may have been lost.
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    prv_ahci_msi_ctrl_handler(ctrl_ctx);
+    if (restore_int) { arch_enable_ints(); }
+
+    LOG_INFO("ctrl %s: %zu MSI vector(s) on processor %u", ctrl_ctx->name,
+             num_vecs, proc_num);
+    return true;
+}
+
+bool ahci_ctrl_set_ccc(ahci_ctrl_ctx_t *ctrl_ctx, uint8_t num_cmds,
+                       uint16_t timeout_ms) {
+    if (!ctrl_ctx->ccc_supported) { return false; }
+
+    // CC, TV and CCC_PORTS may only be changed while CCC is disabled.
+    ahci_ghc_ccc_ctl_t ccc_ctl;
+    kmemread_v4(&ccc_ctl, &ctrl_ctx->reg_ghc->ccc_ctl);
+    ccc_ctl.en = 0;
+    kmemwrite_v4(&ctrl_ctx->reg_ghc->ccc_ctl, &ccc_ctl);
+
+    // Give the previously coalesced ports their own completion interrupts
+    // back, and complete what the HBA has not reported yet.
+    const uint32_t old_ports = ctrl_ctx->ccc_ports;
+    ctrl_ctx->ccc_ports = 0;
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+        if (old_ports & (1u << port_idx)) {
+            ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+            ahci_port_set_int(port_ctx, AHCI_PORT_INT_DONE, true);
+            prv_ahci_port_handle_done(port_ctx);
+        }
+    }
+    if (restore_int) { arch_enable_ints(); }
+
+    if (num_cmds == 0) {
+        LOG_DEBUG("ctrl %s: CCC disabled", ctrl_ctx->name);
+        return true;
+    }
+
+    // Only queued commands are worth coalescing: a port without NCQ has one
+    // command in flight and would always wait for the timeout.
+    uint32_t ports = 0;
+    size_t total_depth = 0;
+    for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+        const ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+        if (port_ctx->online_sata && port_ctx->ncq) {
+            ports |= 1u << port_idx;
+            total_depth += port_ctx->queue_depth;
+        }
+    }
+    if (ports == 0) {
+        LOG_DEBUG("ctrl %s: CCC not enabled, no NCQ ports", ctrl_ctx->name);
+        return true;
+    }
+
+    // More completions than there may be commands in flight never arrive.
+    if (num_cmds > total_depth) { num_cmds = total_depth; }
+    // A timeout value of 0 is reserved.
+    if (timeout_ms == 0) { timeout_ms = 1; }
+
+    ctrl_ctx->reg_ghc->ccc_ports = ports;
+    ccc_ctl.cc = num_cmds;
+    ccc_ctl.tv = timeout_ms;
+    kmemwrite_v4(&ctrl_ctx->reg_ghc->ccc_ctl, &ccc_ctl);
+
+    for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+        if (ports & (1u << port_idx)) {
+            ahci_port_set_int(&ctrl_ctx->ports[port_idx], AHCI_PORT_INT_DONE,
+                              false);
+        }
+    }
+    ctrl_ctx->ccc_ports = ports;
+
+    ccc_ctl.en = 1;
+    kmemwrite_v4(&ctrl_ctx->reg_ghc->ccc_ctl, &ccc_ctl);
+
+    LOG_DEBUG("ctrl %s: CCC ports 0x%08" PRIx32 ", %u commands, %u ms",
+              ctrl_ctx->name, ports, num_cmds, timeout_ms);
+    return true;
 }
 
 bool ahci_port_is_online(const ahci_port_ctx_t *port_ctx) {
@@ -273,6 +658,10 @@ const char *ahci_port_name(const ahci_port_ctx_t *port_ctx) {
     return port_ctx->name;
 }
 
+ahci_ctrl_ctx_t *ahci_port_get_ctrl(ahci_port_ctx_t *port_ctx) {
+    return port_ctx->ctrl_ctx;
+}
+
 void ahci_port_set_int(ahci_port_ctx_t *port_ctx, ahci_port_int_t port_int,
                        bool on) {
     uint32_t ie_val = port_ctx->reg_port->ie;
@@ -286,80 +675,33 @@ void ahci_port_set_int(ahci_port_ctx_t *port_ctx, ahci_port_int_t port_int,
 
 void ahci_port_irq_handler(ahci_port_ctx_t *port_ctx) {
     const uint32_t int_status = port_ctx->reg_port->is;
-
-    // NOTE: check for TFE *before* DHR, because both of them may be set.
-    if (int_status & AHCI_PORT_INT_TFE) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_TFE;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_TFE", port_ctx->name);
-
-        prv_ahci_port_handle_tfe(port_ctx);
+    if (int_status == 0) { return; }
+
+    // Acknowledge everything with one register write, each status bit is
+    // cleared by writing 1 to it.
+    port_ctx->reg_port->is = int_status;
+    LOG_FLOW("port %s irq: IS = 0x%08" PRIx32, port_ctx->name, int_status);
+
+    if (port_ctx->state == AHCI_PORT_PROBING) {
+        // #SATA_CMD_IDENTIFY_DEVICE is issued in the first slot, see
+        // #prv_ahci_identify_port().
+        if (int_status & AHCI_PORT_INT_TFE) {
+            port_ctx->probe_err = true;
+            port_ctx->probe_done = true;
+        } else if (!(port_ctx->reg_port->ci & 1)) {
+            port_ctx->probe_done = true;
+        }
+        return;
     }
 
-    if (int_status & AHCI_PORT_INT_DHR) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_DHR;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_DHR", port_ctx->name);
+    // NOTE: check for TFE *before* the completions, because both of them may
+    // be set.
+    if (int_status & AHCI_PORT_INT_TFE) { prv_ahci_port_handle_tfe(port_ctx); }
 
-        prv_ahci_port_handle_dhr(port_ctx);
-    }
-    if (int_status & AHCI_PORT_INT_PS) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_PS;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_PS", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_DS) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_DS;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_DS", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_SDB) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_SDB;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_SDB", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_UF) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_UF;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_UF", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_DP) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_DP;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_DP", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_PC) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_PC;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_PC", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_DMP) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_DMP;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_DMP", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_PRC) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_PRC;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_PRC", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_IPM) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_IPM;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_IPM", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_OF) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_OF;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_OF", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_INF) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_INF;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_INF", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_IF) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_IF;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_IF", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_HBD) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_HBD;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_HBD", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_HBF) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_HBF;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_HBF", port_ctx->name);
-    }
-    if (int_status & AHCI_PORT_INT_CPD) {
-        port_ctx->reg_port->is = AHCI_PORT_INT_CPD;
-        LOG_FLOW("port %s irq: AHCI_PORT_INT_CPD", port_ctx->name);
+    // Non-queued commands complete with a D2H Register FIS, queued ones with a
+    // Set Device Bits FIS. All completed slots are reaped at once.
+    if (int_status & (AHCI_PORT_INT_DHR | AHCI_PORT_INT_SDB)) {
+        prv_ahci_port_handle_done(port_ctx);
     }
 }
 
@@ -369,105 +711,124 @@ bool ahci_port_is_idle(ahci_port_ctx_t *port_ctx) {
 
 bool ahci_port_start_read(ahci_port_ctx_t *port_ctx, uint64_t start_sector,
                           uint32_t num_sectors, void *buf) {
-    if (port_ctx->state != AHCI_PORT_IDLE) { return false; }
-    if (!prv_ahci_port_check_sectors(port_ctx, start_sector, num_sectors)) {
-        return false;
-    }
-
-    // Set up an ATA command.
-    ata_cmd_t cmd = {0};
-    cmd.count = num_sectors;
-    cmd.lba = start_sector;
-    cmd.device = 1 << 6; // "shall be set to one"
-    cmd.command = SATA_CMD_READ_DMA_EXT;
-
-    // Issue the command.
-    port_ctx->state = AHCI_PORT_ACTIVE;
-    if (!prv_ahci_send_ata_cmd(port_ctx, cmd, (uint32_t)buf, num_sectors, false,
-                               &port_ctx->req_cmd_slot)) {
-        port_ctx->state = AHCI_PORT_IDLE;
-        LOG_ERROR("%s: failed to issue read command", port_ctx->name);
-        return false;
-    }
-
-    return true;
+    const blkdev_seg_t seg = {.addr = (uintptr_t)buf, .len = 512 * num_sectors};
+    return prv_ahci_port_start_rw(port_ctx, NULL, false, false, start_sector,
+                                  num_sectors, &seg, 1);
 }
 
 bool ahci_port_start_write(ahci_port_ctx_t *port_ctx, uint64_t start_sector,
                            uint32_t num_sectors, const void *buf) {
-    if (port_ctx->state != AHCI_PORT_IDLE) { return false; }
-    if (!prv_ahci_port_check_sectors(port_ctx, start_sector, num_sectors)) {
-        return false;
-    }
+    const blkdev_seg_t seg = {.addr = (uintptr_t)buf, .len = 512 * num_sectors};
+    return prv_ahci_port_start_rw(port_ctx, NULL, true, false, start_sector,
+                                  num_sectors, &seg, 1);
+}
 
-    // Set up an ATA command.
-    ata_cmd_t cmd = {0};
-    cmd.count = num_sectors;
-    cmd.lba = start_sector;
-    cmd.device = 1 << 6;
-    // There is no mention of setting the 6th bit in "ATA/ATAPI Command Set -
-    // 3" for the WRITE DMA EXT command, however not setting it in QEMU results
-    // in the command failing. Internet says it's the LBA mode bit, but I could
-    // not find the original source for this.
-    cmd.command = SATA_CMD_WRITE_DMA_EXT;
+void ahci_port_fill_blkdev_if(blkdev_if_t *blkdev_if) {
+    blkdev_if->f_get_queue_depth = ahci_port_if_get_queue_depth;
+    blkdev_if->f_get_num_sectors = ahci_port_if_get_num_sectors;
+    blkdev_if->f_can_merge = ahci_port_if_can_merge;
+    blkdev_if->f_resolve = NULL;
+    blkdev_if->f_submit_req = ahci_port_if_submit_req;
+    blkdev_if->f_commit = NULL;
+    blkdev_if->f_poll = ahci_port_if_poll;
+    blkdev_if->f_get_dma_mask = ahci_port_if_get_dma_mask;
+    blkdev_if->f_get_caps = ahci_port_if_get_caps;
+}
 
-    // Issue the command.
-    port_ctx->state = AHCI_PORT_ACTIVE;
-    if (!prv_ahci_send_ata_cmd(port_ctx, cmd, (uint32_t)buf, num_sectors, true,
-                               &port_ctx->req_cmd_slot)) {
-        port_ctx->state = AHCI_PORT_IDLE;
-        LOG_ERROR("%s: failed to issue write command", port_ctx->name);
-        return false;
-    }
+uint32_t ahci_port_if_get_caps(void *v_port_ctx) {
+    ahci_port_ctx_t *port_ctx = v_port_ctx;
+    uint32_t caps = 0;
+    if (port_ctx->write_cache) { caps |= BLKDEV_CAP_FLUSH; }
+    if (port_ctx->trim_blocks > 0) { caps |= BLKDEV_CAP_DISCARD; }
+    return caps;
+}
 
-    return true;
+paddr_t ahci_port_if_get_dma_mask(void *v_port_ctx) {
+    ahci_port_ctx_t *port_ctx = v_port_ctx;
+    return port_ctx->ctrl_ctx->dma_mask;
 }
 
-void ahci_port_fill_blkdev_if(blkdev_if_t *blkdev_if) {
-    blkdev_if->f_is_busy = ahci_port_if_is_busy;
-    blkdev_if->f_submit_req = ahci_port_if_submit_req;
+size_t ahci_port_if_get_queue_depth(void *v_port_ctx) {
+    ahci_port_ctx_t *port_ctx = v_port_ctx;
+    return port_ctx->queue_depth;
 }
 
-bool ahci_port_if_is_busy(void *v_port_ctx) {
+uint64_t ahci_port_if_get_num_sectors(void *v_port_ctx) {
     ahci_port_ctx_t *port_ctx = v_port_ctx;
-    return !ahci_port_is_idle(port_ctx);
+    return port_ctx->num_sectors;
+}
+
+bool ahci_port_if_can_merge(void *v_port_ctx, const blkdev_req_t *req,
+                            const blkdev_req_t *next) {
+    (void)v_port_ctx;
+
+    size_t num_prds = prv_ahci_req_num_prds(next);
+    size_t num_sectors = blkdev_req_sectors(next);
+    for (const blkdev_req_t *it = req; it; it = it->merged_next) {
+        num_prds += prv_ahci_req_num_prds(it);
+        num_sectors += blkdev_req_sectors(it);
+    }
+
+    return num_prds <= AHCI_CMD_TABLE_NUM_PRDS &&
+           num_sectors <= AHCI_MAX_CMD_SECTORS;
 }
 
 void ahci_port_if_submit_req(blkdev_req_t *req) {
     ahci_port_ctx_t *const port_ctx = req->dev->driver_ctx;
 
-    if (!ahci_port_is_idle(port_ctx)) {
-        LOG_ERROR("refuse to submit request when the port is busy");
-        req->state = BLKDEV_REQ_ERROR;
-        semaphore_increase(&req->sem_done);
+    if (req->op == BLKDEV_OP_FLUSH || req->op == BLKDEV_OP_DISCARD) {
+        // Flushes and discards are never merged.
+        const bool issued =
+            req->op == BLKDEV_OP_FLUSH
+                ? prv_ahci_port_start_flush(port_ctx, req)
+                : prv_ahci_port_start_trim(port_ctx, req, req->start_sector,
+                                           blkdev_req_sectors(req));
+        if (!issued) { blkdev_complete_req(req, BLKDEV_REQ_ERROR); }
         return;
     }
 
-    switch (req->op) {
-    case BLKDEV_OP_READ:
-        port_ctx->blkdev_req = req;
-        port_ctx->blkdev_req->state = BLKDEV_REQ_ACTIVE;
-        port_ctx->has_blkdev_req = true;
-        if (!ahci_port_start_read(port_ctx, req->start_sector,
-                                  req->read_sectors, req->read_buf)) {
-            port_ctx->blkdev_req->state = BLKDEV_REQ_ERROR;
-            port_ctx->has_blkdev_req = false;
-            semaphore_increase(&req->sem_done);
-        }
-        break;
-
-    case BLKDEV_OP_WRITE:
-        port_ctx->blkdev_req = req;
-        port_ctx->blkdev_req->state = BLKDEV_REQ_ACTIVE;
-        port_ctx->has_blkdev_req = true;
-        if (!ahci_port_start_write(port_ctx, req->start_sector,
-                                   req->write_sectors, req->write_buf)) {
-            port_ctx->blkdev_req->state = BLKDEV_REQ_ERROR;
-            port_ctx->has_blkdev_req = false;
-            semaphore_increase(&req->sem_done);
-        }
-        break;
+    // Each request merged into req is transferred from its own segments.
+    blkdev_seg_t segs[AHCI_CMD_TABLE_NUM_PRDS];
+    size_t num_segs = 0;
+    uint32_t num_sectors = 0;
+    bool issued = true;
+    for (const blkdev_req_t *it = req; it && issued; it = it->merged_next) {
+        issued = prv_ahci_req_segs(it, segs, AHCI_CMD_TABLE_NUM_PRDS,
+                                   &num_segs);
+        num_sectors += blkdev_req_sectors(it);
     }
+
+    if (issued) {
+        issued = prv_ahci_port_start_rw(
+            port_ctx, req, req->op == BLKDEV_OP_WRITE,
+            req->flags & BLKDEV_REQ_FLAG_FUA, req->start_sector, num_sectors,
+            segs, num_segs);
+    } else {
+        LOG_ERROR("%s: too many segments in a request", port_ctx->name);
+    }
+
+    if (!issued) { blkdev_complete_req(req, BLKDEV_REQ_ERROR); }
+}
+
+size_t ahci_port_if_poll(void *v_port_ctx) {
+    ahci_port_ctx_t *const port_ctx = v_port_ctx;
+    blkdev_req_t *done_reqs[AHCI_CMD_LIST_LEN];
+    size_t num_done = 0;
+
+    const bool restore_int = prv_ahci_port_lock(port_ctx);
+    // The commands that completed before an error are reaped by the TFE
+    // handler, which needs to see them as active.
+    if (port_ctx->state == AHCI_PORT_ACTIVE &&
+        !(port_ctx->reg_port->is & AHCI_PORT_INT_TFE)) {
+        num_done = prv_ahci_port_reap_slots(port_ctx, done_reqs);
+    }
+    prv_ahci_port_unlock(port_ctx, restore_int);
+    prv_ahci_port_post_flush(port_ctx);
+
+    for (size_t idx = 0; idx < num_done; idx++) {
+        blkdev_complete_req(done_reqs[idx], BLKDEV_REQ_SUCCESS);
+    }
+    return num_done;
 }
 
 static void prv_ahci_set_ctrl_name(ahci_ctrl_ctx_t *ctrl_ctx) {
@@ -574,6 +935,7 @@ static bool prv_ahci_enter_ahci_mode(ahci_ctrl_ctx_t *ctrl_ctx) {
  * Initializes the following fields of each port context:
  * - #ahci_port_ctx_t.name
  * - #ahci_port_ctx_t.port_num
+ * - #ahci_port_ctx_t.implemented
  * - #ahci_port_ctx_t.online_sata
  * - #ahci_port_ctx_t.state
  * - #ahci_port_ctx_t.ctrl_ctx
@@ -600,32 +962,8 @@ static void prv_ahci_enumerate_ports(ahci_ctrl_ctx_t *ctrl_ctx) {
         port_ctx->reg_port = AHCI_REG_PORT(reg_ghc, port_idx);
         prv_ahci_set_port_name(port_ctx);
 
-        const bool impl = (reg_ghc->pi & (1 << port_idx)) != 0;
-        if (!impl) { continue; }
-
-        reg_port_t *const reg_port = port_ctx->reg_port;
-        ahci_port_ssts_t port_ssts;
-        kmemread_v4(&port_ssts, &reg_port->ssts);
-        switch (port_ssts.det) {
-        case AHCI_SSTS_DET_NDEV_NPHY:
-            LOG_INFO("%s: no device", port_ctx->name);
-            break;
-        case AHCI_SSTS_DET_DEV_NPHY:
-            LOG_INFO("%s: has device, no Phy communication", port_ctx->name);
-            break;
-        case AHCI_SSTS_DET_DEV_PHY:
-            if (port_ctx->reg_port->sig == SATA_SIG_ATA) {
-                port_ctx->online_sata = true;
-                LOG_INFO("%s: detected SATA_SIG_ATA", port_ctx->name);
-            } else {
-                LOG_INFO("%s: unrecognized signature 0x%08" PRIx32,
-                         port_ctx->name, port_ctx->reg_port->sig);
-            }
-            break;
-        case AHCI_SSTS_DET_PHY_OFF:
-            LOG_INFO("port %s: has device, Phy offline", port_ctx->name);
-            break;
-        }
+        spinlock_init(&port_ctx->slot_lock);
+        port_ctx->implemented = (reg_ghc->pi & (1 << port_idx)) != 0;
     }
 }
 
@@ -656,90 +994,279 @@ static void prv_ahci_set_port_name(ahci_port_ctx_t *port_ctx) {
     port_ctx->name[pos] = 0;
 }
 
+/**
+ * Applies @a f_step to every port that is being probed.
+ * See #ahci_port_ctx.probing.
+ */
+static void prv_ahci_probe_each(void (*f_step)(ahci_port_ctx_t *port_ctx)) {
+    for (size_t ctrl_idx = 0; ctrl_idx < g_ahci_num_ctrls; ctrl_idx++) {
+        ahci_ctrl_ctx_t *const ctrl_ctx = g_ahci_ctrls[ctrl_idx];
+        for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+            ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+            if (port_ctx->probing) { f_step(port_ctx); }
+        }
+    }
+}
+
+/**
+ * Waits until @a f_ready returns `true` for every port that is being probed,
+ * or until @a timeout_ms elapses.
+ *
+ * The ports are checked every #AHCI_PROBE_POLL_MS, the waiting task sleeps in
+ * between. Ports that are not ready by the timeout drop out of the probe, and
+ * @a what is logged for them.
+ */
+static void prv_ahci_probe_wait(bool (*f_ready)(ahci_port_ctx_t *port_ctx),
+                                uint32_t timeout_ms, const char *what) {
+    const uint64_t deadline_ms = arch_timer_current_ms() + timeout_ms;
+
+    for (;;) {
+        bool all_ready = true;
+        for (size_t ctrl_idx = 0; ctrl_idx < g_ahci_num_ctrls; ctrl_idx++) {
+            ahci_ctrl_ctx_t *const ctrl_ctx = g_ahci_ctrls[ctrl_idx];
+            for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL;
+                 port_idx++) {
+                ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+                if (port_ctx->probing && !f_ready(port_ctx)) {
+                    all_ready = false;
+                }
+            }
+        }
+        if (all_ready || arch_timer_current_ms() >= deadline_ms) { break; }
+
+        taskmgr_local_sleep_ms(AHCI_PROBE_POLL_MS);
+    }
+
+    for (size_t ctrl_idx = 0; ctrl_idx < g_ahci_num_ctrls; ctrl_idx++) {
+        ahci_ctrl_ctx_t *const ctrl_ctx = g_ahci_ctrls[ctrl_idx];
+        for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+            ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+            if (!port_ctx->probing || f_ready(port_ctx)) { continue; }
+
+            LOG_INFO("%s: %s", port_ctx->name, what);
+            port_ctx->probing = false;
+            if (port_ctx->state == AHCI_PORT_PROBING) {
+                // Abort the outstanding command, the buffer is leaked in case
+                // the HBA still writes to it.
+                port_ctx->reg_port->cmd &= ~AHCI_PORT_CMD_ST;
+                port_ctx->state = AHCI_PORT_UNINIT;
+            }
+        }
+    }
+}
+
+/// Stops the command list DMA engine of @a port_ctx, see section 10.3.2.
+static void prv_ahci_probe_stop_cmd(ahci_port_ctx_t *port_ctx) {
+    port_ctx->reg_port->cmd &= ~AHCI_PORT_CMD_ST;
+}
+
+static bool prv_ahci_probe_cmd_stopped(ahci_port_ctx_t *port_ctx) {
+    return !(port_ctx->reg_port->cmd & AHCI_PORT_CMD_CR);
+}
+
+/// Stops the FIS receive DMA engine of @a port_ctx, see section 10.3.2.
+static void prv_ahci_probe_stop_fis(ahci_port_ctx_t *port_ctx) {
+    port_ctx->reg_port->cmd &= ~AHCI_PORT_CMD_FRE;
+}
+
+static bool prv_ahci_probe_fis_stopped(ahci_port_ctx_t *port_ctx) {
+    return !(port_ctx->reg_port->cmd & AHCI_PORT_CMD_FR);
+}
+
+/**
+ * Spins up the device of @a port_ctx, and starts a COMRESET if the Phy has not
+ * established communication with the device.
+ * See #prv_ahci_probe_end_reset().
+ */
+static void prv_ahci_probe_start_reset(ahci_port_ctx_t *port_ctx) {
+    reg_port_t *const reg_port = port_ctx->reg_port;
+
+    ahci_cap_t ctrl_cap;
+    kmemread_v4(&ctrl_cap, &port_ctx->ctrl_ctx->reg_ghc->cap);
+    if (ctrl_cap.sss) {
+        ahci_port_cmd_t port_cmd;
+        kmemread_v4(&port_cmd, &reg_port->cmd);
+        port_cmd.sud = 1;
+        kmemwrite_v4(&reg_port->cmd, &port_cmd);
+    }
+
+    ahci_port_ssts_t port_ssts;
+    kmemread_v4(&port_ssts, &reg_port->ssts);
+    if (port_ssts.det == AHCI_SSTS_DET_DEV_PHY) { return; }
+
+    ahci_port_sctl_t port_sctl;
+    kmemread_v4(&port_sctl, &reg_port->sctl);
+    port_sctl.det = AHCI_SCTL_DET_RESET;
+    kmemwrite_v4(&reg_port->sctl, &port_sctl);
+}
+
+/// Ends the COMRESET started by #prv_ahci_probe_start_reset(), if any.
+static void prv_ahci_probe_end_reset(ahci_port_ctx_t *port_ctx) {
+    ahci_port_sctl_t port_sctl;
+    kmemread_v4(&port_sctl, &port_ctx->reg_port->sctl);
+    if (port_sctl.det == AHCI_SCTL_DET_RESET) {
+        port_sctl.det = AHCI_SCTL_DET_NONE;
+        kmemwrite_v4(&port_ctx->reg_port->sctl, &port_sctl);
+    }
+}
+
+static bool prv_ahci_probe_link_up(ahci_port_ctx_t *port_ctx) {
+    ahci_port_ssts_t port_ssts;
+    kmemread_v4(&port_ssts, &port_ctx->reg_port->ssts);
+    return port_ssts.det == AHCI_SSTS_DET_DEV_PHY;
+}
+
 /**
  * Sets up port @a port_ctx for communication.
  *
  * - Allocates buffers.
  * - Initializes the port registers.
+ * - Starts the FIS receive DMA engine.
+ *
+ * The command list DMA engine is started once the device is ready, see
+ * #prv_ahci_probe_start_cmd().
  */
 static void prv_ahci_setup_port(ahci_port_ctx_t *port_ctx) {
     ASSERT(port_ctx);
     ASSERT(port_ctx->reg_port);
     reg_port_t *const reg_port = port_ctx->reg_port;
 
+    const paddr_t dma_mask = port_ctx->ctrl_ctx->dma_mask;
+    paddr_t rfis_addr;
     port_ctx->p_rfis =
-        heap_alloc_aligned(sizeof(*port_ctx->p_rfis), AHCI_FIS_BASE_ALIGN);
-    port_ctx->p_cmd_list = heap_alloc_aligned(
-        AHCI_CMD_LIST_LEN * sizeof(ahci_cmd_hdr_t), AHCI_CMD_LIST_ALIGN);
+        dma_alloc_coherent(sizeof(*port_ctx->p_rfis), AHCI_FIS_BASE_ALIGN,
+                           dma_mask, &rfis_addr);
+    paddr_t cmd_list_addr;
+    port_ctx->p_cmd_list =
+        dma_alloc_coherent(AHCI_CMD_LIST_LEN * sizeof(ahci_cmd_hdr_t),
+                           AHCI_CMD_LIST_ALIGN, dma_mask, &cmd_list_addr);
+    paddr_t cmd_tables_addr;
     port_ctx->p_cmd_tables =
-        heap_alloc_aligned(AHCI_CMD_LIST_LEN * sizeof(ahci_cmd_table_t),
-                           alignof(ahci_cmd_table_t));
+        dma_alloc_coherent(AHCI_CMD_LIST_LEN * sizeof(ahci_cmd_table_t),
+                           alignof(ahci_cmd_table_t), dma_mask,
+                           &cmd_tables_addr);
 
-    // Stop FIS receive and command list DMA engines. The order is important.
-    // Refer to section 10.3, Software Manipulation of Port DMA Engines.
-    reg_port->cmd &= ~AHCI_PORT_CMD_ST;
-    reg_port->cmd &= ~AHCI_PORT_CMD_FRE;
-    while ((reg_port->cmd & AHCI_PORT_CMD_FR) ||
-           (reg_port->cmd & AHCI_PORT_CMD_CR)) {}
+    // Until the device is identified, assume that it cannot queue commands.
+    port_ctx->ncq = false;
+    port_ctx->queue_depth = 1;
+    port_ctx->active_slots = 0;
 
     // Initialzie the Command List Base Address and FIS Base Address registers.
-    reg_port->clb = (uint32_t)port_ctx->p_cmd_list;
-    reg_port->clbu = 0;
-    reg_port->fb = (uint32_t)port_ctx->p_rfis;
-    reg_port->fbu = 0;
+    reg_port->clb = (uint32_t)cmd_list_addr;
+    reg_port->clbu = (uint32_t)(cmd_list_addr >> 32);
+    reg_port->fb = (uint32_t)rfis_addr;
+    reg_port->fbu = (uint32_t)(rfis_addr >> 32);
 
     // Set up each command header to point to the appropriate command table.
     for (size_t cmd_idx = 0; cmd_idx < AHCI_CMD_LIST_LEN; cmd_idx++) {
         ahci_cmd_hdr_t *const p_cmd_hdr = &port_ctx->p_cmd_list[cmd_idx];
-        p_cmd_hdr->ctba = (uint32_t)&port_ctx->p_cmd_tables[cmd_idx];
-        p_cmd_hdr->ctbau = 0;
+        const paddr_t ctba =
+            cmd_tables_addr + cmd_idx * sizeof(ahci_cmd_table_t);
+        p_cmd_hdr->ctba = (uint32_t)ctba;
+        p_cmd_hdr->ctbau = (uint32_t)(ctba >> 32);
     }
 
-    // Start the command list DMA engine. The order is important.
+    // Clear the errors of the reset, so that the device's first D2H Register
+    // FIS updates PxTFD and PxSIG. Refer to section 10.1.2.
+    reg_port->serr = 0xFFFFFFFF;
+    reg_port->is = AHCI_PORT_INT_ALL;
+
     reg_port->cmd |= AHCI_PORT_CMD_FRE;
+}
+
+static bool prv_ahci_probe_fis_running(ahci_port_ctx_t *port_ctx) {
+    return (port_ctx->reg_port->cmd & AHCI_PORT_CMD_FR) != 0;
+}
+
+/// Returns `true` once the device has spun up and has sent its signature.
+static bool prv_ahci_probe_dev_ready(ahci_port_ctx_t *port_ctx) {
+    ahci_port_tfd_t port_tfd;
+    kmemread_v4(&port_tfd, &port_ctx->reg_port->tfd);
+    return (port_tfd.sts & (AHCI_TFD_STS_BSY | AHCI_TFD_STS_DRQ)) == 0;
+}
+
+/**
+ * Starts the command list DMA engine of @a port_ctx if its device is an ATA
+ * device, and enables the port interrupts.
+ */
+static void prv_ahci_probe_start_cmd(ahci_port_ctx_t *port_ctx) {
+    reg_port_t *const reg_port = port_ctx->reg_port;
+    if (reg_port->sig != SATA_SIG_ATA) {
+        LOG_INFO("%s: unrecognized signature 0x%08" PRIx32, port_ctx->name,
+                 reg_port->sig);
+        port_ctx->probing = false;
+        return;
+    }
+    LOG_INFO("%s: detected SATA_SIG_ATA", port_ctx->name);
+
+    ahci_port_set_int(port_ctx, AHCI_PORT_INT_ALL, true);
     reg_port->cmd |= AHCI_PORT_CMD_ST;
+}
 
-    // Wait for them to start.
-    while (((reg_port->cmd & AHCI_PORT_CMD_CR) == 0) ||
-           ((reg_port->cmd & AHCI_PORT_CMD_FR) == 0)) {}
+static bool prv_ahci_probe_cmd_running(ahci_port_ctx_t *port_ctx) {
+    return (port_ctx->reg_port->cmd & AHCI_PORT_CMD_CR) != 0;
 }
 
 /**
- * Sends a #SATA_CMD_IDENTIFY_DEVICE command on @a port_ctx.
+ * Issues a #SATA_CMD_IDENTIFY_DEVICE command on @a port_ctx.
  *
- * Fills in the following fields of @a port_ctx:
- * - #ahci_port_ctx_t.serial_str
- * - #ahci_port_ctx_t.identified
- * - #ahci_port_ctx_t.num_sectors
+ * Its completion is reported by the IRQ handler, see #AHCI_PORT_PROBING, and
+ * processed by #prv_ahci_probe_parse_ident().
  */
 static void prv_ahci_identify_port(ahci_port_ctx_t *port_ctx) {
-    ASSERT(port_ctx);
-    ASSERT(port_ctx->reg_port);
-
     ata_cmd_t cmd = {0};
     cmd.command = SATA_CMD_IDENTIFY_DEVICE;
 
-    uint16_t *const p_ident = heap_alloc_aligned(512, 2);
-    size_t cmd_slot;
-    if (!prv_ahci_send_ata_cmd(port_ctx, cmd, (uint32_t)p_ident, 1, false,
-                               &cmd_slot)) {
+    paddr_t ident_addr;
+    port_ctx->probe_ident = dma_alloc_coherent(
+        512, 2, port_ctx->ctrl_ctx->dma_mask, &ident_addr);
+    port_ctx->probe_done = false;
+    port_ctx->probe_err = false;
+    port_ctx->state = AHCI_PORT_PROBING;
+
+    // No other command can be outstanding, so the first slot is free.
+    const blkdev_seg_t ident_seg = {.addr = ident_addr, .len = 512};
+    if (!prv_ahci_send_ata_cmd(port_ctx, cmd, &ident_seg, 1, false, false, 0)) {
         LOG_ERROR("%s: could not issue IDENTIFY_DEVICE", port_ctx->name);
-        heap_free(p_ident);
-        port_ctx->identified = false;
-        return;
+        dma_free_coherent(port_ctx->probe_ident);
+        port_ctx->probe_ident = NULL;
+        port_ctx->state = AHCI_PORT_UNINIT;
+        port_ctx->probing = false;
     }
+}
 
-    bool b_ok = prv_ahci_wait_for_cmd(port_ctx, cmd_slot);
-    if (!b_ok) {
-        LOG_ERROR("%s: command IDENTIFY_DEVICE failed", port_ctx->name);
-        heap_free(p_ident);
-        port_ctx->identified = false;
+static bool prv_ahci_probe_identified(ahci_port_ctx_t *port_ctx) {
+    return port_ctx->probe_done;
+}
+
+/**
+ * Processes the result of #prv_ahci_identify_port().
+ *
+ * Fills in the following fields of @a port_ctx:
+ * - #ahci_port_ctx_t.serial_str
+ * - #ahci_port_ctx_t.identified
+ * - #ahci_port_ctx_t.num_sectors
+ * - #ahci_port_ctx_t.ncq
+ * - #ahci_port_ctx_t.queue_depth
+ * - #ahci_port_ctx_t.write_cache
+ * - #ahci_port_ctx_t.fua_ext
+ * - #ahci_port_ctx_t.trim_blocks
+ * - #ahci_port_ctx_t.online_sata
+ */
+static void prv_ahci_probe_parse_ident(ahci_port_ctx_t *port_ctx) {
+    uint16_t *const p_ident = port_ctx->probe_ident;
+    port_ctx->probe_ident = NULL;
+    port_ctx->probing = false;
+
+    if (port_ctx->probe_err) {
+        LOG_ERROR("%s: command IDENTIFY_DEVICE failed, TFD.ERR = 0x%02x",
+                  port_ctx->name, port_ctx->p_rfis->rfis.error);
+        port_ctx->reg_port->cmd &= ~AHCI_PORT_CMD_ST;
+        port_ctx->state = AHCI_PORT_UNINIT;
+        dma_free_coherent(p_ident);
         return;
     }
 
-    // Clear all interrupt status flags.
-    port_ctx->reg_port->is = AHCI_PORT_INT_ALL;
-
     kmemcpy(port_ctx->serial_str, p_ident + 10, SATA_SERIAL_STR_LEN);
     port_ctx->num_sectors = *((uint32_t *)&p_ident[60]);
 
@@ -747,8 +1274,59 @@ static void prv_ahci_identify_port(ahci_port_ctx_t *port_ctx) {
     LOG_INFO("%s: number of sectors: %zu", port_ctx->name,
              port_ctx->num_sectors);
 
-    heap_free(p_ident);
+    // NCQ is used only if both the HBA and the device support it. The number
+    // of tags is limited by both of them, too.
+    ahci_cap_t ctrl_cap;
+    kmemread_v4(&ctrl_cap, &port_ctx->ctrl_ctx->reg_ghc->cap);
+    const bool dev_ncq = p_ident[SATA_IDENT_SATA_CAP] & SATA_IDENT_SATA_CAP_NCQ;
+    if (ctrl_cap.sncq && dev_ncq) {
+        const size_t hba_depth = ctrl_cap.ncs + 1;
+        const size_t dev_depth =
+            (p_ident[SATA_IDENT_QUEUE_DEPTH] & SATA_IDENT_QUEUE_DEPTH_MASK) + 1;
+        port_ctx->ncq = true;
+        port_ctx->queue_depth = hba_depth < dev_depth ? hba_depth : dev_depth;
+        LOG_INFO("%s: NCQ queue depth: %zu", port_ctx->name,
+                 port_ctx->queue_depth);
+    } else {
+        LOG_INFO("%s: NCQ is not supported (HBA %u, device %u)",
+                 port_ctx->name, ctrl_cap.sncq, dev_ncq);
+    }
+
+    // A cache that cannot be flushed is left alone, writes to it are not
+    // guaranteed to be durable anyway.
+    const bool cache_on =
+        p_ident[SATA_IDENT_CMD_ENABLED] & SATA_IDENT_WRITE_CACHE;
+    const bool flush_ext = p_ident[SATA_IDENT_CMD_SET_2] & SATA_IDENT_FLUSH_EXT;
+    port_ctx->write_cache = cache_on && flush_ext;
+    port_ctx->fua_ext = p_ident[SATA_IDENT_CMD_SET_3] & SATA_IDENT_FUA_EXT;
+    if (cache_on && !flush_ext) {
+        LOG_INFO("%s: write cache is enabled, but cannot be flushed",
+                 port_ctx->name);
+    }
+    LOG_INFO("%s: write cache %s, FUA EXT %s", port_ctx->name,
+             port_ctx->write_cache ? "on" : "off",
+             port_ctx->fua_ext ? "supported" : "not supported");
+
+    if (p_ident[SATA_IDENT_DSM] & SATA_IDENT_DSM_TRIM) {
+        // Zero means that the limit is not reported, one block is always
+        // accepted.
+        size_t trim_blocks = p_ident[SATA_IDENT_DSM_MAX_BLOCKS];
+        if (trim_blocks == 0) { trim_blocks = 1; }
+        if (trim_blocks > AHCI_TRIM_MAX_BLOCKS) {
+            trim_blocks = AHCI_TRIM_MAX_BLOCKS;
+        }
+        port_ctx->p_trim_ranges = dma_alloc_coherent(
+            512 * trim_blocks, 8, port_ctx->ctrl_ctx->dma_mask,
+            &port_ctx->trim_ranges_addr);
+        port_ctx->trim_blocks = trim_blocks;
+        LOG_INFO("%s: TRIM is supported, %zu blocks of ranges", port_ctx->name,
+                 trim_blocks);
+    }
+
+    dma_free_coherent(p_ident);
     port_ctx->identified = true;
+    port_ctx->online_sata = true;
+    port_ctx->state = AHCI_PORT_IDLE;
 }
 
 /// Checks sector arguments for validness.
@@ -776,12 +1354,10 @@ static bool prv_ahci_port_check_sectors(ahci_port_ctx_t *port_ctx,
         return false;
     }
 
-    // There is a finite amount of PRDs in the driver. Each can describe a 4 MiB
-    // data block, or 8192 512-byte sectors.
-    if (num_sectors > 8192 * AHCI_CMD_TABLE_NUM_PRDS) {
+    if (num_sectors > AHCI_MAX_CMD_SECTORS) {
         LOG_ERROR(
             "ahci: %s: number of sectors to read cannot be greater than %u",
-            port_ctx->name, 8192 * AHCI_CMD_TABLE_NUM_PRDS);
+            port_ctx->name, AHCI_MAX_CMD_SECTORS);
         return false;
     }
 
@@ -789,51 +1365,290 @@ static bool prv_ahci_port_check_sectors(ahci_port_ctx_t *port_ctx,
 }
 
 /**
- * Sends an ATA command to a device.
+ * Issues a read or a write command on port @a port_ctx.
  *
- * @param[in]  port_ctx    Context of the port that will handle the command.
- * @param[in]  cmd         ATA command details.
- * @param[in]  buf_addr    Buffer to read sectors to or write them from.
- * @param[in]  num_sectors Number of sectors in @a p_buf.
- * @param[in]  dir_write   `true` if writing to the device, `false` if reading.
- * @param[out] p_cmd_slot  Command slot pointer.
+ * If the port supports NCQ (see #ahci_port_ctx.ncq), the command is
+ * #SATA_CMD_READ_FPDMA_QUEUED or #SATA_CMD_WRITE_FPDMA_QUEUED, and it may be
+ * issued while other commands are outstanding. Otherwise, the command is
+ * #SATA_CMD_READ_DMA_EXT or #SATA_CMD_WRITE_DMA_EXT.
  *
- * If the command has been issued, writes its slot to @a p_cmd_slot.
+ * @param port_ctx     Port context.
+ * @param req          Request to complete when the command finishes, or `NULL`.
+ * @param dir_write    `true` if writing to the device, `false` if reading.
+ * @param fua          `true` if the written data must reach the media before
+ *                     the command completes, see #ahci_port_ctx.write_cache.
+ * @param start_sector First sector to read or write.
+ * @param num_sectors  Number of sectors to read or write.
+ * @param segs         Physical memory to read sectors to or write them from, in
+ *                     the order of the sectors. The total length must be
+ *                     equal to @a num_sectors sectors.
+ * @param num_segs     Number of items in @a segs.
  *
- * @returns `true` if the command has been issued, otherwise `false`.
+ * @returns
+ * - `true` if the command has been issued.
+ * - `false` if the command could not be issued, e.g., due to invalid sector
+ *   parameters, or no command slot being free.
  */
-static bool prv_ahci_send_ata_cmd(ahci_port_ctx_t *port_ctx, ata_cmd_t cmd,
-                                  uint32_t buf_addr, size_t num_sectors,
-                                  bool dir_write, size_t *p_cmd_slot) {
-    // Depending on the sector count, there may be one or more physical region
-    // descriptors necessary. Maximum region length is 4 MiB. However, the last
-    // region length may be less than that to ensure that the buffer is not
-    // overwritten.
+static bool prv_ahci_port_start_rw(ahci_port_ctx_t *port_ctx,
+                                   blkdev_req_t *req, bool dir_write, bool fua,
+                                   uint64_t start_sector, uint32_t num_sectors,
+                                   const blkdev_seg_t *segs, size_t num_segs) {
+    if (!prv_ahci_port_check_sectors(port_ctx, start_sector, num_sectors)) {
+        return false;
+    }
 
-    if (num_sectors == 0) {
-        // FIXME: do not fail
-        PANIC("invalid argument 'num_sectors' value 0, port %s",
-              port_ctx->name);
+    uint64_t seg_len = 0;
+    for (size_t idx = 0; idx < num_segs; idx++) { seg_len += segs[idx].len; }
+    if (seg_len != 512ULL * num_sectors) {
+        LOG_ERROR("%s: segments take %llu bytes, but %" PRIu32
+                  " sectors are transferred",
+                  port_ctx->name, seg_len, num_sectors);
+        return false;
     }
 
-    // One PRD can describe a 4 MiB block of data.
-    const size_t read_size = 512 * num_sectors;
-    const size_t num_prds = (read_size + 0x3FFFFF) / 0x400000;
-    const size_t last_prd_len = (read_size % 0x400000) - 1;
+    // Without a write cache, every write goes to the media.
+    fua = fua && dir_write && port_ctx->write_cache;
+    bool post_flush = false;
 
-    if (num_prds > AHCI_CMD_TABLE_NUM_PRDS) {
-        LOG_ERROR("%s: not enough PRDs to transfer %zu bytes", port_ctx->name,
-                  read_size);
+    // Set up an ATA command.
+    ata_cmd_t cmd = {0};
+    cmd.lba = start_sector;
+    cmd.device = 1 << 6; // "shall be set to one"
+    // There is no mention of setting the 6th bit in "ATA/ATAPI Command Set -
+    // 3" for the WRITE DMA EXT command, however not setting it in QEMU results
+    // in the command failing. Internet says it's the LBA mode bit, but I could
+    // not find the original source for this.
+    if (port_ctx->ncq) {
+        // FPDMA QUEUED commands take the sector count in the Features field,
+        // and the NCQ tag, which is the command slot, in the Count field. The
+        // tag is filled in by prv_ahci_port_issue().
+        cmd.features = num_sectors;
+        if (fua) { cmd.device |= SATA_NCQ_FUA; }
+        cmd.command = dir_write ? SATA_CMD_WRITE_FPDMA_QUEUED
+                                : SATA_CMD_READ_FPDMA_QUEUED;
+    } else {
+        cmd.count = num_sectors;
+        if (!dir_write) {
+            cmd.command = SATA_CMD_READ_DMA_EXT;
+        } else if (fua && port_ctx->fua_ext) {
+            cmd.command = SATA_CMD_WRITE_DMA_FUA_EXT;
+        } else {
+            cmd.command = SATA_CMD_WRITE_DMA_EXT;
+            post_flush = fua;
+        }
+    }
+
+    const bool issued = prv_ahci_port_issue(port_ctx, req, cmd, segs, num_segs,
+                                            dir_write, port_ctx->ncq,
+                                            post_flush);
+    if (!issued) {
+        LOG_ERROR("%s: failed to issue %s command", port_ctx->name,
+                  dir_write ? "write" : "read");
+    }
+    return issued;
+}
+
+/**
+ * Issues #SATA_CMD_FLUSH_CACHE_EXT on port @a port_ctx.
+ *
+ * The command is not queued, so no other command may be outstanding.
+ *
+ * @returns `false` if the command could not be issued.
+ */
+static bool prv_ahci_port_start_flush(ahci_port_ctx_t *port_ctx,
+                                      blkdev_req_t *req) {
+    ata_cmd_t cmd = {0};
+    cmd.command = SATA_CMD_FLUSH_CACHE_EXT;
+
+    const bool issued =
+        prv_ahci_port_issue(port_ctx, req, cmd, NULL, 0, false, false, false);
+    if (!issued) {
+        LOG_ERROR("%s: failed to issue flush command", port_ctx->name);
+    }
+    return issued;
+}
+
+/**
+ * Issues a TRIM #SATA_CMD_DATA_SET_MGMT on port @a port_ctx for
+ * @a num_sectors starting from sector @a start_sector.
+ *
+ * The range is described by LBA Range Entries in #ahci_port_ctx.p_trim_ranges.
+ * The command is not queued, so no other command may be outstanding.
+ *
+ * @returns `false` if the command could not be issued, e.g., because the range
+ * needs more entries than fit into #ahci_port_ctx.trim_blocks blocks.
+ */
+static bool prv_ahci_port_start_trim(ahci_port_ctx_t *port_ctx,
+                                     blkdev_req_t *req, uint64_t start_sector,
+                                     uint64_t num_sectors) {
+    if (port_ctx->trim_blocks == 0) {
+        LOG_ERROR("%s: TRIM is not supported", port_ctx->name);
         return false;
     }
+    if (num_sectors == 0 || start_sector >= port_ctx->num_sectors ||
+        num_sectors > port_ctx->num_sectors - start_sector) {
+        LOG_ERROR("%s: bad TRIM range, sectors %llu+%llu", port_ctx->name,
+                  start_sector, num_sectors);
+        return false;
+    }
+
+    const uint64_t num_ranges =
+        (num_sectors + SATA_DSM_RANGE_MAX_SECTORS - 1) /
+        SATA_DSM_RANGE_MAX_SECTORS;
+    if (num_ranges > port_ctx->trim_blocks * SATA_DSM_RANGES_PER_BLOCK) {
+        LOG_ERROR("%s: TRIM of %llu sectors needs too many ranges",
+                  port_ctx->name, num_sectors);
+        return false;
+    }
+    const size_t num_blocks =
+        (num_ranges + SATA_DSM_RANGES_PER_BLOCK - 1) /
+        SATA_DSM_RANGES_PER_BLOCK;
+
+    // Unused entries of the last block must have a zero sector count.
+    kmemset(port_ctx->p_trim_ranges, 0, 512 * num_blocks);
+    uint64_t sector = start_sector;
+    uint64_t left = num_sectors;
+    for (size_t range_idx = 0; left > 0; range_idx++) {
+        const uint64_t count = left < SATA_DSM_RANGE_MAX_SECTORS
+                                   ? left
+                                   : SATA_DSM_RANGE_MAX_SECTORS;
+        port_ctx->p_trim_ranges[range_idx] = sector | (count << 48);
+        sector += count;
+        left -= count;
+    }
+
+    ata_cmd_t cmd = {0};
+    cmd.features = SATA_DSM_TRIM;
+    cmd.count = num_blocks;
+    cmd.device = 1 << 6;
+    cmd.command = SATA_CMD_DATA_SET_MGMT;
+
+    const blkdev_seg_t ranges_seg = {.addr = port_ctx->trim_ranges_addr,
+                                     .len = 512 * num_blocks};
+    const bool issued = prv_ahci_port_issue(port_ctx, req, cmd, &ranges_seg, 1,
+                                            true, false, false);
+    if (!issued) {
+        LOG_ERROR("%s: failed to issue TRIM command", port_ctx->name);
+    }
+    return issued;
+}
+
+/**
+ * Allocates a command slot on port @a port_ctx and issues @a cmd in it.
+ *
+ * @param port_ctx   Port context.
+ * @param req        Request to complete when the command finishes, or `NULL`.
+ * @param cmd        ATA command. The NCQ tag of a queued command is filled in.
+ * @param segs       Physical memory of the transfer, see
+ *                   #prv_ahci_send_ata_cmd().
+ * @param num_segs   Number of items in @a segs, zero if there is no data.
+ * @param dir_write  `true` if writing to the device, `false` if reading.
+ * @param queued     `true` if @a cmd is an NCQ command.
+ * @param post_flush `true` if @a req completes only after a flush, see
+ *                   #ahci_port_ctx.post_flush_slots.
+ *
+ * @returns `false` if there is no free slot, or if the command could not be
+ * issued.
+ */
+static bool prv_ahci_port_issue(ahci_port_ctx_t *port_ctx, blkdev_req_t *req,
+                                ata_cmd_t cmd, const blkdev_seg_t *segs,
+                                size_t num_segs, bool dir_write, bool queued,
+                                bool post_flush) {
+    const bool restore_int = prv_ahci_port_lock(port_ctx);
 
-    // Find a free command slot.
     size_t cmd_slot;
-    if (!prv_ahci_find_cmd_slot(port_ctx->reg_port, &cmd_slot)) {
-        LOG_ERROR("%s: could not find free command slot", port_ctx->name);
+    if (!prv_ahci_port_alloc_slot(port_ctx, &cmd_slot)) {
+        prv_ahci_port_unlock(port_ctx, restore_int);
+        LOG_ERROR("%s: no free command slot", port_ctx->name);
         return false;
     }
 
+    // The NCQ tag is the command slot.
+    if (queued) { cmd.count = cmd_slot << SATA_NCQ_TAG_SHIFT; }
+
+    // The request must be in place before the command is issued, because the
+    // IRQ handler may complete it right away on another processor.
+    port_ctx->slot_reqs[cmd_slot] = req;
+    if (req) { req->state = BLKDEV_REQ_ACTIVE; }
+    if (post_flush) { port_ctx->post_flush_slots |= 1U << cmd_slot; }
+    port_ctx->state = AHCI_PORT_ACTIVE;
+
+    const bool issued = prv_ahci_send_ata_cmd(port_ctx, cmd, segs, num_segs,
+                                              dir_write, queued, cmd_slot);
+    if (!issued) {
+        port_ctx->slot_reqs[cmd_slot] = NULL;
+        port_ctx->active_slots &= ~(1U << cmd_slot);
+        port_ctx->post_flush_slots &= ~(1U << cmd_slot);
+        if (port_ctx->active_slots == 0) { port_ctx->state = AHCI_PORT_IDLE; }
+    }
+
+    prv_ahci_port_unlock(port_ctx, restore_int);
+    return issued;
+}
+
+/**
+ * Issues the flush of the FUA write whose data transfer has completed, see
+ * #ahci_port_ctx.post_flush_req. Its request completes with the flush.
+ *
+ * It is called after the slots have been reaped, without the port lock.
+ */
+static void prv_ahci_port_post_flush(ahci_port_ctx_t *port_ctx) {
+    const bool restore_int = prv_ahci_port_lock(port_ctx);
+    blkdev_req_t *const req = port_ctx->post_flush_req;
+    port_ctx->post_flush_req = NULL;
+    prv_ahci_port_unlock(port_ctx, restore_int);
+
+    if (req && !prv_ahci_port_start_flush(port_ctx, req)) {
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+    }
+}
+
+/**
+ * Sends an ATA command to a device.
+ *
+ * @param port_ctx    Context of the port that will handle the command.
+ * @param cmd         ATA command details.
+ * @param segs        Physical memory to read sectors to or write them from.
+ * @param num_segs    Number of items in @a segs, zero for a command without
+ *                    data.
+ * @param dir_write   `true` if writing to the device, `false` if reading.
+ * @param queued      `true` if @a cmd is an NCQ command tagged with
+ *                    @a cmd_slot.
+ * @param cmd_slot    Free command slot to issue the command in.
+ *
+ * @returns `true` if the command has been issued, otherwise `false`.
+ */
+static bool prv_ahci_send_ata_cmd(ahci_port_ctx_t *port_ctx, ata_cmd_t cmd,
+                                  const blkdev_seg_t *segs, size_t num_segs,
+                                  bool dir_write, bool queued,
+                                  size_t cmd_slot) {
+    // Depending on the segment length, there may be one or more physical
+    // region descriptors necessary per segment. Maximum region length is 4 MiB.
+    // However, the last region length of a segment may be less than that to
+    // ensure that the buffer is not overwritten.
+
+    size_t num_prds = 0;
+    for (size_t seg_idx = 0; seg_idx < num_segs; seg_idx++) {
+        const blkdev_seg_t *const seg = &segs[seg_idx];
+        // Data Base Address and Data Byte Count must be word aligned, and the
+        // segment must be reachable by the HBA, see #ahci_ctrl_ctx.dma_mask.
+        if (seg->len == 0 || (seg->len & 1) || (seg->addr & 1) ||
+            seg->addr + seg->len - 1 > port_ctx->ctrl_ctx->dma_mask) {
+            LOG_ERROR("%s: bad segment 0x%llx, length %" PRIu32,
+                      port_ctx->name, seg->addr, seg->len);
+            return false;
+        }
+        num_prds += prv_ahci_num_prds(seg->len);
+    }
+
+    if (num_prds > AHCI_CMD_TABLE_NUM_PRDS) {
+        LOG_ERROR("%s: not enough PRDs to transfer %zu segments",
+                  port_ctx->name, num_segs);
+        return false;
+    }
+
+    ASSERT(cmd_slot < AHCI_CMD_LIST_LEN);
+
     // Set up the command header.
     ahci_cmd_hdr_t *const p_cmd_hdr = &port_ctx->p_cmd_list[cmd_slot];
     p_cmd_hdr->cfl = (sizeof(sata_fis_reg_h2d_t) / 4);
@@ -848,21 +1663,23 @@ static bool prv_ahci_send_ata_cmd(ahci_port_ctx_t *port_ctx, ata_cmd_t cmd,
 
     // Fill the command table. Start with the PRD table.
     ahci_cmd_table_t *const p_cmd_table = &port_ctx->p_cmd_tables[cmd_slot];
-    ASSERT(num_prds >= 1);
-    for (size_t prd_idx = 0; prd_idx < num_prds - 1; prd_idx++) {
-        ahci_prd_t *const p_prd = &p_cmd_table->p_prd_table[prd_idx];
-        p_prd->dba = buf_addr + 0x400000 * prd_idx;
-        p_prd->dbau = 0;
-        p_prd->dbc = 0x3FFFFF; // 4 MiB
-        p_prd->b_int = true;
-    }
-    // The last PRD may describe less than 4 MiB, that's why it's not in the
-    // loop.
-    ahci_prd_t *const last_prd = &p_cmd_table->p_prd_table[num_prds - 1];
-    last_prd->dba = buf_addr + 0x400000 * (num_prds - 1);
-    last_prd->dbau = 0;
-    last_prd->dbc = last_prd_len;
-    last_prd->b_int = true;
+    size_t prd_idx = 0;
+    for (size_t seg_idx = 0; seg_idx < num_segs; seg_idx++) {
+        const paddr_t seg_addr = segs[seg_idx].addr;
+        uint32_t left_len = segs[seg_idx].len;
+        for (uint32_t offset = 0; left_len > 0; offset += AHCI_PRD_MAX_LEN) {
+            // The last PRD of a segment may describe less than 4 MiB.
+            const uint32_t prd_len =
+                left_len < AHCI_PRD_MAX_LEN ? left_len : AHCI_PRD_MAX_LEN;
+            ahci_prd_t *const p_prd = &p_cmd_table->p_prd_table[prd_idx++];
+            p_prd->dba = (uint32_t)(seg_addr + offset);
+            p_prd->dbau = (uint32_t)((seg_addr + offset) >> 32);
+            p_prd->dbc = prd_len - 1;
+            p_prd->b_int = true;
+            left_len -= prd_len;
+        }
+    }
+    ASSERT(prd_idx == num_prds);
 
     // Finish by setting the CFIS.
     sata_fis_reg_h2d_t *p_cfis = (sata_fis_reg_h2d_t *)&p_cmd_table->p_cfis;
@@ -881,105 +1698,197 @@ static bool prv_ahci_send_ata_cmd(ahci_port_ctx_t *port_ctx, ata_cmd_t cmd,
     p_cfis->lba5 = (cmd.lba >> 40) & 0xFF;
     p_cfis->count = cmd.count;
 
-    // Wait until the port is no longer busy.
-    size_t spin = 0;
-    while (spin < 100000) {
-        ahci_port_tfd_t port_tfd;
-        kmemread_v4(&port_tfd, &port_ctx->reg_port->tfd);
-        if ((port_tfd.sts & (AHCI_TFD_STS_BSY | AHCI_TFD_STS_DRQ)) == 0) {
-            break;
+    if (queued) {
+        // Queued commands may be issued while other queued commands are
+        // outstanding. The tag must be marked active before the command is
+        // issued. Refer to section 5.3.1.
+        port_ctx->reg_port->sact = (1 << cmd_slot);
+    } else {
+        // Wait until the port is no longer busy.
+        const uint64_t deadline_us =
+            arch_timer_current_us() + AHCI_BUSY_TIMEOUT_US;
+        for (;;) {
+            ahci_port_tfd_t port_tfd;
+            kmemread_v4(&port_tfd, &port_ctx->reg_port->tfd);
+            if ((port_tfd.sts & (AHCI_TFD_STS_BSY | AHCI_TFD_STS_DRQ)) == 0) {
+                break;
+            }
+            if (arch_timer_current_us() >= deadline_us) {
+                LOG_ERROR("%s: port is busy", port_ctx->name);
+                return false;
+            }
+            arch_pause_in_loop();
         }
-    }
-    if (spin >= 100000) {
-        LOG_ERROR("%s: port is busy", port_ctx->name);
-        return false;
+
+        // Clear the D2H Register FIS interrupt flag.
+        port_ctx->reg_port->is = AHCI_PORT_INT_DHR;
     }
 
-    // Clear the D2H Register FIS interrupt flag.
-    port_ctx->reg_port->is = AHCI_PORT_INT_DHR;
+    const uint64_t now_us = blktrace_now_us();
+    for (blkdev_req_t *req = port_ctx->slot_reqs[cmd_slot]; req;
+         req = req->merged_next) {
+        req->trace.issue_us = now_us;
+    }
 
     // Issue the command.
     port_ctx->reg_port->ci = (1 << cmd_slot);
 
-    *p_cmd_slot = cmd_slot;
     return true;
 }
 
-/**
- * Waits for the command in slot @a cmd_slot to finish.
- *
- * @param port_ctx Port context.
- * @param cmd_slot Command slot to wait on.
- *
- * @returns
- * - `true` if the command has finished successfully.
- * - `false` if the Task File Error bit is set in the Port Interrupt Status
- *   register (IS.TFES), or if no FIS has been received at all.
- */
-static bool prv_ahci_wait_for_cmd(ahci_port_ctx_t *port_ctx, size_t cmd_slot) {
-    reg_port_t *const reg_port = port_ctx->reg_port;
-
-    bool b_has_err = false;
-    while (true) {
-        if (reg_port->is & AHCI_PORT_INT_TFE) {
-            b_has_err = true;
-            reg_port->is = AHCI_PORT_INT_TFE;
-            LOG_ERROR("task file error");
-            break;
-        }
+/// Returns the number of PRDs needed to describe a segment of @a len bytes.
+static size_t prv_ahci_num_prds(uint32_t len) {
+    return (len + AHCI_PRD_MAX_LEN - 1) / AHCI_PRD_MAX_LEN;
+}
 
-        if (!(reg_port->ci & (1 << cmd_slot))) { break; }
+/// Returns the number of PRDs needed to describe the memory of @a req.
+static size_t prv_ahci_req_num_prds(const blkdev_req_t *req) {
+    if (req->num_segs == 0) {
+        return prv_ahci_num_prds(512 * blkdev_req_sectors(req));
     }
 
-    // We expect a D2H RFIS to arrive.
-    if (!(reg_port->is & AHCI_PORT_INT_DHR)) {
-        // RFIS did not arrive.
-        LOG_ERROR("command completed, but RFIS was not received");
-        return false;
+    size_t num_prds = 0;
+    for (size_t idx = 0; idx < req->num_segs; idx++) {
+        num_prds += prv_ahci_num_prds(req->segs[idx].len);
     }
+    return num_prds;
+}
 
-    // Clear RFIS interrupt flag.
-    reg_port->is = AHCI_PORT_INT_DHR;
-
-    // Check the error.
-    if (b_has_err) {
-        if (port_ctx->p_rfis->rfis.error & SATA_ERROR_ABORT) {
-            LOG_ERROR("%s: received FIS error is set to 0x02%x; device aborted "
-                      "command",
-                      port_ctx->name, port_ctx->p_rfis->rfis.error);
-        } else {
-            LOG_ERROR("%s: received FIS error is set to 0x02%x", port_ctx->name,
-                      port_ctx->p_rfis->rfis.error);
-        }
-        return false;
+/**
+ * Appends the memory segments of @a req to @a out_segs.
+ *
+ * A request without #blkdev_req.segs has an identity mapped buffer, which is
+ * a single segment.
+ *
+ * @returns `false` if @a out_segs has no room for all segments.
+ */
+static bool prv_ahci_req_segs(const blkdev_req_t *req, blkdev_seg_t *out_segs,
+                              size_t max_segs, size_t *inout_num_segs) {
+    if (req->num_segs == 0) {
+        if (*inout_num_segs == max_segs) { return false; }
+
+        const void *const buf =
+            req->op == BLKDEV_OP_READ ? req->read_buf : req->write_buf;
+        blkdev_seg_t *const seg = &out_segs[(*inout_num_segs)++];
+        seg->addr = (uintptr_t)buf;
+        seg->len = 512 * blkdev_req_sectors(req);
+        return true;
     }
 
+    if (*inout_num_segs + req->num_segs > max_segs) { return false; }
+    kmemcpy(&out_segs[*inout_num_segs], req->segs,
+            req->num_segs * sizeof(blkdev_seg_t));
+    *inout_num_segs += req->num_segs;
     return true;
 }
 
-static bool prv_ahci_find_cmd_slot(reg_port_t *reg_port, size_t *out_slot) {
-    ASSERT(out_slot);
+/**
+ * Locks the command slot bookkeeping of port @a port_ctx.
+ *
+ * Interrupts are disabled while the lock is held, otherwise the port IRQ
+ * handler could spin forever on the lock held by the task it has interrupted.
+ *
+ * @returns `true` if interrupts were enabled before the call. Pass it to
+ * #prv_ahci_port_unlock().
+ */
+static bool prv_ahci_port_lock(ahci_port_ctx_t *port_ctx) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&port_ctx->slot_lock);
+    return restore_int;
+}
 
-    for (int cmd_slot = 0; cmd_slot < 32; cmd_slot++) {
-        // Device Status bit.
-        const bool b_ds = 0 != (reg_port->sact & (1 << cmd_slot));
-        // Command Issued bit.
-        const bool b_ci = 0 != (reg_port->ci & (1 << cmd_slot));
+/**
+ * Unlocks the command slot bookkeeping of port @a port_ctx.
+ * See #prv_ahci_port_lock().
+ */
+static void prv_ahci_port_unlock(ahci_port_ctx_t *port_ctx, bool restore_int) {
+    spinlock_release(&port_ctx->slot_lock);
+    if (restore_int) { arch_enable_ints(); }
+}
 
-        if (!b_ds && !b_ci) {
-            *out_slot = cmd_slot;
-            return true;
+/**
+ * Allocates a command slot on port @a port_ctx.
+ *
+ * At most #ahci_port_ctx.queue_depth slots can be allocated at a time. The
+ * caller must hold the port lock, see #prv_ahci_port_lock().
+ *
+ * @returns `true` and the slot index in @a out_slot, if a slot is free.
+ */
+static bool prv_ahci_port_alloc_slot(ahci_port_ctx_t *port_ctx,
+                                     size_t *out_slot) {
+    const size_t num_active = __builtin_popcount(port_ctx->active_slots);
+    if (num_active >= port_ctx->queue_depth) { return false; }
+
+    // Fewer than queue_depth slots are active, so the lowest free slot is
+    // below queue_depth, which does not exceed the HBA slot count.
+    const size_t cmd_slot = __builtin_ctz(~port_ctx->active_slots);
+    ASSERT(cmd_slot < port_ctx->queue_depth);
+
+    port_ctx->active_slots |= 1U << cmd_slot;
+    *out_slot = cmd_slot;
+    return true;
+}
+
+/**
+ * Frees the slots of the commands that have been completed by the HBA.
+ *
+ * A command has been completed when its slot bit is clear both in PxCI and
+ * PxSACT. The caller must hold the port lock, see #prv_ahci_port_lock(). A FUA
+ * write that needs a flush is not returned, but left for
+ * #prv_ahci_port_post_flush(), which the caller calls after unlocking.
+ *
+ * @param port_ctx Port context.
+ * @param out_reqs Array of at least #AHCI_CMD_LIST_LEN items to store the
+ *                 requests of the completed commands to.
+ *
+ * @returns Number of requests written to @a out_reqs.
+ */
+static size_t prv_ahci_port_reap_slots(ahci_port_ctx_t *port_ctx,
+                                       blkdev_req_t **out_reqs) {
+    const uint32_t busy_slots =
+        port_ctx->reg_port->sact | port_ctx->reg_port->ci;
+    uint32_t done_slots = port_ctx->active_slots & ~busy_slots;
+    port_ctx->active_slots &= ~done_slots;
+
+    size_t num_reqs = 0;
+    while (done_slots != 0) {
+        const size_t cmd_slot = __builtin_ctz(done_slots);
+        done_slots &= ~(1U << cmd_slot);
+
+        blkdev_req_t *const req = port_ctx->slot_reqs[cmd_slot];
+        port_ctx->slot_reqs[cmd_slot] = NULL;
+        if (port_ctx->post_flush_slots & (1U << cmd_slot)) {
+            // Only ports without NCQ flush after a write, and they have a
+            // single slot.
+            port_ctx->post_flush_slots &= ~(1U << cmd_slot);
+            ASSERT(!port_ctx->post_flush_req);
+            port_ctx->post_flush_req = req;
+        } else if (req) {
+            out_reqs[num_reqs++] = req;
         }
     }
-    return false;
+
+    if (port_ctx->active_slots == 0) { port_ctx->state = AHCI_PORT_IDLE; }
+    return num_reqs;
 }
 
 /**
  * Handles a Task File Error interrupt.
- * Refer to section 6.2.2.1 "Non-Queued Error Recovery".
+ *
+ * Refer to section 6.2.2.1 "Non-Queued Error Recovery". The same recovery is
+ * used for queued commands: the commands that have completed before the error
+ * succeed, the rest of the outstanding commands fail.
+ *
  * @param port_ctx Port that got a Task File Error.
  */
 static void prv_ahci_port_handle_tfe(ahci_port_ctx_t *port_ctx) {
+    blkdev_req_t *done_reqs[AHCI_CMD_LIST_LEN];
+    blkdev_req_t *failed_reqs[AHCI_CMD_LIST_LEN];
+    size_t num_failed = 0;
+
+    const bool restore_int = prv_ahci_port_lock(port_ctx);
+
     const ahci_port_state_t port_state = port_ctx->state;
     if (port_state != AHCI_PORT_ACTIVE) {
         PANIC("port %s got TFE IRQ in unexpected state %u", port_ctx->name,
@@ -988,19 +1897,16 @@ static void prv_ahci_port_handle_tfe(ahci_port_ctx_t *port_ctx) {
 
     LOG_FLOW("port %s TFE: AHCI_PORT_ACTIVE", port_ctx->name);
 
-    if (!port_ctx->has_blkdev_req ||
-        port_ctx->blkdev_req->state != BLKDEV_REQ_ACTIVE) {
-        PANIC("port %s got TFE IRQ with no active request", port_ctx->name);
+    const size_t num_done = prv_ahci_port_reap_slots(port_ctx, done_reqs);
+    if (port_ctx->active_slots == 0) {
+        PANIC("port %s got TFE IRQ with no active command", port_ctx->name);
     }
+    LOG_FLOW("port %s TFE: CI = 0x%08" PRIx32 ", SACT = 0x%08" PRIx32
+             ", active slots = 0x%08" PRIx32,
+             port_ctx->name, port_ctx->reg_port->ci, port_ctx->reg_port->sact,
+             port_ctx->active_slots);
 
-    const uint32_t ci = port_ctx->reg_port->ci;
-    if (ci != (uint32_t)(1 << (port_ctx->req_cmd_slot))) {
-        PANIC("port %s got TFE IRQ with CI = 0x%08" PRIx32
-              ", request slot = %zu",
-              port_ctx->name, ci, port_ctx->req_cmd_slot);
-    }
-
-    // Clear PxCMD.ST to '0' to reset the CI register.
+    // Clear PxCMD.ST to '0' to reset the CI and SACT registers.
     port_ctx->reg_port->cmd &= ~AHCI_PORT_CMD_ST;
     while (port_ctx->reg_port->cmd & AHCI_PORT_CMD_CR) {}
 
@@ -1037,37 +1943,117 @@ static void prv_ahci_port_handle_tfe(ahci_port_ctx_t *port_ctx) {
     port_ctx->reg_port->cmd |= AHCI_PORT_CMD_ST;
     while (!(port_ctx->reg_port->cmd & AHCI_PORT_CMD_CR)) {}
 
-    LOG_FLOW("port %s TFE: failing active request", port_ctx->name);
-    port_ctx->blkdev_req->state = BLKDEV_REQ_ERROR;
-    semaphore_increase(&port_ctx->blkdev_req->sem_done);
+    // Every command that was still outstanding has been dropped by the HBA.
+    while (port_ctx->active_slots != 0) {
+        const size_t cmd_slot = __builtin_ctz(port_ctx->active_slots);
+        port_ctx->active_slots &= ~(1U << cmd_slot);
 
-    port_ctx->has_blkdev_req = false;
+        blkdev_req_t *const req = port_ctx->slot_reqs[cmd_slot];
+        port_ctx->slot_reqs[cmd_slot] = NULL;
+        if (req) { failed_reqs[num_failed++] = req; }
+    }
+    port_ctx->post_flush_slots = 0;
     port_ctx->state = AHCI_PORT_IDLE;
+
+    prv_ahci_port_unlock(port_ctx, restore_int);
+    prv_ahci_port_post_flush(port_ctx);
+
+    for (size_t idx = 0; idx < num_done; idx++) {
+        blkdev_complete_req(done_reqs[idx], BLKDEV_REQ_SUCCESS);
+    }
+
+    LOG_FLOW("port %s TFE: failing %zu requests", port_ctx->name, num_failed);
+    for (size_t idx = 0; idx < num_failed; idx++) {
+        blkdev_complete_req(failed_reqs[idx], BLKDEV_REQ_ERROR);
+    }
 }
 
 /**
- * Handles a Device to Host Register FIS interrupt.
- * @param port_ctx Port that got a DHR interrupt.
+ * Handles a Device to Host Register FIS or a Set Device Bits FIS interrupt.
+ *
+ * Non-queued commands complete with a D2H Register FIS, queued commands
+ * complete with a Set Device Bits FIS. Either way, the requests of all
+ * completed commands are marked as successful.
+ *
+ * @param port_ctx Port that got a DHR or an SDB interrupt.
  */
-static void prv_ahci_port_handle_dhr(ahci_port_ctx_t *port_ctx) {
+static void prv_ahci_port_handle_done(ahci_port_ctx_t *port_ctx) {
+    blkdev_req_t *done_reqs[AHCI_CMD_LIST_LEN];
+
+    const bool restore_int = prv_ahci_port_lock(port_ctx);
     const ahci_port_state_t port_state = port_ctx->state;
+    const size_t num_done = prv_ahci_port_reap_slots(port_ctx, done_reqs);
+    prv_ahci_port_unlock(port_ctx, restore_int);
+    prv_ahci_port_post_flush(port_ctx);
+
     if (port_state != AHCI_PORT_ACTIVE) {
-        LOG_FLOW("port %s irq: port is not active (state %u), ignoring DHR",
+        LOG_FLOW("port %s irq: port is not active (state %u), nothing to "
+                 "complete",
                  port_ctx->name, port_state);
+        return;
     }
 
-    LOG_FLOW("port %s irq: AHCI_PORT_ACTIVE", port_ctx->name);
-    if (!port_ctx->has_blkdev_req ||
-        port_ctx->blkdev_req->state != BLKDEV_REQ_ACTIVE) {
-        PANIC("port %s got DHR IRQ with port state AHCI_PORT_ACTIVE, but there "
-              "is no active request",
-              port_ctx->name);
+    LOG_FLOW("port %s irq: %zu requests completed", port_ctx->name, num_done);
+    for (size_t idx = 0; idx < num_done; idx++) {
+        blkdev_complete_req(done_reqs[idx], BLKDEV_REQ_SUCCESS);
     }
+}
 
-    LOG_FLOW("port %s irq: has active request", port_ctx->name);
-    port_ctx->blkdev_req->state = BLKDEV_REQ_SUCCESS;
-    semaphore_increase(&port_ctx->blkdev_req->sem_done);
+/**
+ * Handles the coalesced completion interrupt of controller @a ctrl_ctx, if it
+ * is pending. See #ahci_ctrl_set_ccc().
+ *
+ * The interrupt does not tell which ports have completed commands, so all
+ * coalesced ports are reaped.
+ */
+static void prv_ahci_ctrl_handle_ccc(ahci_ctrl_ctx_t *ctrl_ctx) {
+    const uint32_t ports = ctrl_ctx->ccc_ports;
+    if (ports == 0) { return; }
 
-    port_ctx->has_blkdev_req = false;
-    port_ctx->state = AHCI_PORT_IDLE;
+    const uint32_t ccc_bit = 1u << ctrl_ctx->ccc_int;
+    if (!(ctrl_ctx->reg_ghc->is & ccc_bit)) { return; }
+    ctrl_ctx->reg_ghc->is = ccc_bit;
+
+    for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+        if (!(ports & (1u << port_idx))) { continue; }
+
+        ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+        // The completion status bits are set even though they do not raise
+        // interrupts.
+        port_ctx->reg_port->is = AHCI_PORT_INT_DONE;
+        prv_ahci_port_handle_done(port_ctx);
+    }
+}
+
+/**
+ * MSI handler of a controller whose ports share one vector.
+ * Handles all ports that have a pending interrupt.
+ */
+static void prv_ahci_msi_ctrl_handler(void *ctx) {
+    ahci_ctrl_ctx_t *const ctrl_ctx = ctx;
+    const uint32_t pending = ctrl_ctx->reg_ghc->is;
+
+    for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
+        ahci_port_ctx_t *const port_ctx = &ctrl_ctx->ports[port_idx];
+        if ((pending & (1u << port_idx)) && port_ctx->online_sata) {
+            ahci_port_irq_handler(port_ctx);
+        }
+    }
+    prv_ahci_ctrl_handle_ccc(ctrl_ctx);
+
+    ctrl_ctx->reg_ghc->is = pending;
+}
+
+/// MSI handler of a port that has a vector of its own.
+static void prv_ahci_msi_port_handler(void *ctx) {
+    ahci_port_ctx_t *const port_ctx = ctx;
+    if (!port_ctx->online_sata) { return; }
+
+    ahci_port_irq_handler(port_ctx);
+    port_ctx->ctrl_ctx->reg_ghc->is = 1u << port_ctx->port_num;
+}
+
+/// MSI handler of the coalesced completions of a controller.
+static void prv_ahci_msi_ccc_handler(void *ctx) {
+    prv_ahci_ctrl_handle_ccc(ctx);
 }
@@ -22,6 +22,12 @@
  */
 #define AHCI_PORTS_PER_CTRL 30
 
+/// Default Command Completion Coalescing threshold, see #ahci_ctrl_set_ccc().
+#define AHCI_CCC_DEF_CMDS 8
+
+/// Default Command Completion Coalescing timeout (milliseconds).
+#define AHCI_CCC_DEF_TIMEOUT_MS 1
+
 typedef struct ahci_ctrl_ctx ahci_ctrl_ctx_t;
 typedef struct ahci_port_ctx ahci_port_ctx_t;
 
@@ -29,11 +35,43 @@ typedef enum {
     AHCI_PORT_UNINIT,
     AHCI_PORT_IDLE,
     AHCI_PORT_ACTIVE,
+    /// #SATA_CMD_IDENTIFY_DEVICE is outstanding, see #ahci_probe_ports().
+    AHCI_PORT_PROBING,
 } ahci_port_state_t;
 
+/**
+ * Creates the context of an AHCI Controller and switches it to AHCI mode.
+ *
+ * The ports are only enumerated, they are brought up by #ahci_probe_ports().
+ *
+ * @returns `NULL` if the controller cannot be used.
+ */
 ahci_ctrl_ctx_t *ahci_ctrl_new(const pci_dev_t *pci_dev);
 ahci_port_ctx_t *ahci_ctrl_get_port(ahci_ctrl_ctx_t *ctrl_ctx, size_t port_idx);
 
+/// Returns the number of controllers created by #ahci_ctrl_new().
+size_t ahci_num_ctrls(void);
+
+/// Returns controller @a ctrl_idx, or `NULL` if there is no such controller.
+ahci_ctrl_ctx_t *ahci_get_ctrl(size_t ctrl_idx);
+
+/**
+ * Brings up the implemented ports of all controllers.
+ *
+ * Each port is reset, its device is spun up and identified. Every step is
+ * started on all ports at once, and the calling task sleeps until the step is
+ * done on all of them, or until its timeout elapses. A port that fails a step
+ * drops out of the probe. The IDENTIFY DEVICE completions are reported by the
+ * port interrupts.
+ *
+ * Ports that have been identified are online, see #ahci_port_is_online().
+ *
+ * @note
+ * It must be called from a task, with the interrupts of the controllers
+ * mapped and enabled.
+ */
+void ahci_probe_ports(void);
+
 /**
  * Enables or disables the controller's global interrupt line.
  *
@@ -54,8 +92,45 @@ void ahci_ctrl_map_irq(ahci_ctrl_ctx_t *ctrl_ctx, uint8_t vec);
 
 void ahci_ctrl_irq_handler(void);
 
+/**
+ * Switches an AHCI Controller to Message Signaled Interrupts that are
+ * delivered to processor @a proc_num.
+ *
+ * If the controller can send one message per port, every port gets its own
+ * vector, so the interrupt of one port does not check the others. Otherwise,
+ * all ports share one vector.
+ *
+ * @param ctrl_ctx Controller context pointer.
+ * @param proc_num Processor to deliver the interrupts to.
+ *
+ * @returns `false` if the controller does not support MSI, or there are no
+ * free vectors. In that case, the controller keeps using its IRQ, see
+ * #ahci_ctrl_map_irq().
+ */
+bool ahci_ctrl_enable_msi(ahci_ctrl_ctx_t *ctrl_ctx, uint8_t proc_num);
+
+/**
+ * Configures Command Completion Coalescing of an AHCI Controller.
+ *
+ * Completions of queued commands on the NCQ ports of the controller stop
+ * raising an interrupt each. Instead, one interrupt is raised after
+ * @a num_cmds completions, or @a timeout_ms after the first one of them,
+ * whichever comes first. The handler then reaps all completed slots of all
+ * coalesced ports.
+ *
+ * @param ctrl_ctx   Controller context pointer.
+ * @param num_cmds   Completions per interrupt, 0 disables coalescing. It is
+ *                   limited to the number of commands that may be in flight.
+ * @param timeout_ms Maximum delay of a completion (milliseconds).
+ *
+ * @returns `false` if the controller does not support coalescing.
+ */
+bool ahci_ctrl_set_ccc(ahci_ctrl_ctx_t *ctrl_ctx, uint8_t num_cmds,
+                       uint16_t timeout_ms);
+
 bool ahci_port_is_online(const ahci_port_ctx_t *port_ctx);
 const char *ahci_port_name(const ahci_port_ctx_t *port_ctx);
+ahci_ctrl_ctx_t *ahci_port_get_ctrl(ahci_port_ctx_t *port_ctx);
 
 /**
  * Enables or disables an interrupt @a port_int on port @a port_ctx.
@@ -69,7 +144,7 @@ void ahci_port_set_int(ahci_port_ctx_t *port_ctx, ahci_port_int_t port_int,
 
 void ahci_port_irq_handler(ahci_port_ctx_t *port_ctx);
 
-/// Returns `true` if port @a port_ctx is ready for a new request.
+/// Returns `true` if port @a port_ctx has no outstanding commands.
 bool ahci_port_is_idle(ahci_port_ctx_t *port_ctx);
 
 /**
@@ -83,7 +158,7 @@ bool ahci_port_is_idle(ahci_port_ctx_t *port_ctx);
  * @returns
  * - `true` if the read command has been issued.
  * - `false` if the read command could not be issued, e.g., due to invalid
- *   sector parameters, or the port being busy.
+ *   sector parameters, or no command slot being free.
  */
 bool ahci_port_start_read(ahci_port_ctx_t *port_ctx, uint64_t start_sector,
                           uint32_t num_sectors, void *buf);
@@ -99,7 +174,7 @@ bool ahci_port_start_read(ahci_port_ctx_t *port_ctx, uint64_t start_sector,
  * @returns
  * - `true` if the write command has been issued.
  * - `false` if the write command could not be issued, e.g., due to invalid
- *   sector parameters, or the port being busy.
+ *   sector parameters, or no command slot being free.
  */
 bool ahci_port_start_write(ahci_port_ctx_t *port_ctx, uint64_t start_sector,
                            uint32_t num_sectors, const void *buf);
@@ -111,13 +186,68 @@ bool ahci_port_start_write(ahci_port_ctx_t *port_ctx, uint64_t start_sector,
 void ahci_port_fill_blkdev_if(blkdev_if_t *blkdev_if);
 
 /**
- * Returns `true` if port @a v_port_ctx is busy and cannot accept new requests.
+ * Returns the number of commands that port @a v_port_ctx can have outstanding.
+ *
+ * It is #ahci_port_ctx.queue_depth if the port supports NCQ, otherwise 1.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t ahci_port_if_get_queue_depth(void *v_port_ctx);
+
+/**
+ * Returns the number of sectors of the device attached to port @a v_port_ctx.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint64_t ahci_port_if_get_num_sectors(void *v_port_ctx);
+
+/**
+ * Returns `true` if request @a next can be merged into request @a req.
+ *
+ * Every merged request is transferred from its own buffer, so the PRDs of all
+ * of them must fit into one command table, see #AHCI_CMD_TABLE_NUM_PRDS.
+ *
  * This is a part of the @ref blkdev_if_t "blkdev interface".
  */
-bool ahci_port_if_is_busy(void *v_port_ctx);
+bool ahci_port_if_can_merge(void *v_port_ctx, const blkdev_req_t *req,
+                            const blkdev_req_t *next);
 
 /**
  * Starts the processing of a blkdev request.
+ *
+ * The request and the requests merged into it (see #blkdev_req.merged_next) are
+ * issued as a single read or write command. A write with #BLKDEV_REQ_FLAG_FUA
+ * sets the FUA bit of a queued command, or is a #SATA_CMD_WRITE_DMA_FUA_EXT.
+ * A flush is a #SATA_CMD_FLUSH_CACHE_EXT, and a discard is a TRIM
+ * #SATA_CMD_DATA_SET_MGMT. Neither of them is queued, the worker task issues
+ * them while the port is idle.
+ * The request is completed with #blkdev_complete_req() from the port IRQ
+ * handler, or right away if the command could not be issued.
+ *
  * This is a part of the @ref blkdev_if_t "blkdev interface".
  */
 void ahci_port_if_submit_req(blkdev_req_t *req);
+
+/**
+ * Completes the commands whose PxCI and PxSACT bits have been cleared, without
+ * waiting for the port interrupt. A Task File Error is left to the IRQ
+ * handler.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t ahci_port_if_poll(void *v_port_ctx);
+
+/**
+ * Returns #DMA_MASK_ALL if the controller supports 64-bit addressing
+ * (CAP.S64A), and #DMA_MASK_32BIT otherwise.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+paddr_t ahci_port_if_get_dma_mask(void *v_port_ctx);
+
+/**
+ * Returns #BLKDEV_CAP_FLUSH if the device has its write cache enabled, and
+ * #BLKDEV_CAP_DISCARD if it supports TRIM.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint32_t ahci_port_if_get_caps(void *v_port_ctx);
@@ -60,8 +60,12 @@
 /**
  * Number of PRDT entries in each command table.
  * See #ahci_cmd_table_t.
+ *
+ * Each physical segment of a request takes at least one entry, so there must
+ * be enough entries for a page vector of a few merged requests. 24 entries
+ * make a command table exactly 512 bytes long.
  */
-#define AHCI_CMD_TABLE_NUM_PRDS 8
+#define AHCI_CMD_TABLE_NUM_PRDS 24
 
 /**
  * Generic HBA Control registers.
@@ -287,6 +291,8 @@ typedef enum {
     AHCI_PORT_INT_CPD = 1 << 31, //!< Cold Presence Detect.
 
     AHCI_PORT_INT_ALL = 0xFDC000FF, //!< Enable all interrupts.
+    /// Interrupts that report command completions (DHR, PS, DS, SDB, DP).
+    AHCI_PORT_INT_DONE = 0x0000002F,
 } ahci_port_int_t;
 
 /**
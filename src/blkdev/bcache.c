@@ -0,0 +1,668 @@
+/**
+ * @file bcache.c
+ * Block device buffer cache implementation.
+ */
+
+#include "assert.h"
+#include "blkdev/bcache.h"
+#include "heap.h"
+#include "kmutex.h"
+#include "list.h"
+#include "log.h"
+#include "memfun.h"
+#include "panic.h"
+#include "smp.h"
+#include "taskmgr.h"
+
+/// Number of hash buckets in #g_bcache.buckets.
+#define BCACHE_NUM_BUCKETS 64
+
+/// Maximum number of cache misses that fill the cache at the same time.
+#define BCACHE_FILL_SLOTS 8
+
+typedef struct bcache_block bcache_block_t;
+
+/// Cache entry holding one block.
+struct bcache_block {
+    /// Device that stores the block, `NULL` if the entry is unused.
+    blkdev_dev_t *dev;
+    /// Sector number on #bcache_block.dev.
+    uint64_t sector;
+
+    /// The data has been changed, but not written back yet.
+    bool dirty;
+    /**
+     * The block is being written back by #bcache_flush().
+     * Such a block must not be evicted.
+     */
+    bool flushing;
+    /// The block has been read ahead and not been read by anyone yet.
+    bool readahead;
+
+    /// Next entry in the same hash bucket.
+    bcache_block_t *bucket_next;
+    /// Node in #g_bcache.lru.
+    list_node_t lru_node;
+
+    /// #BCACHE_BLOCK_SIZE bytes of block data.
+    uint8_t *data;
+};
+
+/// Write-back request of #bcache_flush().
+typedef struct {
+    blkdev_req_t req;
+    bcache_block_t *block;
+    bool enqueued;
+    uint8_t data[BCACHE_BLOCK_SIZE];
+} bcache_flush_slot_t;
+
+/// Sequential read detection of one device.
+typedef struct {
+    /// Device of the stream, `NULL` if the entry is unused.
+    blkdev_dev_t *dev;
+    /// Sector that follows the last read, a read from it is sequential.
+    uint64_t next_sector;
+    /// Current read-ahead window (sectors), 0 until the reads are sequential.
+    uint32_t window;
+    /// First sector that has not been read ahead yet.
+    uint64_t ra_sector;
+    /// Value of #g_bcache.stream_clock at the last read, for replacement.
+    uint64_t last_use;
+} bcache_stream_t;
+
+/// Read-ahead read in flight.
+typedef struct {
+    /// Request taken from the pool of the device, `NULL` if the slot is free.
+    blkdev_req_t *req;
+    blkdev_dev_t *dev;
+    uint64_t sector;
+    uint32_t num_sectors;
+    /// #BCACHE_RA_MAX_SECTORS blocks of data.
+    uint8_t *data;
+} bcache_ra_slot_t;
+
+/**
+ * Device read of a cache miss in flight, see #bcache_read().
+ * The data read is only added to the cache if no write has overlapped it.
+ */
+typedef struct {
+    /// Device being read, `NULL` if the slot is free.
+    blkdev_dev_t *dev;
+    uint64_t sector;
+    uint32_t num_sectors;
+    /// A write has overlapped the read, so the data read may be older.
+    bool stale;
+} bcache_fill_t;
+
+static struct {
+    bool ready;
+
+    /// Protects the fields below, except for the counters.
+    task_mutex_t lock;
+    /// Serializes #bcache_flush() calls, see #bcache_block.flushing.
+    task_mutex_t flush_lock;
+
+    bcache_block_t *blocks;
+    bcache_block_t *buckets[BCACHE_NUM_BUCKETS];
+    /// All entries, the most recently used first. Unused entries are last.
+    list_t lru;
+    size_t num_dirty;
+
+    /// Requests of #bcache_flush(), protected by #g_bcache.flush_lock.
+    bcache_flush_slot_t *flush_slots;
+
+    bcache_stream_t streams[BCACHE_RA_STREAMS];
+    uint64_t stream_clock;
+    bcache_ra_slot_t ra_slots[BCACHE_RA_SLOTS];
+    bcache_fill_t fills[BCACHE_FILL_SLOTS];
+
+    _Atomic uint64_t read_hits;
+    _Atomic uint64_t read_misses;
+    _Atomic uint64_t writes;
+    _Atomic uint64_t writebacks;
+    _Atomic uint64_t evictions;
+    _Atomic uint64_t readahead_sectors;
+    _Atomic uint64_t readahead_hits;
+} g_bcache;
+
+static size_t prv_bcache_hash(const blkdev_dev_t *dev, uint64_t sector);
+static bcache_block_t *prv_bcache_lookup(const blkdev_dev_t *dev,
+                                         uint64_t sector);
+static bcache_block_t *prv_bcache_insert(blkdev_dev_t *dev, uint64_t sector);
+static void prv_bcache_unhash(bcache_block_t *block);
+static void prv_bcache_touch(bcache_block_t *block);
+static void prv_bcache_consume(bcache_block_t *block);
+static size_t prv_bcache_collect_dirty(void);
+static void prv_bcache_readahead(blkdev_dev_t *dev, uint64_t sector,
+                                 uint32_t num_sectors);
+static bcache_stream_t *prv_bcache_get_stream(blkdev_dev_t *dev);
+static void prv_bcache_ra_start(bcache_stream_t *stream, uint64_t end);
+static void prv_bcache_ra_reap(const blkdev_dev_t *dev, uint64_t sector,
+                               uint32_t num_sectors);
+static void prv_bcache_ra_finish(bcache_ra_slot_t *slot, bool ok);
+static bcache_fill_t *prv_bcache_fill_start(blkdev_dev_t *dev,
+                                            uint64_t sector,
+                                            uint32_t num_sectors);
+static void prv_bcache_fill_cancel(const blkdev_dev_t *dev, uint64_t sector,
+                                   uint32_t num_sectors);
+
+void bcache_init(void) {
+    ASSERT(!g_bcache.ready);
+
+    mutex_init(&g_bcache.lock);
+    mutex_init(&g_bcache.flush_lock);
+    list_init(&g_bcache.lru, NULL);
+
+    g_bcache.blocks = heap_alloc(BCACHE_NUM_BLOCKS * sizeof(bcache_block_t));
+    uint8_t *const data = heap_alloc(BCACHE_NUM_BLOCKS * BCACHE_BLOCK_SIZE);
+    kmemset(g_bcache.blocks, 0, BCACHE_NUM_BLOCKS * sizeof(bcache_block_t));
+    for (size_t idx = 0; idx < BCACHE_NUM_BLOCKS; idx++) {
+        bcache_block_t *const block = &g_bcache.blocks[idx];
+        block->data = &data[idx * BCACHE_BLOCK_SIZE];
+        list_append(&g_bcache.lru, &block->lru_node);
+    }
+
+    g_bcache.flush_slots =
+        heap_alloc(BCACHE_FLUSH_BATCH * sizeof(bcache_flush_slot_t));
+
+    for (size_t idx = 0; idx < BCACHE_RA_SLOTS; idx++) {
+        g_bcache.ra_slots[idx].data =
+            heap_alloc(BCACHE_RA_MAX_SECTORS * BCACHE_BLOCK_SIZE);
+    }
+
+    g_bcache.ready = true;
+
+    taskmgr_t *const taskmgr = smp_get_running_taskmgr();
+    if (!taskmgr) { PANIC("running processor has no task manager"); }
+    taskmgr_new_kernel_task(taskmgr, "bcache", (uint32_t)bcache_flusher_entry,
+                            NULL);
+
+    LOG_DEBUG("buffer cache of %u blocks is ready", BCACHE_NUM_BLOCKS);
+}
+
+bool bcache_read(blkdev_dev_t *dev, uint64_t start_sector,
+                 uint32_t num_sectors, void *buf) {
+    ASSERT(dev);
+    if (!g_bcache.ready) {
+        return blkdev_sync_read(dev, start_sector, num_sectors, buf);
+    }
+
+    uint64_t sector = start_sector;
+    blkdev_dev_t *const phys_dev = blkdev_resolve(dev, &sector);
+    uint8_t *const out = buf;
+
+    mutex_acquire(&g_bcache.lock);
+
+    prv_bcache_ra_reap(phys_dev, sector, num_sectors);
+
+    bool all_cached = true;
+    for (uint32_t idx = 0; idx < num_sectors && all_cached; idx++) {
+        all_cached = prv_bcache_lookup(phys_dev, sector + idx) != NULL;
+    }
+    if (all_cached) {
+        for (uint32_t idx = 0; idx < num_sectors; idx++) {
+            bcache_block_t *const block =
+                prv_bcache_lookup(phys_dev, sector + idx);
+            kmemcpy(&out[idx * BCACHE_BLOCK_SIZE], block->data,
+                    BCACHE_BLOCK_SIZE);
+            prv_bcache_consume(block);
+        }
+        prv_bcache_readahead(phys_dev, sector, num_sectors);
+        mutex_release(&g_bcache.lock);
+        g_bcache.read_hits++;
+        return true;
+    }
+
+    // A write may land while the device is read, and be written back and
+    // evicted before the read completes. Then the data read is older than the
+    // device, and must not be cached.
+    bcache_fill_t *const fill_slot =
+        num_sectors <= BCACHE_MAX_FILL_SECTORS
+            ? prv_bcache_fill_start(phys_dev, sector, num_sectors)
+            : NULL;
+    mutex_release(&g_bcache.lock);
+    g_bcache.read_misses++;
+
+    // Read the whole range at once, the device worker merges it into as few
+    // commands as possible.
+    const bool ok = blkdev_sync_read(phys_dev, sector, num_sectors, buf);
+
+    mutex_acquire(&g_bcache.lock);
+    const bool fill = fill_slot && !fill_slot->stale;
+    if (fill_slot) { fill_slot->dev = NULL; }
+    if (!ok) {
+        mutex_release(&g_bcache.lock);
+        return false;
+    }
+
+    for (uint32_t idx = 0; idx < num_sectors; idx++) {
+        uint8_t *const out_block = &out[idx * BCACHE_BLOCK_SIZE];
+        bcache_block_t *block = prv_bcache_lookup(phys_dev, sector + idx);
+        if (block) {
+            // The block may have been written meanwhile, or be dirty, so it is
+            // newer than what has been read from the device.
+            kmemcpy(out_block, block->data, BCACHE_BLOCK_SIZE);
+        } else if (fill) {
+            block = prv_bcache_insert(phys_dev, sector + idx);
+            kmemcpy(block->data, out_block, BCACHE_BLOCK_SIZE);
+        }
+        if (block) { prv_bcache_consume(block); }
+    }
+    prv_bcache_readahead(phys_dev, sector, num_sectors);
+    mutex_release(&g_bcache.lock);
+
+    return true;
+}
+
+bool bcache_write(blkdev_dev_t *dev, uint64_t start_sector,
+                  uint32_t num_sectors, const void *buf) {
+    ASSERT(dev);
+    if (!g_bcache.ready) {
+        return blkdev_sync_write(dev, start_sector, num_sectors, buf);
+    }
+
+    uint64_t sector = start_sector;
+    blkdev_dev_t *const phys_dev = blkdev_resolve(dev, &sector);
+    const uint8_t *const in = buf;
+
+    mutex_acquire(&g_bcache.lock);
+    // A read-ahead of these sectors would bring back the old data if the new
+    // one got written back and evicted before the read-ahead completes.
+    prv_bcache_ra_reap(phys_dev, sector, num_sectors);
+    // The same goes for a cache miss that is reading these sectors.
+    prv_bcache_fill_cancel(phys_dev, sector, num_sectors);
+    for (uint32_t idx = 0; idx < num_sectors; idx++) {
+        bcache_block_t *block = prv_bcache_lookup(phys_dev, sector + idx);
+        if (!block) { block = prv_bcache_insert(phys_dev, sector + idx); }
+        kmemcpy(block->data, &in[idx * BCACHE_BLOCK_SIZE], BCACHE_BLOCK_SIZE);
+        block->readahead = false;
+        if (!block->dirty) {
+            block->dirty = true;
+            g_bcache.num_dirty++;
+        }
+        prv_bcache_touch(block);
+    }
+    mutex_release(&g_bcache.lock);
+
+    g_bcache.writes++;
+    return true;
+}
+
+bool bcache_flush(void) {
+    if (!g_bcache.ready) { return true; }
+
+    mutex_acquire(&g_bcache.flush_lock);
+
+    bool ok = true;
+    size_t num_slots;
+    while (ok && (num_slots = prv_bcache_collect_dirty()) > 0) {
+        // Enqueue the whole batch before waiting, so that the device worker
+        // can sort and merge the writes.
+        for (size_t idx = 0; idx < num_slots; idx++) {
+            bcache_flush_slot_t *const slot = &g_bcache.flush_slots[idx];
+            slot->enqueued = blkdev_enqueue_req(&slot->req);
+        }
+        for (size_t idx = 0; idx < num_slots; idx++) {
+            bcache_flush_slot_t *const slot = &g_bcache.flush_slots[idx];
+            if (slot->enqueued) { semaphore_decrease(&slot->req.sem_done); }
+        }
+
+        uint64_t num_written = 0;
+        mutex_acquire(&g_bcache.lock);
+        for (size_t idx = 0; idx < num_slots; idx++) {
+            bcache_flush_slot_t *const slot = &g_bcache.flush_slots[idx];
+            bcache_block_t *const block = slot->block;
+            block->flushing = false;
+            if (slot->enqueued && slot->req.state == BLKDEV_REQ_SUCCESS) {
+                num_written++;
+            } else if (!block->dirty) {
+                // Retry with the next flush, unless the block has been written
+                // again meanwhile and is dirty anyway.
+                block->dirty = true;
+                g_bcache.num_dirty++;
+                ok = false;
+            } else {
+                ok = false;
+            }
+        }
+        mutex_release(&g_bcache.lock);
+
+        g_bcache.writebacks += num_written;
+    }
+
+    mutex_release(&g_bcache.flush_lock);
+    return ok;
+}
+
+void bcache_get_stats(bcache_stats_t *out_stats) {
+    out_stats->read_hits = g_bcache.read_hits;
+    out_stats->read_misses = g_bcache.read_misses;
+    out_stats->writes = g_bcache.writes;
+    out_stats->writebacks = g_bcache.writebacks;
+    out_stats->evictions = g_bcache.evictions;
+    out_stats->dirty_blocks = g_bcache.num_dirty;
+    out_stats->readahead_sectors = g_bcache.readahead_sectors;
+    out_stats->readahead_hits = g_bcache.readahead_hits;
+}
+
+[[gnu::noreturn]]
+void bcache_flusher_entry(void *arg) {
+    (void)arg;
+    // taskmgr_switch_tasks() requires that task entries enable interrupts.
+    __asm__ volatile("sti");
+
+    for (;;) {
+        taskmgr_local_sleep_ms(BCACHE_FLUSH_INTERVAL_MS);
+        if (!bcache_flush()) { LOG_ERROR("failed to write back some blocks"); }
+    }
+
+    PANIC("reached task end");
+}
+
+static size_t prv_bcache_hash(const blkdev_dev_t *dev, uint64_t sector) {
+    const uint32_t mixed =
+        (uint32_t)sector * 2654435761U ^ (uint32_t)(uintptr_t)dev;
+    return (mixed >> 8) % BCACHE_NUM_BUCKETS;
+}
+
+/// Finds a cached block, #g_bcache.lock must be held.
+static bcache_block_t *prv_bcache_lookup(const blkdev_dev_t *dev,
+                                         uint64_t sector) {
+    bcache_block_t *block = g_bcache.buckets[prv_bcache_hash(dev, sector)];
+    while (block && !(block->dev == dev && block->sector == sector)) {
+        block = block->bucket_next;
+    }
+    return block;
+}
+
+/**
+ * Takes an entry for a block that is not cached yet, #g_bcache.lock must be
+ * held.
+ *
+ * The least recently used clean entry is reused. If all entries are dirty,
+ * the least recently used one that is not being flushed is written back first.
+ * The data of the returned entry is to be filled by the caller.
+ */
+static bcache_block_t *prv_bcache_insert(blkdev_dev_t *dev, uint64_t sector) {
+    bcache_block_t *victim = NULL;
+    bcache_block_t *dirty_victim = NULL;
+    for (list_node_t *node = g_bcache.lru.p_last_node; node;
+         node = node->p_prev) {
+        bcache_block_t *const block =
+            LIST_NODE_TO_STRUCT(node, bcache_block_t, lru_node);
+        if (block->flushing) { continue; }
+        if (!block->dirty) {
+            victim = block;
+            break;
+        }
+        if (!dirty_victim) { dirty_victim = block; }
+    }
+
+    if (!victim) {
+        if (!dirty_victim) { PANIC("all cached blocks are being flushed"); }
+        victim = dirty_victim;
+        if (blkdev_sync_write(victim->dev, victim->sector, 1, victim->data)) {
+            g_bcache.writebacks++;
+        } else {
+            LOG_ERROR("lost sector %llu: write-back failed", victim->sector);
+        }
+        victim->dirty = false;
+        g_bcache.num_dirty--;
+    }
+
+    if (victim->dev) {
+        prv_bcache_unhash(victim);
+        g_bcache.evictions++;
+    }
+
+    victim->dev = dev;
+    victim->sector = sector;
+    victim->readahead = false;
+    const size_t bucket = prv_bcache_hash(dev, sector);
+    victim->bucket_next = g_bcache.buckets[bucket];
+    g_bcache.buckets[bucket] = victim;
+
+    return victim;
+}
+
+/// Removes a block from its hash bucket, #g_bcache.lock must be held.
+static void prv_bcache_unhash(bcache_block_t *block) {
+    bcache_block_t **link =
+        &g_bcache.buckets[prv_bcache_hash(block->dev, block->sector)];
+    while (*link != block) {
+        ASSERT(*link);
+        link = &(*link)->bucket_next;
+    }
+    *link = block->bucket_next;
+    block->bucket_next = NULL;
+    block->dev = NULL;
+}
+
+/// Makes a block the most recently used one, #g_bcache.lock must be held.
+static void prv_bcache_touch(bcache_block_t *block) {
+    list_remove(&g_bcache.lru, &block->lru_node);
+    list_insert(&g_bcache.lru, NULL, &block->lru_node);
+}
+
+/// Touches a block that is being read, #g_bcache.lock must be held.
+static void prv_bcache_consume(bcache_block_t *block) {
+    if (block->readahead) {
+        block->readahead = false;
+        g_bcache.readahead_hits++;
+    }
+    prv_bcache_touch(block);
+}
+
+/**
+ * Prepares write requests for up to #BCACHE_FLUSH_BATCH dirty blocks in
+ * #g_bcache.flush_slots.
+ *
+ * The block data is copied, so that the blocks can be written to again while
+ * the requests are in flight.
+ *
+ * @returns The number of prepared requests.
+ */
+static size_t prv_bcache_collect_dirty(void) {
+    size_t num_slots = 0;
+
+    mutex_acquire(&g_bcache.lock);
+    for (size_t idx = 0;
+         idx < BCACHE_NUM_BLOCKS && num_slots < BCACHE_FLUSH_BATCH; idx++) {
+        bcache_block_t *const block = &g_bcache.blocks[idx];
+        if (!block->dirty) { continue; }
+
+        bcache_flush_slot_t *const slot = &g_bcache.flush_slots[num_slots++];
+        kmemcpy(slot->data, block->data, BCACHE_BLOCK_SIZE);
+        slot->block = block;
+        slot->enqueued = false;
+
+        kmemset(&slot->req, 0, sizeof(slot->req));
+        slot->req.state = BLKDEV_REQ_INACTIVE;
+        slot->req.op = BLKDEV_OP_WRITE;
+        slot->req.start_sector = block->sector;
+        slot->req.write_sectors = 1;
+        slot->req.write_buf = slot->data;
+        slot->req.dev = block->dev;
+        semaphore_init(&slot->req.sem_done);
+
+        block->dirty = false;
+        block->flushing = true;
+        g_bcache.num_dirty--;
+    }
+    mutex_release(&g_bcache.lock);
+
+    return num_slots;
+}
+
+/**
+ * Updates the stream of @a dev with a read and starts read-ahead if the reads
+ * are sequential, #g_bcache.lock must be held.
+ */
+static void prv_bcache_readahead(blkdev_dev_t *dev, uint64_t sector,
+                                 uint32_t num_sectors) {
+    bcache_stream_t *const stream = prv_bcache_get_stream(dev);
+    const uint64_t end = sector + num_sectors;
+
+    if (sector == stream->next_sector) {
+        if (stream->window == 0) {
+            stream->window = BCACHE_RA_MIN_SECTORS;
+        } else if (stream->window < BCACHE_RA_MAX_SECTORS) {
+            stream->window *= 2;
+        }
+    } else {
+        stream->window = 0;
+        stream->ra_sector = 0;
+    }
+    stream->next_sector = end;
+    stream->last_use = ++g_bcache.stream_clock;
+
+    if (stream->window > 0) { prv_bcache_ra_start(stream, end); }
+}
+
+/**
+ * Returns the stream of @a dev, #g_bcache.lock must be held.
+ * If @a dev has none, the least recently used stream is taken over.
+ */
+static bcache_stream_t *prv_bcache_get_stream(blkdev_dev_t *dev) {
+    bcache_stream_t *lru = &g_bcache.streams[0];
+    for (size_t idx = 0; idx < BCACHE_RA_STREAMS; idx++) {
+        bcache_stream_t *const stream = &g_bcache.streams[idx];
+        if (stream->dev == dev) { return stream; }
+        if (stream->last_use < lru->last_use) { lru = stream; }
+    }
+
+    lru->dev = dev;
+    lru->next_sector = UINT64_MAX;
+    lru->window = 0;
+    lru->ra_sector = 0;
+    return lru;
+}
+
+/**
+ * Starts reading ahead up to a window past sector @a end that the stream
+ * @a stream has been read to, #g_bcache.lock must be held.
+ *
+ * Nothing is started while at least half a window is still ahead of the
+ * reader, so that the reads are not split into tiny ones.
+ */
+static void prv_bcache_ra_start(bcache_stream_t *stream, uint64_t end) {
+    if (stream->ra_sector < end) { stream->ra_sector = end; }
+    if (stream->ra_sector - end >= stream->window / 2) { return; }
+
+    const uint64_t ra_end = end + stream->window;
+    while (stream->ra_sector < ra_end &&
+           prv_bcache_lookup(stream->dev, stream->ra_sector)) {
+        stream->ra_sector++;
+    }
+
+    for (size_t idx = 0;
+         idx < BCACHE_RA_SLOTS && stream->ra_sector < ra_end; idx++) {
+        bcache_ra_slot_t *const slot = &g_bcache.ra_slots[idx];
+        if (slot->req) { continue; }
+
+        // Read-ahead is opportunistic. Waiting for a request here would stall
+        // the whole cache until another user of the pool frees one.
+        blkdev_req_t *const req = blkdev_try_alloc_req(stream->dev);
+        if (!req) { return; }
+
+        const uint64_t left = ra_end - stream->ra_sector;
+        slot->num_sectors =
+            left < BCACHE_RA_MAX_SECTORS ? left : BCACHE_RA_MAX_SECTORS;
+        slot->dev = stream->dev;
+        slot->sector = stream->ra_sector;
+        slot->req = req;
+        if (!blkdev_submit_read(slot->req, slot->sector, slot->num_sectors,
+                                slot->data, NULL, NULL)) {
+            blkdev_free_req(slot->req);
+            slot->req = NULL;
+            return;
+        }
+        stream->ra_sector += slot->num_sectors;
+    }
+}
+
+/**
+ * Adds completed read-ahead reads to the cache, #g_bcache.lock must be held.
+ *
+ * Reads of @a dev overlapping the sectors from @a sector to
+ * `sector + num_sectors` are waited for, so that the caller can access these
+ * sectors in the cache.
+ */
+static void prv_bcache_ra_reap(const blkdev_dev_t *dev, uint64_t sector,
+                               uint32_t num_sectors) {
+    for (size_t idx = 0; idx < BCACHE_RA_SLOTS; idx++) {
+        bcache_ra_slot_t *const slot = &g_bcache.ra_slots[idx];
+        if (!slot->req) { continue; }
+
+        const bool overlaps = slot->dev == dev &&
+                              slot->sector < sector + num_sectors &&
+                              sector < slot->sector + slot->num_sectors;
+        if (overlaps) {
+            prv_bcache_ra_finish(slot, blkdev_wait_req(slot->req));
+        } else if (semaphore_try_decrease(&slot->req->sem_done)) {
+            prv_bcache_ra_finish(slot, slot->req->state == BLKDEV_REQ_SUCCESS);
+        }
+    }
+}
+
+/**
+ * Adds the sectors of a completed read-ahead read to the cache and frees its
+ * slot, #g_bcache.lock must be held.
+ *
+ * Sectors that are cached already are kept, they may be newer.
+ */
+static void prv_bcache_ra_finish(bcache_ra_slot_t *slot, bool ok) {
+    blkdev_free_req(slot->req);
+    slot->req = NULL;
+    if (!ok) { return; }
+
+    for (uint32_t idx = 0; idx < slot->num_sectors; idx++) {
+        if (prv_bcache_lookup(slot->dev, slot->sector + idx)) { continue; }
+        bcache_block_t *const block =
+            prv_bcache_insert(slot->dev, slot->sector + idx);
+        kmemcpy(block->data, &slot->data[idx * BCACHE_BLOCK_SIZE],
+                BCACHE_BLOCK_SIZE);
+        block->readahead = true;
+        prv_bcache_touch(block);
+    }
+    g_bcache.readahead_sectors += slot->num_sectors;
+}
+
+/**
+ * Reserves a fill slot for a device read of a cache miss, #g_bcache.lock must
+ * be held. See #bcache_fill_t.
+ *
+ * @returns The slot, `NULL` if all slots are in use, then the data read is not
+ * cached.
+ */
+static bcache_fill_t *prv_bcache_fill_start(blkdev_dev_t *dev,
+                                            uint64_t sector,
+                                            uint32_t num_sectors) {
+    for (size_t idx = 0; idx < BCACHE_FILL_SLOTS; idx++) {
+        bcache_fill_t *const fill = &g_bcache.fills[idx];
+        if (fill->dev) { continue; }
+
+        fill->dev = dev;
+        fill->sector = sector;
+        fill->num_sectors = num_sectors;
+        fill->stale = false;
+        return fill;
+    }
+    return NULL;
+}
+
+/**
+ * Keeps the data of reads in flight of @a dev overlapping the sectors from
+ * @a sector to `sector + num_sectors` out of the cache, #g_bcache.lock must be
+ * held.
+ */
+static void prv_bcache_fill_cancel(const blkdev_dev_t *dev, uint64_t sector,
+                                   uint32_t num_sectors) {
+    for (size_t idx = 0; idx < BCACHE_FILL_SLOTS; idx++) {
+        bcache_fill_t *const fill = &g_bcache.fills[idx];
+        const bool overlaps = fill->dev == dev &&
+                              fill->sector < sector + num_sectors &&
+                              sector < fill->sector + fill->num_sectors;
+        if (overlaps) { fill->stale = true; }
+    }
+}
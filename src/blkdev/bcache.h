@@ -0,0 +1,127 @@
+/**
+ * @file bcache.h
+ * Block device buffer cache.
+ *
+ * The cache keeps recently used sectors of block devices in memory. Sectors
+ * are keyed by the device that physically stores them (see #blkdev_resolve()),
+ * so a disk and all of its partitions share the cached sectors.
+ *
+ * Writes are write-back: they only update the cache and mark the sectors
+ * dirty. Dirty sectors are written to the devices by the flusher task every
+ * #BCACHE_FLUSH_INTERVAL_MS, when they are evicted, or by #bcache_flush().
+ *
+ * Reads are followed per device. Once a read starts right where the previous
+ * one of the same device ended, the device is being read sequentially and the
+ * following sectors are read ahead into the cache asynchronously. The
+ * read-ahead window starts at #BCACHE_RA_MIN_SECTORS and doubles with each
+ * sequential read up to #BCACHE_RA_MAX_SECTORS. A read elsewhere resets it.
+ *
+ * @warning
+ * Requests enqueued directly with #blkdev_enqueue_req() bypass the cache.
+ * Mixing them with cached access to the same sectors results in stale data.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blkdev/blkdev.h"
+
+/// Size of a cached block, which is one sector (bytes).
+#define BCACHE_BLOCK_SIZE 512
+
+/// Number of cached blocks.
+#define BCACHE_NUM_BLOCKS 1024
+
+/**
+ * Maximum number of sectors that a read may populate the cache with.
+ * Larger reads are not cached, so that a single bulk read does not evict all
+ * the metadata.
+ */
+#define BCACHE_MAX_FILL_SECTORS (BCACHE_NUM_BLOCKS / 4)
+
+/// Period of the flusher task (milliseconds).
+#define BCACHE_FLUSH_INTERVAL_MS 1000
+
+/// Maximum number of write requests the flusher has in flight.
+#define BCACHE_FLUSH_BATCH 16
+
+/// Read-ahead window of a newly detected sequential stream (sectors).
+#define BCACHE_RA_MIN_SECTORS 8
+
+/// Maximum read-ahead window, which is also the size of one read (sectors).
+#define BCACHE_RA_MAX_SECTORS 64
+
+/// Maximum number of read-ahead reads in flight.
+#define BCACHE_RA_SLOTS 4
+
+/// Number of devices whose read streams are followed at the same time.
+#define BCACHE_RA_STREAMS 4
+
+/// Buffer cache counters, see #bcache_get_stats().
+typedef struct {
+    uint64_t read_hits;         ///< Reads served entirely from the cache.
+    uint64_t read_misses;       ///< Reads that had to go to the device.
+    uint64_t writes;            ///< Writes absorbed by the cache.
+    uint64_t writebacks;        ///< Dirty blocks written to the devices.
+    uint64_t evictions;         ///< Blocks dropped to make room for others.
+    size_t dirty_blocks;        ///< Blocks that have not been written back yet.
+    uint64_t readahead_sectors; ///< Sectors read ahead into the cache.
+    uint64_t readahead_hits;    ///< Read-ahead sectors that have been read.
+} bcache_stats_t;
+
+/**
+ * Allocates the cache and starts the flusher task.
+ *
+ * Until it is called, #bcache_read() and #bcache_write() go directly to the
+ * devices.
+ */
+void bcache_init(void);
+
+/**
+ * Reads @a num_sectors starting from sector @a start_sector through the cache.
+ *
+ * If all sectors are cached, no device access is done. Otherwise, all of them
+ * are read from the device and, unless there are more than
+ * #BCACHE_MAX_FILL_SECTORS of them, added to the cache.
+ *
+ * If the read continues the previous one, read-ahead is started, see the file
+ * description.
+ *
+ * @returns `true` if the sectors have been copied to @a buf.
+ *
+ * @note
+ * This function may block the calling task.
+ */
+bool bcache_read(blkdev_dev_t *dev, uint64_t start_sector,
+                 uint32_t num_sectors, void *buf);
+
+/**
+ * Writes @a num_sectors starting from sector @a start_sector to the cache.
+ *
+ * The sectors are written to the device later, see the file description.
+ *
+ * @returns `true` if the sectors have been cached.
+ *
+ * @note
+ * This function may block the calling task.
+ */
+bool bcache_write(blkdev_dev_t *dev, uint64_t start_sector,
+                  uint32_t num_sectors, const void *buf);
+
+/**
+ * Writes all dirty blocks to their devices and waits for the writes.
+ * @returns `true` if all dirty blocks have been written successfully.
+ */
+bool bcache_flush(void);
+
+/// Copies the current cache counters to @a out_stats.
+void bcache_get_stats(bcache_stats_t *out_stats);
+
+/**
+ * Entry point of the flusher task.
+ * See #bcache_init().
+ */
+[[gnu::noreturn]]
+void bcache_flusher_entry(void *arg);
@@ -1,108 +1,742 @@
 /**
  * @file blkdev.c
- * Block device worker process.
+ * Block device worker tasks.
  */
 
+#include <stdatomic.h>
+
+#include "arch.h"
+#include "arch_timer.h"
+#include "assert.h"
 #include "blkdev/blkdev.h"
+#include "blkdev/blktrace.h"
+#include "cpu.h"
 #include "heap.h"
-#include "kmutex.h"
 #include "log.h"
+#include "memfun.h"
 #include "panic.h"
-#include "queue.h"
+#include "smp.h"
+
+/**
+ * Number of the processor to place the next worker task on.
+ * Processor 0 runs kshell, so the first worker goes to the next one, if any.
+ */
+static _Atomic uint8_t g_blkdev_next_proc = 1;
+
+static taskmgr_t *prv_blkdev_pick_taskmgr(void);
+static bool prv_blkdev_sync_rw(blkdev_dev_t *dev, blkdev_op_t op,
+                               uint64_t start_sector, uint32_t num_sectors,
+                               void *buf);
+static void prv_blkdev_init_pool(blkdev_dev_t *dev);
+static blkdev_req_t *prv_blkdev_take_req(blkdev_dev_t *dev);
+static bool prv_blkdev_poll_req(blkdev_dev_t *dev, blkdev_req_t *req);
+static bool prv_blkdev_req_done(const blkdev_req_t *req);
+static bool prv_blkdev_submit(blkdev_req_t *req, blkdev_op_t op,
+                              uint32_t flags, uint64_t start_sector,
+                              uint32_t num_sectors, void *buf,
+                              blkdev_done_fn_t f_done, void *done_arg);
+
+static void prv_blkdev_sched_add(blkdev_dev_t *dev, blkdev_req_t *req);
+static void prv_blkdev_sched_drain(blkdev_dev_t *dev);
+static void prv_blkdev_sched_remove(blkdev_dev_t *dev, blkdev_req_t *req);
+static blkdev_req_t *prv_blkdev_sched_pick(blkdev_dev_t *dev);
+static void prv_blkdev_sched_merge(blkdev_dev_t *dev, blkdev_req_t *req);
+static void prv_blkdev_commit(blkdev_dev_t *dev);
+static bool prv_blkdev_check_caps(blkdev_dev_t *dev, blkdev_req_t *req);
+static bool prv_blkdev_is_alone(const blkdev_req_t *req);
+static void prv_blkdev_take_all_credits(blkdev_dev_t *dev);
+static void prv_blkdev_return_all_credits(blkdev_dev_t *dev);
+static bool prv_blkdev_dma_map(blkdev_dev_t *dev, blkdev_req_t *req);
+static kerr_t prv_blkdev_dma_map_one(blkdev_dev_t *dev, blkdev_req_t *req);
 
-#define blkdevMAX_REQS 32
+void blkdev_start_worker(blkdev_dev_t *dev, const char *name) {
+    ASSERT(dev);
+    ASSERT(!dev->worker_task);
 
-typedef struct {
-    task_mutex_t lock;
+    queue_init(&dev->req_queue, blkdevMAX_REQS, sizeof(uintptr_t));
+    semaphore_init(&dev->sem_queue_slots);
+    for (size_t idx = 0; idx < blkdevMAX_REQS; idx++) {
+        semaphore_increase(&dev->sem_queue_slots);
+    }
+
+    if (!dev->driver_intf.f_get_queue_depth) {
+        PANIC("bad device: driver_intf.f_get_queue_depth = NULL");
+    }
+    if (!dev->driver_intf.f_submit_req) {
+        PANIC("bad device: driver_intf.f_submit_req = NULL");
+    }
+
+    list_init(&dev->sched_sorted, NULL);
+    list_init(&dev->sched_read_fifo, NULL);
+    list_init(&dev->sched_write_fifo, NULL);
+    dev->sched_next_sector = 0;
 
-    /**
-     * Request queue.
-     * - Item type: pointer to #blkdev_req_t.
-     * - Max itemss: #blkdevMAX_REQS.
-     */
-    queue_t req_queue;
-} blkdev_ctx_t;
+    prv_blkdev_init_pool(dev);
 
-static blkdev_ctx_t g_blkdev_ctx;
-static volatile _Atomic bool g_blkdev_ready;
+    dev->queue_depth = dev->driver_intf.f_get_queue_depth(dev->driver_ctx);
+    dev->dma_mask = dev->driver_intf.f_get_dma_mask
+                        ? dev->driver_intf.f_get_dma_mask(dev->driver_ctx)
+                        : DMA_MASK_ALL;
+    dev->caps = dev->driver_intf.f_get_caps
+                    ? dev->driver_intf.f_get_caps(dev->driver_ctx)
+                    : 0;
+    semaphore_init(&dev->sem_credits);
+    for (size_t idx = 0; idx < dev->queue_depth; idx++) {
+        semaphore_increase(&dev->sem_credits);
+    }
 
-static void prv_blkdev_init(void);
+    taskmgr_t *const taskmgr = prv_blkdev_pick_taskmgr();
+    dev->worker_task = taskmgr_new_kernel_task(
+        taskmgr, name, (uint32_t)blkdev_worker_entry, dev);
 
-bool blkdev_is_ready(void) {
-    return g_blkdev_ready;
+    LOG_DEBUG("started worker '%s' on processor %u", name, taskmgr->proc_num);
 }
 
 bool blkdev_enqueue_req(blkdev_req_t *req) {
-    return queue_write(&g_blkdev_ctx.req_queue, &req);
+    if (!req->dev) {
+        LOG_ERROR("bad request: dev = NULL");
+        return false;
+    }
+    if (!req->dev->worker_task) {
+        LOG_ERROR("bad request: device has no worker task");
+        return false;
+    }
+    req->credit_dev = NULL;
+    req->merged_next = NULL;
+    kmemset(&req->dma_map, 0, sizeof(req->dma_map));
+    // A partition enqueues its requests again to the parent device, the
+    // request has been waiting since the first enqueue.
+    if (req->trace.enqueue_us == 0) {
+        req->trace.enqueue_us = blktrace_now_us();
+    }
+
+    // Wait for the worker to make room rather than failing the request.
+    semaphore_decrease(&req->dev->sem_queue_slots);
+    if (!queue_write(&req->dev->req_queue, &req)) {
+        PANIC("request queue is full despite a free slot");
+    }
+    return true;
+}
+
+void blkdev_complete_req(blkdev_req_t *req, blkdev_req_state_t state) {
+    ASSERT(state == BLKDEV_REQ_SUCCESS || state == BLKDEV_REQ_ERROR);
+
+    blkdev_dev_t *const credit_dev = req->credit_dev;
+    req->credit_dev = NULL;
+    if (credit_dev) { semaphore_increase(&credit_dev->sem_credits); }
+
+    while (req) {
+        // Read the fields before waking the owner up, it may free the request.
+        blkdev_req_t *const next = req->merged_next;
+        req->merged_next = NULL;
+        if (dma_is_bounced(&req->dma_map)) {
+            dma_unmap(&req->dma_map, state == BLKDEV_REQ_SUCCESS);
+            req->segs = req->dma_map.segs;
+            req->num_segs = req->dma_map.num_segs;
+        }
+        req->state = state;
+        req->trace.complete_us = blktrace_now_us();
+        blktrace_add(req, BLKTRACE_COMPLETE);
+        if (req->f_done) {
+            req->f_done(req, req->done_arg);
+        } else {
+            semaphore_increase(&req->sem_done);
+        }
+        req = next;
+    }
+}
+
+blkdev_req_t *blkdev_alloc_req(blkdev_dev_t *dev) {
+    // The pool is created together with the worker.
+    ASSERT(dev->worker_task);
+    semaphore_decrease(&dev->sem_pool);
+    return prv_blkdev_take_req(dev);
+}
+
+blkdev_req_t *blkdev_try_alloc_req(blkdev_dev_t *dev) {
+    ASSERT(dev->worker_task);
+    if (!semaphore_try_decrease(&dev->sem_pool)) { return NULL; }
+    return prv_blkdev_take_req(dev);
+}
+
+void blkdev_free_req(blkdev_req_t *req) {
+    blkdev_dev_t *const dev = req->pool_dev;
+    ASSERT(dev);
+
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&dev->pool_lock);
+
+    req->pool_next = dev->pool_free;
+    dev->pool_free = req;
+
+    spinlock_release(&dev->pool_lock);
+    if (restore_int) { arch_enable_ints(); }
+
+    // It may be called from an IRQ handler, which semaphore_increase() allows.
+    semaphore_increase(&dev->sem_pool);
+}
+
+bool blkdev_submit_read(blkdev_req_t *req, uint64_t start_sector,
+                        uint32_t num_sectors, void *buf,
+                        blkdev_done_fn_t f_done, void *done_arg) {
+    return prv_blkdev_submit(req, BLKDEV_OP_READ, 0, start_sector,
+                             num_sectors, buf, f_done, done_arg);
+}
+
+bool blkdev_submit_write(blkdev_req_t *req, uint64_t start_sector,
+                         uint32_t num_sectors, const void *buf, uint32_t flags,
+                         blkdev_done_fn_t f_done, void *done_arg) {
+    return prv_blkdev_submit(req, BLKDEV_OP_WRITE, flags, start_sector,
+                             num_sectors, (void *)buf, f_done, done_arg);
+}
+
+bool blkdev_submit_flush(blkdev_req_t *req, blkdev_done_fn_t f_done,
+                         void *done_arg) {
+    return prv_blkdev_submit(req, BLKDEV_OP_FLUSH, 0, 0, 0, NULL, f_done,
+                             done_arg);
+}
+
+bool blkdev_submit_discard(blkdev_req_t *req, uint64_t start_sector,
+                           uint32_t num_sectors, blkdev_done_fn_t f_done,
+                           void *done_arg) {
+    return prv_blkdev_submit(req, BLKDEV_OP_DISCARD, 0, start_sector,
+                             num_sectors, NULL, f_done, done_arg);
+}
+
+bool blkdev_wait_req(blkdev_req_t *req) {
+    ASSERT(!req->f_done);
+
+    // The request may still be on its way through a partition, the device
+    // that completes it is the one that stores its sectors.
+    uint64_t sector = req->start_sector;
+    blkdev_dev_t *const dev = blkdev_resolve(req->dev, &sector);
+
+    const uint64_t start_us = arch_timer_current_us();
+    bool polled = false;
+    bool done = false;
+    if (dev->poll_budget_us > 0 && dev->driver_intf.f_poll &&
+        blkdev_req_sectors(req) <= blkdevPOLL_MAX_SECTORS) {
+        polled = true;
+        done = prv_blkdev_poll_req(dev, req);
+    }
+
+    // The semaphore is increased even if the request has been polled for.
+    semaphore_decrease(&req->sem_done);
+
+    const uint64_t wait_us = arch_timer_current_us() - start_us;
+    if (done) {
+        atomic_fetch_add(&dev->poll_polled_waits, 1);
+        atomic_fetch_add(&dev->poll_polled_us, wait_us);
+    } else if (polled) {
+        atomic_fetch_add(&dev->poll_missed_waits, 1);
+        atomic_fetch_add(&dev->poll_missed_us, wait_us);
+    } else {
+        atomic_fetch_add(&dev->poll_slept_waits, 1);
+        atomic_fetch_add(&dev->poll_slept_us, wait_us);
+    }
+
+    req->trace.wake_us = blktrace_now_us();
+    blktrace_add(req, BLKTRACE_WAKE);
+    return req->state == BLKDEV_REQ_SUCCESS;
 }
 
 bool blkdev_sync_read(blkdev_dev_t *dev, uint64_t start_sector,
                       uint32_t num_sectors, void *buf) {
-    bool ret;
-    blkdev_req_t *const req = heap_alloc(sizeof(*req));
+    return prv_blkdev_sync_rw(dev, BLKDEV_OP_READ, start_sector, num_sectors,
+                              buf);
+}
 
-    req->state = BLKDEV_REQ_INACTIVE;
-    req->op = BLKDEV_OP_READ;
-    req->start_sector = start_sector;
-    req->read_sectors = num_sectors;
-    req->read_buf = buf;
-    req->dev = dev;
-    semaphore_init(&req->sem_done);
+bool blkdev_sync_write(blkdev_dev_t *dev, uint64_t start_sector,
+                       uint32_t num_sectors, const void *buf) {
+    return prv_blkdev_sync_rw(dev, BLKDEV_OP_WRITE, start_sector, num_sectors,
+                              (void *)buf);
+}
 
-    if (!blkdev_enqueue_req(req)) {
-        LOG_ERROR("failed to enqueue a request");
-        heap_free(req);
-        return false;
+bool blkdev_sync_flush(blkdev_dev_t *dev) {
+    return prv_blkdev_sync_rw(dev, BLKDEV_OP_FLUSH, 0, 0, NULL);
+}
+
+bool blkdev_sync_discard(blkdev_dev_t *dev, uint64_t start_sector,
+                         uint32_t num_sectors) {
+    return prv_blkdev_sync_rw(dev, BLKDEV_OP_DISCARD, start_sector,
+                              num_sectors, NULL);
+}
+
+size_t blkdev_req_sectors(const blkdev_req_t *req) {
+    return req->op == BLKDEV_OP_READ ? req->read_sectors : req->write_sectors;
+}
+
+blkdev_dev_t *blkdev_resolve(blkdev_dev_t *dev, uint64_t *inout_sector) {
+    while (dev->driver_intf.f_resolve) {
+        dev = dev->driver_intf.f_resolve(dev->driver_ctx, inout_sector);
     }
+    return dev;
+}
 
-    semaphore_decrease(&req->sem_done);
+bool blkdev_set_poll(blkdev_dev_t *dev, uint32_t budget_us) {
+    if (budget_us > 0 && !dev->driver_intf.f_poll) { return false; }
+    dev->poll_budget_us = budget_us;
+    return true;
+}
+
+void blkdev_get_poll_stats(blkdev_dev_t *dev, blkdev_poll_stats_t *out_stats) {
+    out_stats->polled_waits = atomic_load(&dev->poll_polled_waits);
+    out_stats->polled_us = atomic_load(&dev->poll_polled_us);
+    out_stats->missed_waits = atomic_load(&dev->poll_missed_waits);
+    out_stats->missed_us = atomic_load(&dev->poll_missed_us);
+    out_stats->slept_waits = atomic_load(&dev->poll_slept_waits);
+    out_stats->slept_us = atomic_load(&dev->poll_slept_us);
+}
+
+uint64_t blkdev_num_sectors(blkdev_dev_t *dev) {
+    return dev->driver_intf.f_get_num_sectors(dev->driver_ctx);
+}
+
+uint32_t blkdev_get_caps(const blkdev_dev_t *dev) {
+    return dev->caps;
+}
+
+/// Submits a request from the device pool and waits for it to complete.
+static bool prv_blkdev_sync_rw(blkdev_dev_t *dev, blkdev_op_t op,
+                               uint64_t start_sector, uint32_t num_sectors,
+                               void *buf) {
+    blkdev_req_t *const req = blkdev_alloc_req(dev);
 
-    ret = req->state == BLKDEV_REQ_SUCCESS;
-    heap_free(req);
+    bool ret = prv_blkdev_submit(req, op, 0, start_sector, num_sectors, buf,
+                                 NULL, NULL);
+    if (ret) {
+        ret = blkdev_wait_req(req);
+    } else {
+        LOG_ERROR("failed to enqueue a request");
+    }
 
+    blkdev_free_req(req);
     return ret;
 }
 
+/**
+ * Polls the driver of @a dev until @a req completes, or until
+ * #blkdev_dev_t.poll_budget_us runs out.
+ *
+ * The driver is polled with interrupts disabled, so that the requests it
+ * completes are completed in the same context as in its IRQ handler.
+ *
+ * @returns `true` if @a req has completed.
+ */
+static bool prv_blkdev_poll_req(blkdev_dev_t *dev, blkdev_req_t *req) {
+    const uint64_t start_us = arch_timer_current_us();
+    // The microsecond counter is not calibrated yet.
+    if (start_us == 0) { return false; }
+
+    while (!prv_blkdev_req_done(req)) {
+        if (arch_timer_current_us() - start_us >= dev->poll_budget_us) {
+            return false;
+        }
+
+        const bool restore_int = cpu_get_int_flag();
+        arch_disable_ints();
+        dev->driver_intf.f_poll(dev->driver_ctx);
+        if (restore_int) { arch_enable_ints(); }
+
+        arch_pause_in_loop();
+    }
+    return true;
+}
+
+/// Returns `true` if @a req has reached its final state.
+static bool prv_blkdev_req_done(const blkdev_req_t *req) {
+    const blkdev_req_state_t state = req->state;
+    return state == BLKDEV_REQ_SUCCESS || state == BLKDEV_REQ_ERROR;
+}
+
+/// Allocates the preallocated requests of @a dev, see #blkdev_alloc_req().
+static void prv_blkdev_init_pool(blkdev_dev_t *dev) {
+    blkdev_req_t *const reqs = heap_alloc(blkdevPOOL_REQS * sizeof(*reqs));
+    kmemset(reqs, 0, blkdevPOOL_REQS * sizeof(*reqs));
+
+    spinlock_init(&dev->pool_lock);
+    semaphore_init(&dev->sem_pool);
+    dev->pool_free = NULL;
+    for (size_t idx = 0; idx < blkdevPOOL_REQS; idx++) {
+        reqs[idx].pool_dev = dev;
+        reqs[idx].pool_next = dev->pool_free;
+        dev->pool_free = &reqs[idx];
+        semaphore_increase(&dev->sem_pool);
+    }
+}
+
+/// Pops a request from the pool of @a dev, whose count has been taken.
+static blkdev_req_t *prv_blkdev_take_req(blkdev_dev_t *dev) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&dev->pool_lock);
+
+    blkdev_req_t *const req = dev->pool_free;
+    ASSERT(req);
+    dev->pool_free = req->pool_next;
+
+    spinlock_release(&dev->pool_lock);
+    if (restore_int) { arch_enable_ints(); }
+
+    req->pool_next = NULL;
+    req->dev = dev;
+    return req;
+}
+
+/// Fills in @a req and enqueues it, see #blkdev_submit_read().
+static bool prv_blkdev_submit(blkdev_req_t *req, blkdev_op_t op,
+                              uint32_t flags, uint64_t start_sector,
+                              uint32_t num_sectors, void *buf,
+                              blkdev_done_fn_t f_done, void *done_arg) {
+    // The buffer is split into physical segments, so it may be anywhere in
+    // the kernel address space. Flushes and discards have no data.
+    size_t num_segs = 0;
+    if (op == BLKDEV_OP_READ || op == BLKDEV_OP_WRITE) {
+        num_segs = dma_buf_to_segs(buf, 512 * (size_t)num_sectors,
+                                   req->seg_storage, blkdevREQ_MAX_SEGS);
+        if (num_segs == 0) { return false; }
+    }
+
+    // A partition retargets its requests to the parent device.
+    if (req->pool_dev) { req->dev = req->pool_dev; }
+    req->state = BLKDEV_REQ_INACTIVE;
+    req->op = op;
+    req->flags = flags;
+    req->start_sector = start_sector;
+    if (op == BLKDEV_OP_READ) {
+        req->read_buf = buf;
+        req->read_sectors = num_sectors;
+        req->write_buf = NULL;
+        req->write_sectors = 0;
+    } else {
+        req->read_buf = NULL;
+        req->read_sectors = 0;
+        req->write_buf = buf;
+        req->write_sectors = num_sectors;
+    }
+    req->segs = req->seg_storage;
+    req->num_segs = num_segs;
+    req->f_done = f_done;
+    req->done_arg = done_arg;
+    semaphore_init(&req->sem_done);
+    kmemset(&req->trace, 0, sizeof(req->trace));
+
+    return blkdev_enqueue_req(req);
+}
+
 [[gnu::noreturn]]
-void blkdev_task_entry(void) {
+void blkdev_worker_entry(void *v_dev) {
     // taskmgr_switch_tasks() requires that task entries enable interrupts.
     __asm__ volatile("sti");
 
-    prv_blkdev_init();
-    g_blkdev_ready = true;
+    blkdev_dev_t *const dev = v_dev;
 
     for (;;) {
-        blkdev_req_t *req;
-        queue_read(&g_blkdev_ctx.req_queue, &req, sizeof(uintptr_t));
-
-        // Check the request.
-        // FIXME: increase semaphore with error field set?
-        if (!req->dev) {
-            LOG_ERROR("bad request: dev = NULL");
-            continue;
+        if (list_is_empty(&dev->sched_sorted)) {
+            prv_blkdev_commit(dev);
+            blkdev_req_t *req;
+            queue_read(&dev->req_queue, &req, sizeof(uintptr_t));
+            semaphore_increase(&dev->sem_queue_slots);
+            prv_blkdev_sched_add(dev, req);
         }
-        if (!req->dev->driver_intf.f_is_busy) {
-            LOG_ERROR("bad request: dev->driver_intf.f_is_busy = NULL");
-            continue;
+        prv_blkdev_sched_drain(dev);
+
+        // Sleep until the driver has room for a request. The credit is
+        // returned by blkdev_complete_req(). Requests that arrive meanwhile
+        // take part in sorting and merging.
+        if (dev->queue_depth > 0) {
+            if (!semaphore_try_decrease(&dev->sem_credits)) {
+                prv_blkdev_commit(dev);
+                semaphore_decrease(&dev->sem_credits);
+            }
+            prv_blkdev_sched_drain(dev);
         }
-        if (!req->dev->driver_intf.f_submit_req) {
-            LOG_ERROR("bad request: dev->driver_intf.f_submit_req = NULL");
-            continue;
+
+        blkdev_req_t *const req = prv_blkdev_sched_pick(dev);
+        if (dev->queue_depth > 0) { req->credit_dev = dev; }
+        if (!prv_blkdev_check_caps(dev, req)) { continue; }
+        if (!prv_blkdev_dma_map(dev, req)) { continue; }
+
+        // Dispatched alone, so that the device is idle meanwhile.
+        const bool alone = prv_blkdev_is_alone(req) && dev->queue_depth > 0;
+        if (alone) { prv_blkdev_take_all_credits(dev); }
+
+        const uint64_t now_us = blktrace_now_us();
+        for (blkdev_req_t *merged = req; merged; merged = merged->merged_next) {
+            merged->trace.dispatch_us = now_us;
         }
 
-        // Wait for the driver to be ready.
-        // FIXME: if there are multiple blkdev drivers, one busy driver prevents
-        // from other drivers getting their requests. Add per-block-device
-        // workers with their own queues.
-        while (req->dev->driver_intf.f_is_busy(req->dev->driver_ctx)) {}
+        dev->driver_intf.f_submit_req(req);
+        dev->commit_pending = true;
 
-        req->dev->driver_intf.f_submit_req(req);
+        if (alone) { prv_blkdev_return_all_credits(dev); }
     }
 
     PANIC("reached task end");
 }
 
-static void prv_blkdev_init(void) {
-    mutex_init(&g_blkdev_ctx.lock);
-    queue_init(&g_blkdev_ctx.req_queue, blkdevMAX_REQS, sizeof(uintptr_t));
+/**
+ * Chooses the task manager to run the next worker task.
+ *
+ * Processors are picked in a round-robin fashion. Processors without a task
+ * manager are skipped. If there are none, the running processor is chosen.
+ */
+static taskmgr_t *prv_blkdev_pick_taskmgr(void) {
+    const uint8_t num_procs = smp_get_num_procs();
+    for (uint8_t attempt = 0; attempt < num_procs; attempt++) {
+        const uint8_t proc_num = g_blkdev_next_proc++ % num_procs;
+        smp_proc_t *const proc = smp_get_proc(proc_num);
+        if (proc && proc->taskmgr) { return proc->taskmgr; }
+    }
+
+    taskmgr_t *const taskmgr = smp_get_running_taskmgr();
+    if (!taskmgr) { PANIC("running processor has no task manager"); }
+    return taskmgr;
+}
+
+/// Adds a request taken from the device queue to the scheduler lists.
+static void prv_blkdev_sched_add(blkdev_dev_t *dev, blkdev_req_t *req) {
+    ASSERT(req->dev == dev);
+
+    const bool is_read = req->op == BLKDEV_OP_READ;
+    req->deadline_ms =
+        arch_timer_current_ms() +
+        (is_read ? blkdevREAD_DEADLINE_MS : blkdevWRITE_DEADLINE_MS);
+    list_append(is_read ? &dev->sched_read_fifo : &dev->sched_write_fifo,
+                &req->fifo_node);
+
+    // Requests mostly arrive in ascending order, so search from the end.
+    list_node_t *after = dev->sched_sorted.p_last_node;
+    while (after) {
+        const blkdev_req_t *const it =
+            LIST_NODE_TO_STRUCT(after, blkdev_req_t, sched_node);
+        if (it->start_sector <= req->start_sector) { break; }
+        after = after->p_prev;
+    }
+    list_insert(&dev->sched_sorted, after, &req->sched_node);
+}
+
+/// Moves all requests from the device queue to the scheduler lists.
+static void prv_blkdev_sched_drain(blkdev_dev_t *dev) {
+    blkdev_req_t *req;
+    while (queue_try_read(&dev->req_queue, &req, sizeof(uintptr_t))) {
+        semaphore_increase(&dev->sem_queue_slots);
+        prv_blkdev_sched_add(dev, req);
+    }
+}
+
+/// Removes a request from the scheduler lists.
+static void prv_blkdev_sched_remove(blkdev_dev_t *dev, blkdev_req_t *req) {
+    list_remove(&dev->sched_sorted, &req->sched_node);
+    list_remove(req->op == BLKDEV_OP_READ ? &dev->sched_read_fifo
+                                          : &dev->sched_write_fifo,
+                &req->fifo_node);
+}
+
+/**
+ * Removes the next request to dispatch from the scheduler lists.
+ *
+ * An expired read is picked first, then an expired write. Otherwise, the
+ * request with the lowest sector at or after #blkdev_dev_t.sched_next_sector
+ * is picked, wrapping around to the lowest sector. Contiguous requests are
+ * merged into the picked one, see #prv_blkdev_sched_merge().
+ */
+static blkdev_req_t *prv_blkdev_sched_pick(blkdev_dev_t *dev) {
+    ASSERT(!list_is_empty(&dev->sched_sorted));
+
+    const uint64_t now_ms = arch_timer_current_ms();
+    blkdev_req_t *req = NULL;
+
+    list_t *const fifos[] = {&dev->sched_read_fifo, &dev->sched_write_fifo};
+    for (size_t idx = 0; idx < sizeof(fifos) / sizeof(fifos[0]); idx++) {
+        list_node_t *const oldest = fifos[idx]->p_first_node;
+        if (!oldest) { continue; }
+        blkdev_req_t *const it =
+            LIST_NODE_TO_STRUCT(oldest, blkdev_req_t, fifo_node);
+        if (it->deadline_ms <= now_ms) {
+            req = it;
+            break;
+        }
+    }
+
+    if (!req) {
+        LIST_FIND(&dev->sched_sorted, req, blkdev_req_t, sched_node,
+                  it->start_sector >= dev->sched_next_sector, it);
+    }
+    if (!req) {
+        req = LIST_NODE_TO_STRUCT(dev->sched_sorted.p_first_node, blkdev_req_t,
+                                  sched_node);
+    }
+
+    prv_blkdev_sched_merge(dev, req);
+    prv_blkdev_sched_remove(dev, req);
+    return req;
+}
+
+/**
+ * Merges the requests that directly follow @a req into it.
+ *
+ * Only reads and writes are merged, with requests of the same operation and
+ * flags, and only as long as the driver accepts them, see
+ * #blkdev_if_t.f_can_merge.
+ */
+static void prv_blkdev_sched_merge(blkdev_dev_t *dev, blkdev_req_t *req) {
+    // A flush has no sectors, the sweep goes on from where it is.
+    if (req->op == BLKDEV_OP_FLUSH) { return; }
+
+    blkdev_req_t *last = req;
+    uint64_t next_sector = req->start_sector + blkdev_req_sectors(req);
+
+    if (dev->driver_intf.f_can_merge && !prv_blkdev_is_alone(req)) {
+        list_node_t *node = req->sched_node.p_next;
+        while (node) {
+            blkdev_req_t *const next =
+                LIST_NODE_TO_STRUCT(node, blkdev_req_t, sched_node);
+            node = node->p_next;
+
+            if (next->start_sector != next_sector || next->op != req->op ||
+                next->flags != req->flags) {
+                break;
+            }
+            if (!dev->driver_intf.f_can_merge(dev->driver_ctx, req, next)) {
+                break;
+            }
+
+            prv_blkdev_sched_remove(dev, next);
+            last->merged_next = next;
+            last = next;
+            next_sector += blkdev_req_sectors(next);
+        }
+    }
+
+    dev->sched_next_sector = next_sector;
+}
+
+/// Calls #blkdev_if_t.f_commit if requests have been submitted since.
+static void prv_blkdev_commit(blkdev_dev_t *dev) {
+    if (!dev->commit_pending) { return; }
+    dev->commit_pending = false;
+    if (dev->driver_intf.f_commit) {
+        dev->driver_intf.f_commit(dev->driver_ctx);
+    }
+}
+
+/**
+ * Completes @a req right away if it needs a capability that @a dev does not
+ * have, see #blkdev_dev_t.caps.
+ *
+ * @returns `false` if @a req has been completed.
+ */
+static bool prv_blkdev_check_caps(blkdev_dev_t *dev, blkdev_req_t *req) {
+    if (req->op == BLKDEV_OP_FLUSH && !(dev->caps & BLKDEV_CAP_FLUSH)) {
+        // Without a volatile cache, completed writes are already on the media.
+        blkdev_complete_req(req, BLKDEV_REQ_SUCCESS);
+        return false;
+    }
+    if (req->op == BLKDEV_OP_DISCARD && !(dev->caps & BLKDEV_CAP_DISCARD)) {
+        LOG_ERROR("device does not support discard, sectors %llu+%zu",
+                  req->start_sector, blkdev_req_sectors(req));
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return false;
+    }
+    return true;
+}
+
+/// Returns `true` if @a req is dispatched alone, see #blkdev_start_worker().
+static bool prv_blkdev_is_alone(const blkdev_req_t *req) {
+    return req->op == BLKDEV_OP_FLUSH || req->op == BLKDEV_OP_DISCARD;
+}
+
+/**
+ * Waits for the requests in flight on @a dev to complete, by taking the
+ * credits they hold. The worker already holds one credit.
+ */
+static void prv_blkdev_take_all_credits(blkdev_dev_t *dev) {
+    prv_blkdev_commit(dev);
+    for (size_t idx = 1; idx < dev->queue_depth; idx++) {
+        semaphore_decrease(&dev->sem_credits);
+    }
+}
+
+/**
+ * Waits for the request submitted after #prv_blkdev_take_all_credits() to
+ * complete, then returns all credits of @a dev.
+ */
+static void prv_blkdev_return_all_credits(blkdev_dev_t *dev) {
+    prv_blkdev_commit(dev);
+    semaphore_decrease(&dev->sem_credits);
+    for (size_t idx = 0; idx < dev->queue_depth; idx++) {
+        semaphore_increase(&dev->sem_credits);
+    }
+}
+
+/**
+ * Makes the data of @a req and the requests merged into it reachable by the
+ * device, see #blkdev_dev_t.dma_mask.
+ *
+ * Merged requests that do not fit in the bounce pool are returned to the
+ * scheduler lists, they are dispatched later. If @a req itself does not fit,
+ * the worker task sleeps until the pool has room.
+ *
+ * @returns `false` if @a req could not be mapped and has been completed with
+ * an error.
+ */
+static bool prv_blkdev_dma_map(blkdev_dev_t *dev, blkdev_req_t *req) {
+    if (dev->dma_mask == DMA_MASK_ALL) { return true; }
+
+    blkdev_req_t *last_mapped = NULL;
+    kerr_t err = KERR_NONE;
+    for (blkdev_req_t *it = req; it; it = it->merged_next) {
+        err = prv_blkdev_dma_map_one(dev, it);
+        while (err == KERR_IN_USE && it == req) {
+            dma_wait_bounce();
+            err = prv_blkdev_dma_map_one(dev, it);
+        }
+        if (err != KERR_NONE) { break; }
+        last_mapped = it;
+    }
+    if (err == KERR_NONE) { return true; }
+
+    blkdev_req_t *const tail = last_mapped ? last_mapped : req;
+    blkdev_req_t *rest = tail->merged_next;
+    tail->merged_next = NULL;
+    while (rest) {
+        blkdev_req_t *const next = rest->merged_next;
+        rest->merged_next = NULL;
+        // Keep the deadline, the request has already been waiting.
+        const uint64_t deadline_ms = rest->deadline_ms;
+        prv_blkdev_sched_add(dev, rest);
+        rest->deadline_ms = deadline_ms;
+        rest = next;
+    }
+
+    if (!last_mapped) {
+        LOG_ERROR("could not map request at sector %llu for DMA, error %d "
+                  "(%s)",
+                  req->start_sector, err, kerr_str(err));
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Maps the segments of one request for the device, bouncing them if needed.
+ * See #dma_map_segs() for the return values.
+ */
+static kerr_t prv_blkdev_dma_map_one(blkdev_dev_t *dev, blkdev_req_t *req) {
+    // Buffers without segments are identity mapped, so they are below 4 GiB
+    // and not bounced.
+    if (req->num_segs == 0) { return KERR_NONE; }
+
+    const dma_dir_t dir =
+        req->op == BLKDEV_OP_READ ? DMA_FROM_DEV : DMA_TO_DEV;
+    const kerr_t err = dma_map_segs(&req->dma_map, req->segs, req->num_segs,
+                                    dev->dma_mask, dir);
+    if (err == KERR_NONE) {
+        req->segs = req->dma_map.segs;
+        req->num_segs = req->dma_map.num_segs;
+    }
+    return err;
 }
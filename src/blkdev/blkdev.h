@@ -8,18 +8,196 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "dma.h"
 #include "ksemaphore.h"
+#include "kspinlock.h"
+#include "list.h"
+#include "queue.h"
+#include "taskmgr.h"
+#include "types.h"
+
+/// Maximum number of queued requests per block device.
+#define blkdevMAX_REQS 32
+
+/// Number of preallocated requests per block device, see #blkdev_alloc_req().
+#define blkdevPOOL_REQS 32
+
+/**
+ * Number of segments that #blkdev_submit_read() and #blkdev_submit_write() can
+ * describe a buffer with, see #blkdev_req.seg_storage.
+ */
+#define blkdevREQ_MAX_SEGS 16
+
+/**
+ * Largest request that is polled for, see #blkdev_set_poll(). Larger requests
+ * take long enough for the interrupt and the wakeup to not matter.
+ */
+#define blkdevPOLL_MAX_SECTORS 64
+
+/**
+ * Time after which a pending read request is dispatched before any other
+ * request, regardless of its sector (milliseconds).
+ */
+#define blkdevREAD_DEADLINE_MS 100
+/**
+ * Time after which a pending write request is dispatched before any other
+ * request, except expired reads (milliseconds).
+ */
+#define blkdevWRITE_DEADLINE_MS 1000
+
+/**
+ * @{
+ * @name Request flags
+ * See #blkdev_req.flags.
+ */
+/**
+ * The write completes only once its data is on non-volatile media, not just in
+ * the volatile cache of the device. Devices without #BLKDEV_CAP_FLUSH ignore
+ * it.
+ */
+#define BLKDEV_REQ_FLAG_FUA (1u << 0)
+/// @}
+
+/**
+ * @{
+ * @name Device capabilities
+ * See #blkdev_if_t.f_get_caps.
+ */
+/**
+ * The device has a volatile write cache and processes #BLKDEV_OP_FLUSH and
+ * #BLKDEV_REQ_FLAG_FUA. Flushes to a device without it complete right away.
+ */
+#define BLKDEV_CAP_FLUSH   (1u << 0)
+/// The device processes #BLKDEV_OP_DISCARD.
+#define BLKDEV_CAP_DISCARD (1u << 1)
+/// @}
 
 typedef struct blkdev_req blkdev_req_t;
+typedef struct blkdev_dev blkdev_dev_t;
+
+/**
+ * Request completion callback, see #blkdev_req.f_done.
+ *
+ * @param req Completed request, see #blkdev_req.state for the result.
+ * @param arg #blkdev_req.done_arg.
+ */
+typedef void (*blkdev_done_fn_t)(blkdev_req_t *req, void *arg);
 
+/**
+ * Block device driver interface.
+ *
+ * A driver completes each submitted request by calling #blkdev_complete_req(),
+ * usually from its IRQ handler. That returns the credit taken by the worker
+ * task before submitting the request, see #blkdev_dev_t.sem_credits.
+ */
 typedef struct {
-    bool (*f_is_busy)(void *ctx);
+    /**
+     * Returns the number of requests the driver can process at the same time.
+     * Zero means that the driver does not limit it, e.g., because it forwards
+     * requests to another device.
+     */
+    size_t (*f_get_queue_depth)(void *ctx);
+    /// Returns the number of sectors of the device.
+    uint64_t (*f_get_num_sectors)(void *ctx);
+    /**
+     * Returns `true` if the driver can process request @a next together with
+     * request @a req and the requests already merged into it in one command.
+     * The caller guarantees that @a next has the same operation and flags as
+     * @a req, that the operation is a read or a write, and that @a next starts
+     * right after the last merged sector.
+     *
+     * May be `NULL` if the driver does not support merging.
+     */
+    bool (*f_can_merge)(void *ctx, const blkdev_req_t *req,
+                        const blkdev_req_t *next);
+    /**
+     * Returns the device that stores the sectors of this device, and
+     * translates @a *inout_sector to a sector of that device.
+     *
+     * May be `NULL` if the device stores its sectors itself.
+     * See #blkdev_resolve().
+     */
+    blkdev_dev_t *(*f_resolve)(void *ctx, uint64_t *inout_sector);
+    /**
+     * Starts processing the request and the requests merged into it, see
+     * #blkdev_req.merged_next.
+     */
     void (*f_submit_req)(blkdev_req_t *req);
+    /**
+     * Lets the device know about the requests submitted since the previous
+     * call, so that a driver can notify the device once per batch.
+     *
+     * The worker task calls it before it waits for requests or for a credit.
+     * May be `NULL` if #blkdev_if_t.f_submit_req starts each request itself.
+     */
+    void (*f_commit)(void *ctx);
+    /**
+     * Completes the requests that the device has finished, without waiting
+     * for the completion interrupt, see #blkdev_set_poll().
+     *
+     * It is called with interrupts disabled. Returns the number of completed
+     * requests. May be `NULL` if the driver cannot poll.
+     */
+    size_t (*f_poll)(void *ctx);
+    /**
+     * Returns the DMA mask of the device, see dma.h. Data that the device
+     * does not reach is bounced by the worker task, see
+     * #blkdev_req.dma_map.
+     *
+     * May be `NULL` if the device reaches all of physical memory, e.g.,
+     * because it forwards requests or copies data with the processor.
+     */
+    paddr_t (*f_get_dma_mask)(void *ctx);
+    /**
+     * Returns the capabilities of the device, a combination of the
+     * `BLKDEV_CAP_*` bits. See #blkdev_dev_t.caps.
+     *
+     * May be `NULL` if the device has none of them.
+     */
+    uint32_t (*f_get_caps)(void *ctx);
 } blkdev_if_t;
 
+/// Hybrid polling statistics of a device, see #blkdev_get_poll_stats().
+typedef struct {
+    uint64_t polled_waits; ///< Waits that ended while polling.
+    uint64_t polled_us;    ///< Total time of the polled waits.
+    uint64_t missed_waits; ///< Waits that polled, then went to sleep.
+    uint64_t missed_us;    ///< Total time of the missed waits.
+    uint64_t slept_waits;  ///< Waits that went to sleep without polling.
+    uint64_t slept_us;     ///< Total time of the slept waits.
+} blkdev_poll_stats_t;
+
+/// Physically contiguous memory segment, see #blkdev_req.segs.
+typedef dma_seg_t blkdev_seg_t;
+
+/**
+ * Lifecycle timestamps of a request (microseconds), see blktrace.h.
+ * A stage that the request has not passed has a zero timestamp.
+ */
+typedef struct {
+    uint64_t enqueue_us;  ///< Enqueued with #blkdev_enqueue_req().
+    uint64_t dispatch_us; ///< Passed to the driver by the worker task.
+    uint64_t issue_us;    ///< Issued to the device by the driver.
+    uint64_t complete_us; ///< Completed with #blkdev_complete_req().
+    uint64_t wake_us;     ///< Waiter woken up in #blkdev_wait_req().
+} blkdev_trace_t;
+
 typedef enum {
     BLKDEV_OP_READ,
     BLKDEV_OP_WRITE,
+    /**
+     * Writes the volatile cache of the device to non-volatile media. It
+     * covers the writes that have completed before it is dispatched. The
+     * request has no sectors.
+     */
+    BLKDEV_OP_FLUSH,
+    /**
+     * Lets the device know that the data of #blkdev_req.write_sectors sectors
+     * starting from #blkdev_req.start_sector is no longer needed, e.g., TRIM
+     * of an SSD. The request has no data, and the discarded sectors read back
+     * undefined data.
+     */
+    BLKDEV_OP_DISCARD,
 } blkdev_op_t;
 
 typedef enum {
@@ -29,14 +207,107 @@ typedef enum {
     BLKDEV_REQ_SUCCESS,
 } blkdev_req_state_t;
 
-typedef struct {
+struct blkdev_dev {
     void *driver_ctx;
     blkdev_if_t driver_intf;
-} blkdev_dev_t;
+
+    /**
+     * Request queue of the device.
+     * - Item type: pointer to #blkdev_req_t.
+     * - Max items: #blkdevMAX_REQS.
+     *
+     * Initialized by #blkdev_start_worker().
+     */
+    queue_t req_queue;
+    /**
+     * Number of free items in #blkdev_dev_t.req_queue.
+     *
+     * #blkdev_enqueue_req() decreases it and sleeps if it is zero, the worker
+     * task increases it for every request it takes from the queue. Requests
+     * come from any number of pools and partitions, so a full queue delays
+     * them instead of failing them.
+     */
+    semaphore_t sem_queue_slots;
+
+    /// Worker task draining #blkdev_dev_t.req_queue, see #blkdev_worker_entry.
+    task_t *worker_task;
+
+    /**
+     * Driver queue depth, see #blkdev_if_t.f_get_queue_depth.
+     * Initialized by #blkdev_start_worker().
+     */
+    size_t queue_depth;
+    /**
+     * Number of requests the driver can accept right now.
+     *
+     * The worker task decreases it before submitting a request and sleeps if
+     * it is zero. #blkdev_complete_req() increases it. It is not used if
+     * #blkdev_dev_t.queue_depth is zero.
+     */
+    semaphore_t sem_credits;
+
+    /**
+     * DMA mask of the device, see #blkdev_if_t.f_get_dma_mask.
+     * Initialized by #blkdev_start_worker().
+     */
+    paddr_t dma_mask;
+    /**
+     * Capabilities of the device, see #blkdev_if_t.f_get_caps.
+     * Initialized by #blkdev_start_worker().
+     */
+    uint32_t caps;
+
+    /**
+     * Pending requests sorted by #blkdev_req.start_sector.
+     * Only the worker task accesses it, see #blkdev_worker_entry.
+     */
+    list_t sched_sorted;
+    /// Pending read requests in arrival order, for the read deadlines.
+    list_t sched_read_fifo;
+    /// Pending write requests in arrival order, for the write deadlines.
+    list_t sched_write_fifo;
+    /// Sector right after the last dispatched request.
+    uint64_t sched_next_sector;
+    /// Requests have been submitted since the last #blkdev_if_t.f_commit.
+    bool commit_pending;
+
+    /**
+     * Free preallocated requests, linked by #blkdev_req.pool_next.
+     * See #blkdev_alloc_req().
+     */
+    blkdev_req_t *pool_free;
+    /// Protects #blkdev_dev_t.pool_free, taken with interrupts disabled.
+    spinlock_t pool_lock;
+    /// Number of requests in #blkdev_dev_t.pool_free.
+    semaphore_t sem_pool;
+
+    /**
+     * Time to poll for a request before going to sleep (microseconds), zero
+     * if polling is disabled. See #blkdev_set_poll().
+     */
+    uint32_t poll_budget_us;
+    /**
+     * @{
+     * @name Hybrid polling statistics
+     * See #blkdev_poll_stats_t for the meaning of the fields.
+     */
+    _Atomic uint64_t poll_polled_waits;
+    _Atomic uint64_t poll_polled_us;
+    _Atomic uint64_t poll_missed_waits;
+    _Atomic uint64_t poll_missed_us;
+    _Atomic uint64_t poll_slept_waits;
+    _Atomic uint64_t poll_slept_us;
+    /// @}
+};
 
 struct blkdev_req {
     _Atomic blkdev_req_state_t state;
     blkdev_op_t op;
+    /**
+     * Combination of the `BLKDEV_REQ_FLAG_*` flags, e.g.,
+     * #BLKDEV_REQ_FLAG_FUA.
+     */
+    uint32_t flags;
     uint64_t start_sector;
 
     void *read_buf;
@@ -44,19 +315,109 @@ struct blkdev_req {
     const void *write_buf;
     size_t write_sectors;
 
+    /**
+     * Physical memory to transfer the sectors to or from, in sector order.
+     *
+     * If #blkdev_req.num_segs is zero, the driver uses #blkdev_req.read_buf or
+     * #blkdev_req.write_buf, which must be identity mapped. Otherwise, the
+     * total length of the segments must be equal to the sector count, and the
+     * buffer fields are ignored. See #dma_buf_to_segs().
+     */
+    const blkdev_seg_t *segs;
+    /// Number of items in #blkdev_req.segs.
+    size_t num_segs;
+
     blkdev_dev_t *dev;
+    /**
+     * Device that has taken a credit to submit this request.
+     * This field is managed by the blkdev worker tasks.
+     */
+    blkdev_dev_t *credit_dev;
 
+    /**
+     * Next request merged into this one. The driver processes the whole chain
+     * as a single command on the device. Managed by the blkdev worker tasks.
+     */
+    blkdev_req_t *merged_next;
+    /// Node in #blkdev_dev_t.sched_sorted.
+    list_node_t sched_node;
+    /// Node in #blkdev_dev_t.sched_read_fifo or #blkdev_dev_t.sched_write_fifo.
+    list_node_t fifo_node;
+    /// Time by which the request is to be dispatched, see arch_timer.h.
+    uint64_t deadline_ms;
+
+    /**
+     * Called by #blkdev_complete_req() instead of increasing
+     * #blkdev_req.sem_done, unless it is `NULL`.
+     *
+     * It is called in the context of the driver completion, usually an IRQ
+     * handler, so it must not block. It may free the request with
+     * #blkdev_free_req(), but must not submit it again, since
+     * #blkdev_enqueue_req() may block. A task that is woken up from it
+     * resubmits the request instead.
+     */
+    blkdev_done_fn_t f_done;
+    /// Argument of #blkdev_req.f_done.
+    void *done_arg;
+    /// Completion object, used if #blkdev_req.f_done is `NULL`.
     semaphore_t sem_done;
+
+    /**
+     * Mapping of #blkdev_req.segs for the device that processes the request.
+     * If the device does not reach the segments, the worker task points
+     * #blkdev_req.segs to a bounce buffer before submitting the request, and
+     * #blkdev_complete_req() restores them.
+     */
+    dma_map_t dma_map;
+
+    /**
+     * Lifecycle timestamps. They must be zeroed before the request is
+     * enqueued, #blkdev_submit_read() and #blkdev_submit_write() do that.
+     */
+    blkdev_trace_t trace;
+
+    /// Device whose pool the request belongs to, see #blkdev_alloc_req().
+    blkdev_dev_t *pool_dev;
+    /// Next free request in #blkdev_dev_t.pool_free.
+    blkdev_req_t *pool_next;
+    /**
+     * Storage for #blkdev_req.segs, used by #blkdev_submit_read() and
+     * #blkdev_submit_write().
+     */
+    blkdev_seg_t seg_storage[blkdevREQ_MAX_SEGS];
 };
 
 /**
- * Returns `true` if the blkdev task is ready to process requests.
- * See #blkdev_task_entry.
+ * Initializes the request queue of @a dev and creates its worker task.
+ *
+ * Each block device has its own queue and worker, so that a busy device does
+ * not delay the requests to other devices. Worker tasks are distributed among
+ * the processors in a round-robin fashion.
+ *
+ * The worker does not dispatch the requests in arrival order. Requests are
+ * sorted by sector and dispatched in ascending order (C-LOOK), contiguous
+ * requests of the same operation are merged if the driver supports it (see
+ * #blkdev_if_t.f_can_merge). Requests older than #blkdevREAD_DEADLINE_MS or
+ * #blkdevWRITE_DEADLINE_MS are dispatched first, reads before writes.
+ *
+ * Flush and discard requests are dispatched alone: the worker waits for the
+ * requests dispatched before them to complete, and dispatches the next request
+ * once they have completed. Requests that need a capability the device does
+ * not have are completed by the worker, see #blkdev_if_t.f_get_caps.
+ *
+ * Requests can be enqueued as soon as this function returns, even if the
+ * worker task has not started yet.
+ *
+ * @param dev  Block device to start the worker for.
+ * @param name Name of the worker task.
  */
-bool blkdev_is_ready(void);
+void blkdev_start_worker(blkdev_dev_t *dev, const char *name);
 
 /**
- * Enqueues the request @a req.
+ * Enqueues the request @a req to the queue of the device #blkdev_req.dev.
+ *
+ * If the queue is full, the calling task is blocked until the worker task
+ * takes a request from it. So it must not be called in an IRQ handler.
  *
  * @warning
  * Lifetime of @a *req must be long enough for a driver to fulfill the request,
@@ -69,6 +430,125 @@ bool blkdev_is_ready(void);
  */
 bool blkdev_enqueue_req(blkdev_req_t *req);
 
+/**
+ * Completes the request @a req with the final state @a state.
+ *
+ * It must be called by a driver once for every request passed to its
+ * #blkdev_if_t.f_submit_req, including requests that failed to be submitted.
+ * The requests merged into @a req are completed with the same state.
+ * It is safe to call it in an IRQ handler.
+ *
+ * @param req   Request to complete.
+ * @param state #BLKDEV_REQ_SUCCESS or #BLKDEV_REQ_ERROR.
+ *
+ * @warning
+ * @a req must not be accessed after the call, since its owner may free it as
+ * soon as #blkdev_req.sem_done is increased, or in #blkdev_req.f_done.
+ */
+void blkdev_complete_req(blkdev_req_t *req, blkdev_req_state_t state);
+
+/**
+ * Takes a preallocated request of device @a dev.
+ *
+ * Each device has #blkdevPOOL_REQS requests, so that submitting I/O does not
+ * need to allocate memory. If all of them are in use, the calling task is
+ * blocked until one is freed.
+ *
+ * @returns A request that can be passed to #blkdev_submit_read() or
+ * #blkdev_submit_write(). It must be returned with #blkdev_free_req().
+ */
+blkdev_req_t *blkdev_alloc_req(blkdev_dev_t *dev);
+
+/**
+ * Takes a preallocated request of device @a dev without blocking.
+ * See #blkdev_alloc_req().
+ *
+ * @returns The request, `NULL` if all of them are in use.
+ */
+blkdev_req_t *blkdev_try_alloc_req(blkdev_dev_t *dev);
+
+/**
+ * Returns the request @a req taken with #blkdev_alloc_req() to its pool.
+ *
+ * It is safe to call it in an IRQ handler, e.g., in #blkdev_req.f_done, even
+ * on the processor of a task blocked in #blkdev_alloc_req(): both the pool lock
+ * and the lock of #blkdev_dev.sem_pool are taken with interrupts disabled.
+ */
+void blkdev_free_req(blkdev_req_t *req);
+
+/**
+ * Starts reading @a num_sectors starting from sector @a start_sector of
+ * #blkdev_req.dev without waiting for the read to finish.
+ *
+ * When the read is done, @a f_done is called with @a done_arg. If @a f_done
+ * is `NULL`, the completion can be waited for with #blkdev_wait_req().
+ *
+ * @param req          Request, e.g., taken with #blkdev_alloc_req(). It must
+ *                     not be in use. A request from a pool is submitted to the
+ *                     device of the pool, otherwise #blkdev_req.dev must be set
+ *                     before every submission.
+ * @param start_sector First sector to read.
+ * @param num_sectors  Number of sectors to read.
+ * @param buf          Destination buffer. It must consist of at most
+ *                     #blkdevREQ_MAX_SEGS physically contiguous segments.
+ * @param f_done       Completion callback or `NULL`.
+ * @param done_arg     Argument of @a f_done.
+ *
+ * @returns `true` if the request has been enqueued. Otherwise, it has not been
+ * completed and @a f_done is not called.
+ */
+bool blkdev_submit_read(blkdev_req_t *req, uint64_t start_sector,
+                        uint32_t num_sectors, void *buf,
+                        blkdev_done_fn_t f_done, void *done_arg);
+
+/**
+ * Starts writing @a num_sectors starting from sector @a start_sector of
+ * #blkdev_req.dev without waiting for the write to finish.
+ *
+ * @a flags is a combination of the `BLKDEV_REQ_FLAG_*` flags, e.g.,
+ * #BLKDEV_REQ_FLAG_FUA. See #blkdev_submit_read() for the description of the
+ * other parameters.
+ */
+bool blkdev_submit_write(blkdev_req_t *req, uint64_t start_sector,
+                         uint32_t num_sectors, const void *buf, uint32_t flags,
+                         blkdev_done_fn_t f_done, void *done_arg);
+
+/**
+ * Starts flushing the volatile cache of #blkdev_req.dev, see
+ * #BLKDEV_OP_FLUSH. Only the writes that have completed before the call are
+ * guaranteed to be flushed.
+ *
+ * See #blkdev_submit_read() for the description of the parameters.
+ */
+bool blkdev_submit_flush(blkdev_req_t *req, blkdev_done_fn_t f_done,
+                         void *done_arg);
+
+/**
+ * Starts discarding @a num_sectors starting from sector @a start_sector of
+ * #blkdev_req.dev, see #BLKDEV_OP_DISCARD. The request fails if the device
+ * does not have #BLKDEV_CAP_DISCARD.
+ *
+ * See #blkdev_submit_read() for the description of the parameters.
+ */
+bool blkdev_submit_discard(blkdev_req_t *req, uint64_t start_sector,
+                           uint32_t num_sectors, blkdev_done_fn_t f_done,
+                           void *done_arg);
+
+/**
+ * Waits for the request @a req submitted without a completion callback.
+ *
+ * If the device that stores the sectors of @a req polls (see
+ * #blkdev_set_poll()), and the request is not larger than
+ * #blkdevPOLL_MAX_SECTORS, the calling task first spins polling the driver
+ * for the completion, and only goes to sleep when the budget runs out.
+ *
+ * @returns `true` if the request has completed successfully.
+ */
+bool blkdev_wait_req(blkdev_req_t *req);
+
+/// Returns the number of sectors to read, write or discard by @a req.
+size_t blkdev_req_sectors(const blkdev_req_t *req);
+
 /**
  * Synchronously reads @a num_sectors starting from sector @a start_sector.
  *
@@ -76,7 +556,8 @@ bool blkdev_enqueue_req(blkdev_req_t *req);
  *                     #devmgr_dev_t.blkdev_dev).
  * @param start_sector First sector to read.
  * @param num_sectors  Number of sectors to read.
- * @param buf          Destination buffer.
+ * @param buf          Destination buffer, it does not need to be identity
+ *                     mapped or physically contiguous.
  *
  * @returns `true` if @a num_sectors sectors starting from @a start_sector have
  * been read from the device @a dev and copied to @a buf.
@@ -88,5 +569,91 @@ bool blkdev_enqueue_req(blkdev_req_t *req);
 bool blkdev_sync_read(blkdev_dev_t *dev, uint64_t start_sector,
                       uint32_t num_sectors, void *buf);
 
+/**
+ * Synchronously writes @a num_sectors starting from sector @a start_sector.
+ *
+ * @param dev          blkdev-level context of the device (see
+ *                     #devmgr_dev_t.blkdev_dev).
+ * @param start_sector First sector to write.
+ * @param num_sectors  Number of sectors to write.
+ * @param buf          Source buffer, it does not need to be identity mapped or
+ *                     physically contiguous.
+ *
+ * @returns `true` if @a num_sectors sectors from @a buf have been written to
+ * the device @a dev starting from @a start_sector.
+ *
+ * @note
+ * This function is synchronous, i.e., it blocks the calling task until the
+ * write request is finished.
+ */
+bool blkdev_sync_write(blkdev_dev_t *dev, uint64_t start_sector,
+                       uint32_t num_sectors, const void *buf);
+
+/**
+ * Synchronously flushes the volatile cache of @a dev, so that the writes that
+ * have completed before the call survive a power loss.
+ *
+ * @returns `true` if the cache has been flushed, or if @a dev has no volatile
+ * cache.
+ */
+bool blkdev_sync_flush(blkdev_dev_t *dev);
+
+/**
+ * Synchronously discards @a num_sectors starting from sector @a start_sector,
+ * see #BLKDEV_OP_DISCARD.
+ *
+ * @returns `true` if the device has accepted the discard.
+ */
+bool blkdev_sync_discard(blkdev_dev_t *dev, uint64_t start_sector,
+                         uint32_t num_sectors);
+
+/**
+ * Finds the device that physically stores sector @a *inout_sector of @a dev.
+ *
+ * E.g., a partition is resolved to the disk it is on. @a *inout_sector is
+ * translated to a sector of the returned device.
+ *
+ * @returns The device that stores the sector, @a dev itself if it does not
+ * have #blkdev_if_t.f_resolve.
+ */
+blkdev_dev_t *blkdev_resolve(blkdev_dev_t *dev, uint64_t *inout_sector);
+
+/**
+ * Enables or disables hybrid polling of @a dev.
+ *
+ * For a fast device, the completion interrupt and the wakeup of the waiting
+ * task may take longer than the request itself. A task waiting in
+ * #blkdev_wait_req() for a small request then polls the driver for up to
+ * @a budget_us microseconds before it goes to sleep. The interrupts stay
+ * enabled, so a request that takes longer completes as usual.
+ *
+ * Partitions poll if the device they are on polls.
+ *
+ * @param dev       Device whose driver supports #blkdev_if_t.f_poll.
+ * @param budget_us Time to poll for, zero to disable polling.
+ *
+ * @returns `false` if the driver of @a dev cannot poll.
+ */
+bool blkdev_set_poll(blkdev_dev_t *dev, uint32_t budget_us);
+
+/**
+ * Copies the hybrid polling statistics of @a dev to @a out_stats.
+ * The waits are accounted to the device that stores the sectors, see
+ * #blkdev_resolve().
+ */
+void blkdev_get_poll_stats(blkdev_dev_t *dev, blkdev_poll_stats_t *out_stats);
+
+/// Returns the number of sectors of @a dev, see #blkdev_if_t.f_get_num_sectors.
+uint64_t blkdev_num_sectors(blkdev_dev_t *dev);
+
+/// Returns the capabilities of @a dev, see #blkdev_dev_t.caps.
+uint32_t blkdev_get_caps(const blkdev_dev_t *dev);
+
+/**
+ * Entry point of a block device worker task.
+ * See #blkdev_start_worker().
+ *
+ * @param v_dev Block device, whose request queue the worker drains.
+ */
 [[gnu::noreturn]]
-void blkdev_task_entry(void);
+void blkdev_worker_entry(void *v_dev);
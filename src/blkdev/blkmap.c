@@ -0,0 +1,383 @@
+/**
+ * @file blkmap.c
+ * Mapped block device driver implementation.
+ */
+
+#include <stdatomic.h>
+
+#include "arch.h"
+#include "blkdev/blkmap.h"
+#include "blkdev/blktrace.h"
+#include "cpu.h"
+#include "heap.h"
+#include "log.h"
+#include "memfun.h"
+
+/// Sector size of the legs (bytes).
+#define BLKMAP_SECTOR_SIZE 512
+
+static_assert(BLKMAP_MAX_REQS < 64, "slots must fit busy_slots");
+
+static blkmap_ctx_t *prv_blkmap_alloc(blkmap_type_t type,
+                                      blkdev_dev_t *const *legs,
+                                      size_t num_legs);
+static uint64_t prv_blkmap_map(const blkmap_ctx_t *map_ctx, uint64_t sector,
+                               size_t *out_leg, uint64_t *out_leg_sector);
+static size_t prv_blkmap_slice(const blkdev_req_t *req, uint64_t offset,
+                               uint64_t len, blkdev_seg_t *out_segs);
+static bool prv_blkmap_submit_child(blkmap_slot_t *slot, blkdev_dev_t *leg,
+                                    uint64_t leg_sector, uint64_t offset,
+                                    uint64_t num_sectors);
+
+static blkmap_slot_t *prv_blkmap_alloc_slot(blkmap_ctx_t *map_ctx);
+static void prv_blkmap_put_slot(blkmap_slot_t *slot);
+static void prv_blkmap_child_done(blkdev_req_t *child, void *arg);
+
+blkmap_ctx_t *blkmap_new_linear(blkdev_dev_t *const *legs, size_t num_legs) {
+    blkmap_ctx_t *const map_ctx =
+        prv_blkmap_alloc(BLKMAP_LINEAR, legs, num_legs);
+    if (!map_ctx) { return NULL; }
+
+    for (size_t leg_idx = 0; leg_idx < num_legs; leg_idx++) {
+        map_ctx->leg_sectors[leg_idx] = blkdev_num_sectors(legs[leg_idx]);
+        map_ctx->num_sectors += map_ctx->leg_sectors[leg_idx];
+    }
+    return map_ctx;
+}
+
+blkmap_ctx_t *blkmap_new_striped(blkdev_dev_t *const *legs, size_t num_legs,
+                                 uint32_t chunk_sectors) {
+    if (chunk_sectors == 0) {
+        LOG_ERROR("blkmap: chunk size cannot be zero");
+        return NULL;
+    }
+
+    uint64_t leg_sectors = UINT64_MAX;
+    for (size_t leg_idx = 0; leg_idx < num_legs; leg_idx++) {
+        const uint64_t num_sectors = blkdev_num_sectors(legs[leg_idx]);
+        if (num_sectors < leg_sectors) { leg_sectors = num_sectors; }
+    }
+    leg_sectors -= leg_sectors % chunk_sectors;
+    if (num_legs > 0 && leg_sectors == 0) {
+        LOG_ERROR("blkmap: a leg is smaller than one chunk");
+        return NULL;
+    }
+
+    blkmap_ctx_t *const map_ctx =
+        prv_blkmap_alloc(BLKMAP_STRIPED, legs, num_legs);
+    if (!map_ctx) { return NULL; }
+
+    map_ctx->chunk_sectors = chunk_sectors;
+    for (size_t leg_idx = 0; leg_idx < num_legs; leg_idx++) {
+        map_ctx->leg_sectors[leg_idx] = leg_sectors;
+    }
+    map_ctx->num_sectors = num_legs * leg_sectors;
+    return map_ctx;
+}
+
+void blkmap_fill_blkdev_if(blkdev_if_t *blkdev_if) {
+    blkdev_if->f_get_queue_depth = blkmap_if_get_queue_depth;
+    blkdev_if->f_get_num_sectors = blkmap_if_get_num_sectors;
+    // Requests are merged by the workers of the legs.
+    blkdev_if->f_can_merge = NULL;
+    blkdev_if->f_resolve = NULL;
+    blkdev_if->f_submit_req = blkmap_if_submit_req;
+    blkdev_if->f_commit = NULL;
+    blkdev_if->f_poll = NULL;
+    blkdev_if->f_get_dma_mask = NULL;
+    blkdev_if->f_get_caps = blkmap_if_get_caps;
+}
+
+size_t blkmap_if_get_queue_depth(void *v_map_ctx) {
+    (void)v_map_ctx;
+    return BLKMAP_MAX_REQS;
+}
+
+uint64_t blkmap_if_get_num_sectors(void *v_map_ctx) {
+    blkmap_ctx_t *const map_ctx = v_map_ctx;
+    return map_ctx->num_sectors;
+}
+
+uint32_t blkmap_if_get_caps(void *v_map_ctx) {
+    blkmap_ctx_t *const map_ctx = v_map_ctx;
+
+    uint32_t any_caps = 0;
+    uint32_t all_caps = UINT32_MAX;
+    for (size_t leg_idx = 0; leg_idx < map_ctx->num_legs; leg_idx++) {
+        const uint32_t leg_caps = blkdev_get_caps(map_ctx->legs[leg_idx]);
+        any_caps |= leg_caps;
+        all_caps &= leg_caps;
+    }
+    // A flush is sent to every leg, and completes right away on the legs
+    // without a cache. A discard could fail on some legs only.
+    return (any_caps & BLKDEV_CAP_FLUSH) | (all_caps & BLKDEV_CAP_DISCARD);
+}
+
+void blkmap_if_submit_req(blkdev_req_t *req) {
+    blkmap_ctx_t *const map_ctx = req->dev->driver_ctx;
+
+    const bool flush = req->op == BLKDEV_OP_FLUSH;
+    const uint64_t num_sectors = blkdev_req_sectors(req);
+    if (req->merged_next ||
+        (!flush && (num_sectors == 0 ||
+                    req->start_sector >= map_ctx->num_sectors ||
+                    num_sectors > map_ctx->num_sectors - req->start_sector))) {
+        LOG_ERROR("blkmap: bad request, sectors %llu+%llu", req->start_sector,
+                  num_sectors);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+
+    blkmap_slot_t *const slot = prv_blkmap_alloc_slot(map_ctx);
+    if (!slot) {
+        // The worker task takes a credit per slot, so this is a driver bug.
+        LOG_ERROR("blkmap: no free request slot");
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+    slot->req = req;
+    slot->failed = false;
+    // Held until all children are submitted, so that the request is not
+    // completed by the first child to finish.
+    slot->pending = 1;
+
+    req->trace.issue_us = blktrace_now_us();
+
+    if (flush) {
+        for (size_t leg_idx = 0; leg_idx < map_ctx->num_legs; leg_idx++) {
+            if (!prv_blkmap_submit_child(slot, map_ctx->legs[leg_idx], 0, 0,
+                                         0)) {
+                slot->failed = true;
+                break;
+            }
+        }
+    }
+
+    uint64_t offset = 0;
+    while (offset < num_sectors) {
+        size_t leg_idx;
+        uint64_t leg_sector;
+        uint64_t piece = prv_blkmap_map(map_ctx, req->start_sector + offset,
+                                        &leg_idx, &leg_sector);
+        if (piece > num_sectors - offset) { piece = num_sectors - offset; }
+
+        if (!prv_blkmap_submit_child(slot, map_ctx->legs[leg_idx], leg_sector,
+                                     offset, piece)) {
+            slot->failed = true;
+            break;
+        }
+        offset += piece;
+    }
+
+    prv_blkmap_put_slot(slot);
+}
+
+/**
+ * Allocates a mapped device context of type @a type over @a legs.
+ * The sector counts are left for the caller to fill in.
+ */
+static blkmap_ctx_t *prv_blkmap_alloc(blkmap_type_t type,
+                                      blkdev_dev_t *const *legs,
+                                      size_t num_legs) {
+    if (num_legs == 0 || num_legs > BLKMAP_MAX_LEGS) {
+        LOG_ERROR("blkmap: expected 1 to %u legs, got %zu", BLKMAP_MAX_LEGS,
+                  num_legs);
+        return NULL;
+    }
+
+    blkmap_ctx_t *const map_ctx = heap_alloc(sizeof(*map_ctx));
+    kmemset(map_ctx, 0, sizeof(*map_ctx));
+    map_ctx->type = type;
+    map_ctx->num_legs = num_legs;
+    for (size_t leg_idx = 0; leg_idx < num_legs; leg_idx++) {
+        map_ctx->legs[leg_idx] = legs[leg_idx];
+    }
+    spinlock_init(&map_ctx->lock);
+    for (size_t slot_idx = 0; slot_idx < BLKMAP_MAX_REQS; slot_idx++) {
+        map_ctx->slots[slot_idx].map_ctx = map_ctx;
+    }
+    return map_ctx;
+}
+
+/**
+ * Finds the leg that stores sector @a sector of the mapped device.
+ *
+ * @param map_ctx       Mapped device.
+ * @param sector        Sector of the mapped device, less than
+ *                      #blkmap_ctx.num_sectors.
+ * @param out_leg       Output, index of the leg.
+ * @param out_leg_sector Output, sector of the leg.
+ *
+ * @returns The number of sectors that follow @a sector on the same leg
+ * without a break, including @a sector itself.
+ */
+static uint64_t prv_blkmap_map(const blkmap_ctx_t *map_ctx, uint64_t sector,
+                               size_t *out_leg, uint64_t *out_leg_sector) {
+    if (map_ctx->type == BLKMAP_STRIPED) {
+        const uint64_t chunk = sector / map_ctx->chunk_sectors;
+        const uint64_t chunk_offset = sector % map_ctx->chunk_sectors;
+        *out_leg = chunk % map_ctx->num_legs;
+        *out_leg_sector =
+            chunk / map_ctx->num_legs * map_ctx->chunk_sectors + chunk_offset;
+        return map_ctx->chunk_sectors - chunk_offset;
+    }
+
+    size_t leg_idx = 0;
+    while (sector >= map_ctx->leg_sectors[leg_idx]) {
+        sector -= map_ctx->leg_sectors[leg_idx];
+        leg_idx++;
+    }
+    *out_leg = leg_idx;
+    *out_leg_sector = sector;
+    return map_ctx->leg_sectors[leg_idx] - sector;
+}
+
+/**
+ * Describes @a len bytes at byte @a offset of the data of @a req with at most
+ * #blkdevREQ_MAX_SEGS segments.
+ *
+ * @returns The number of segments written to @a out_segs, zero if more are
+ * needed.
+ */
+static size_t prv_blkmap_slice(const blkdev_req_t *req, uint64_t offset,
+                               uint64_t len, blkdev_seg_t *out_segs) {
+    blkdev_seg_t buf_seg;
+    const blkdev_seg_t *segs = req->segs;
+    size_t num_segs = req->num_segs;
+    if (num_segs == 0) {
+        const void *const buf =
+            req->op == BLKDEV_OP_READ ? req->read_buf : req->write_buf;
+        buf_seg.addr = (uintptr_t)buf;
+        buf_seg.len = BLKMAP_SECTOR_SIZE * blkdev_req_sectors(req);
+        segs = &buf_seg;
+        num_segs = 1;
+    }
+
+    size_t num_out = 0;
+    for (size_t seg_idx = 0; seg_idx < num_segs && len > 0; seg_idx++) {
+        if (offset >= segs[seg_idx].len) {
+            offset -= segs[seg_idx].len;
+            continue;
+        }
+        if (num_out == blkdevREQ_MAX_SEGS) { return 0; }
+
+        uint64_t seg_len = segs[seg_idx].len - offset;
+        if (seg_len > len) { seg_len = len; }
+        out_segs[num_out].addr = segs[seg_idx].addr + offset;
+        out_segs[num_out].len = seg_len;
+        num_out++;
+
+        len -= seg_len;
+        offset = 0;
+    }
+    return len == 0 ? num_out : 0;
+}
+
+/**
+ * Enqueues a child request of the request in @a slot to leg @a leg.
+ *
+ * @param slot        Slot of the parent request.
+ * @param leg         Leg to enqueue the child to.
+ * @param leg_sector  First sector of the child on the leg.
+ * @param offset      Offset of the child in the parent request (sectors).
+ * @param num_sectors Number of sectors of the child.
+ *
+ * @returns `false` if the child could not be enqueued.
+ */
+static bool prv_blkmap_submit_child(blkmap_slot_t *slot, blkdev_dev_t *leg,
+                                    uint64_t leg_sector, uint64_t offset,
+                                    uint64_t num_sectors) {
+    const blkdev_req_t *const req = slot->req;
+
+    // Blocks while all requests of the leg are in use, until one completes.
+    blkdev_req_t *const child = blkdev_alloc_req(leg);
+
+    // Flushes and discards have no data.
+    child->num_segs = 0;
+    if (req->op == BLKDEV_OP_READ || req->op == BLKDEV_OP_WRITE) {
+        child->num_segs = prv_blkmap_slice(req, BLKMAP_SECTOR_SIZE * offset,
+                                           BLKMAP_SECTOR_SIZE * num_sectors,
+                                           child->seg_storage);
+        if (child->num_segs == 0) {
+            LOG_ERROR("blkmap: too many segments in a child request");
+            blkdev_free_req(child);
+            return false;
+        }
+    }
+    child->segs = child->seg_storage;
+
+    child->state = BLKDEV_REQ_INACTIVE;
+    child->op = req->op;
+    child->flags = req->flags;
+    child->start_sector = leg_sector;
+    child->read_buf = NULL;
+    child->write_buf = NULL;
+    child->read_sectors = req->op == BLKDEV_OP_READ ? num_sectors : 0;
+    child->write_sectors = req->op == BLKDEV_OP_READ ? 0 : num_sectors;
+    child->f_done = prv_blkmap_child_done;
+    child->done_arg = slot;
+    semaphore_init(&child->sem_done);
+    kmemset(&child->trace, 0, sizeof(child->trace));
+
+    atomic_fetch_add(&slot->pending, 1);
+    if (!blkdev_enqueue_req(child)) {
+        LOG_ERROR("blkmap: failed to enqueue a child request");
+        atomic_fetch_sub(&slot->pending, 1);
+        blkdev_free_req(child);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Reserves a free slot of @a map_ctx.
+ * @returns The slot, `NULL` if all slots are in use.
+ */
+static blkmap_slot_t *prv_blkmap_alloc_slot(blkmap_ctx_t *map_ctx) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&map_ctx->lock);
+
+    blkmap_slot_t *slot = NULL;
+    const uint64_t all_slots = (1ull << BLKMAP_MAX_REQS) - 1;
+    const uint64_t free_slots = ~map_ctx->busy_slots & all_slots;
+    if (free_slots) {
+        const size_t slot_idx = __builtin_ctzll(free_slots);
+        map_ctx->busy_slots |= 1ull << slot_idx;
+        slot = &map_ctx->slots[slot_idx];
+    }
+
+    spinlock_release(&map_ctx->lock);
+    if (restore_int) { arch_enable_ints(); }
+    return slot;
+}
+
+/**
+ * Drops a reference to @a slot. The last one frees the slot and completes its
+ * request. It is safe to call it in an IRQ handler.
+ */
+static void prv_blkmap_put_slot(blkmap_slot_t *slot) {
+    if (atomic_fetch_sub(&slot->pending, 1) != 1) { return; }
+
+    blkmap_ctx_t *const map_ctx = slot->map_ctx;
+    blkdev_req_t *const req = slot->req;
+    const bool failed = slot->failed;
+    slot->req = NULL;
+
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&map_ctx->lock);
+    map_ctx->busy_slots &= ~(1ull << (slot - map_ctx->slots));
+    spinlock_release(&map_ctx->lock);
+    if (restore_int) { arch_enable_ints(); }
+
+    blkdev_complete_req(req, failed ? BLKDEV_REQ_ERROR : BLKDEV_REQ_SUCCESS);
+}
+
+/// Completion callback of child requests, see #blkdev_req.f_done.
+static void prv_blkmap_child_done(blkdev_req_t *child, void *arg) {
+    blkmap_slot_t *const slot = arg;
+    if (child->state != BLKDEV_REQ_SUCCESS) { slot->failed = true; }
+    blkdev_free_req(child);
+    prv_blkmap_put_slot(slot);
+}
@@ -0,0 +1,138 @@
+/**
+ * @file blkmap.h
+ * Mapped block device driver: linear concatenation and striping.
+ *
+ * A mapped device is built over several block devices, its legs, e.g., disks,
+ * NVMe namespaces, partitions or RAM disks. Its sectors are mapped to the legs
+ * in one of two ways:
+ * - #BLKMAP_LINEAR concatenates the legs one after another.
+ * - #BLKMAP_STRIPED (RAID-0) interleaves chunks of #blkmap_ctx_t.chunk_sectors
+ *   sectors among the legs, so that a sequential transfer keeps all legs busy.
+ *   Each leg contributes as many whole chunks as the smallest leg has.
+ *
+ * Like a partition, a mapped device forwards its requests to the queues of the
+ * legs. A request is split at the leg and chunk boundaries into child requests
+ * taken from the pools of the legs. The request completes when all its
+ * children have, and fails if any of them does. Children that are adjacent on
+ * a leg are merged again by the worker of the leg.
+ *
+ * Mapped devices are created at run time with `devmgr --linear` and
+ * `devmgr --striped`, see #devmgr_add_blkmap().
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blkdev/blkdev.h"
+#include "kspinlock.h"
+
+/// Maximum number of legs of a mapped device.
+#define BLKMAP_MAX_LEGS 8
+
+/**
+ * Maximum number of requests in flight per mapped device, less than 64, see
+ * #blkmap_ctx_t.busy_slots.
+ */
+#define BLKMAP_MAX_REQS 32
+
+typedef enum {
+    BLKMAP_LINEAR,  ///< Legs are concatenated.
+    BLKMAP_STRIPED, ///< Chunks are interleaved among the legs.
+} blkmap_type_t;
+
+typedef struct blkmap_ctx blkmap_ctx_t;
+
+/// Request in flight, see #blkmap_if_submit_req().
+typedef struct {
+    blkmap_ctx_t *map_ctx;
+    /// Request being served, `NULL` if the slot is free.
+    blkdev_req_t *req;
+    /**
+     * Number of child requests in flight, plus one while the children are
+     * being submitted.
+     */
+    _Atomic uint32_t pending;
+    /// A child request has failed.
+    _Atomic bool failed;
+} blkmap_slot_t;
+
+struct blkmap_ctx {
+    blkmap_type_t type;
+
+    blkdev_dev_t *legs[BLKMAP_MAX_LEGS];
+    /// Number of sectors of each leg that are used by the mapped device.
+    uint64_t leg_sectors[BLKMAP_MAX_LEGS];
+    size_t num_legs;
+    /// Chunk size of #BLKMAP_STRIPED (sectors).
+    uint32_t chunk_sectors;
+    uint64_t num_sectors;
+
+    /// Protects #blkmap_ctx.busy_slots, taken with interrupts disabled.
+    spinlock_t lock;
+    /// Bit `i` is set if slot `i` is in use.
+    uint64_t busy_slots;
+    blkmap_slot_t slots[BLKMAP_MAX_REQS];
+};
+
+/**
+ * Creates a mapped device that concatenates @a legs in the given order.
+ *
+ * @param legs     Devices to concatenate, they must have worker tasks.
+ * @param num_legs Number of items in @a legs, at most #BLKMAP_MAX_LEGS.
+ *
+ * @returns `NULL` if the number of legs is out of range.
+ */
+blkmap_ctx_t *blkmap_new_linear(blkdev_dev_t *const *legs, size_t num_legs);
+
+/**
+ * Creates a mapped device that stripes chunks of @a chunk_sectors sectors
+ * among @a legs.
+ *
+ * @param legs          Devices to stripe, they must have worker tasks.
+ * @param num_legs      Number of items in @a legs, at most #BLKMAP_MAX_LEGS.
+ * @param chunk_sectors Chunk size (sectors), non-zero.
+ *
+ * @returns `NULL` if the number of legs or the chunk size is out of range,
+ * or if a leg is smaller than one chunk.
+ */
+blkmap_ctx_t *blkmap_new_striped(blkdev_dev_t *const *legs, size_t num_legs,
+                                 uint32_t chunk_sectors);
+
+/**
+ * Fills the fields of the blkdev interface struct.
+ * See #blkdev_if_t.
+ */
+void blkmap_fill_blkdev_if(blkdev_if_t *blkdev_if);
+
+/**
+ * Returns #BLKMAP_MAX_REQS, the number of request slots.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t blkmap_if_get_queue_depth(void *v_map_ctx);
+
+/**
+ * Returns the number of sectors of the mapped device.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint64_t blkmap_if_get_num_sectors(void *v_map_ctx);
+
+/**
+ * Returns the capabilities of the mapped device: #BLKDEV_CAP_FLUSH if any leg
+ * has it, and #BLKDEV_CAP_DISCARD if all legs have it.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint32_t blkmap_if_get_caps(void *v_map_ctx);
+
+/**
+ * Splits the request into child requests and enqueues them to the legs.
+ *
+ * Requests are not merged by the worker of the mapped device, see
+ * #blkdev_if_t.f_can_merge, so @a req is a single request. A flush is sent to
+ * every leg, a discard is split like a write.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+void blkmap_if_submit_req(blkdev_req_t *req);
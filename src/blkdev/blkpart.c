@@ -1,5 +1,6 @@
 #include "blkdev/blkpart.h"
 #include "heap.h"
+#include "log.h"
 #include "memfun.h"
 #include "panic.h"
 
@@ -21,19 +22,46 @@ blkpart_ctx_t *blkpart_init(blkdev_dev_t *parent_dev, gpt_part_t *part) {
 }
 
 void blkpart_fill_blkdev_if(blkdev_if_t *blkdev_if) {
-    blkdev_if->f_is_busy = blkpart_if_is_busy;
+    blkdev_if->f_get_queue_depth = blkpart_if_get_queue_depth;
+    blkdev_if->f_get_num_sectors = blkpart_if_get_num_sectors;
+    // Requests are merged by the worker of the parent device.
+    blkdev_if->f_can_merge = NULL;
+    blkdev_if->f_resolve = blkpart_if_resolve;
     blkdev_if->f_submit_req = blkpart_if_submit_req;
+    blkdev_if->f_commit = NULL;
+    blkdev_if->f_poll = NULL;
+    blkdev_if->f_get_dma_mask = NULL;
+    blkdev_if->f_get_caps = blkpart_if_get_caps;
 }
 
-bool blkpart_if_is_busy(void *v_blkpart_ctx) {
+size_t blkpart_if_get_queue_depth(void *v_blkpart_ctx) {
+    (void)v_blkpart_ctx;
+    return 0;
+}
+
+uint64_t blkpart_if_get_num_sectors(void *v_blkpart_ctx) {
+    blkpart_ctx_t *const blkpart_ctx = v_blkpart_ctx;
+    return blkpart_ctx->num_sectors;
+}
+
+uint32_t blkpart_if_get_caps(void *v_blkpart_ctx) {
     blkpart_ctx_t *const blkpart_ctx = v_blkpart_ctx;
-    return blkpart_ctx->parent_dev->driver_intf.f_is_busy(
-        blkpart_ctx->parent_dev->driver_ctx);
+    return blkdev_get_caps(blkpart_ctx->parent_dev);
+}
+
+blkdev_dev_t *blkpart_if_resolve(void *v_blkpart_ctx, uint64_t *inout_sector) {
+    blkpart_ctx_t *const blkpart_ctx = v_blkpart_ctx;
+    *inout_sector += blkpart_ctx->start_sector;
+    return blkpart_ctx->parent_dev;
 }
 
 void blkpart_if_submit_req(blkdev_req_t *req) {
     blkpart_ctx_t *const blkpart_ctx = req->dev->driver_ctx;
     req->start_sector += blkpart_ctx->start_sector;
     req->dev = blkpart_ctx->parent_dev;
-    blkpart_ctx->parent_dev->driver_intf.f_submit_req(req);
+
+    if (!blkdev_enqueue_req(req)) {
+        LOG_ERROR("failed to forward a request to the parent device");
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+    }
 }
@@ -33,18 +33,42 @@ blkpart_ctx_t *blkpart_init(blkdev_dev_t *parent_dev, gpt_part_t *part);
 void blkpart_fill_blkdev_if(blkdev_if_t *blkdev_if);
 
 /**
- * Returns `true` if the parent block device of a partition is busy.
+ * Always returns zero, i.e., no limit.
  *
  * Partitions of the same block device are represented as separate devices at
- * the kernel level. A partition can be considered busy if it itself has no
- * ongoing read or write operations, but one of its sibling partitions has.
+ * the kernel level, but their requests are forwarded to the request queue of
+ * the parent device (see #blkpart_if_submit_req()). It is the parent's worker
+ * that waits for the parent device to have room for a request, so a partition
+ * itself does not limit the number of requests.
  *
  * This is a part of the @ref blkdev_if_t "blkdev interface".
  */
-bool blkpart_if_is_busy(void *v_blkpart_ctx);
+size_t blkpart_if_get_queue_depth(void *v_blkpart_ctx);
 
 /**
- * Passes a request to the underlying block device.
+ * Returns the number of sectors of the partition.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint64_t blkpart_if_get_num_sectors(void *v_blkpart_ctx);
+
+/**
+ * Returns the capabilities of the parent device.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint32_t blkpart_if_get_caps(void *v_blkpart_ctx);
+
+/**
+ * Returns the parent device and translates @a *inout_sector to its sector.
+ *
+ * This way, e.g., the buffer cache shares the cached sectors between a disk and
+ * its partitions, see bcache.h.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+blkdev_dev_t *blkpart_if_resolve(void *v_blkpart_ctx, uint64_t *inout_sector);
+
+/**
+ * Passes a request to the request queue of the underlying block device.
  * This is a part of the @ref blkdev_if_t "blkdev interface".
  */
 void blkpart_if_submit_req(blkdev_req_t *req);
@@ -0,0 +1,228 @@
+/**
+ * @file blktrace.c
+ * Block request lifecycle tracing implementation.
+ */
+
+#include <stdatomic.h>
+
+#include "arch.h"
+#include "arch_timer.h"
+#include "assert.h"
+#include "blkdev/blktrace.h"
+#include "chardev.h"
+#include "cpu.h"
+#include "fs/devfs.h"
+#include "heap.h"
+#include "kmutex.h"
+#include "kprintf.h"
+#include "log.h"
+#include "memfun.h"
+#include "smp.h"
+#include "taskmgr.h"
+
+/// Trace ring of one processor.
+typedef struct {
+    /**
+     * Number of records ever added. Only the owning processor writes it, with
+     * its interrupts disabled.
+     */
+    _Atomic uint32_t head;
+    /// Number of records ever consumed, protected by #g_blktrace.read_lock.
+    uint32_t tail;
+    blktrace_rec_t recs[BLKTRACE_RING_LEN];
+} blktrace_ring_t;
+
+static struct {
+    bool ready;
+    uint8_t num_rings;
+    blktrace_ring_t *rings;
+
+    /// Serializes readers, the writers never take it.
+    task_mutex_t read_lock;
+    /// Ring to continue reading from, so that no ring starves the others.
+    uint8_t read_ring;
+    uint64_t num_dropped;
+
+    chardev_t chardev;
+} g_blktrace;
+
+static kerr_t prv_blktrace_chardev_read(void *ctx, void *buf, size_t buf_size,
+                                        size_t *out_read);
+static bool prv_blktrace_pop(blktrace_ring_t *ring, blktrace_rec_t *out_rec);
+static size_t prv_blktrace_format(const blktrace_rec_t *rec, uint8_t proc_num,
+                                  char *buf, size_t size);
+static uint64_t prv_blktrace_delta(uint64_t from_us, uint64_t to_us);
+static char prv_blktrace_op_char(uint8_t op);
+
+static const chardev_ops_t g_blktrace_chardev_ops = {
+    .f_read = prv_blktrace_chardev_read,
+};
+
+void blktrace_init(void) {
+    ASSERT(!g_blktrace.ready);
+
+    g_blktrace.num_rings = smp_get_num_procs();
+    if (g_blktrace.num_rings == 0) { g_blktrace.num_rings = 1; }
+    const size_t rings_size = g_blktrace.num_rings * sizeof(blktrace_ring_t);
+    g_blktrace.rings = heap_alloc(rings_size);
+    kmemset(g_blktrace.rings, 0, rings_size);
+    mutex_init(&g_blktrace.read_lock);
+
+    g_blktrace.chardev.type = CHARDEV_BLKTRACE;
+    g_blktrace.chardev.ctx = &g_blktrace;
+    g_blktrace.chardev.ops = &g_blktrace_chardev_ops;
+
+    g_blktrace.ready = true;
+
+    const kerr_t err =
+        devfs_add_chardev(devfs_global_ctx(), "blktrace", &g_blktrace.chardev);
+    if (err != KERR_NONE) {
+        LOG_ERROR("failed to create the blktrace devfs node, error %d (%s)",
+                  err, kerr_str(err));
+    }
+}
+
+uint64_t blktrace_now_us(void) {
+    if (!g_blktrace.ready) { return 0; }
+    return arch_timer_current_us();
+}
+
+void blktrace_add(const blkdev_req_t *req, blktrace_kind_t kind) {
+    if (!g_blktrace.ready) { return; }
+
+    // The running processor must not change, and an IRQ handler must not add
+    // a record in the middle of this one.
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+
+    const smp_proc_t *const proc = smp_get_running_proc();
+    const uint8_t proc_num = proc ? proc->proc_num : 0;
+    if (proc_num < g_blktrace.num_rings) {
+        blktrace_ring_t *const ring = &g_blktrace.rings[proc_num];
+        const uint32_t head =
+            atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        blktrace_rec_t *const rec = &ring->recs[head % BLKTRACE_RING_LEN];
+        rec->dev = req->dev;
+        rec->start_sector = req->start_sector;
+        rec->num_sectors = blkdev_req_sectors(req);
+        rec->kind = kind;
+        rec->op = req->op;
+        rec->state = req->state;
+        rec->trace = req->trace;
+
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+
+    if (restore_int) { arch_enable_ints(); }
+}
+
+size_t blktrace_read(char *buf, size_t size) {
+    if (!g_blktrace.ready) { return 0; }
+
+    mutex_acquire(&g_blktrace.read_lock);
+
+    size_t len = 0;
+    size_t num_empty = 0;
+    while (size - len >= BLKTRACE_LINE_LEN &&
+           num_empty < g_blktrace.num_rings) {
+        const uint8_t proc_num = g_blktrace.read_ring;
+        blktrace_rec_t rec;
+        if (prv_blktrace_pop(&g_blktrace.rings[proc_num], &rec)) {
+            len += prv_blktrace_format(&rec, proc_num, &buf[len], size - len);
+            num_empty = 0;
+        } else {
+            num_empty++;
+        }
+        g_blktrace.read_ring = (proc_num + 1) % g_blktrace.num_rings;
+    }
+
+    mutex_release(&g_blktrace.read_lock);
+    return len;
+}
+
+uint64_t blktrace_num_dropped(void) {
+    return g_blktrace.num_dropped;
+}
+
+static kerr_t prv_blktrace_chardev_read(void *ctx, void *buf, size_t buf_size,
+                                        size_t *out_read) {
+    (void)ctx;
+    const size_t len = blktrace_read(buf, buf_size);
+    if (out_read) { *out_read = len; }
+    return KERR_NONE;
+}
+
+/**
+ * Takes the oldest unread record of @a ring, #g_blktrace.read_lock must be
+ * held.
+ *
+ * The owning processor may overwrite the record while it is being copied. In
+ * that case, the copy is discarded and counted as dropped.
+ *
+ * @returns `false` if the ring has no unread records.
+ */
+static bool prv_blktrace_pop(blktrace_ring_t *ring, blktrace_rec_t *out_rec) {
+    for (;;) {
+        const uint32_t head =
+            atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == ring->tail) { return false; }
+        if (head - ring->tail > BLKTRACE_RING_LEN) {
+            g_blktrace.num_dropped += head - ring->tail - BLKTRACE_RING_LEN;
+            ring->tail = head - BLKTRACE_RING_LEN;
+        }
+
+        kmemcpy(out_rec, &ring->recs[ring->tail % BLKTRACE_RING_LEN],
+                sizeof(*out_rec));
+        atomic_thread_fence(memory_order_acquire);
+
+        // The writer overwrites the record once it adds the record
+        // #BLKTRACE_RING_LEN positions ahead of it.
+        const uint32_t new_head =
+            atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (new_head - ring->tail < BLKTRACE_RING_LEN) {
+            ring->tail++;
+            return true;
+        }
+        g_blktrace.num_dropped++;
+        ring->tail++;
+    }
+}
+
+/// Formats @a rec as a text line, see blktrace.h.
+static size_t prv_blktrace_format(const blktrace_rec_t *rec, uint8_t proc_num,
+                                  char *buf, size_t size) {
+    const blkdev_trace_t *const trace = &rec->trace;
+    const char *const dev_name =
+        rec->dev && rec->dev->worker_task ? rec->dev->worker_task->name : "?";
+
+    const int len = ksnprintf(
+        buf, size, "%u %c %c %llu+%lu %s %llu %llu %llu %llu %s\n", proc_num,
+        rec->kind == BLKTRACE_COMPLETE ? 'C' : 'W',
+        prv_blktrace_op_char(rec->op), rec->start_sector,
+        (unsigned long)rec->num_sectors, dev_name,
+        prv_blktrace_delta(trace->enqueue_us, trace->dispatch_us),
+        prv_blktrace_delta(trace->dispatch_us, trace->issue_us),
+        prv_blktrace_delta(trace->issue_us, trace->complete_us),
+        prv_blktrace_delta(trace->complete_us, trace->wake_us),
+        rec->state == BLKDEV_REQ_SUCCESS ? "ok" : "err");
+    if (len < 0) { return 0; }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+/// Returns the time between two stages, 0 if either has not been recorded.
+static uint64_t prv_blktrace_delta(uint64_t from_us, uint64_t to_us) {
+    if (from_us == 0 || to_us < from_us) { return 0; }
+    return to_us - from_us;
+}
+
+/// Returns the letter of operation @a op, see blktrace.h.
+static char prv_blktrace_op_char(uint8_t op) {
+    switch (op) {
+    case BLKDEV_OP_READ:    return 'R';
+    case BLKDEV_OP_WRITE:   return 'W';
+    case BLKDEV_OP_FLUSH:   return 'F';
+    case BLKDEV_OP_DISCARD: return 'D';
+    default:                return '?';
+    }
+}
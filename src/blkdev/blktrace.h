@@ -0,0 +1,84 @@
+/**
+ * @file blktrace.h
+ * Block request lifecycle tracing.
+ *
+ * Every request records when it passes a stage of its lifecycle, see
+ * #blkdev_trace_t. When a request completes, a #BLKTRACE_COMPLETE record with
+ * its timestamps is added to the trace ring of the processor that completed
+ * it. A task woken up by #blkdev_wait_req() adds a #BLKTRACE_WAKE record, so
+ * that the semaphore wakeup latency is visible, too.
+ *
+ * Each processor has its own ring, so adding a record only has to disable the
+ * interrupts of the local processor. The rings are overwritten when they are
+ * full, records that have been overwritten before being read are counted as
+ * dropped.
+ *
+ * The trace is read as text lines from the `blktrace` devfs node, or with
+ * `devmgr --blktrace`. Each line describes one record:
+ *
+ *     cpu kind op sector+count device queue_us driver_us device_us wake_us res
+ *
+ * where op is `R`, `W`, `F` or `D` for a read, a write, a flush or a discard,
+ * and the durations are between consecutive stages: enqueue to dispatch,
+ * dispatch to issue, issue to completion, and completion to wakeup.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blkdev/blkdev.h"
+
+/// Number of records in the ring of a processor, a power of two.
+#define BLKTRACE_RING_LEN 256
+
+/// Maximum length of a formatted record, including the newline.
+#define BLKTRACE_LINE_LEN 128
+
+typedef enum {
+    BLKTRACE_COMPLETE, ///< The request has completed.
+    BLKTRACE_WAKE,     ///< The task waiting for the request has woken up.
+} blktrace_kind_t;
+
+/// Trace record.
+typedef struct {
+    const blkdev_dev_t *dev;
+    uint64_t start_sector;
+    uint32_t num_sectors;
+    uint8_t kind;  ///< #blktrace_kind_t.
+    uint8_t op;    ///< #blkdev_op_t.
+    uint8_t state; ///< #blkdev_req_state_t.
+    blkdev_trace_t trace;
+} blktrace_rec_t;
+
+/**
+ * Allocates the trace rings of all processors and creates the `blktrace`
+ * devfs node.
+ *
+ * Until it is called, nothing is recorded.
+ */
+void blktrace_init(void);
+
+/// Returns the current time for #blkdev_trace_t, 0 if tracing is not ready.
+uint64_t blktrace_now_us(void);
+
+/**
+ * Adds a record of kind @a kind for the request @a req to the ring of the
+ * running processor. It is safe to call it in an IRQ handler.
+ */
+void blktrace_add(const blkdev_req_t *req, blktrace_kind_t kind);
+
+/**
+ * Formats the oldest unread records as text lines into @a buf.
+ *
+ * Only whole lines are written, and the output is not NUL-terminated. The
+ * records are consumed.
+ *
+ * @returns The number of bytes written, 0 if there are no unread records or
+ * @a size is less than #BLKTRACE_LINE_LEN.
+ */
+size_t blktrace_read(char *buf, size_t size);
+
+/// Returns the number of records overwritten before they have been read.
+uint64_t blktrace_num_dropped(void);
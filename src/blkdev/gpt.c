@@ -6,6 +6,7 @@
  * Release 2.11.
  */
 
+#include "blkdev/bcache.h"
 #include "blkdev/blkdev.h"
 #include "blkdev/gpt.h"
 #include "heap.h"
@@ -71,7 +72,7 @@ static void prv_gpt_snprint_guid(char *buf, size_t size,
 
 bool gpt_probe_signature(blkdev_dev_t *dev) {
     uint8_t *const sector1 = heap_alloc(512);
-    if (!blkdev_sync_read(dev, 1, 1, sector1)) {
+    if (!bcache_read(dev, 1, 1, sector1)) {
         LOG_ERROR("failed to read sector 1");
         heap_free(sector1);
         return false;
@@ -91,7 +92,7 @@ bool gpt_probe_signature(blkdev_dev_t *dev) {
 
 bool gpt_parse(blkdev_dev_t *dev, gpt_disk_t **out_gpt_disk) {
     uint8_t *const sector1 = heap_alloc(512);
-    if (!blkdev_sync_read(dev, 1, 1, sector1)) {
+    if (!bcache_read(dev, 1, 1, sector1)) {
         LOG_ERROR("failed to read sector 1");
         heap_free(sector1);
         return false;
@@ -125,7 +126,7 @@ bool gpt_parse(blkdev_dev_t *dev, gpt_disk_t **out_gpt_disk) {
     const size_t gpes_sectors =
         ((gpt_hdr->gpe_size * gpt_hdr->gpes_num) + 511) / 512;
     uint8_t *const gpes_buf = heap_alloc(512 * gpes_sectors);
-    if (!blkdev_sync_read(dev, gpt_hdr->gpes_lba, gpes_sectors, gpes_buf)) {
+    if (!bcache_read(dev, gpt_hdr->gpes_lba, gpes_sectors, gpes_buf)) {
         LOG_ERROR(
             "failed to read GUID Partition Entry Array (sectors %llu..%llu)",
             gpt_hdr->gpes_lba, gpt_hdr->gpes_lba + gpes_sectors);
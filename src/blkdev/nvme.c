@@ -0,0 +1,793 @@
+/**
+ * @file nvme.c
+ * NVMe controller driver implementation.
+ */
+
+#include <stdatomic.h>
+
+#include "arch.h"
+#include "arch_timer.h"
+#include "blkdev/blktrace.h"
+#include "blkdev/nvme.h"
+#include "cpu.h"
+#include "heap.h"
+#include "kprintf.h"
+#include "log.h"
+#include "memfun.h"
+#include "smp.h"
+
+static_assert(NVME_IO_QUEUE_SIZE < 64, "slots must fit busy_slots");
+static_assert(NVME_MAX_PRPS * sizeof(uint64_t) <= NVME_PAGE_SIZE,
+              "a PRP list must not cross a page");
+
+/// Size of the Identify data structures (bytes).
+#define NVME_IDENTIFY_SIZE 4096
+
+static bool prv_nvme_map_regs(nvme_ctrl_ctx_t *ctrl_ctx);
+static bool prv_nvme_wait_ready(nvme_ctrl_ctx_t *ctrl_ctx, bool ready);
+static bool prv_nvme_enable(nvme_ctrl_ctx_t *ctrl_ctx);
+static bool prv_nvme_identify(nvme_ctrl_ctx_t *ctrl_ctx);
+static size_t prv_nvme_num_io_queues(nvme_ctrl_ctx_t *ctrl_ctx);
+static bool prv_nvme_setup_io_queue(nvme_ctrl_ctx_t *ctrl_ctx,
+                                    size_t queue_idx);
+
+static void prv_nvme_init_queue(nvme_ctrl_ctx_t *ctrl_ctx, nvme_queue_t *queue,
+                                uint16_t qid, uint16_t size);
+static nvme_sqe_t *prv_nvme_next_sqe(nvme_queue_t *queue);
+static void prv_nvme_submit_flush(nvme_ctrl_ctx_t *ctrl_ctx,
+                                  blkdev_req_t *req);
+static bool prv_nvme_admin_cmd(nvme_ctrl_ctx_t *ctrl_ctx, nvme_sqe_t *cmd,
+                               uint32_t *out_dw0);
+
+static const blkdev_seg_t *prv_nvme_req_segs(const blkdev_req_t *req,
+                                             blkdev_seg_t *buf_seg,
+                                             size_t *out_num_segs);
+static size_t prv_nvme_req_prps(const blkdev_req_t *req,
+                                const blkdev_req_t *next, uint64_t *out_prps);
+static bool prv_nvme_add_prps(const blkdev_req_t *req, uint64_t *out_prps,
+                              size_t *inout_num_prps, bool *inout_ends_at_page);
+
+static bool prv_nvme_queue_lock(nvme_queue_t *queue);
+static void prv_nvme_queue_unlock(nvme_queue_t *queue, bool restore_int);
+static nvme_queue_t *prv_nvme_pick_queue(nvme_ctrl_ctx_t *ctrl_ctx,
+                                         size_t *out_slot,
+                                         bool *out_restore_int);
+
+static size_t prv_nvme_reap(nvme_queue_t *queue);
+static void prv_nvme_msix_handler(void *ctx);
+
+nvme_ctrl_ctx_t *nvme_ctrl_new(const pci_dev_t *pci_dev) {
+    nvme_ctrl_ctx_t *const ctrl_ctx =
+        heap_alloc_aligned(sizeof(*ctrl_ctx), alignof(nvme_ctrl_ctx_t));
+    kmemset(ctrl_ctx, 0, sizeof(*ctrl_ctx));
+    ctrl_ctx->pci_dev = pci_dev;
+    ksnprintf(ctrl_ctx->name, sizeof(ctrl_ctx->name), "nvme %u-%u-%u",
+              pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num);
+
+    if (!prv_nvme_map_regs(ctrl_ctx)) { goto fail; }
+    pci_enable_bus_master(pci_dev);
+
+    // Refer to section 7.6.1 Initialization.
+    ctrl_ctx->regs->cc &= ~NVME_CC_EN;
+    if (!prv_nvme_wait_ready(ctrl_ctx, false)) {
+        LOG_ERROR("%s: controller does not stop", ctrl_ctx->name);
+        goto fail;
+    }
+    if (!prv_nvme_enable(ctrl_ctx)) { goto fail; }
+    if (!prv_nvme_identify(ctrl_ctx)) { goto fail; }
+
+    if (!pci_enable_msix(pci_dev)) {
+        LOG_ERROR("%s: MSI-X is not available", ctrl_ctx->name);
+        goto fail;
+    }
+
+    const size_t num_io_queues = prv_nvme_num_io_queues(ctrl_ctx);
+    for (size_t queue_idx = 0; queue_idx < num_io_queues; queue_idx++) {
+        if (!prv_nvme_setup_io_queue(ctrl_ctx, queue_idx)) { break; }
+        ctrl_ctx->num_io_queues++;
+    }
+    if (ctrl_ctx->num_io_queues == 0) {
+        LOG_ERROR("%s: no usable I/O queue", ctrl_ctx->name);
+        goto fail;
+    }
+
+    LOG_INFO("%s: %llu sectors, %zu I/O queue(s), write cache %s",
+             ctrl_ctx->name, ctrl_ctx->num_sectors, ctrl_ctx->num_io_queues,
+             ctrl_ctx->write_cache ? "on" : "off");
+    return ctrl_ctx;
+
+fail:
+    // The context is not freed, the controller may still hold the queue
+    // addresses.
+    if (ctrl_ctx->regs) { ctrl_ctx->regs->cc &= ~NVME_CC_EN; }
+    return NULL;
+}
+
+void nvme_fill_blkdev_if(blkdev_if_t *blkdev_if) {
+    blkdev_if->f_get_queue_depth = nvme_if_get_queue_depth;
+    blkdev_if->f_get_num_sectors = nvme_if_get_num_sectors;
+    blkdev_if->f_can_merge = nvme_if_can_merge;
+    blkdev_if->f_resolve = NULL;
+    blkdev_if->f_submit_req = nvme_if_submit_req;
+    blkdev_if->f_commit = nvme_if_commit;
+    blkdev_if->f_poll = nvme_if_poll;
+    // PRPs are 64-bit.
+    blkdev_if->f_get_dma_mask = NULL;
+    blkdev_if->f_get_caps = nvme_if_get_caps;
+}
+
+uint32_t nvme_if_get_caps(void *v_ctrl_ctx) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = v_ctrl_ctx;
+    // Dataset Management commands are not issued.
+    return ctrl_ctx->write_cache ? BLKDEV_CAP_FLUSH : 0;
+}
+
+size_t nvme_if_get_queue_depth(void *v_ctrl_ctx) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = v_ctrl_ctx;
+
+    size_t queue_depth = 0;
+    for (size_t idx = 0; idx < ctrl_ctx->num_io_queues; idx++) {
+        queue_depth += ctrl_ctx->io_queues[idx].size - 1;
+    }
+    return queue_depth;
+}
+
+uint64_t nvme_if_get_num_sectors(void *v_ctrl_ctx) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = v_ctrl_ctx;
+    return ctrl_ctx->num_sectors;
+}
+
+bool nvme_if_can_merge(void *v_ctrl_ctx, const blkdev_req_t *req,
+                       const blkdev_req_t *next) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = v_ctrl_ctx;
+
+    size_t num_sectors = blkdev_req_sectors(next);
+    for (const blkdev_req_t *it = req; it; it = it->merged_next) {
+        num_sectors += blkdev_req_sectors(it);
+    }
+    if (num_sectors > ctrl_ctx->max_sectors) { return false; }
+
+    return prv_nvme_req_prps(req, next, NULL) > 0;
+}
+
+void nvme_if_submit_req(blkdev_req_t *req) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = req->dev->driver_ctx;
+
+    if (req->op == BLKDEV_OP_FLUSH) {
+        prv_nvme_submit_flush(ctrl_ctx, req);
+        return;
+    }
+
+    size_t num_sectors = 0;
+    for (const blkdev_req_t *it = req; it; it = it->merged_next) {
+        num_sectors += blkdev_req_sectors(it);
+    }
+    if (num_sectors == 0 || num_sectors > ctrl_ctx->max_sectors) {
+        LOG_ERROR("%s: invalid request size of %zu sectors", ctrl_ctx->name,
+                  num_sectors);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+    if (req->start_sector >= ctrl_ctx->num_sectors ||
+        num_sectors > ctrl_ctx->num_sectors - req->start_sector) {
+        LOG_ERROR("%s: request past the namespace end, sectors %llu+%zu",
+                  ctrl_ctx->name, req->start_sector, num_sectors);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+
+    size_t slot_idx;
+    bool restore_int;
+    nvme_queue_t *const queue =
+        prv_nvme_pick_queue(ctrl_ctx, &slot_idx, &restore_int);
+    if (!queue) {
+        // The worker task takes a credit per slot, so this is a driver bug.
+        LOG_ERROR("%s: no free command slot", ctrl_ctx->name);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+
+    uint64_t *const prps = &queue->prp_lists[slot_idx * NVME_MAX_PRPS];
+    const size_t num_prps = prv_nvme_req_prps(req, NULL, prps);
+    if (num_prps == 0) {
+        prv_nvme_queue_unlock(queue, restore_int);
+        LOG_ERROR("%s: request cannot be described with PRPs", ctrl_ctx->name);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+
+    nvme_sqe_t *const sqe = prv_nvme_next_sqe(queue);
+    sqe->opc = req->op == BLKDEV_OP_READ ? NVME_CMD_READ : NVME_CMD_WRITE;
+    sqe->cid = slot_idx;
+    sqe->nsid = ctrl_ctx->nsid;
+    sqe->prp1 = prps[0];
+    if (num_prps == 2) {
+        sqe->prp2 = prps[1];
+    } else if (num_prps > 2) {
+        // The list continues after the first entry, which is in PRP1.
+        sqe->prp2 = (uintptr_t)&prps[1];
+    }
+    sqe->cdw10 = (uint32_t)req->start_sector;
+    sqe->cdw11 = (uint32_t)(req->start_sector >> 32);
+    sqe->cdw12 = num_sectors - 1;
+    if (req->flags & BLKDEV_REQ_FLAG_FUA && ctrl_ctx->write_cache) {
+        sqe->cdw12 |= NVME_RW_FUA;
+    }
+
+    const uint64_t now_us = blktrace_now_us();
+    for (blkdev_req_t *it = req; it; it = it->merged_next) {
+        it->trace.issue_us = now_us;
+    }
+
+    queue->reqs[slot_idx] = req;
+    queue->busy_slots |= 1ull << slot_idx;
+
+    prv_nvme_queue_unlock(queue, restore_int);
+}
+
+void nvme_if_commit(void *v_ctrl_ctx) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = v_ctrl_ctx;
+
+    for (size_t idx = 0; idx < ctrl_ctx->num_io_queues; idx++) {
+        nvme_queue_t *const queue = &ctrl_ctx->io_queues[idx];
+        const bool restore_int = prv_nvme_queue_lock(queue);
+        if (queue->sq_tail != queue->sq_tail_rung) {
+            // The entries must be visible before the doorbell is written.
+            atomic_thread_fence(memory_order_release);
+            *queue->sq_doorbell = queue->sq_tail;
+            queue->sq_tail_rung = queue->sq_tail;
+        }
+        prv_nvme_queue_unlock(queue, restore_int);
+    }
+}
+
+size_t nvme_if_poll(void *v_ctrl_ctx) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = v_ctrl_ctx;
+
+    // A request may have been submitted to any queue pair if its own one was
+    // full, so all of them are checked. The Phase Tag is checked first to not
+    // contend for the lock of an idle pair.
+    size_t num_done = 0;
+    for (size_t idx = 0; idx < ctrl_ctx->num_io_queues; idx++) {
+        nvme_queue_t *const queue = &ctrl_ctx->io_queues[idx];
+        const volatile nvme_cqe_t *const cqe = &queue->cq[queue->cq_head];
+        if ((cqe->status & NVME_CQE_PHASE) != queue->cq_phase) { continue; }
+        num_done += prv_nvme_reap(queue);
+    }
+    return num_done;
+}
+
+/**
+ * Maps the controller registers and the doorbells of the admin queues and
+ * #NVME_MAX_IO_QUEUES I/O queue pairs.
+ */
+static bool prv_nvme_map_regs(nvme_ctrl_ctx_t *ctrl_ctx) {
+    uintptr_t addr;
+    if (!pci_map_bar(ctrl_ctx->pci_dev, 0, 0, NVME_DOORBELL_OFFSET, &addr)) {
+        LOG_ERROR("%s: cannot map BAR0", ctrl_ctx->name);
+        return false;
+    }
+    ctrl_ctx->regs = (nvme_regs_t *)addr;
+
+    const uint32_t cap_lo = ctrl_ctx->regs->cap_lo;
+    const uint32_t cap_hi = ctrl_ctx->regs->cap_hi;
+    ctrl_ctx->doorbell_stride = 4 << NVME_CAP_HI_DSTRD(cap_hi);
+    ctrl_ctx->ready_timeout_ms = 500 * NVME_CAP_LO_TO(cap_lo);
+    if (NVME_CAP_HI_MPSMIN(cap_hi) != 0) {
+        LOG_ERROR("%s: 4 KiB pages are not supported", ctrl_ctx->name);
+        return false;
+    }
+
+    const uint32_t doorbells_size =
+        2 * (NVME_MAX_IO_QUEUES + 1) * ctrl_ctx->doorbell_stride;
+    if (!pci_map_bar(ctrl_ctx->pci_dev, 0, NVME_DOORBELL_OFFSET,
+                     doorbells_size, &ctrl_ctx->doorbells)) {
+        LOG_ERROR("%s: cannot map the doorbells", ctrl_ctx->name);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Waits until CSTS.RDY becomes @a ready, for #nvme_ctrl_ctx.ready_timeout_ms.
+ * @returns `false` on a timeout, or if the controller reports a fatal error.
+ */
+static bool prv_nvme_wait_ready(nvme_ctrl_ctx_t *ctrl_ctx, bool ready) {
+    const uint64_t deadline_ms =
+        arch_timer_current_ms() + ctrl_ctx->ready_timeout_ms;
+    while (true) {
+        const uint32_t csts = ctrl_ctx->regs->csts;
+        if (csts & NVME_CSTS_CFS) {
+            LOG_ERROR("%s: controller fatal status", ctrl_ctx->name);
+            return false;
+        }
+        if (!!(csts & NVME_CSTS_RDY) == ready) { return true; }
+        if (arch_timer_current_ms() >= deadline_ms) { return false; }
+        arch_pause_in_loop();
+    }
+}
+
+/// Sets up the admin queues and enables the stopped controller.
+static bool prv_nvme_enable(nvme_ctrl_ctx_t *ctrl_ctx) {
+    nvme_regs_t *const regs = ctrl_ctx->regs;
+    nvme_queue_t *const admin_queue = &ctrl_ctx->admin_queue;
+    prv_nvme_init_queue(ctrl_ctx, admin_queue, 0, NVME_ADMIN_QUEUE_SIZE);
+
+    regs->aqa = (NVME_ADMIN_QUEUE_SIZE - 1) | (NVME_ADMIN_QUEUE_SIZE - 1) << 16;
+    regs->asq_lo = (uintptr_t)admin_queue->sq;
+    regs->asq_hi = 0;
+    regs->acq_lo = (uintptr_t)admin_queue->cq;
+    regs->acq_hi = 0;
+
+    // NVM command set, 4 KiB pages, round robin arbitration.
+    regs->cc = NVME_SQE_SIZE_LOG2 << NVME_CC_IOSQES_SHIFT |
+               NVME_CQE_SIZE_LOG2 << NVME_CC_IOCQES_SHIFT;
+    regs->cc |= NVME_CC_EN;
+    if (!prv_nvme_wait_ready(ctrl_ctx, true)) {
+        LOG_ERROR("%s: controller does not become ready", ctrl_ctx->name);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Identifies the controller and namespace 1, and fills
+ * #nvme_ctrl_ctx.max_sectors, #nvme_ctrl_ctx.write_cache, #nvme_ctrl_ctx.nsid
+ * and #nvme_ctrl_ctx.num_sectors.
+ */
+static bool prv_nvme_identify(nvme_ctrl_ctx_t *ctrl_ctx) {
+    uint8_t *const data = heap_alloc_aligned(NVME_IDENTIFY_SIZE, 4096);
+    bool b_ok = false;
+
+    nvme_sqe_t cmd = {0};
+    cmd.opc = NVME_ADMIN_IDENTIFY;
+    cmd.prp1 = (uintptr_t)data;
+    cmd.cdw10 = NVME_CNS_CONTROLLER;
+    if (!prv_nvme_admin_cmd(ctrl_ctx, &cmd, NULL)) {
+        LOG_ERROR("%s: identify controller failed", ctrl_ctx->name);
+        goto out;
+    }
+
+    // The first PRP entry may point into the middle of a page, so one entry
+    // less is guaranteed to cover the full length.
+    ctrl_ctx->max_sectors =
+        (NVME_MAX_PRPS - 1) * (NVME_PAGE_SIZE / NVME_SECTOR_SIZE);
+    const uint8_t mdts = data[NVME_ID_CTRL_MDTS];
+    if (mdts != 0 && mdts < 16) {
+        const uint32_t mdts_sectors =
+            (1u << mdts) * (NVME_PAGE_SIZE / NVME_SECTOR_SIZE);
+        if (mdts_sectors < ctrl_ctx->max_sectors) {
+            ctrl_ctx->max_sectors = mdts_sectors;
+        }
+    }
+    ctrl_ctx->write_cache = data[NVME_ID_CTRL_VWC] & NVME_ID_CTRL_VWC_PRESENT;
+
+    cmd = (nvme_sqe_t){0};
+    cmd.opc = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = 1;
+    cmd.prp1 = (uintptr_t)data;
+    cmd.cdw10 = NVME_CNS_NAMESPACE;
+    if (!prv_nvme_admin_cmd(ctrl_ctx, &cmd, NULL)) {
+        LOG_ERROR("%s: identify namespace 1 failed", ctrl_ctx->name);
+        goto out;
+    }
+
+    const nvme_id_ns_t *const id_ns = (const nvme_id_ns_t *)data;
+    const uint32_t lbaf = id_ns->lbaf[id_ns->flbas & 0xF];
+    if (id_ns->nsze == 0) {
+        LOG_ERROR("%s: namespace 1 is not active", ctrl_ctx->name);
+        goto out;
+    }
+    if ((1u << NVME_LBAF_LBADS(lbaf)) != NVME_SECTOR_SIZE) {
+        LOG_ERROR("%s: unsupported logical block size of %u bytes",
+                  ctrl_ctx->name, 1u << NVME_LBAF_LBADS(lbaf));
+        goto out;
+    }
+    ctrl_ctx->nsid = 1;
+    ctrl_ctx->num_sectors = id_ns->nsze;
+    b_ok = true;
+
+out:
+    heap_free(data);
+    return b_ok;
+}
+
+/**
+ * Requests one I/O queue pair per processor, and returns the number of pairs
+ * to set up, limited by the pairs allocated by the controller, the MSI-X table
+ * entries, and #NVME_MAX_IO_QUEUES.
+ */
+static size_t prv_nvme_num_io_queues(nvme_ctrl_ctx_t *ctrl_ctx) {
+    size_t num_queues = smp_get_num_procs();
+    if (num_queues > NVME_MAX_IO_QUEUES) { num_queues = NVME_MAX_IO_QUEUES; }
+
+    const size_t num_vecs = pci_msix_num_vecs(ctrl_ctx->pci_dev);
+    if (num_queues > num_vecs) { num_queues = num_vecs; }
+    if (num_queues == 0) { return 0; }
+
+    // Refer to section 5.21.1.7 Number of Queues.
+    nvme_sqe_t cmd = {0};
+    cmd.opc = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = (num_queues - 1) | (num_queues - 1) << 16;
+    uint32_t dw0;
+    if (!prv_nvme_admin_cmd(ctrl_ctx, &cmd, &dw0)) {
+        LOG_ERROR("%s: cannot set the number of queues", ctrl_ctx->name);
+        return 0;
+    }
+
+    const size_t num_sqs = (dw0 & 0xFFFF) + 1;
+    const size_t num_cqs = (dw0 >> 16) + 1;
+    if (num_queues > num_sqs) { num_queues = num_sqs; }
+    if (num_queues > num_cqs) { num_queues = num_cqs; }
+    return num_queues;
+}
+
+/**
+ * Creates I/O queue pair @a queue_idx, and steers its completion interrupt to
+ * the processor with the same number. The pair uses MSI-X entry @a queue_idx.
+ *
+ * @returns `false` if the queues or an interrupt vector are not available.
+ */
+static bool prv_nvme_setup_io_queue(nvme_ctrl_ctx_t *ctrl_ctx,
+                                    size_t queue_idx) {
+    nvme_queue_t *const queue = &ctrl_ctx->io_queues[queue_idx];
+    const uint16_t qid = queue_idx + 1;
+
+    uint16_t size = NVME_IO_QUEUE_SIZE;
+    const size_t max_size = NVME_CAP_LO_MQES(ctrl_ctx->regs->cap_lo) + 1;
+    if (size > max_size) { size = max_size; }
+
+    uint8_t vec;
+    if (!arch_alloc_msi_vecs(1, &vec)) {
+        LOG_ERROR("%s: no free MSI vector for queue %u", ctrl_ctx->name, qid);
+        return false;
+    }
+
+    prv_nvme_init_queue(ctrl_ctx, queue, qid, size);
+    const size_t prps_size = size * NVME_MAX_PRPS * sizeof(uint64_t);
+    queue->prp_lists = heap_alloc_aligned(prps_size, NVME_PAGE_SIZE);
+    arch_set_msi_handler(vec, prv_nvme_msix_handler, queue);
+
+    // Refer to section 5.3 Create I/O Completion Queue command.
+    nvme_sqe_t cmd = {0};
+    cmd.opc = NVME_ADMIN_CREATE_IO_CQ;
+    cmd.prp1 = (uintptr_t)queue->cq;
+    cmd.cdw10 = (uint32_t)(size - 1) << 16 | qid;
+    cmd.cdw11 = (uint32_t)queue_idx << 16 | NVME_QUEUE_IEN | NVME_QUEUE_PC;
+    if (!prv_nvme_admin_cmd(ctrl_ctx, &cmd, NULL)) {
+        LOG_ERROR("%s: cannot create I/O CQ %u", ctrl_ctx->name, qid);
+        return false;
+    }
+
+    // Refer to section 5.4 Create I/O Submission Queue command.
+    cmd = (nvme_sqe_t){0};
+    cmd.opc = NVME_ADMIN_CREATE_IO_SQ;
+    cmd.prp1 = (uintptr_t)queue->sq;
+    cmd.cdw10 = (uint32_t)(size - 1) << 16 | qid;
+    cmd.cdw11 = (uint32_t)qid << 16 | NVME_QUEUE_PC;
+    if (!prv_nvme_admin_cmd(ctrl_ctx, &cmd, NULL)) {
+        LOG_ERROR("%s: cannot create I/O SQ %u", ctrl_ctx->name, qid);
+        return false;
+    }
+
+    const uint8_t proc_num = queue_idx % smp_get_num_procs();
+    return pci_set_msix_vec(ctrl_ctx->pci_dev, queue_idx, proc_num, vec);
+}
+
+/// Allocates the entries of queue pair @a qid and initializes @a queue.
+static void prv_nvme_init_queue(nvme_ctrl_ctx_t *ctrl_ctx, nvme_queue_t *queue,
+                                uint16_t qid, uint16_t size) {
+    queue->ctrl_ctx = ctrl_ctx;
+    queue->qid = qid;
+    queue->size = size;
+    spinlock_init(&queue->lock);
+
+    const size_t sq_size = size * sizeof(nvme_sqe_t);
+    const size_t cq_size = size * sizeof(nvme_cqe_t);
+    queue->sq = heap_alloc_aligned(sq_size, NVME_PAGE_SIZE);
+    queue->cq = heap_alloc_aligned(cq_size, NVME_PAGE_SIZE);
+    kmemset(queue->sq, 0, sq_size);
+    kmemset((void *)queue->cq, 0, cq_size);
+
+    const uintptr_t sq_doorbell =
+        ctrl_ctx->doorbells + 2 * qid * ctrl_ctx->doorbell_stride;
+    queue->sq_doorbell = (IO32 *)sq_doorbell;
+    queue->cq_doorbell = (IO32 *)(sq_doorbell + ctrl_ctx->doorbell_stride);
+
+    queue->sq_tail = 0;
+    queue->sq_tail_rung = 0;
+    queue->cq_head = 0;
+    queue->cq_phase = NVME_CQE_PHASE;
+    queue->busy_slots = 0;
+}
+
+/// Returns the zeroed submission queue entry at the tail and advances the tail.
+static nvme_sqe_t *prv_nvme_next_sqe(nvme_queue_t *queue) {
+    nvme_sqe_t *const sqe = &queue->sq[queue->sq_tail];
+    kmemset(sqe, 0, sizeof(*sqe));
+    queue->sq_tail = (queue->sq_tail + 1) % queue->size;
+    return sqe;
+}
+
+/**
+ * Writes a Flush command for @a req to a submission queue, without ringing the
+ * doorbell. Flushes are never merged.
+ */
+static void prv_nvme_submit_flush(nvme_ctrl_ctx_t *ctrl_ctx,
+                                  blkdev_req_t *req) {
+    size_t slot_idx;
+    bool restore_int;
+    nvme_queue_t *const queue =
+        prv_nvme_pick_queue(ctrl_ctx, &slot_idx, &restore_int);
+    if (!queue) {
+        LOG_ERROR("%s: no free command slot", ctrl_ctx->name);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+
+    nvme_sqe_t *const sqe = prv_nvme_next_sqe(queue);
+    sqe->opc = NVME_CMD_FLUSH;
+    sqe->cid = slot_idx;
+    sqe->nsid = ctrl_ctx->nsid;
+
+    req->trace.issue_us = blktrace_now_us();
+    queue->reqs[slot_idx] = req;
+    queue->busy_slots |= 1ull << slot_idx;
+
+    prv_nvme_queue_unlock(queue, restore_int);
+}
+
+/**
+ * Issues admin command @a cmd and polls for its completion.
+ *
+ * @param ctrl_ctx Controller.
+ * @param cmd      Command, its identifier is set by this function.
+ * @param out_dw0  Output, command specific result, may be `NULL`.
+ *
+ * @returns `false` if the command fails or times out.
+ */
+static bool prv_nvme_admin_cmd(nvme_ctrl_ctx_t *ctrl_ctx, nvme_sqe_t *cmd,
+                               uint32_t *out_dw0) {
+    nvme_queue_t *const queue = &ctrl_ctx->admin_queue;
+
+    cmd->cid = queue->sq_tail;
+    *prv_nvme_next_sqe(queue) = *cmd;
+    atomic_thread_fence(memory_order_release);
+    *queue->sq_doorbell = queue->sq_tail;
+
+    volatile nvme_cqe_t *const cqe = &queue->cq[queue->cq_head];
+    const uint64_t deadline_ms =
+        arch_timer_current_ms() + NVME_ADMIN_TIMEOUT_MS;
+    while ((cqe->status & NVME_CQE_PHASE) != queue->cq_phase) {
+        if (arch_timer_current_ms() >= deadline_ms) {
+            LOG_ERROR("%s: admin command 0x%02x timed out", ctrl_ctx->name,
+                      cmd->opc);
+            return false;
+        }
+        arch_pause_in_loop();
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    const uint16_t status = cqe->status >> 1;
+    if (out_dw0) { *out_dw0 = cqe->dw0; }
+
+    queue->cq_head = (queue->cq_head + 1) % queue->size;
+    if (queue->cq_head == 0) { queue->cq_phase ^= NVME_CQE_PHASE; }
+    *queue->cq_doorbell = queue->cq_head;
+
+    if (status != 0) {
+        LOG_ERROR("%s: admin command 0x%02x failed, status 0x%04x",
+                  ctrl_ctx->name, cmd->opc, status);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the data segments of one request, not including the merged ones.
+ * A request without segments is described with @a buf_seg.
+ */
+static const blkdev_seg_t *prv_nvme_req_segs(const blkdev_req_t *req,
+                                             blkdev_seg_t *buf_seg,
+                                             size_t *out_num_segs) {
+    if (req->num_segs != 0) {
+        *out_num_segs = req->num_segs;
+        return req->segs;
+    }
+
+    const void *const buf =
+        req->op == BLKDEV_OP_READ ? req->read_buf : req->write_buf;
+    buf_seg->addr = (uintptr_t)buf;
+    buf_seg->len = NVME_SECTOR_SIZE * blkdev_req_sectors(req);
+    *out_num_segs = 1;
+    return buf_seg;
+}
+
+/**
+ * Builds the PRP entries of request @a req, the requests merged into it, and,
+ * unless it is `NULL`, request @a next.
+ *
+ * @param req      First request of the chain.
+ * @param next     Request to append to the chain, or `NULL`.
+ * @param out_prps Output, #NVME_MAX_PRPS entries, or `NULL` to only count them.
+ *
+ * @returns The number of entries, zero if the data cannot be described with
+ * one PRP list.
+ */
+static size_t prv_nvme_req_prps(const blkdev_req_t *req,
+                                const blkdev_req_t *next, uint64_t *out_prps) {
+    size_t num_prps = 0;
+    bool ends_at_page = true;
+    for (const blkdev_req_t *it = req; it; it = it->merged_next) {
+        if (!prv_nvme_add_prps(it, out_prps, &num_prps, &ends_at_page)) {
+            return 0;
+        }
+    }
+    if (next && !prv_nvme_add_prps(next, out_prps, &num_prps, &ends_at_page)) {
+        return 0;
+    }
+    return num_prps;
+}
+
+/**
+ * Appends the PRP entries of one request, not including the merged ones, to
+ * the @a *inout_num_prps entries at @a out_prps.
+ *
+ * Only the first segment of a command may start in the middle of a page, and
+ * only the last one may end in the middle of a page. Refer to section 4.3
+ * Physical Region Page Entry and List.
+ *
+ * @param req                Request.
+ * @param out_prps           Output, or `NULL` to only count the entries.
+ * @param inout_num_prps     Number of entries before and after the call.
+ * @param inout_ends_at_page Whether the previous segment ends at a page
+ *                           boundary, before and after the call.
+ *
+ * @returns `false` if the segments break the rule above, or if there are more
+ * than #NVME_MAX_PRPS entries.
+ */
+static bool prv_nvme_add_prps(const blkdev_req_t *req, uint64_t *out_prps,
+                              size_t *inout_num_prps,
+                              bool *inout_ends_at_page) {
+    blkdev_seg_t buf_seg;
+    size_t num_segs;
+    const blkdev_seg_t *const segs =
+        prv_nvme_req_segs(req, &buf_seg, &num_segs);
+
+    size_t num_prps = *inout_num_prps;
+    bool ends_at_page = *inout_ends_at_page;
+    for (size_t seg_idx = 0; seg_idx < num_segs; seg_idx++) {
+        const uint64_t start = segs[seg_idx].addr;
+        const uint64_t end = start + segs[seg_idx].len;
+        const uint64_t first_page = start - start % NVME_PAGE_SIZE;
+        if (num_prps > 0 && (!ends_at_page || start != first_page)) {
+            return false;
+        }
+
+        for (uint64_t page = first_page; page < end; page += NVME_PAGE_SIZE) {
+            if (num_prps == NVME_MAX_PRPS) { return false; }
+            if (out_prps) { out_prps[num_prps] = num_prps ? page : start; }
+            num_prps++;
+        }
+        ends_at_page = end % NVME_PAGE_SIZE == 0;
+    }
+
+    *inout_num_prps = num_prps;
+    *inout_ends_at_page = ends_at_page;
+    return true;
+}
+
+/// Locks @a queue and disables interrupts, returns the previous int flag.
+static bool prv_nvme_queue_lock(nvme_queue_t *queue) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&queue->lock);
+    return restore_int;
+}
+
+/// Unlocks @a queue, see #prv_nvme_queue_lock().
+static void prv_nvme_queue_unlock(nvme_queue_t *queue, bool restore_int) {
+    spinlock_release(&queue->lock);
+    if (restore_int) { arch_enable_ints(); }
+}
+
+/**
+ * Finds an I/O queue pair with a free slot, preferring the pair of the running
+ * processor, and reserves the slot.
+ *
+ * A pair has one slot less than its queues have entries, so the submission
+ * queue cannot overflow.
+ *
+ * @returns The queue pair, locked with #prv_nvme_queue_lock(), or `NULL` if
+ * all slots are in use.
+ */
+static nvme_queue_t *prv_nvme_pick_queue(nvme_ctrl_ctx_t *ctrl_ctx,
+                                         size_t *out_slot,
+                                         bool *out_restore_int) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    const size_t first = smp_get_running_proc()->proc_num;
+
+    for (size_t off = 0; off < ctrl_ctx->num_io_queues; off++) {
+        nvme_queue_t *const queue =
+            &ctrl_ctx->io_queues[(first + off) % ctrl_ctx->num_io_queues];
+        spinlock_acquire(&queue->lock);
+
+        const uint64_t all_slots = (1ull << (queue->size - 1)) - 1;
+        const uint64_t free_slots = ~queue->busy_slots & all_slots;
+        if (free_slots) {
+            *out_slot = __builtin_ctzll(free_slots);
+            *out_restore_int = restore_int;
+            return queue;
+        }
+        spinlock_release(&queue->lock);
+    }
+
+    if (restore_int) { arch_enable_ints(); }
+    return NULL;
+}
+
+/**
+ * Consumes the new entries of the completion queue of @a queue, and completes
+ * their requests. Interrupts must be disabled.
+ *
+ * The entries are consumed under the queue lock, and the requests are
+ * completed after it is released, since completion callbacks may submit new
+ * requests.
+ *
+ * @returns The number of completed requests.
+ */
+static size_t prv_nvme_reap(nvme_queue_t *queue) {
+    nvme_ctrl_ctx_t *const ctrl_ctx = queue->ctrl_ctx;
+
+    blkdev_req_t *done_reqs[NVME_IO_QUEUE_SIZE];
+    uint16_t done_status[NVME_IO_QUEUE_SIZE];
+    size_t num_done = 0;
+
+    spinlock_acquire(&queue->lock);
+    const uint16_t old_head = queue->cq_head;
+    while (true) {
+        volatile nvme_cqe_t *const cqe = &queue->cq[queue->cq_head];
+        const uint16_t status = cqe->status;
+        if ((status & NVME_CQE_PHASE) != queue->cq_phase) { break; }
+        atomic_thread_fence(memory_order_acquire);
+
+        const size_t slot_idx = cqe->cid;
+        queue->cq_head = (queue->cq_head + 1) % queue->size;
+        if (queue->cq_head == 0) { queue->cq_phase ^= NVME_CQE_PHASE; }
+
+        if (slot_idx >= NVME_IO_QUEUE_SIZE ||
+            !(queue->busy_slots & (1ull << slot_idx))) {
+            LOG_ERROR("%s: spurious completion of command %zu on queue %u",
+                      ctrl_ctx->name, slot_idx, queue->qid);
+            continue;
+        }
+
+        done_reqs[num_done] = queue->reqs[slot_idx];
+        done_status[num_done] = status >> 1;
+        num_done++;
+
+        queue->reqs[slot_idx] = NULL;
+        queue->busy_slots &= ~(1ull << slot_idx);
+    }
+    if (queue->cq_head != old_head) { *queue->cq_doorbell = queue->cq_head; }
+    spinlock_release(&queue->lock);
+
+    for (size_t idx = 0; idx < num_done; idx++) {
+        if (done_status[idx] != 0) {
+            LOG_ERROR("%s: command failed, sector %llu, status 0x%04x",
+                      ctrl_ctx->name, done_reqs[idx]->start_sector,
+                      done_status[idx]);
+        }
+        blkdev_complete_req(done_reqs[idx], done_status[idx] == 0
+                                                ? BLKDEV_REQ_SUCCESS
+                                                : BLKDEV_REQ_ERROR);
+    }
+    return num_done;
+}
+
+/// Completion interrupt handler of an I/O queue pair.
+static void prv_nvme_msix_handler(void *ctx) {
+    prv_nvme_reap(ctx);
+}
@@ -0,0 +1,188 @@
+/**
+ * @file nvme.h
+ * NVMe controller driver.
+ *
+ * The driver creates one I/O submission and completion queue pair per
+ * processor, as many as the controller and its MSI-X table allow. The
+ * completion interrupt of the pair `q` is delivered to processor `q`, and a
+ * request is submitted to the pair of the processor it is submitted on, so
+ * that processors do not contend for a queue.
+ *
+ * The data of a request is described with PRPs (Physical Region Pages) built
+ * from its page vector, see #blkdev_req.segs. The submission queue doorbell is
+ * written once per batch, see #nvme_if_commit().
+ *
+ * Only namespace 1 is used, and it must be formatted with 512-byte logical
+ * blocks. If the controller has a volatile write cache, flushes and FUA writes
+ * are issued, see #nvme_ctrl_ctx.write_cache.
+ *
+ * Admin commands are only issued while the controller is being initialized,
+ * their completions are polled.
+ *
+ * Refer to NVM Express Base Specification, Revision 1.4.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blkdev/blkdev.h"
+#include "blkdev/nvme_regs.h"
+#include "kspinlock.h"
+#include "pci.h"
+
+/// Sector (logical block) size supported by the driver (bytes).
+#define NVME_SECTOR_SIZE 512
+
+/// Maximum number of I/O queue pairs per controller.
+#define NVME_MAX_IO_QUEUES 16
+
+/**
+ * Number of entries of each I/O queue, less than 64, see
+ * #nvme_queue_t.busy_slots. One entry is always left empty, so a queue has one
+ * slot less.
+ */
+#define NVME_IO_QUEUE_SIZE 32
+
+/// Number of entries of the admin queues.
+#define NVME_ADMIN_QUEUE_SIZE 8
+
+/**
+ * Maximum number of PRP entries per command, i.e., the number of pages that
+ * a command may touch. A PRP list of this size takes 1 KiB.
+ */
+#define NVME_MAX_PRPS 128
+
+/// Time to wait for the completion of an admin command (milliseconds).
+#define NVME_ADMIN_TIMEOUT_MS 1000
+
+typedef struct nvme_ctrl_ctx nvme_ctrl_ctx_t;
+
+/// Submission and completion queue pair.
+typedef struct {
+    nvme_ctrl_ctx_t *ctrl_ctx;
+    /// Queue identifier, 0 for the admin queues.
+    uint16_t qid;
+    /// Number of entries of each queue.
+    uint16_t size;
+    /// Protects the queue pair, taken with interrupts disabled.
+    spinlock_t lock;
+
+    nvme_sqe_t *sq;
+    volatile nvme_cqe_t *cq;
+    IO32 *sq_doorbell;
+    IO32 *cq_doorbell;
+
+    /// Next free submission queue entry.
+    uint16_t sq_tail;
+    /// #nvme_queue_t.sq_tail last written to the doorbell.
+    uint16_t sq_tail_rung;
+    /// Next completion queue entry to consume.
+    uint16_t cq_head;
+    /// Phase Tag value of new completion queue entries.
+    uint16_t cq_phase;
+
+    /**
+     * PRP lists of the slots, #NVME_MAX_PRPS entries per slot. The slot
+     * number is the command identifier.
+     */
+    uint64_t *prp_lists;
+    /// Request submitted in each slot, `NULL` if the slot is free.
+    blkdev_req_t *reqs[NVME_IO_QUEUE_SIZE];
+    /// Bit `i` is set if slot `i` is in use.
+    uint64_t busy_slots;
+} nvme_queue_t;
+
+struct nvme_ctrl_ctx {
+    const pci_dev_t *pci_dev;
+    char name[16];
+
+    nvme_regs_t *regs;
+    /// Address of the first doorbell register.
+    uintptr_t doorbells;
+    /// Distance between doorbell registers (bytes).
+    uint32_t doorbell_stride;
+    /// Timeout of enabling and disabling the controller (milliseconds).
+    uint32_t ready_timeout_ms;
+
+    nvme_queue_t admin_queue;
+    nvme_queue_t io_queues[NVME_MAX_IO_QUEUES];
+    size_t num_io_queues;
+
+    /// Namespace used as the block device.
+    uint32_t nsid;
+    uint64_t num_sectors;
+    /// Maximum number of sectors per command.
+    uint32_t max_sectors;
+    /**
+     * The controller has a volatile write cache, so flushes and
+     * #BLKDEV_REQ_FLAG_FUA are issued. Otherwise, completed writes are on the
+     * media.
+     */
+    bool write_cache;
+};
+
+/**
+ * Resets NVMe controller @a pci_dev, identifies its namespace, and creates the
+ * I/O queues.
+ *
+ * @returns `NULL` if the controller cannot be used.
+ */
+nvme_ctrl_ctx_t *nvme_ctrl_new(const pci_dev_t *pci_dev);
+
+/**
+ * Fills the fields of the blkdev interface struct.
+ * See #blkdev_if_t.
+ */
+void nvme_fill_blkdev_if(blkdev_if_t *blkdev_if);
+
+/**
+ * Returns #BLKDEV_CAP_FLUSH if the controller has a volatile write cache.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint32_t nvme_if_get_caps(void *v_ctrl_ctx);
+
+/**
+ * Returns the number of command slots of all I/O queues.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t nvme_if_get_queue_depth(void *v_ctrl_ctx);
+
+/**
+ * Returns the size of the namespace in sectors.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint64_t nvme_if_get_num_sectors(void *v_ctrl_ctx);
+
+/**
+ * Returns `true` if @a req, the requests merged into it, and @a next can be
+ * described with one PRP list: the segments must join at page boundaries,
+ * and the command must not exceed #nvme_ctrl_ctx.max_sectors.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+bool nvme_if_can_merge(void *v_ctrl_ctx, const blkdev_req_t *req,
+                       const blkdev_req_t *next);
+
+/**
+ * Writes a command to the submission queue of the running processor, without
+ * ringing the doorbell.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+void nvme_if_submit_req(blkdev_req_t *req);
+
+/**
+ * Rings the submission queue doorbells of the queues that have new commands.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+void nvme_if_commit(void *v_ctrl_ctx);
+
+/**
+ * Consumes the new entries of the completion queues, without waiting for the
+ * completion interrupts.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t nvme_if_poll(void *v_ctrl_ctx);
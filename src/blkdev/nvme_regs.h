@@ -0,0 +1,160 @@
+/**
+ * @file nvme_regs.h
+ * NVMe register and data structure definitions.
+ *
+ * Refer to NVM Express Base Specification, Revision 1.4.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "types.h"
+
+/// Offset of the first doorbell register in BAR0 (bytes).
+#define NVME_DOORBELL_OFFSET 0x1000
+
+/**
+ * Controller registers.
+ * Refer to section 3.1 Register Definition.
+ */
+typedef volatile struct [[gnu::packed]] {
+    IO32 cap_lo;    //!< Controller Capabilities, bits 31:0.
+    IO32 cap_hi;    //!< Controller Capabilities, bits 63:32.
+    IO32 vs;        //!< Version.
+    IO32 intms;     //!< Interrupt Mask Set.
+    IO32 intmc;     //!< Interrupt Mask Clear.
+    IO32 cc;        //!< Controller Configuration.
+    IO32 reserved0;
+    IO32 csts;      //!< Controller Status.
+    IO32 nssr;      //!< NVM Subsystem Reset.
+    IO32 aqa;       //!< Admin Queue Attributes.
+    IO32 asq_lo;    //!< Admin Submission Queue Base Address, bits 31:0.
+    IO32 asq_hi;    //!< Admin Submission Queue Base Address, bits 63:32.
+    IO32 acq_lo;    //!< Admin Completion Queue Base Address, bits 31:0.
+    IO32 acq_hi;    //!< Admin Completion Queue Base Address, bits 63:32.
+} nvme_regs_t;
+
+/// Maximum Queue Entries Supported (zero-based), see #nvme_regs_t.cap_lo.
+#define NVME_CAP_LO_MQES(CAP) ((CAP) & 0xFFFF)
+/// Timeout of CSTS.RDY transitions (500 ms units), see #nvme_regs_t.cap_lo.
+#define NVME_CAP_LO_TO(CAP) (((CAP) >> 24) & 0xFF)
+/// Doorbell Stride, see #nvme_regs_t.cap_hi.
+#define NVME_CAP_HI_DSTRD(CAP) ((CAP) & 0xF)
+/// Memory Page Size Minimum, see #nvme_regs_t.cap_hi.
+#define NVME_CAP_HI_MPSMIN(CAP) (((CAP) >> 16) & 0xF)
+
+/// Controller Configuration fields, see #nvme_regs_t.cc.
+#define NVME_CC_EN           (1 << 0)  //!< Enable.
+#define NVME_CC_IOSQES_SHIFT 16        //!< I/O Submission Queue Entry Size.
+#define NVME_CC_IOCQES_SHIFT 20        //!< I/O Completion Queue Entry Size.
+
+/// Controller Status fields, see #nvme_regs_t.csts.
+#define NVME_CSTS_RDY (1 << 0) //!< Ready.
+#define NVME_CSTS_CFS (1 << 1) //!< Controller Fatal Status.
+
+/// Page size configured by the driver (bytes), CC.MPS is zero.
+#define NVME_PAGE_SIZE 4096
+
+/**
+ * Submission Queue Entry.
+ * Refer to section 4.2 Submission Queue Entry - Command Format.
+ */
+typedef struct [[gnu::packed]] {
+    uint8_t opc;   //!< Opcode.
+    uint8_t flags; //!< Fused operation and PRP/SGL selection, zero for PRPs.
+    uint16_t cid;  //!< Command Identifier.
+    uint32_t nsid; //!< Namespace Identifier.
+    uint64_t reserved0;
+    uint64_t mptr; //!< Metadata Pointer.
+    uint64_t prp1; //!< PRP Entry 1.
+    uint64_t prp2; //!< PRP Entry 2, or the address of a PRP List.
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} nvme_sqe_t;
+
+/// Log2 of the size of #nvme_sqe_t, for CC.IOSQES.
+#define NVME_SQE_SIZE_LOG2 6
+static_assert(sizeof(nvme_sqe_t) == 1 << NVME_SQE_SIZE_LOG2, "SQE size");
+
+/**
+ * Completion Queue Entry.
+ * Refer to section 4.6 Completion Queue Entry.
+ */
+typedef struct [[gnu::packed]] {
+    uint32_t dw0; //!< Command specific.
+    uint32_t dw1;
+    uint16_t sq_head; //!< SQ Head Pointer.
+    uint16_t sq_id;   //!< SQ Identifier.
+    uint16_t cid;     //!< Command Identifier.
+    uint16_t status;  //!< Phase Tag (bit 0) and Status Field (bits 15:1).
+} nvme_cqe_t;
+
+/// Log2 of the size of #nvme_cqe_t, for CC.IOCQES.
+#define NVME_CQE_SIZE_LOG2 4
+static_assert(sizeof(nvme_cqe_t) == 1 << NVME_CQE_SIZE_LOG2, "CQE size");
+
+/// Phase Tag bit, see #nvme_cqe_t.status.
+#define NVME_CQE_PHASE 1
+
+/// Admin command opcodes, see #nvme_sqe_t.opc.
+typedef enum {
+    NVME_ADMIN_CREATE_IO_SQ = 0x01,
+    NVME_ADMIN_CREATE_IO_CQ = 0x05,
+    NVME_ADMIN_IDENTIFY = 0x06,
+    NVME_ADMIN_SET_FEATURES = 0x09,
+} nvme_admin_opc_t;
+
+/// NVM command opcodes, see #nvme_sqe_t.opc.
+typedef enum {
+    NVME_CMD_FLUSH = 0x00,
+    NVME_CMD_WRITE = 0x01,
+    NVME_CMD_READ = 0x02,
+} nvme_cmd_opc_t;
+
+/// Force Unit Access bit of Read and Write CDW12.
+#define NVME_RW_FUA (1u << 30)
+
+/// Create I/O queue flags (CDW11).
+#define NVME_QUEUE_PC  (1 << 0) //!< Physically Contiguous.
+#define NVME_QUEUE_IEN (1 << 1) //!< Interrupts Enabled, CQ only.
+
+/// Identify Controller or Namespace Structure (CNS), Identify CDW10.
+typedef enum {
+    NVME_CNS_NAMESPACE = 0x00,
+    NVME_CNS_CONTROLLER = 0x01,
+} nvme_cns_t;
+
+/// Feature Identifier of Number of Queues, Set Features CDW10.
+#define NVME_FEAT_NUM_QUEUES 0x07
+
+/// Byte offset of MDTS in the Identify Controller data structure.
+#define NVME_ID_CTRL_MDTS 77
+
+/// Byte offset of VWC in the Identify Controller data structure.
+#define NVME_ID_CTRL_VWC 525
+/// Volatile Write Cache present bit of VWC.
+#define NVME_ID_CTRL_VWC_PRESENT (1 << 0)
+
+/**
+ * Identify Namespace data structure, the fields that the driver uses.
+ * Refer to section 6.1.5 Identify Namespace data structure.
+ */
+typedef struct [[gnu::packed]] {
+    uint64_t nsze; //!< Namespace Size (logical blocks).
+    uint64_t ncap; //!< Namespace Capacity.
+    uint64_t nuse; //!< Namespace Utilization.
+    uint8_t nsfeat;
+    uint8_t nlbaf; //!< Number of LBA Formats (zero-based).
+    uint8_t flbas; //!< Formatted LBA Size, bits 3:0 index #lbaf.
+    uint8_t reserved0[101];
+    /// LBA formats: Metadata Size (bits 15:0), LBA Data Size (bits 23:16).
+    uint32_t lbaf[16];
+} nvme_id_ns_t;
+
+/// LBA Data Size (log2 of bytes) of an LBA format, see #nvme_id_ns_t.lbaf.
+#define NVME_LBAF_LBADS(LBAF) (((LBAF) >> 16) & 0xFF)
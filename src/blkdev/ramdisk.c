@@ -0,0 +1,141 @@
+/**
+ * @file ramdisk.c
+ * RAM disk block device driver implementation.
+ */
+
+#include "assert.h"
+#include "blkdev/blktrace.h"
+#include "blkdev/ramdisk.h"
+#include "heap.h"
+#include "kinttypes.h"
+#include "log.h"
+#include "memfun.h"
+#include "pmm.h"
+
+static ramdisk_ctx_t *prv_ramdisk_alloc(uint64_t size);
+static bool prv_ramdisk_copy_req(ramdisk_ctx_t *ramdisk_ctx,
+                                 const blkdev_req_t *req);
+static void prv_ramdisk_copy(uint8_t *disk, uintptr_t buf, size_t len,
+                             bool dir_write);
+
+ramdisk_ctx_t *ramdisk_new(uint32_t size_kib) {
+    if (size_kib == 0 || size_kib > RAMDISK_MAX_SIZE_KIB) {
+        LOG_ERROR("invalid RAM disk size %" PRIu32 " KiB", size_kib);
+        return NULL;
+    }
+
+    ramdisk_ctx_t *const ramdisk_ctx =
+        prv_ramdisk_alloc((uint64_t)size_kib * 1024);
+    kmemset(ramdisk_ctx->data, 0, ramdisk_ctx->num_pages * PMM_PAGE_SIZE);
+    return ramdisk_ctx;
+}
+
+ramdisk_ctx_t *ramdisk_new_from_mod(const arch_boot_mod_t *mod) {
+    const uint64_t mod_size = mod->phys_end - mod->phys_start;
+    if (mod->phys_end <= mod->phys_start ||
+        mod_size > (uint64_t)RAMDISK_MAX_SIZE_KIB * 1024) {
+        LOG_ERROR("invalid RAM disk module '%s' size %llu", mod->name,
+                  mod_size);
+        return NULL;
+    }
+
+    ramdisk_ctx_t *const ramdisk_ctx = prv_ramdisk_alloc(mod_size);
+    const void *const mod_data = (const void *)(uintptr_t)mod->phys_start;
+    kmemcpy(ramdisk_ctx->data, mod_data, mod_size);
+    kmemset(&ramdisk_ctx->data[mod_size], 0,
+            ramdisk_ctx->num_pages * PMM_PAGE_SIZE - mod_size);
+    return ramdisk_ctx;
+}
+
+void ramdisk_fill_blkdev_if(blkdev_if_t *blkdev_if) {
+    blkdev_if->f_get_queue_depth = ramdisk_if_get_queue_depth;
+    blkdev_if->f_get_num_sectors = ramdisk_if_get_num_sectors;
+    // Merging would not save anything, each request is copied separately.
+    blkdev_if->f_can_merge = NULL;
+    blkdev_if->f_resolve = NULL;
+    blkdev_if->f_submit_req = ramdisk_if_submit_req;
+    blkdev_if->f_commit = NULL;
+    blkdev_if->f_poll = NULL;
+    blkdev_if->f_get_dma_mask = NULL;
+    blkdev_if->f_get_caps = NULL;
+}
+
+size_t ramdisk_if_get_queue_depth(void *v_ramdisk_ctx) {
+    (void)v_ramdisk_ctx;
+    return 0;
+}
+
+uint64_t ramdisk_if_get_num_sectors(void *v_ramdisk_ctx) {
+    ramdisk_ctx_t *const ramdisk_ctx = v_ramdisk_ctx;
+    return ramdisk_ctx->num_sectors;
+}
+
+void ramdisk_if_submit_req(blkdev_req_t *req) {
+    ramdisk_ctx_t *const ramdisk_ctx = req->dev->driver_ctx;
+
+    const uint64_t now_us = blktrace_now_us();
+    bool b_ok = true;
+    for (blkdev_req_t *it = req; it && b_ok; it = it->merged_next) {
+        it->trace.issue_us = now_us;
+        b_ok = prv_ramdisk_copy_req(ramdisk_ctx, it);
+    }
+
+    blkdev_complete_req(req, b_ok ? BLKDEV_REQ_SUCCESS : BLKDEV_REQ_ERROR);
+}
+
+/**
+ * Allocates a RAM disk context and the pages for @a size bytes, rounded up to
+ * whole pages. The pages are not cleared.
+ */
+static ramdisk_ctx_t *prv_ramdisk_alloc(uint64_t size) {
+    ramdisk_ctx_t *const ramdisk_ctx = heap_alloc(sizeof(*ramdisk_ctx));
+    kmemset(ramdisk_ctx, 0, sizeof(*ramdisk_ctx));
+
+    ramdisk_ctx->num_pages = PMM_PAGE_ALIGN_UP(size) / PMM_PAGE_SIZE;
+    ramdisk_ctx->num_sectors =
+        (size + RAMDISK_SECTOR_SIZE - 1) / RAMDISK_SECTOR_SIZE;
+    // Physical memory is identity mapped in the kernel address space.
+    const paddr_t pages = pmm_alloc_pages(ramdisk_ctx->num_pages);
+    ramdisk_ctx->data = (uint8_t *)(uintptr_t)pages;
+
+    return ramdisk_ctx;
+}
+
+/// Copies the sectors of one request, not including the merged ones.
+static bool prv_ramdisk_copy_req(ramdisk_ctx_t *ramdisk_ctx,
+                                 const blkdev_req_t *req) {
+    const uint64_t num_sectors = blkdev_req_sectors(req);
+    if (req->start_sector >= ramdisk_ctx->num_sectors ||
+        num_sectors > ramdisk_ctx->num_sectors - req->start_sector) {
+        LOG_ERROR("request past the RAM disk end, sectors %llu+%llu",
+                  req->start_sector, num_sectors);
+        return false;
+    }
+
+    uint8_t *disk = &ramdisk_ctx->data[req->start_sector * RAMDISK_SECTOR_SIZE];
+    const bool dir_write = req->op == BLKDEV_OP_WRITE;
+
+    if (req->num_segs == 0) {
+        const void *const buf = dir_write ? req->write_buf : req->read_buf;
+        prv_ramdisk_copy(disk, (uintptr_t)buf,
+                         num_sectors * RAMDISK_SECTOR_SIZE, dir_write);
+        return true;
+    }
+
+    for (size_t seg_idx = 0; seg_idx < req->num_segs; seg_idx++) {
+        const blkdev_seg_t *const seg = &req->segs[seg_idx];
+        prv_ramdisk_copy(disk, seg->addr, seg->len, dir_write);
+        disk += seg->len;
+    }
+    return true;
+}
+
+/// Copies @a len bytes between the RAM disk and identity mapped @a buf.
+static void prv_ramdisk_copy(uint8_t *disk, uintptr_t buf, size_t len,
+                             bool dir_write) {
+    if (dir_write) {
+        kmemcpy(disk, (const void *)buf, len);
+    } else {
+        kmemcpy((void *)buf, disk, len);
+    }
+}
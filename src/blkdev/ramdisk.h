@@ -0,0 +1,89 @@
+/**
+ * @file ramdisk.h
+ * RAM disk block device driver.
+ *
+ * A RAM disk keeps its sectors in physically contiguous pages allocated from
+ * the PMM. The worker task of the device serves each request by copying memory,
+ * so the request is completed before #ramdisk_if_submit_req() returns. Since
+ * there is no device latency, RAM disks are used to benchmark the block layers
+ * above the drivers, and as fast scratch storage.
+ *
+ * RAM disks are created at boot from the kernel command line, each key may be
+ * given several times:
+ * - `ramdisk.size-kib=<size>` creates an empty RAM disk of `<size>` KiB.
+ * - `ramdisk.mod=<name>` creates a RAM disk holding a copy of boot module
+ *   `<name>`, e.g., a GPT-partitioned disk image.
+ *
+ * See #devmgr_probe_blkdevs().
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "arch_boot.h"
+#include "blkdev/blkdev.h"
+
+/// Sector size of RAM disks (bytes).
+#define RAMDISK_SECTOR_SIZE 512
+
+/// Maximum size of a RAM disk, so that a typo does not exhaust the PMM (KiB).
+#define RAMDISK_MAX_SIZE_KIB (256 * 1024)
+
+typedef struct {
+    /// Identity mapped memory that holds the sectors.
+    uint8_t *data;
+    /// Number of pages allocated for #ramdisk_ctx_t.data.
+    size_t num_pages;
+    uint64_t num_sectors;
+} ramdisk_ctx_t;
+
+/**
+ * Creates a zero-filled RAM disk of @a size_kib KiB.
+ *
+ * @returns `NULL` if @a size_kib is zero or larger than #RAMDISK_MAX_SIZE_KIB.
+ *
+ * @warning
+ * The PMM panics if there is not enough contiguous physical memory.
+ */
+ramdisk_ctx_t *ramdisk_new(uint32_t size_kib);
+
+/**
+ * Creates a RAM disk holding a copy of boot module @a mod.
+ *
+ * The size of the module is rounded up to whole sectors, the padding is
+ * zero-filled. The module itself is not modified.
+ *
+ * @returns `NULL` if the module is empty or larger than #RAMDISK_MAX_SIZE_KIB.
+ */
+ramdisk_ctx_t *ramdisk_new_from_mod(const arch_boot_mod_t *mod);
+
+/**
+ * Fills the fields of the blkdev interface struct.
+ * See #blkdev_if_t.
+ */
+void ramdisk_fill_blkdev_if(blkdev_if_t *blkdev_if);
+
+/**
+ * Always returns zero, i.e., no limit.
+ *
+ * Requests are completed during submission, so there are never any requests
+ * in flight to limit.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t ramdisk_if_get_queue_depth(void *v_ramdisk_ctx);
+
+/**
+ * Returns the number of sectors of the RAM disk.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint64_t ramdisk_if_get_num_sectors(void *v_ramdisk_ctx);
+
+/**
+ * Copies the sectors of the request from or to the RAM disk, and completes
+ * the request.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+void ramdisk_if_submit_req(blkdev_req_t *req);
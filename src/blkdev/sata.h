@@ -35,11 +35,61 @@
  * @{
  * @name ATA Commands
  */
-#define SATA_CMD_IDENTIFY_DEVICE 0xEC
-#define SATA_CMD_READ_DMA_EXT    0x25
-#define SATA_CMD_WRITE_DMA_EXT   0x35
+#define SATA_CMD_IDENTIFY_DEVICE    0xEC
+#define SATA_CMD_READ_DMA_EXT       0x25
+#define SATA_CMD_WRITE_DMA_EXT      0x35
+#define SATA_CMD_READ_FPDMA_QUEUED  0x60
+#define SATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define SATA_CMD_WRITE_DMA_FUA_EXT  0x3D
+#define SATA_CMD_FLUSH_CACHE_EXT    0xEA
+#define SATA_CMD_DATA_SET_MGMT      0x06
 /// @}
 
+/**
+ * @{
+ * @name IDENTIFY DEVICE data words
+ */
+/// Queue depth (bits 4:0 hold the maximum queue depth minus one).
+#define SATA_IDENT_QUEUE_DEPTH      75
+#define SATA_IDENT_QUEUE_DEPTH_MASK 0x1F
+/// Serial ATA capabilities.
+#define SATA_IDENT_SATA_CAP         76
+#define SATA_IDENT_SATA_CAP_NCQ     (1 << 8)
+/// Commands and feature sets supported.
+#define SATA_IDENT_CMD_SET_2        83
+#define SATA_IDENT_FLUSH_EXT        (1 << 13)
+/// Commands and feature sets supported or enabled.
+#define SATA_IDENT_CMD_SET_3        84
+#define SATA_IDENT_FUA_EXT          (1 << 6)
+/// Commands and feature sets enabled.
+#define SATA_IDENT_CMD_ENABLED      85
+#define SATA_IDENT_WRITE_CACHE      (1 << 5)
+/// Maximum number of 512-byte blocks of LBA Range Entries per DSM command.
+#define SATA_IDENT_DSM_MAX_BLOCKS   105
+/// Data Set Management support.
+#define SATA_IDENT_DSM              169
+#define SATA_IDENT_DSM_TRIM         (1 << 0)
+/// @}
+
+/**
+ * Shift of the NCQ tag in the Count field of a FPDMA QUEUED command.
+ * The sector count of such commands goes to the Features field instead.
+ */
+#define SATA_NCQ_TAG_SHIFT 3
+
+/// Forced Unit Access bit in the Device field of a FPDMA QUEUED command.
+#define SATA_NCQ_FUA (1 << 7)
+
+/// TRIM bit in the Features field of #SATA_CMD_DATA_SET_MGMT.
+#define SATA_DSM_TRIM              0x01
+/**
+ * Number of LBA Range Entries in a 512-byte block of #SATA_CMD_DATA_SET_MGMT.
+ * Each entry holds a 48-bit LBA and a 16-bit sector count.
+ */
+#define SATA_DSM_RANGES_PER_BLOCK  64
+/// Largest sector count of an LBA Range Entry.
+#define SATA_DSM_RANGE_MAX_SECTORS 0xFFFF
+
 #define SATA_SERIAL_STR_LEN 20
 
 #define SATA_ERROR_ABORT (1 << 2)
@@ -0,0 +1,469 @@
+/**
+ * @file virtio_blk.c
+ * Virtio block device driver implementation.
+ */
+
+#include "arch.h"
+#include "blkdev/blktrace.h"
+#include "blkdev/virtio_blk.h"
+#include "cpu.h"
+#include "heap.h"
+#include "kprintf.h"
+#include "log.h"
+#include "memfun.h"
+#include "smp.h"
+
+static_assert(VIRTIO_BLK_QUEUE_SIZE < 64, "slots must fit busy_slots");
+
+/// Feature bits of the block device, refer to section 5.2.3 Feature bits.
+#define VIRTIO_BLK_F_SEG_MAX 2 //!< #virtio_blk_cfg_t.seg_max is valid.
+#define VIRTIO_BLK_F_MQ      12 //!< #virtio_blk_cfg_t.num_queues is valid.
+
+/// Request types, see #virtio_blk_req_hdr_t.type.
+#define VIRTIO_BLK_T_IN  0 //!< Read.
+#define VIRTIO_BLK_T_OUT 1 //!< Write.
+
+/// Request status OK, see #virtio_blk_slot_t.status.
+#define VIRTIO_BLK_S_OK 0
+
+/**
+ * Device configuration, the fields that the driver uses.
+ * Refer to section 5.2.4 Device configuration layout.
+ */
+typedef volatile struct [[gnu::packed]] {
+    uint32_t capacity_lo;
+    uint32_t capacity_hi;
+    uint32_t size_max;
+    uint32_t seg_max;
+    uint8_t geometry[4];
+    uint32_t blk_size;
+    uint8_t topology[8];
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
+} virtio_blk_cfg_t;
+
+static size_t prv_virtio_blk_num_queues(virtio_blk_ctx_t *blk_ctx);
+static bool prv_virtio_blk_setup_queue(virtio_blk_ctx_t *blk_ctx,
+                                       uint16_t queue_idx);
+
+static size_t prv_virtio_blk_req_num_segs(const blkdev_req_t *req);
+static void prv_virtio_blk_req_segs(const blkdev_req_t *req,
+                                    virtq_desc_t *inout_desc,
+                                    size_t *inout_num_segs);
+static void prv_virtio_blk_fill_slot(virtio_blk_slot_t *slot,
+                                     const blkdev_req_t *req);
+
+static bool prv_virtio_blk_queue_lock(virtio_blk_queue_t *queue);
+static void prv_virtio_blk_queue_unlock(virtio_blk_queue_t *queue,
+                                        bool restore_int);
+static virtio_blk_queue_t *prv_virtio_blk_pick_queue(virtio_blk_ctx_t *blk_ctx,
+                                                     size_t *out_slot,
+                                                     bool *out_restore_int);
+
+static size_t prv_virtio_blk_reap(virtio_blk_queue_t *queue);
+static void prv_virtio_blk_msix_handler(void *ctx);
+
+virtio_blk_ctx_t *virtio_blk_new(const pci_dev_t *pci_dev) {
+    virtio_blk_ctx_t *const blk_ctx =
+        heap_alloc_aligned(sizeof(*blk_ctx), alignof(virtio_blk_ctx_t));
+    kmemset(blk_ctx, 0, sizeof(*blk_ctx));
+    ksnprintf(blk_ctx->name, sizeof(blk_ctx->name), "vblk %u-%u-%u",
+              pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num);
+
+    virtio_pci_dev_t *const vdev = &blk_ctx->vdev;
+    if (!virtio_pci_init(vdev, pci_dev)) { goto fail; }
+
+    const uint64_t wanted = (1ull << VIRTIO_F_RING_INDIRECT_DESC) |
+                            (1ull << VIRTIO_F_RING_EVENT_IDX) |
+                            (1ull << VIRTIO_BLK_F_SEG_MAX) |
+                            (1ull << VIRTIO_BLK_F_MQ);
+    if (!virtio_pci_negotiate(vdev, wanted)) {
+        LOG_ERROR("%s: feature negotiation failed", blk_ctx->name);
+        goto fail;
+    }
+    if (!virtio_pci_has_feature(vdev, VIRTIO_F_RING_INDIRECT_DESC)) {
+        LOG_ERROR("%s: no indirect descriptors", blk_ctx->name);
+        goto fail;
+    }
+
+    const virtio_blk_cfg_t *const cfg = vdev->dev_cfg;
+    blk_ctx->num_sectors =
+        cfg->capacity_lo | ((uint64_t)cfg->capacity_hi << 32);
+    blk_ctx->max_segs = VIRTIO_BLK_MAX_SEGS;
+    if (virtio_pci_has_feature(vdev, VIRTIO_BLK_F_SEG_MAX) &&
+        cfg->seg_max > 0 && cfg->seg_max < blk_ctx->max_segs) {
+        blk_ctx->max_segs = cfg->seg_max;
+    }
+
+    if (!pci_enable_msix(pci_dev)) {
+        LOG_ERROR("%s: MSI-X is not available", blk_ctx->name);
+        goto fail;
+    }
+
+    const size_t num_queues = prv_virtio_blk_num_queues(blk_ctx);
+    for (size_t queue_idx = 0; queue_idx < num_queues; queue_idx++) {
+        if (!prv_virtio_blk_setup_queue(blk_ctx, queue_idx)) { break; }
+        blk_ctx->num_queues++;
+    }
+    if (blk_ctx->num_queues == 0) {
+        LOG_ERROR("%s: no usable queue", blk_ctx->name);
+        goto fail;
+    }
+
+    virtio_pci_driver_ok(vdev);
+    LOG_INFO("%s: %llu sectors, %zu queue(s)", blk_ctx->name,
+             blk_ctx->num_sectors, blk_ctx->num_queues);
+    return blk_ctx;
+
+fail:
+    // The context is not freed, the device may still hold the queue addresses.
+    virtio_pci_fail(vdev);
+    return NULL;
+}
+
+void virtio_blk_fill_blkdev_if(blkdev_if_t *blkdev_if) {
+    blkdev_if->f_get_queue_depth = virtio_blk_if_get_queue_depth;
+    blkdev_if->f_get_num_sectors = virtio_blk_if_get_num_sectors;
+    blkdev_if->f_can_merge = virtio_blk_if_can_merge;
+    blkdev_if->f_resolve = NULL;
+    blkdev_if->f_submit_req = virtio_blk_if_submit_req;
+    blkdev_if->f_commit = virtio_blk_if_commit;
+    blkdev_if->f_poll = virtio_blk_if_poll;
+    // Virtio devices reach all of physical memory.
+    blkdev_if->f_get_dma_mask = NULL;
+    // VIRTIO_BLK_F_FLUSH is not negotiated, so the device writes through.
+    blkdev_if->f_get_caps = NULL;
+}
+
+size_t virtio_blk_if_get_queue_depth(void *v_blk_ctx) {
+    virtio_blk_ctx_t *const blk_ctx = v_blk_ctx;
+
+    size_t queue_depth = 0;
+    for (size_t queue_idx = 0; queue_idx < blk_ctx->num_queues; queue_idx++) {
+        queue_depth += blk_ctx->queues[queue_idx].vq.size;
+    }
+    return queue_depth;
+}
+
+uint64_t virtio_blk_if_get_num_sectors(void *v_blk_ctx) {
+    virtio_blk_ctx_t *const blk_ctx = v_blk_ctx;
+    return blk_ctx->num_sectors;
+}
+
+bool virtio_blk_if_can_merge(void *v_blk_ctx, const blkdev_req_t *req,
+                             const blkdev_req_t *next) {
+    virtio_blk_ctx_t *const blk_ctx = v_blk_ctx;
+
+    size_t num_segs = prv_virtio_blk_req_num_segs(next);
+    for (const blkdev_req_t *it = req; it; it = it->merged_next) {
+        num_segs += prv_virtio_blk_req_num_segs(it);
+    }
+    return num_segs <= blk_ctx->max_segs;
+}
+
+void virtio_blk_if_submit_req(blkdev_req_t *req) {
+    virtio_blk_ctx_t *const blk_ctx = req->dev->driver_ctx;
+
+    size_t num_sectors = 0;
+    size_t num_segs = 0;
+    for (const blkdev_req_t *it = req; it; it = it->merged_next) {
+        num_sectors += blkdev_req_sectors(it);
+        num_segs += prv_virtio_blk_req_num_segs(it);
+    }
+    if (req->start_sector >= blk_ctx->num_sectors ||
+        num_sectors > blk_ctx->num_sectors - req->start_sector) {
+        LOG_ERROR("%s: request past the device end, sectors %llu+%zu",
+                  blk_ctx->name, req->start_sector, num_sectors);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+    if (num_segs > blk_ctx->max_segs) {
+        LOG_ERROR("%s: too many segments in a request", blk_ctx->name);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+
+    size_t slot_idx;
+    bool restore_int;
+    virtio_blk_queue_t *const queue =
+        prv_virtio_blk_pick_queue(blk_ctx, &slot_idx, &restore_int);
+    if (!queue) {
+        // The worker task takes a credit per slot, so this is a driver bug.
+        LOG_ERROR("%s: no free request slot", blk_ctx->name);
+        blkdev_complete_req(req, BLKDEV_REQ_ERROR);
+        return;
+    }
+
+    virtio_blk_slot_t *const slot = &queue->slots[slot_idx];
+    prv_virtio_blk_fill_slot(slot, req);
+
+    virtq_desc_t *const desc = &queue->vq.desc[slot_idx];
+    desc->addr = (uintptr_t)slot->table;
+    desc->len = (num_segs + 2) * sizeof(virtq_desc_t);
+    desc->flags = VIRTQ_DESC_F_INDIRECT;
+    desc->next = 0;
+
+    const uint64_t now_us = blktrace_now_us();
+    for (blkdev_req_t *it = req; it; it = it->merged_next) {
+        it->trace.issue_us = now_us;
+    }
+
+    queue->reqs[slot_idx] = req;
+    queue->busy_slots |= 1ull << slot_idx;
+    virtq_add(&queue->vq, slot_idx);
+
+    prv_virtio_blk_queue_unlock(queue, restore_int);
+}
+
+void virtio_blk_if_commit(void *v_blk_ctx) {
+    virtio_blk_ctx_t *const blk_ctx = v_blk_ctx;
+
+    for (size_t queue_idx = 0; queue_idx < blk_ctx->num_queues; queue_idx++) {
+        virtio_blk_queue_t *const queue = &blk_ctx->queues[queue_idx];
+        const bool restore_int = prv_virtio_blk_queue_lock(queue);
+        virtq_kick(&queue->vq);
+        prv_virtio_blk_queue_unlock(queue, restore_int);
+    }
+}
+
+size_t virtio_blk_if_poll(void *v_blk_ctx) {
+    virtio_blk_ctx_t *const blk_ctx = v_blk_ctx;
+
+    size_t num_done = 0;
+    for (size_t queue_idx = 0; queue_idx < blk_ctx->num_queues; queue_idx++) {
+        num_done += prv_virtio_blk_reap(&blk_ctx->queues[queue_idx]);
+    }
+    return num_done;
+}
+
+/**
+ * Returns the number of queues to set up: one per processor, limited by the
+ * device queues, the MSI-X table entries, and #VIRTIO_BLK_MAX_QUEUES.
+ */
+static size_t prv_virtio_blk_num_queues(virtio_blk_ctx_t *blk_ctx) {
+    virtio_pci_dev_t *const vdev = &blk_ctx->vdev;
+    const virtio_blk_cfg_t *const cfg = vdev->dev_cfg;
+
+    size_t num_queues = smp_get_num_procs();
+    if (num_queues > VIRTIO_BLK_MAX_QUEUES) {
+        num_queues = VIRTIO_BLK_MAX_QUEUES;
+    }
+
+    size_t dev_queues = 1;
+    if (virtio_pci_has_feature(vdev, VIRTIO_BLK_F_MQ)) {
+        dev_queues = cfg->num_queues;
+    }
+    if (dev_queues > virtio_pci_num_queues(vdev)) {
+        dev_queues = virtio_pci_num_queues(vdev);
+    }
+    if (num_queues > dev_queues) { num_queues = dev_queues; }
+
+    const size_t num_vecs = pci_msix_num_vecs(vdev->pci_dev);
+    if (num_queues > num_vecs) { num_queues = num_vecs; }
+
+    return num_queues;
+}
+
+/**
+ * Sets up queue @a queue_idx, and steers its completion interrupt to the
+ * processor with the same number.
+ *
+ * @returns `false` if the queue or an interrupt vector is not available.
+ */
+static bool prv_virtio_blk_setup_queue(virtio_blk_ctx_t *blk_ctx,
+                                       uint16_t queue_idx) {
+    virtio_blk_queue_t *const queue = &blk_ctx->queues[queue_idx];
+    queue->blk_ctx = blk_ctx;
+    spinlock_init(&queue->lock);
+
+    uint8_t vec;
+    if (!arch_alloc_msi_vecs(1, &vec)) {
+        LOG_ERROR("%s: no free MSI vector for queue %u", blk_ctx->name,
+                  queue_idx);
+        return false;
+    }
+
+    if (!virtio_pci_setup_queue(&blk_ctx->vdev, &queue->vq, queue_idx,
+                                VIRTIO_BLK_QUEUE_SIZE, queue_idx)) {
+        LOG_ERROR("%s: cannot set up queue %u", blk_ctx->name, queue_idx);
+        return false;
+    }
+
+    const size_t slots_size = queue->vq.size * sizeof(virtio_blk_slot_t);
+    queue->slots = heap_alloc_aligned(slots_size, alignof(virtio_blk_slot_t));
+    kmemset(queue->slots, 0, slots_size);
+
+    arch_set_msi_handler(vec, prv_virtio_blk_msix_handler, queue);
+    const uint8_t proc_num = queue_idx % smp_get_num_procs();
+    return pci_set_msix_vec(blk_ctx->vdev.pci_dev, queue_idx, proc_num, vec);
+}
+
+/// Returns the number of data segments of one request.
+static size_t prv_virtio_blk_req_num_segs(const blkdev_req_t *req) {
+    return req->num_segs == 0 ? 1 : req->num_segs;
+}
+
+/**
+ * Describes the data segments of one request, not including the merged ones,
+ * with descriptors starting at @a inout_desc[*inout_num_segs].
+ */
+static void prv_virtio_blk_req_segs(const blkdev_req_t *req,
+                                    virtq_desc_t *inout_desc,
+                                    size_t *inout_num_segs) {
+    const uint16_t flags = req->op == BLKDEV_OP_READ ? VIRTQ_DESC_F_WRITE : 0;
+
+    if (req->num_segs == 0) {
+        const void *const buf =
+            req->op == BLKDEV_OP_READ ? req->read_buf : req->write_buf;
+        virtq_desc_t *const desc = &inout_desc[(*inout_num_segs)++];
+        desc->addr = (uintptr_t)buf;
+        desc->len = VIRTIO_BLK_SECTOR_SIZE * blkdev_req_sectors(req);
+        desc->flags = flags;
+        return;
+    }
+
+    for (size_t seg_idx = 0; seg_idx < req->num_segs; seg_idx++) {
+        virtq_desc_t *const desc = &inout_desc[(*inout_num_segs)++];
+        desc->addr = req->segs[seg_idx].addr;
+        desc->len = req->segs[seg_idx].len;
+        desc->flags = flags;
+    }
+}
+
+/**
+ * Fills the header and the indirect descriptor table of @a slot for request
+ * @a req and the requests merged into it.
+ */
+static void prv_virtio_blk_fill_slot(virtio_blk_slot_t *slot,
+                                     const blkdev_req_t *req) {
+    slot->hdr.type =
+        req->op == BLKDEV_OP_READ ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+    slot->hdr.reserved = 0;
+    slot->hdr.sector = req->start_sector;
+    slot->status = 0xFF;
+
+    slot->table[0].addr = (uintptr_t)&slot->hdr;
+    slot->table[0].len = sizeof(slot->hdr);
+    slot->table[0].flags = 0;
+
+    // Data descriptors start at index 1.
+    size_t num_descs = 1;
+    for (const blkdev_req_t *it = req; it; it = it->merged_next) {
+        prv_virtio_blk_req_segs(it, slot->table, &num_descs);
+    }
+
+    virtq_desc_t *const status_desc = &slot->table[num_descs++];
+    status_desc->addr = (uintptr_t)&slot->status;
+    status_desc->len = sizeof(slot->status);
+    status_desc->flags = VIRTQ_DESC_F_WRITE;
+
+    for (size_t idx = 0; idx < num_descs - 1; idx++) {
+        slot->table[idx].flags |= VIRTQ_DESC_F_NEXT;
+        slot->table[idx].next = idx + 1;
+    }
+}
+
+/// Locks @a queue and disables interrupts, returns the previous int flag.
+static bool prv_virtio_blk_queue_lock(virtio_blk_queue_t *queue) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&queue->lock);
+    return restore_int;
+}
+
+/// Unlocks @a queue, see #prv_virtio_blk_queue_lock().
+static void prv_virtio_blk_queue_unlock(virtio_blk_queue_t *queue,
+                                        bool restore_int) {
+    spinlock_release(&queue->lock);
+    if (restore_int) { arch_enable_ints(); }
+}
+
+/**
+ * Finds a queue with a free slot, preferring the queue of the running
+ * processor, and reserves the slot.
+ *
+ * @returns The queue, locked with #prv_virtio_blk_queue_lock(), or `NULL` if
+ * all slots are in use.
+ */
+static virtio_blk_queue_t *prv_virtio_blk_pick_queue(virtio_blk_ctx_t *blk_ctx,
+                                                     size_t *out_slot,
+                                                     bool *out_restore_int) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    const size_t first = smp_get_running_proc()->proc_num;
+
+    for (size_t off = 0; off < blk_ctx->num_queues; off++) {
+        virtio_blk_queue_t *const queue =
+            &blk_ctx->queues[(first + off) % blk_ctx->num_queues];
+        spinlock_acquire(&queue->lock);
+
+        const uint64_t all_slots = (1ull << queue->vq.size) - 1;
+        const uint64_t free_slots = ~queue->busy_slots & all_slots;
+        if (free_slots) {
+            *out_slot = __builtin_ctzll(free_slots);
+            *out_restore_int = restore_int;
+            return queue;
+        }
+        spinlock_release(&queue->lock);
+    }
+
+    if (restore_int) { arch_enable_ints(); }
+    return NULL;
+}
+
+/**
+ * Takes the completed requests of @a queue from the used ring, and completes
+ * them. Interrupts must be disabled.
+ *
+ * The requests are taken from the used ring under the queue lock, and completed
+ * after it is released, since completion callbacks may submit new requests.
+ *
+ * @returns The number of completed requests.
+ */
+static size_t prv_virtio_blk_reap(virtio_blk_queue_t *queue) {
+    virtio_blk_ctx_t *const blk_ctx = queue->blk_ctx;
+
+    blkdev_req_t *done_reqs[VIRTIO_BLK_QUEUE_SIZE];
+    bool done_ok[VIRTIO_BLK_QUEUE_SIZE];
+    size_t num_done = 0;
+
+    spinlock_acquire(&queue->lock);
+    do {
+        virtq_used_elem_t elem;
+        while (virtq_pop_used(&queue->vq, &elem)) {
+            const size_t slot_idx = elem.id;
+            if (slot_idx >= queue->vq.size ||
+                !(queue->busy_slots & (1ull << slot_idx))) {
+                LOG_ERROR("%s: spurious completion of slot %zu",
+                          blk_ctx->name, slot_idx);
+                continue;
+            }
+
+            done_reqs[num_done] = queue->reqs[slot_idx];
+            done_ok[num_done] =
+                queue->slots[slot_idx].status == VIRTIO_BLK_S_OK;
+            num_done++;
+
+            queue->reqs[slot_idx] = NULL;
+            queue->busy_slots &= ~(1ull << slot_idx);
+        }
+        // Chains returned after the last pop do not raise an interrupt.
+    } while (!virtq_arm_used(&queue->vq));
+    spinlock_release(&queue->lock);
+
+    for (size_t idx = 0; idx < num_done; idx++) {
+        if (!done_ok[idx]) {
+            LOG_ERROR("%s: request failed, sector %llu", blk_ctx->name,
+                      done_reqs[idx]->start_sector);
+        }
+        blkdev_complete_req(done_reqs[idx], done_ok[idx] ? BLKDEV_REQ_SUCCESS
+                                                         : BLKDEV_REQ_ERROR);
+    }
+    return num_done;
+}
+
+/// Completion interrupt handler of a queue.
+static void prv_virtio_blk_msix_handler(void *ctx) {
+    prv_virtio_blk_reap(ctx);
+}
@@ -0,0 +1,149 @@
+/**
+ * @file virtio_blk.h
+ * Virtio block device driver.
+ *
+ * The driver sets up one virtqueue per processor, as many as the device and
+ * the MSI-X table allow. The completion interrupt of queue `q` is delivered to
+ * processor `q`, and a request is submitted to the queue of the processor it is
+ * submitted on, so that the submission and the completion of a request do not
+ * contend with other processors.
+ *
+ * Each request takes one descriptor of the ring, which points to an indirect
+ * table holding the request header, the data segments and the status byte.
+ *
+ * The device is not notified of each request. #virtio_blk_if_commit() notifies
+ * it once per batch submitted by the worker task, and with
+ * #VIRTIO_F_RING_EVENT_IDX the device and the driver skip the notifications
+ * and interrupts that the other side does not need.
+ *
+ * Refer to Virtual I/O Device (VIRTIO) Version 1.1, section 5.2 Block Device.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blkdev/blkdev.h"
+#include "kspinlock.h"
+#include "pci.h"
+#include "virtio/virtio_pci.h"
+#include "virtio/virtq.h"
+
+/// Sector size of virtio block devices, regardless of the block size (bytes).
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+/// Maximum number of queues per device.
+#define VIRTIO_BLK_MAX_QUEUES 16
+
+/**
+ * Maximum number of requests in flight per queue, less than 64, see
+ * #virtio_blk_queue_t.busy_slots.
+ */
+#define VIRTIO_BLK_QUEUE_SIZE 32
+
+/// Maximum number of data segments per request, see #virtio_blk_if_can_merge.
+#define VIRTIO_BLK_MAX_SEGS 32
+
+typedef struct virtio_blk_ctx virtio_blk_ctx_t;
+
+/// Request header, read by the device.
+typedef struct {
+    uint32_t type; ///< #VIRTIO_BLK_T_IN or #VIRTIO_BLK_T_OUT.
+    uint32_t reserved;
+    uint64_t sector;
+} virtio_blk_req_hdr_t;
+
+/// Per-request memory shared with the device.
+typedef struct [[gnu::aligned(VIRTQ_DESC_ALIGN)]] {
+    /// Indirect descriptor table: header, data segments, and status.
+    virtq_desc_t table[VIRTIO_BLK_MAX_SEGS + 2];
+    virtio_blk_req_hdr_t hdr;
+    /// Status written by the device, #VIRTIO_BLK_S_OK on success.
+    volatile uint8_t status;
+} virtio_blk_slot_t;
+
+typedef struct {
+    virtio_blk_ctx_t *blk_ctx;
+    virtq_t vq;
+    /// Protects the queue, taken with interrupts disabled.
+    spinlock_t lock;
+
+    /// Slot `i` uses descriptor `i` of the ring, #virtq_t.size slots.
+    virtio_blk_slot_t *slots;
+    /// Request submitted in each slot, `NULL` if the slot is free.
+    blkdev_req_t *reqs[VIRTIO_BLK_QUEUE_SIZE];
+    /// Bit `i` is set if slot `i` is in use.
+    uint64_t busy_slots;
+} virtio_blk_queue_t;
+
+struct virtio_blk_ctx {
+    virtio_pci_dev_t vdev;
+    char name[16];
+
+    uint64_t num_sectors;
+    /// Maximum number of data segments per request.
+    uint32_t max_segs;
+
+    virtio_blk_queue_t queues[VIRTIO_BLK_MAX_QUEUES];
+    size_t num_queues;
+};
+
+/**
+ * Initializes virtio block device @a pci_dev and its queues.
+ *
+ * @returns `NULL` if the device does not support the features the driver
+ * needs, i.e., the modern interface, MSI-X, and indirect descriptors.
+ */
+virtio_blk_ctx_t *virtio_blk_new(const pci_dev_t *pci_dev);
+
+/**
+ * Fills the fields of the blkdev interface struct.
+ * See #blkdev_if_t.
+ */
+void virtio_blk_fill_blkdev_if(blkdev_if_t *blkdev_if);
+
+/**
+ * Returns the number of request slots of all queues.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t virtio_blk_if_get_queue_depth(void *v_blk_ctx);
+
+/**
+ * Returns the capacity of the device in sectors.
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+uint64_t virtio_blk_if_get_num_sectors(void *v_blk_ctx);
+
+/**
+ * Returns `true` if the data segments of @a req, the requests merged into it,
+ * and @a next fit into one request, see #virtio_blk_ctx.max_segs.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+bool virtio_blk_if_can_merge(void *v_blk_ctx, const blkdev_req_t *req,
+                             const blkdev_req_t *next);
+
+/**
+ * Adds the request to the queue of the running processor, without notifying
+ * the device.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+void virtio_blk_if_submit_req(blkdev_req_t *req);
+
+/**
+ * Notifies the device of the requests added to each queue since the previous
+ * notification.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+void virtio_blk_if_commit(void *v_blk_ctx);
+
+/**
+ * Takes the completed requests from the used rings, without waiting for the
+ * completion interrupts.
+ *
+ * This is a part of the @ref blkdev_if_t "blkdev interface".
+ */
+size_t virtio_blk_if_poll(void *v_blk_ctx);
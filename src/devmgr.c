@@ -6,10 +6,17 @@
 #include "arch.h"
 #include "assert.h"
 #include "blkdev/ahci.h"
+#include "blkdev/blkmap.h"
 #include "blkdev/blkpart.h"
 #include "blkdev/gpt.h"
+#include "blkdev/nvme.h"
+#include "blkdev/ramdisk.h"
+#include "blkdev/virtio_blk.h"
+#include "cmdline.h"
 #include "devmgr.h"
 #include "kinttypes.h"
+#include "kprintf.h"
+#include "kstring.h"
 #include "log.h"
 #include "memfun.h"
 #include "panic.h"
@@ -33,10 +40,17 @@ static devmgr_dev_t g_devmgr_devs[DEVMGR_MAX_DEVS];
 static size_t g_devmgr_num_devs;
 static uint32_t g_devmgr_next_id = DEVMGR_FIRST_ID;
 
-static devmgr_dev_t *prv_devmgr_init_dev(const pci_dev_t *pci_dev);
-static devmgr_dev_t *prv_devmgr_init_ahci(const pci_dev_t *pci_dev);
+static bool prv_devmgr_init_dev(const pci_dev_t *pci_dev);
+static bool prv_devmgr_init_ahci(const pci_dev_t *pci_dev);
+static bool prv_devmgr_init_virtio_blk(const pci_dev_t *pci_dev);
+static bool prv_devmgr_init_nvme(const pci_dev_t *pci_dev);
+static void prv_devmgr_add_ahci_ports(ahci_ctrl_ctx_t *ahci_ctrl);
+static void prv_devmgr_add_ramdisks(void);
+static void prv_devmgr_add_ramdisk(ramdisk_ctx_t *ramdisk_ctx);
 
 static void prv_devmgr_init_blkparts(devmgr_dev_t *dev);
+static void prv_devmgr_start_blkdev_worker(devmgr_dev_t *dev);
+static void prv_devmgr_steer_ahci_ints(void);
 
 static devmgr_dev_t *prv_devmgr_init_next_dev(void);
 
@@ -54,6 +68,29 @@ void devmgr_init(void) {
     }
 }
 
+void devmgr_probe_blkdevs(void) {
+    ahci_probe_ports();
+
+    const size_t num_ctrls = ahci_num_ctrls();
+    for (size_t ctrl_idx = 0; ctrl_idx < num_ctrls; ctrl_idx++) {
+        prv_devmgr_add_ahci_ports(ahci_get_ctrl(ctrl_idx));
+    }
+
+    prv_devmgr_add_ramdisks();
+}
+
+void devmgr_start_blkdev_workers(void) {
+    devmgr_iter_t iter;
+    devmgr_iter_init(&iter, DEVMGR_CLASS_BLOCK);
+
+    devmgr_dev_t *blkdev;
+    while ((blkdev = devmgr_iter_next(&iter))) {
+        prv_devmgr_start_blkdev_worker(blkdev);
+    }
+
+    prv_devmgr_steer_ahci_ints();
+}
+
 void devmgr_init_blkdev_parts(void) {
     devmgr_iter_t iter;
     devmgr_iter_init(&iter, DEVMGR_CLASS_BLOCK);
@@ -64,6 +101,27 @@ void devmgr_init_blkdev_parts(void) {
     }
 }
 
+devmgr_dev_t *devmgr_add_blkmap(blkmap_ctx_t *map_ctx) {
+    devmgr_dev_t *const dev = prv_devmgr_init_next_dev();
+    if (!dev) {
+        LOG_ERROR("could not register a mapped device: no free device slots");
+        return NULL;
+    }
+
+    dev->dev_class = DEVMGR_CLASS_BLOCK;
+    dev->driver_id = DEVMGR_DRIVER_BLKMAP;
+    dev->blkdev_dev.driver_ctx = map_ctx;
+    blkmap_fill_blkdev_if(&dev->blkdev_dev.driver_intf);
+
+    LOG_INFO("blkdev %" PRIu32 ": %s of %zu legs, %llu sectors", dev->id,
+             map_ctx->type == BLKMAP_STRIPED ? "stripe" : "concatenation",
+             map_ctx->num_legs, map_ctx->num_sectors);
+
+    prv_devmgr_start_blkdev_worker(dev);
+    prv_devmgr_init_blkparts(dev);
+    return dev;
+}
+
 devmgr_dev_t *devmgr_get_by_id(uint32_t id) {
     for (size_t idx = 0; idx < g_devmgr_num_devs; idx++) {
         devmgr_dev_t *const dev = &g_devmgr_devs[idx];
@@ -110,10 +168,14 @@ const char *devmgr_class_name(devmgr_class_t dev_class) {
 
 const char *devmgr_driver_name(devmgr_driver_t driver) {
     switch (driver) {
-    case DEVMGR_DRVIER_NONE:      return "none";
-    case DEVMGR_DRIVER_AHCI_PORT: return "ahci port";
-    case DEVMGR_DRIVER_BLKPART:   return "blkpart";
-    default:                      return "unknown";
+    case DEVMGR_DRVIER_NONE:       return "none";
+    case DEVMGR_DRIVER_AHCI_PORT:  return "ahci port";
+    case DEVMGR_DRIVER_BLKPART:    return "blkpart";
+    case DEVMGR_DRIVER_RAMDISK:    return "ramdisk";
+    case DEVMGR_DRIVER_VIRTIO_BLK: return "virtio blk";
+    case DEVMGR_DRIVER_NVME:       return "nvme";
+    case DEVMGR_DRIVER_BLKMAP:     return "blkmap";
+    default:                       return "unknown";
     }
 }
 
@@ -122,16 +184,24 @@ const char *devmgr_driver_name(devmgr_driver_t driver) {
  *
  * @param pci_dev PCI device to load the driver(s) for.
  *
- * @returns An initialized device context pointer, if there is a driver for the
- * device, otherwise `NULL`.
+ * @returns `true` if there is a driver for the device, and it has been
+ * initialized.
  *
  * @note
- * One PCI device may result in several kernel devices registered.
+ * One PCI device may result in several kernel devices registered. They are
+ * registered once the device has been probed, see #devmgr_probe_blkdevs().
  */
-static devmgr_dev_t *prv_devmgr_init_dev(const pci_dev_t *pci_dev) {
+static bool prv_devmgr_init_dev(const pci_dev_t *pci_dev) {
     if (!pci_dev) { PANIC("prv_devmgr_init_dev: dev = NULL"); }
 
-    devmgr_dev_t *dev = NULL;
+    bool b_ok = false;
+
+    // Virtio devices are identified by their IDs, not by their class.
+    if (virtio_pci_is_dev(pci_dev, VIRTIO_ID_BLOCK)) {
+        LOG_INFO("pci %u-%u-%u: virtio block device", pci_dev->bus_num,
+                 pci_dev->dev_num, pci_dev->fun_num);
+        return prv_devmgr_init_virtio_blk(pci_dev);
+    }
 
     const pci_header_common_t *const pci_header = &pci_dev->header.common;
     if (pci_header->base_class == PCI_BASE_CLASS_MASS_STORAGE) {
@@ -139,13 +209,24 @@ static devmgr_dev_t *prv_devmgr_init_dev(const pci_dev_t *pci_dev) {
             if (pci_header->interface == PCI_SATA_INTERFACE_AHCI) {
                 LOG_INFO("pci %u-%u-%u: SATA DPA, AHBI HBA (major rev. 1)",
                          pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num);
-                dev = prv_devmgr_init_ahci(pci_dev);
+                b_ok = prv_devmgr_init_ahci(pci_dev);
             } else {
                 LOG_ERROR("pci %u-%u-%u: unknown SATA DPA interface %u",
                           pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num,
                           pci_header->interface);
             }
 
+        } else if (pci_header->sub_class == PCI_MASS_STORAGE_NVM_CTRL) {
+            if (pci_header->interface == PCI_NVM_INTERFACE_NVME) {
+                LOG_INFO("pci %u-%u-%u: NVM Express controller",
+                         pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num);
+                b_ok = prv_devmgr_init_nvme(pci_dev);
+            } else {
+                LOG_ERROR("pci %u-%u-%u: unknown NVM interface %u",
+                          pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num,
+                          pci_header->interface);
+            }
+
         } else {
             LOG_ERROR("pci %u-%u-%u: unknown mass storage subclass %u",
                       pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num,
@@ -156,30 +237,89 @@ static devmgr_dev_t *prv_devmgr_init_dev(const pci_dev_t *pci_dev) {
                   pci_dev->dev_num, pci_dev->fun_num, pci_header->base_class);
     }
 
-    return dev;
+    return b_ok;
 }
 
-static devmgr_dev_t *prv_devmgr_init_ahci(const pci_dev_t *pci_dev) {
+static bool prv_devmgr_init_ahci(const pci_dev_t *pci_dev) {
     ASSERT(pci_dev->header.common.base_class == PCI_BASE_CLASS_MASS_STORAGE);
     ASSERT(pci_dev->header.common.sub_class == PCI_MASS_STORAGE_SATA_DPA);
     ASSERT(pci_dev->header.common.interface == PCI_SATA_INTERFACE_AHCI);
 
-    devmgr_dev_t *dev = NULL;
-
     ahci_ctrl_ctx_t *const ahci_ctrl = ahci_ctrl_new(pci_dev);
     if (!ahci_ctrl) {
         LOG_ERROR("pci %u-%u-%u: failed to initialize ahci driver",
                   pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num);
-        return NULL;
+        return false;
+    }
+
+    // The ports are probed later, and their completions are interrupt-driven.
+    ahci_ctrl_map_irq(ahci_ctrl, ARCH_VEC_AHCI_GLOBAL);
+    ahci_ctrl_set_int(ahci_ctrl, true);
+
+    return true;
+}
+
+/**
+ * Initializes virtio block device @a pci_dev and registers it as a block
+ * device. Unlike AHCI, there is nothing to probe later.
+ */
+static bool prv_devmgr_init_virtio_blk(const pci_dev_t *pci_dev) {
+    virtio_blk_ctx_t *const blk_ctx = virtio_blk_new(pci_dev);
+    if (!blk_ctx) {
+        LOG_ERROR("pci %u-%u-%u: failed to initialize virtio blk driver",
+                  pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num);
+        return false;
     }
 
+    devmgr_dev_t *const dev = prv_devmgr_init_next_dev();
+    if (!dev) { return false; }
+
+    dev->dev_class = DEVMGR_CLASS_BLOCK;
+    dev->driver_id = DEVMGR_DRIVER_VIRTIO_BLK;
+    dev->blkdev_dev.driver_ctx = blk_ctx;
+    virtio_blk_fill_blkdev_if(&dev->blkdev_dev.driver_intf);
+
+    LOG_DEBUG("loaded driver for %s", blk_ctx->name);
+    return true;
+}
+
+/**
+ * Initializes NVMe controller @a pci_dev and registers its namespace as a block
+ * device.
+ */
+static bool prv_devmgr_init_nvme(const pci_dev_t *pci_dev) {
+    ASSERT(pci_dev->header.common.base_class == PCI_BASE_CLASS_MASS_STORAGE);
+    ASSERT(pci_dev->header.common.sub_class == PCI_MASS_STORAGE_NVM_CTRL);
+    ASSERT(pci_dev->header.common.interface == PCI_NVM_INTERFACE_NVME);
+
+    nvme_ctrl_ctx_t *const ctrl_ctx = nvme_ctrl_new(pci_dev);
+    if (!ctrl_ctx) {
+        LOG_ERROR("pci %u-%u-%u: failed to initialize nvme driver",
+                  pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num);
+        return false;
+    }
+
+    devmgr_dev_t *const dev = prv_devmgr_init_next_dev();
+    if (!dev) { return false; }
+
+    dev->dev_class = DEVMGR_CLASS_BLOCK;
+    dev->driver_id = DEVMGR_DRIVER_NVME;
+    dev->blkdev_dev.driver_ctx = ctrl_ctx;
+    nvme_fill_blkdev_if(&dev->blkdev_dev.driver_intf);
+
+    LOG_DEBUG("loaded driver for %s", ctrl_ctx->name);
+    return true;
+}
+
+/// Registers the online ports of @a ahci_ctrl as block devices.
+static void prv_devmgr_add_ahci_ports(ahci_ctrl_ctx_t *ahci_ctrl) {
     for (size_t port_idx = 0; port_idx < AHCI_PORTS_PER_CTRL; port_idx++) {
         ahci_port_ctx_t *const ahci_port =
             ahci_ctrl_get_port(ahci_ctrl, port_idx);
         if (!ahci_port_is_online(ahci_port)) { continue; }
 
-        dev = prv_devmgr_init_next_dev();
-        if (!dev) { return NULL; }
+        devmgr_dev_t *const dev = prv_devmgr_init_next_dev();
+        if (!dev) { break; }
 
         dev->dev_class = DEVMGR_CLASS_BLOCK;
         dev->driver_id = DEVMGR_DRIVER_AHCI_PORT;
@@ -191,10 +331,57 @@ static devmgr_dev_t *prv_devmgr_init_ahci(const pci_dev_t *pci_dev) {
         LOG_DEBUG("loaded driver for AHCI Port %s", ahci_port_name(ahci_port));
     }
 
-    ahci_ctrl_map_irq(ahci_ctrl, ARCH_VEC_AHCI_GLOBAL);
-    ahci_ctrl_set_int(ahci_ctrl, true);
+    ahci_ctrl_set_ccc(ahci_ctrl, AHCI_CCC_DEF_CMDS, AHCI_CCC_DEF_TIMEOUT_MS);
+}
 
-    return dev;
+/// Creates the RAM disks requested on the kernel command line, see ramdisk.h.
+static void prv_devmgr_add_ramdisks(void) {
+    char value[64];
+
+    const size_t num_sizes = cmdline_num_values("ramdisk.size-kib");
+    for (size_t idx = 0; idx < num_sizes; idx++) {
+        cmdline_get_value("ramdisk.size-kib", idx, value, sizeof(value));
+        value[sizeof(value) - 1] = '\0';
+
+        uint32_t size_kib;
+        if (!string_to_uint32(value, &size_kib, 10)) {
+            LOG_ERROR("invalid ramdisk.size-kib value '%s'", value);
+            continue;
+        }
+        ramdisk_ctx_t *const ramdisk_ctx = ramdisk_new(size_kib);
+        if (ramdisk_ctx) { prv_devmgr_add_ramdisk(ramdisk_ctx); }
+    }
+
+    const size_t num_mods = cmdline_num_values("ramdisk.mod");
+    for (size_t idx = 0; idx < num_mods; idx++) {
+        cmdline_get_value("ramdisk.mod", idx, value, sizeof(value));
+        value[sizeof(value) - 1] = '\0';
+
+        const arch_boot_mod_t *const mod = arch_boot_find_mod(value);
+        if (!mod) {
+            LOG_ERROR("no module named %s for a RAM disk", value);
+            continue;
+        }
+        ramdisk_ctx_t *const ramdisk_ctx = ramdisk_new_from_mod(mod);
+        if (ramdisk_ctx) { prv_devmgr_add_ramdisk(ramdisk_ctx); }
+    }
+}
+
+/// Registers @a ramdisk_ctx as a block device.
+static void prv_devmgr_add_ramdisk(ramdisk_ctx_t *ramdisk_ctx) {
+    devmgr_dev_t *const dev = prv_devmgr_init_next_dev();
+    if (!dev) {
+        LOG_ERROR("could not register a RAM disk: no free device slots");
+        return;
+    }
+
+    dev->dev_class = DEVMGR_CLASS_BLOCK;
+    dev->driver_id = DEVMGR_DRIVER_RAMDISK;
+    dev->blkdev_dev.driver_ctx = ramdisk_ctx;
+    ramdisk_fill_blkdev_if(&dev->blkdev_dev.driver_intf);
+
+    LOG_INFO("blkdev %" PRIu32 ": RAM disk of %llu sectors", dev->id,
+             ramdisk_ctx->num_sectors);
 }
 
 /**
@@ -238,6 +425,50 @@ static void prv_devmgr_init_blkparts(devmgr_dev_t *dev) {
         dev_part->driver_id = DEVMGR_DRIVER_BLKPART;
         dev_part->blkdev_dev.driver_ctx = blkpart_ctx;
         blkpart_fill_blkdev_if(&dev_part->blkdev_dev.driver_intf);
+
+        prv_devmgr_start_blkdev_worker(dev_part);
+    }
+}
+
+/**
+ * Starts the blkdev worker task of a block device @a dev.
+ * The task is named after the device ID.
+ */
+static void prv_devmgr_start_blkdev_worker(devmgr_dev_t *dev) {
+    char name[TASK_NAME_LEN];
+    ksnprintf(name, sizeof(name), "blkdev%" PRIu32, dev->id);
+    blkdev_start_worker(&dev->blkdev_dev, name);
+}
+
+/**
+ * Switches AHCI Controllers to MSI aimed at the processor of the worker task of
+ * their first port, so that the completion IRQs run where the port's requests
+ * are dispatched. Controllers without MSI keep their global IRQ.
+ *
+ * The completions raise the credit semaphore the worker sleeps on. It is safe
+ * to do so on the worker's processor only because semaphore locks are taken
+ * with interrupts disabled, see #semaphore_increase().
+ */
+static void prv_devmgr_steer_ahci_ints(void) {
+    devmgr_iter_t iter;
+    devmgr_iter_init(&iter, DEVMGR_CLASS_BLOCK);
+
+    // Ports of a controller are registered one after another.
+    ahci_ctrl_ctx_t *prev_ctrl = NULL;
+    devmgr_dev_t *dev;
+    while ((dev = devmgr_iter_next(&iter))) {
+        if (dev->driver_id != DEVMGR_DRIVER_AHCI_PORT) { continue; }
+
+        ahci_ctrl_ctx_t *const ctrl =
+            ahci_port_get_ctrl(dev->blkdev_dev.driver_ctx);
+        if (ctrl == prev_ctrl) { continue; }
+        prev_ctrl = ctrl;
+
+        const uint8_t proc_num = dev->blkdev_dev.worker_task->taskmgr->proc_num;
+        if (!ahci_ctrl_enable_msi(ctrl, proc_num)) {
+            LOG_DEBUG("blkdev %" PRIu32 ": controller keeps its global IRQ",
+                      dev->id);
+        }
     }
 }
 
@@ -0,0 +1,304 @@
+/**
+ * @file dma.c
+ * DMA mapping implementation.
+ */
+
+#include "arch.h"
+#include "arch_vmm.h"
+#include "assert.h"
+#include "cpu.h"
+#include "dma.h"
+#include "heap.h"
+#include "kinttypes.h"
+#include "ksemaphore.h"
+#include "kspinlock.h"
+#include "log.h"
+#include "memfun.h"
+#include "panic.h"
+#include "pmm.h"
+
+static_assert(DMA_BOUNCE_PAGES % 32 == 0, "bounce bitmap is made of words");
+
+static struct {
+    /// Physical address of the bounce pool, zero if there is none.
+    paddr_t pool;
+
+    /// Protects the fields below, taken with interrupts disabled.
+    spinlock_t lock;
+    /// Bit `i` is set if page `i` of the bounce pool is in use.
+    uint32_t busy_pages[DMA_BOUNCE_PAGES / 32];
+
+    /**
+     * Set when a bounce buffer is released, cleared when an allocation fails.
+     * A task in #dma_wait_bounce() does not sleep if it is set.
+     */
+    bool released;
+    /// Number of tasks sleeping on #g_dma.sem_wait.
+    size_t num_waiters;
+    /// Increased once per waiter when a bounce buffer is released.
+    semaphore_t sem_wait;
+} g_dma;
+
+static bool prv_dma_alloc_bounce(size_t num_pages, paddr_t *out_addr);
+static void prv_dma_free_bounce(paddr_t addr, size_t num_pages);
+static bool prv_dma_page_busy(size_t page_idx);
+static void prv_dma_set_pages(size_t first, size_t num_pages, bool busy);
+static void prv_dma_copy(const dma_seg_t *segs, size_t num_segs,
+                         paddr_t bounce, bool to_bounce);
+
+void dma_init(void) {
+    ASSERT(!g_dma.pool);
+
+    spinlock_init(&g_dma.lock);
+    semaphore_init(&g_dma.sem_wait);
+
+    // The pool is only used for devices that do not reach the original data,
+    // so it must be reachable by the most limited of them.
+    const paddr_t pool = pmm_alloc_pages(DMA_BOUNCE_PAGES);
+    if (pool + DMA_BOUNCE_PAGES * PMM_PAGE_SIZE - 1 > DMA_MASK_32BIT) {
+        LOG_ERROR("bounce pool at 0x%llx is above 4 GiB, bouncing is disabled",
+                  pool);
+        pmm_free_pages(pool, DMA_BOUNCE_PAGES);
+        return;
+    }
+    g_dma.pool = pool;
+
+    LOG_DEBUG("bounce pool of %u pages at 0x%llx", DMA_BOUNCE_PAGES, pool);
+}
+
+size_t dma_buf_to_segs(const void *buf, size_t size, dma_seg_t *out_segs,
+                       size_t max_segs) {
+    size_t num_segs = 0;
+    vaddr_t virt = (uintptr_t)buf;
+    size_t left = size;
+
+    while (left > 0) {
+        paddr_t phys;
+        if (!vmm_virt_to_phys(virt, &phys)) {
+            LOG_ERROR("buffer %p: address 0x%08" PRIx32 " is not mapped", buf,
+                      virt);
+            return 0;
+        }
+
+        // A segment may not cross a page boundary, unless the next page is
+        // physically adjacent.
+        const size_t page_left = PMM_PAGE_SIZE - (virt % PMM_PAGE_SIZE);
+        const size_t len = left < page_left ? left : page_left;
+
+        dma_seg_t *const last = num_segs ? &out_segs[num_segs - 1] : NULL;
+        if (last && last->addr + last->len == phys) {
+            last->len += len;
+        } else if (num_segs < max_segs) {
+            out_segs[num_segs].addr = phys;
+            out_segs[num_segs].len = len;
+            num_segs++;
+        } else {
+            LOG_ERROR("buffer %p: more than %zu segments", buf, max_segs);
+            return 0;
+        }
+
+        virt += len;
+        left -= len;
+    }
+
+    return num_segs;
+}
+
+kerr_t dma_map_segs(dma_map_t *map, const dma_seg_t *segs, size_t num_segs,
+                    paddr_t mask, dma_dir_t dir) {
+    map->segs = segs;
+    map->num_segs = num_segs;
+    map->orig_segs = segs;
+    map->orig_num_segs = num_segs;
+    map->dir = dir;
+    map->bounce_seg.addr = 0;
+    map->bounce_seg.len = 0;
+
+    size_t size = 0;
+    bool reachable = true;
+    for (size_t seg_idx = 0; seg_idx < num_segs; seg_idx++) {
+        const dma_seg_t *const seg = &segs[seg_idx];
+        if (seg->len > 0 && seg->addr + seg->len - 1 > mask) {
+            reachable = false;
+        }
+        size += seg->len;
+    }
+    if (reachable) { return KERR_NONE; }
+
+    if (!g_dma.pool ||
+        g_dma.pool + DMA_BOUNCE_PAGES * PMM_PAGE_SIZE - 1 > mask) {
+        return KERR_NOT_SUPP;
+    }
+    const size_t num_pages = PMM_PAGE_ALIGN_UP(size) / PMM_PAGE_SIZE;
+    if (num_pages > DMA_BOUNCE_PAGES) { return KERR_NO_SPACE; }
+
+    paddr_t bounce;
+    if (!prv_dma_alloc_bounce(num_pages, &bounce)) { return KERR_IN_USE; }
+    if (dir == DMA_TO_DEV) { prv_dma_copy(segs, num_segs, bounce, true); }
+
+    map->bounce_seg.addr = bounce;
+    map->bounce_seg.len = size;
+    map->segs = &map->bounce_seg;
+    map->num_segs = 1;
+    return KERR_NONE;
+}
+
+void dma_unmap(dma_map_t *map, bool copy_back) {
+    if (!dma_is_bounced(map)) { return; }
+
+    if (map->dir == DMA_FROM_DEV && copy_back) {
+        prv_dma_copy(map->orig_segs, map->orig_num_segs, map->bounce_seg.addr,
+                     false);
+    }
+    prv_dma_free_bounce(map->bounce_seg.addr,
+                        PMM_PAGE_ALIGN_UP(map->bounce_seg.len) / PMM_PAGE_SIZE);
+
+    map->segs = map->orig_segs;
+    map->num_segs = map->orig_num_segs;
+    map->bounce_seg.addr = 0;
+    map->bounce_seg.len = 0;
+}
+
+bool dma_is_bounced(const dma_map_t *map) {
+    return map->bounce_seg.len > 0;
+}
+
+void dma_wait_bounce(void) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&g_dma.lock);
+
+    // A buffer may have been released since the mapping failed.
+    const bool must_wait = !g_dma.released;
+    if (must_wait) { g_dma.num_waiters++; }
+
+    spinlock_release(&g_dma.lock);
+    if (restore_int) { arch_enable_ints(); }
+
+    if (must_wait) { semaphore_decrease(&g_dma.sem_wait); }
+}
+
+void *dma_alloc_coherent(size_t size, size_t align, paddr_t mask,
+                         paddr_t *out_addr) {
+    ASSERT(size > 0);
+
+    void *const buf = heap_alloc_aligned(size, align);
+    kmemset(buf, 0, size);
+
+    paddr_t phys;
+    if (!vmm_virt_to_phys((uintptr_t)buf, &phys)) {
+        PANIC("coherent buffer %p is not mapped", buf);
+    }
+    // Every following page must be physically adjacent.
+    const vaddr_t first_page = PMM_PAGE_ALIGN_DOWN((uintptr_t)buf);
+    const vaddr_t last_page = PMM_PAGE_ALIGN_DOWN((uintptr_t)buf + size - 1);
+    for (vaddr_t page = first_page + PMM_PAGE_SIZE; page <= last_page;
+         page += PMM_PAGE_SIZE) {
+        paddr_t page_phys;
+        if (!vmm_virt_to_phys(page, &page_phys) ||
+            page_phys != PMM_PAGE_ALIGN_DOWN(phys) + (page - first_page)) {
+            PANIC("coherent buffer %p is not physically contiguous", buf);
+        }
+    }
+    if (phys + size - 1 > mask) {
+        PANIC("coherent buffer at 0x%llx is out of DMA mask 0x%llx", phys,
+              mask);
+    }
+
+    *out_addr = phys;
+    return buf;
+}
+
+void dma_free_coherent(void *buf) {
+    heap_free(buf);
+}
+
+/**
+ * Reserves @a num_pages adjacent pages of the bounce pool.
+ * @returns `false` if there are no such free pages now.
+ */
+static bool prv_dma_alloc_bounce(size_t num_pages, paddr_t *out_addr) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&g_dma.lock);
+
+    // First fit.
+    bool found = false;
+    size_t run = 0;
+    for (size_t page_idx = 0; page_idx < DMA_BOUNCE_PAGES; page_idx++) {
+        run = prv_dma_page_busy(page_idx) ? 0 : run + 1;
+        if (run == num_pages) {
+            const size_t first = page_idx + 1 - num_pages;
+            prv_dma_set_pages(first, num_pages, true);
+            *out_addr = g_dma.pool + first * PMM_PAGE_SIZE;
+            found = true;
+            break;
+        }
+    }
+    // Only a release after this failure lets #dma_wait_bounce() return.
+    if (!found) { g_dma.released = false; }
+
+    spinlock_release(&g_dma.lock);
+    if (restore_int) { arch_enable_ints(); }
+    return found;
+}
+
+/// Releases pages reserved by #prv_dma_alloc_bounce().
+static void prv_dma_free_bounce(paddr_t addr, size_t num_pages) {
+    ASSERT(addr >= g_dma.pool);
+    const size_t first = (addr - g_dma.pool) / PMM_PAGE_SIZE;
+    ASSERT(first + num_pages <= DMA_BOUNCE_PAGES);
+
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    spinlock_acquire(&g_dma.lock);
+
+    prv_dma_set_pages(first, num_pages, false);
+    g_dma.released = true;
+    // Wake up each sleeping task once, so that no count is left behind for
+    // the tasks that have not failed yet.
+    const size_t num_waiters = g_dma.num_waiters;
+    g_dma.num_waiters = 0;
+
+    spinlock_release(&g_dma.lock);
+    if (restore_int) { arch_enable_ints(); }
+
+    for (size_t idx = 0; idx < num_waiters; idx++) {
+        semaphore_increase(&g_dma.sem_wait);
+    }
+}
+
+static bool prv_dma_page_busy(size_t page_idx) {
+    return g_dma.busy_pages[page_idx / 32] & (1u << (page_idx % 32));
+}
+
+static void prv_dma_set_pages(size_t first, size_t num_pages, bool busy) {
+    for (size_t page_idx = first; page_idx < first + num_pages; page_idx++) {
+        const uint32_t bit = 1u << (page_idx % 32);
+        if (busy) {
+            g_dma.busy_pages[page_idx / 32] |= bit;
+        } else {
+            g_dma.busy_pages[page_idx / 32] &= ~bit;
+        }
+    }
+}
+
+/**
+ * Copies the data of @a segs to the bounce buffer at @a bounce if
+ * @a to_bounce is `true`, and back otherwise.
+ *
+ * Both the segments and the bounce pool are identity mapped.
+ */
+static void prv_dma_copy(const dma_seg_t *segs, size_t num_segs,
+                         paddr_t bounce, bool to_bounce) {
+    uint8_t *bounce_buf = (uint8_t *)(uintptr_t)bounce;
+    for (size_t seg_idx = 0; seg_idx < num_segs; seg_idx++) {
+        void *const seg_buf = (void *)(uintptr_t)segs[seg_idx].addr;
+        if (to_bounce) {
+            kmemcpy(bounce_buf, seg_buf, segs[seg_idx].len);
+        } else {
+            kmemcpy(seg_buf, bounce_buf, segs[seg_idx].len);
+        }
+        bounce_buf += segs[seg_idx].len;
+    }
+}
@@ -4,9 +4,11 @@
  */
 
 #include "arch.h"
-#include "blkdev/blkdev.h"
+#include "blkdev/bcache.h"
+#include "blkdev/blktrace.h"
 #include "config.h"
 #include "devmgr.h"
+#include "dma.h"
 #include "init.h"
 #include "kshell/kshell.h"
 #include "log.h"
@@ -29,12 +31,11 @@ void init_bsp_task_common(void) {
 
     arch_create_platform_tasks();
 
-    taskmgr_local_new_kernel_task("blkdev", (uint32_t)blkdev_task_entry);
-
-    LOG_FLOW("waiting for blkdev...");
-    while (!blkdev_is_ready()) {}
-    LOG_FLOW("blkdev task is ready for requests");
-
+    blktrace_init();
+    dma_init();
+    devmgr_probe_blkdevs();
+    devmgr_start_blkdev_workers();
+    bcache_init();
     devmgr_init_blkdev_parts();
 
     kshell();
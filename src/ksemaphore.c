@@ -1,6 +1,8 @@
 #include <stdatomic.h>
 #include <stddef.h>
 
+#include "arch.h"
+#include "cpu.h"
 #include "ksemaphore.h"
 #include "list.h"
 #include "taskmgr.h"
@@ -14,6 +16,12 @@ void semaphore_increase(semaphore_t *sem) {
     // Locking the waiting tasks list for the duration of the whole function
     // body guarantees that when semaphore_decrease() acquires the list lock, it
     // sees that 'count' is not zero.
+    //
+    // The semaphore may be increased by an IRQ handler, so the lock is taken
+    // with interrupts disabled. Otherwise, the handler could spin on the lock
+    // held by semaphore_decrease() on the same processor.
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
     spinlock_acquire(&sem->list_lock);
 
     atomic_fetch_add(&sem->count, 1);
@@ -25,6 +33,18 @@ void semaphore_increase(semaphore_t *sem) {
     }
 
     spinlock_release(&sem->list_lock);
+    if (restore_int) { arch_enable_ints(); }
+}
+
+bool semaphore_try_decrease(semaphore_t *sem) {
+    int old_count = atomic_load(&sem->count);
+    while (old_count > 0) {
+        if (atomic_compare_exchange_weak(&sem->count, &old_count,
+                                         old_count - 1)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void semaphore_decrease(semaphore_t *sem) {
@@ -37,6 +57,9 @@ void semaphore_decrease(semaphore_t *sem) {
                 break;
             }
         } else {
+            // See semaphore_increase() for why interrupts are disabled.
+            const bool restore_int = cpu_get_int_flag();
+            arch_disable_ints();
             spinlock_acquire(&sem->list_lock);
 
             // See mutex_acquire() for the reason behind this second check. In
@@ -44,11 +67,13 @@ void semaphore_decrease(semaphore_t *sem) {
             old_count = atomic_load(&sem->count);
             if (old_count > 0) {
                 spinlock_release(&sem->list_lock);
+                if (restore_int) { arch_enable_ints(); }
                 continue;
             }
 
             taskmgr_block_running_task(&sem->waiting_tasks);
             spinlock_release(&sem->list_lock);
+            if (restore_int) { arch_enable_ints(); }
 
             taskmgr_local_reschedule();
         }
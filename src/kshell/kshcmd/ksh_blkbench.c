@@ -0,0 +1,472 @@
+/**
+ * @file ksh_blkbench.c
+ * Block device benchmark command.
+ *
+ * The benchmark keeps a fixed number of requests in flight against a block
+ * device for a given time, resubmitting each request as soon as it completes.
+ * Latency is measured from the submission to the completion callback with
+ * #arch_timer_current_us(), so it includes the queueing in the blkdev worker.
+ */
+
+#include "arch_timer.h"
+#include "blkdev/blkdev.h"
+#include "devmgr.h"
+#include "heap.h"
+#include "kinttypes.h"
+#include "kprintf.h"
+#include "ksemaphore.h"
+#include "kshell/ksharg.h"
+#include "kshell/kshcmd/ksh_blkbench.h"
+#include "kstring.h"
+#include "memfun.h"
+
+/// Largest supported block size (bytes).
+#define BLKBENCH_MAX_BLOCK_SIZE (256 * 1024)
+
+/// Latency histogram sub-buckets per power of two, see
+/// #prv_ksh_blkbench_bucket().
+#define BLKBENCH_HIST_SUB_BITS 3
+#define BLKBENCH_HIST_SUB      (1 << BLKBENCH_HIST_SUB_BITS)
+/// Number of latency histogram buckets, enough for any 32-bit latency.
+#define BLKBENCH_HIST_LEN \
+    ((32 - BLKBENCH_HIST_SUB_BITS + 1) * BLKBENCH_HIST_SUB)
+
+static ksharg_posarg_desc_t g_ksh_blkbench_posargs[] = {
+    {
+        .name = "device",
+        .help_str = "ID of the block device or partition, see 'devmgr -l'.",
+        .def_val_str = NULL,
+    },
+};
+
+static ksharg_flag_desc_t g_ksh_blkbench_flags[] = {
+    {
+        .short_name = "h",
+        .long_name = "help",
+        .help_str = "Print this message and exit.",
+        .val_name = NULL,
+    },
+    {
+        .short_name = "w",
+        .long_name = "write",
+        .help_str = "Write instead of reading. This destroys the data on the "
+                    "device!",
+        .val_name = NULL,
+    },
+    {
+        .short_name = "r",
+        .long_name = "random",
+        .help_str = "Access random blocks instead of sequential ones.",
+        .val_name = NULL,
+    },
+    {
+        .short_name = "b",
+        .long_name = "block-size",
+        .help_str = "Bytes per request, a multiple of 512 (default 4096).",
+        .val_name = "BYTES",
+        .def_val_str = NULL,
+    },
+    {
+        .short_name = "q",
+        .long_name = "queue-depth",
+        .help_str = "Requests in flight (default 1).",
+        .val_name = "DEPTH",
+        .def_val_str = NULL,
+    },
+    {
+        .short_name = "t",
+        .long_name = "time",
+        .help_str = "Duration of each run (default 5).",
+        .val_name = "SECONDS",
+        .def_val_str = NULL,
+    },
+    {
+        .short_name = "s",
+        .long_name = "sweep",
+        .help_str = "Run with queue depths 1, 2, 4, ... up to DEPTH.",
+        .val_name = NULL,
+    },
+};
+
+static const ksharg_parser_desc_t g_ksh_blkbench_parser = {
+    .name = "blkbench",
+    .description = "Block device benchmark.",
+    .epilog = NULL,
+
+    .num_posargs =
+        sizeof(g_ksh_blkbench_posargs) / sizeof(g_ksh_blkbench_posargs[0]),
+    .posargs = g_ksh_blkbench_posargs,
+
+    .num_flags = sizeof(g_ksh_blkbench_flags) / sizeof(g_ksh_blkbench_flags[0]),
+    .flags = g_ksh_blkbench_flags,
+};
+
+/// Benchmark parameters.
+typedef struct {
+    blkdev_dev_t *dev;
+    uint64_t num_sectors;
+    bool write;
+    bool random;
+    uint32_t block_sectors;
+    uint32_t duration_ms;
+} blkbench_cfg_t;
+
+typedef struct blkbench_run blkbench_run_t;
+
+/// One request kept in flight.
+typedef struct {
+    blkbench_run_t *run;
+    blkdev_req_t *req;
+    uint8_t *buf;
+    uint64_t submit_us;
+    /// Completion time, written by #prv_ksh_blkbench_done().
+    uint64_t done_us;
+    _Atomic bool done;
+} blkbench_slot_t;
+
+/// State and results of one run.
+struct blkbench_run {
+    const blkbench_cfg_t *cfg;
+    blkbench_slot_t slots[blkdevPOOL_REQS];
+    /// Increased for every completed request.
+    semaphore_t sem_done;
+
+    uint64_t next_sector;
+    uint64_t rand_state;
+
+    uint64_t num_ios;
+    uint64_t num_errors;
+    uint64_t lat_sum_us;
+    uint64_t lat_max_us;
+    uint64_t hist[BLKBENCH_HIST_LEN];
+};
+
+static bool prv_ksh_blkbench_parse_uint(const ksharg_flag_inst_t *flag,
+                                        uint32_t def_val, uint32_t *out_val);
+static void prv_ksh_blkbench_run(blkbench_run_t *run, size_t queue_depth);
+static bool prv_ksh_blkbench_submit(blkbench_slot_t *slot);
+static void prv_ksh_blkbench_done(blkdev_req_t *req, void *arg);
+static void prv_ksh_blkbench_print(const blkbench_run_t *run,
+                                   size_t queue_depth, uint64_t elapsed_us);
+static size_t prv_ksh_blkbench_bucket(uint64_t lat_us);
+static uint64_t prv_ksh_blkbench_bucket_max(size_t bucket);
+static uint64_t prv_ksh_blkbench_percentile(const blkbench_run_t *run,
+                                            uint32_t per_mille);
+
+void ksh_blkbench(list_t *arg_list) {
+    ksharg_parser_inst_t *parser;
+    ksharg_err_t err;
+
+    err = ksharg_inst_parser(&g_ksh_blkbench_parser, &parser);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_blkbench: error instantiating the argument parser: %u\n",
+                err);
+        return;
+    }
+
+    err = ksharg_parse_list(parser, arg_list);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_blkbench: error parsing arguments: %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+
+    const char *const flag_names[] = {
+        "help", "write", "random", "block-size", "queue-depth", "time", "sweep",
+    };
+    ksharg_flag_inst_t *flags[sizeof(flag_names) / sizeof(flag_names[0])];
+    for (size_t idx = 0; idx < sizeof(flag_names) / sizeof(flag_names[0]);
+         idx++) {
+        err = ksharg_get_flag_inst(parser, flag_names[idx], &flags[idx]);
+        if (err != KSHARG_ERR_NONE) {
+            kprintf("ksh_blkbench: error getting flag '%s': %u\n",
+                    flag_names[idx], err);
+            ksharg_free_parser_inst(parser);
+            return;
+        }
+    }
+    ksharg_flag_inst_t *const flag_help = flags[0];
+    ksharg_flag_inst_t *const flag_write = flags[1];
+    ksharg_flag_inst_t *const flag_random = flags[2];
+    ksharg_flag_inst_t *const flag_block_size = flags[3];
+    ksharg_flag_inst_t *const flag_queue_depth = flags[4];
+    ksharg_flag_inst_t *const flag_time = flags[5];
+    ksharg_flag_inst_t *const flag_sweep = flags[6];
+
+    if (flag_help->given_str) {
+        ksharg_print_help(&g_ksh_blkbench_parser);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+
+    ksharg_posarg_inst_t *posarg_device;
+    err = ksharg_get_posarg_inst(parser, "device", &posarg_device);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_blkbench: error getting positional argument 'device': "
+                "%u\n",
+                err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+
+    uint32_t dev_id;
+    uint32_t block_size;
+    uint32_t queue_depth;
+    uint32_t duration_s;
+    if (!string_to_uint32(posarg_device->given_str, &dev_id, 10)) {
+        kprintf("ksh_blkbench: bad integer '%s'\n", posarg_device->given_str);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    if (!prv_ksh_blkbench_parse_uint(flag_block_size, 4096, &block_size) ||
+        !prv_ksh_blkbench_parse_uint(flag_queue_depth, 1, &queue_depth) ||
+        !prv_ksh_blkbench_parse_uint(flag_time, 5, &duration_s)) {
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+
+    blkbench_cfg_t cfg = {
+        .write = flag_write->given_str,
+        .random = flag_random->given_str,
+        .block_sectors = block_size / 512,
+        .duration_ms = duration_s * 1000,
+    };
+    const bool sweep = flag_sweep->given_str;
+    ksharg_free_parser_inst(parser);
+
+    devmgr_dev_t *const dev = devmgr_get_by_id(dev_id);
+    if (!dev || (dev->dev_class != DEVMGR_CLASS_BLOCK &&
+                 dev->dev_class != DEVMGR_CLASS_BLOCK_PART)) {
+        kprintf("ksh_blkbench: no block device with ID %" PRIu32 "\n", dev_id);
+        return;
+    }
+    cfg.dev = &dev->blkdev_dev;
+    cfg.num_sectors = blkdev_num_sectors(cfg.dev);
+
+    if (block_size == 0 || block_size % 512 != 0 ||
+        block_size > BLKBENCH_MAX_BLOCK_SIZE) {
+        kprintf("ksh_blkbench: block size must be a multiple of 512 up to "
+                "%u\n",
+                BLKBENCH_MAX_BLOCK_SIZE);
+        return;
+    }
+    if (queue_depth == 0 || queue_depth > blkdevPOOL_REQS) {
+        kprintf("ksh_blkbench: queue depth must be 1 to %u\n",
+                blkdevPOOL_REQS);
+        return;
+    }
+    if (duration_s == 0) {
+        kprintf("ksh_blkbench: time must not be zero\n");
+        return;
+    }
+    if (cfg.num_sectors < cfg.block_sectors) {
+        kprintf("ksh_blkbench: device is smaller than one block\n");
+        return;
+    }
+    if (arch_timer_current_us() == 0) {
+        kprintf("ksh_blkbench: microsecond timer is not calibrated\n");
+        return;
+    }
+
+    blkbench_run_t *const run = heap_alloc(sizeof(*run));
+    kmemset(run, 0, sizeof(*run));
+    run->cfg = &cfg;
+    for (size_t idx = 0; idx < queue_depth; idx++) {
+        blkbench_slot_t *const slot = &run->slots[idx];
+        slot->run = run;
+        slot->req = blkdev_alloc_req(cfg.dev);
+        slot->buf = heap_alloc(block_size);
+        kmemset(slot->buf, 0xA5, block_size);
+    }
+
+    kprintf("%s %s, %" PRIu32 " bytes per request, %" PRIu32 " s per run\n",
+            cfg.random ? "random" : "sequential", cfg.write ? "write" : "read",
+            block_size, duration_s);
+
+    for (size_t depth = sweep ? 1 : queue_depth; depth <= queue_depth;
+         depth *= 2) {
+        prv_ksh_blkbench_run(run, depth);
+        if (!sweep) { break; }
+    }
+
+    for (size_t idx = 0; idx < queue_depth; idx++) {
+        blkdev_free_req(run->slots[idx].req);
+        heap_free(run->slots[idx].buf);
+    }
+    heap_free(run);
+}
+
+/// Parses the value of @a flag, or takes @a def_val if it has not been given.
+static bool prv_ksh_blkbench_parse_uint(const ksharg_flag_inst_t *flag,
+                                        uint32_t def_val, uint32_t *out_val) {
+    if (!flag->given_str) {
+        *out_val = def_val;
+        return true;
+    }
+    if (!string_to_uint32(flag->val_str, out_val, 10)) {
+        kprintf("ksh_blkbench: bad integer '%s'\n", flag->val_str);
+        return false;
+    }
+    return true;
+}
+
+/// Keeps @a queue_depth requests in flight for the configured time.
+static void prv_ksh_blkbench_run(blkbench_run_t *run, size_t queue_depth) {
+    semaphore_init(&run->sem_done);
+    run->next_sector = 0;
+    run->rand_state = 0x9E3779B97F4A7C15ULL;
+    run->num_ios = 0;
+    run->num_errors = 0;
+    run->lat_sum_us = 0;
+    run->lat_max_us = 0;
+    kmemset(run->hist, 0, sizeof(run->hist));
+
+    const uint64_t start_us = arch_timer_current_us();
+    const uint64_t stop_us = start_us + 1000 * (uint64_t)run->cfg->duration_ms;
+
+    size_t num_inflight = 0;
+    for (size_t idx = 0; idx < queue_depth; idx++) {
+        if (prv_ksh_blkbench_submit(&run->slots[idx])) { num_inflight++; }
+    }
+
+    while (num_inflight > 0) {
+        semaphore_decrease(&run->sem_done);
+
+        for (size_t idx = 0; idx < queue_depth; idx++) {
+            blkbench_slot_t *const slot = &run->slots[idx];
+            if (!slot->done) { continue; }
+            slot->done = false;
+            num_inflight--;
+
+            if (slot->req->state != BLKDEV_REQ_SUCCESS) {
+                run->num_errors++;
+                continue;
+            }
+
+            const uint64_t lat_us = slot->done_us - slot->submit_us;
+            run->num_ios++;
+            run->lat_sum_us += lat_us;
+            if (lat_us > run->lat_max_us) { run->lat_max_us = lat_us; }
+            run->hist[prv_ksh_blkbench_bucket(lat_us)]++;
+
+            if (arch_timer_current_us() < stop_us &&
+                prv_ksh_blkbench_submit(slot)) {
+                num_inflight++;
+            }
+        }
+    }
+
+    prv_ksh_blkbench_print(run, queue_depth,
+                           arch_timer_current_us() - start_us);
+}
+
+/// Submits the request of @a slot for the next block.
+static bool prv_ksh_blkbench_submit(blkbench_slot_t *slot) {
+    blkbench_run_t *const run = slot->run;
+    const blkbench_cfg_t *const cfg = run->cfg;
+
+    uint64_t sector;
+    if (cfg->random) {
+        // xorshift64
+        run->rand_state ^= run->rand_state << 13;
+        run->rand_state ^= run->rand_state >> 7;
+        run->rand_state ^= run->rand_state << 17;
+        sector = run->rand_state % (cfg->num_sectors / cfg->block_sectors) *
+                 cfg->block_sectors;
+    } else {
+        if (run->next_sector + cfg->block_sectors > cfg->num_sectors) {
+            run->next_sector = 0;
+        }
+        sector = run->next_sector;
+        run->next_sector += cfg->block_sectors;
+    }
+
+    slot->submit_us = arch_timer_current_us();
+    const bool ok =
+        cfg->write
+            ? blkdev_submit_write(slot->req, sector, cfg->block_sectors,
+                                  slot->buf, 0, prv_ksh_blkbench_done, slot)
+            : blkdev_submit_read(slot->req, sector, cfg->block_sectors,
+                                 slot->buf, prv_ksh_blkbench_done, slot);
+    if (!ok) {
+        kprintf("ksh_blkbench: failed to submit a request\n");
+        run->num_errors++;
+    }
+    return ok;
+}
+
+/// Completion callback of the requests, called in the IRQ handler.
+static void prv_ksh_blkbench_done(blkdev_req_t *req, void *arg) {
+    (void)req;
+    blkbench_slot_t *const slot = arg;
+    slot->done_us = arch_timer_current_us();
+    slot->done = true;
+    semaphore_increase(&slot->run->sem_done);
+}
+
+static void prv_ksh_blkbench_print(const blkbench_run_t *run,
+                                   size_t queue_depth, uint64_t elapsed_us) {
+    if (elapsed_us == 0) { elapsed_us = 1; }
+    const uint64_t iops = run->num_ios * 1000000 / elapsed_us;
+    const uint64_t bytes = run->num_ios * run->cfg->block_sectors * 512;
+    // Tenths of MiB/s.
+    const uint64_t mibps_10 = bytes * 10000000 / elapsed_us / 1048576;
+    const uint64_t avg_us = run->num_ios ? run->lat_sum_us / run->num_ios : 0;
+
+    kprintf("qd %2zu: %7llu IOPS %5llu.%llu MiB/s | lat us avg %llu p50 %llu "
+            "p90 %llu p99 %llu p99.9 %llu max %llu",
+            queue_depth, iops, mibps_10 / 10, mibps_10 % 10, avg_us,
+            prv_ksh_blkbench_percentile(run, 500),
+            prv_ksh_blkbench_percentile(run, 900),
+            prv_ksh_blkbench_percentile(run, 990),
+            prv_ksh_blkbench_percentile(run, 999), run->lat_max_us);
+    if (run->num_errors > 0) {
+        kprintf(" | %llu errors", run->num_errors);
+    }
+    kprintf("\n");
+}
+
+/**
+ * Returns the histogram bucket of latency @a lat_us.
+ *
+ * Latencies below #BLKBENCH_HIST_SUB have a bucket each. Above, every power of
+ * two is split into #BLKBENCH_HIST_SUB buckets, so a bucket is at most 12.5%
+ * wide.
+ */
+static size_t prv_ksh_blkbench_bucket(uint64_t lat_us) {
+    if (lat_us > UINT32_MAX) { lat_us = UINT32_MAX; }
+    if (lat_us < BLKBENCH_HIST_SUB) { return lat_us; }
+
+    const size_t msb = 31 - __builtin_clz((uint32_t)lat_us);
+    const size_t sub = (lat_us >> (msb - BLKBENCH_HIST_SUB_BITS)) &
+                       (BLKBENCH_HIST_SUB - 1);
+    return (msb - BLKBENCH_HIST_SUB_BITS + 1) * BLKBENCH_HIST_SUB + sub;
+}
+
+/// Returns the largest latency that falls into histogram bucket @a bucket.
+static uint64_t prv_ksh_blkbench_bucket_max(size_t bucket) {
+    if (bucket < BLKBENCH_HIST_SUB) { return bucket; }
+
+    const size_t msb =
+        bucket / BLKBENCH_HIST_SUB + BLKBENCH_HIST_SUB_BITS - 1;
+    const uint64_t sub = bucket % BLKBENCH_HIST_SUB;
+    const size_t shift = msb - BLKBENCH_HIST_SUB_BITS;
+    return ((BLKBENCH_HIST_SUB + sub + 1) << shift) - 1;
+}
+
+/// Returns the latency below which @a per_mille of the requests completed.
+static uint64_t prv_ksh_blkbench_percentile(const blkbench_run_t *run,
+                                            uint32_t per_mille) {
+    if (run->num_ios == 0) { return 0; }
+
+    const uint64_t rank = (run->num_ios * per_mille + 999) / 1000;
+    uint64_t count = 0;
+    for (size_t bucket = 0; bucket < BLKBENCH_HIST_LEN; bucket++) {
+        count += run->hist[bucket];
+        if (count >= rank) {
+            const uint64_t lat_us = prv_ksh_blkbench_bucket_max(bucket);
+            return lat_us < run->lat_max_us ? lat_us : run->lat_max_us;
+        }
+    }
+    return run->lat_max_us;
+}
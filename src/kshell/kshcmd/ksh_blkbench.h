@@ -0,0 +1,5 @@
+#pragma once
+
+#include "list.h"
+
+void ksh_blkbench(list_t *arg_list);
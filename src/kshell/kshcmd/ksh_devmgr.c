@@ -1,4 +1,8 @@
+#include "blkdev/ahci.h"
+#include "blkdev/bcache.h"
+#include "blkdev/blktrace.h"
 #include "devmgr.h"
+#include "heap.h"
 #include "kinttypes.h"
 #include "kprintf.h"
 #include "kshell/ksharg.h"
@@ -34,6 +38,57 @@ static ksharg_flag_desc_t g_ksh_devmgr_flags[] = {
         .val_name = "ID",
         .def_val_str = NULL,
     },
+    {
+        .short_name = NULL,
+        .long_name = "bcache",
+        .help_str = "Print block device buffer cache statistics.",
+        .val_name = NULL,
+    },
+    {
+        .short_name = NULL,
+        .long_name = "blktrace",
+        .help_str = "Print and consume the block request trace.",
+        .val_name = NULL,
+    },
+    {
+        .short_name = NULL,
+        .long_name = "ahci-ccc",
+        .help_str = "Set completion coalescing of the AHCI controller of "
+                    "device ID to CMDS completions or MS milliseconds, CMDS 0 "
+                    "disables it.",
+        .val_name = "ID,CMDS,MS",
+        .def_val_str = NULL,
+    },
+    {
+        .short_name = NULL,
+        .long_name = "poll",
+        .help_str = "Poll block device ID for up to US microseconds before "
+                    "sleeping on a small request, US 0 disables polling.",
+        .val_name = "ID,US",
+        .def_val_str = NULL,
+    },
+    {
+        .short_name = NULL,
+        .long_name = "poll-stats",
+        .help_str = "Print hybrid polling statistics of block devices.",
+        .val_name = NULL,
+    },
+    {
+        .short_name = NULL,
+        .long_name = "linear",
+        .help_str = "Create a block device that concatenates block devices "
+                    "with the given IDs.",
+        .val_name = "ID,ID[,...]",
+        .def_val_str = NULL,
+    },
+    {
+        .short_name = NULL,
+        .long_name = "striped",
+        .help_str = "Create a block device that stripes chunks of KIB "
+                    "kibibytes among block devices with the given IDs.",
+        .val_name = "KIB,ID,ID[,...]",
+        .def_val_str = NULL,
+    },
 };
 
 static const ksharg_parser_desc_t g_ksh_devmgr_parser = {
@@ -52,6 +107,13 @@ static const ksharg_parser_desc_t g_ksh_devmgr_parser = {
 static void prv_ksh_devmgr_list(void);
 static void prv_ksh_devmgr_list_pci(void);
 static void prv_ksh_devmgr_dump_pci(const char *id_str);
+static void prv_ksh_devmgr_bcache(void);
+static void prv_ksh_devmgr_blktrace(void);
+static void prv_ksh_devmgr_ahci_ccc(const char *arg_str);
+static void prv_ksh_devmgr_poll(const char *arg_str);
+static void prv_ksh_devmgr_poll_stats(void);
+static uint64_t prv_ksh_devmgr_avg(uint64_t total, uint64_t count);
+static void prv_ksh_devmgr_add_blkmap(const char *arg_str, bool striped);
 
 void ksh_devmgr(list_t *arg_list) {
     ksharg_parser_inst_t *parser;
@@ -75,7 +137,18 @@ void ksh_devmgr(list_t *arg_list) {
     bool do_list;
     bool do_list_pci;
     bool do_dump_pci;
+    bool do_bcache;
+    bool do_blktrace;
+    bool do_ahci_ccc;
+    bool do_poll;
+    bool do_poll_stats;
+    bool do_linear;
+    bool do_striped;
     const char *pci_id_str;
+    const char *ahci_ccc_str;
+    const char *poll_str;
+    const char *linear_str;
+    const char *striped_str;
 
     ksharg_flag_inst_t *flag_help;
     err = ksharg_get_flag_inst(parser, "help", &flag_help);
@@ -114,13 +187,83 @@ void ksh_devmgr(list_t *arg_list) {
     do_dump_pci = flag_dump_pci->given_str;
     pci_id_str = flag_dump_pci->val_str;
 
+    ksharg_flag_inst_t *flag_bcache;
+    err = ksharg_get_flag_inst(parser, "bcache", &flag_bcache);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_devmgr: error getting flag 'bcache': %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    do_bcache = flag_bcache->given_str;
+
+    ksharg_flag_inst_t *flag_blktrace;
+    err = ksharg_get_flag_inst(parser, "blktrace", &flag_blktrace);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_devmgr: error getting flag 'blktrace': %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    do_blktrace = flag_blktrace->given_str;
+
+    ksharg_flag_inst_t *flag_ahci_ccc;
+    err = ksharg_get_flag_inst(parser, "ahci-ccc", &flag_ahci_ccc);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_devmgr: error getting flag 'ahci-ccc': %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    do_ahci_ccc = flag_ahci_ccc->given_str;
+    ahci_ccc_str = flag_ahci_ccc->val_str;
+
+    ksharg_flag_inst_t *flag_poll;
+    err = ksharg_get_flag_inst(parser, "poll", &flag_poll);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_devmgr: error getting flag 'poll': %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    do_poll = flag_poll->given_str;
+    poll_str = flag_poll->val_str;
+
+    ksharg_flag_inst_t *flag_poll_stats;
+    err = ksharg_get_flag_inst(parser, "poll-stats", &flag_poll_stats);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_devmgr: error getting flag 'poll-stats': %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    do_poll_stats = flag_poll_stats->given_str;
+
+    ksharg_flag_inst_t *flag_linear;
+    err = ksharg_get_flag_inst(parser, "linear", &flag_linear);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_devmgr: error getting flag 'linear': %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    do_linear = flag_linear->given_str;
+    linear_str = flag_linear->val_str;
+
+    ksharg_flag_inst_t *flag_striped;
+    err = ksharg_get_flag_inst(parser, "striped", &flag_striped);
+    if (err != KSHARG_ERR_NONE) {
+        kprintf("ksh_devmgr: error getting flag 'striped': %u\n", err);
+        ksharg_free_parser_inst(parser);
+        return;
+    }
+    do_striped = flag_striped->given_str;
+    striped_str = flag_striped->val_str;
+
     if (do_help) {
         ksharg_print_help(&g_ksh_devmgr_parser);
         ksharg_free_parser_inst(parser);
         return;
     }
 
-    if (1 != (int)do_list + (int)do_list_pci + (int)do_dump_pci) {
+    if (1 != (int)do_list + (int)do_list_pci + (int)do_dump_pci +
+                 (int)do_bcache + (int)do_blktrace + (int)do_ahci_ccc +
+                 (int)do_poll + (int)do_poll_stats + (int)do_linear +
+                 (int)do_striped) {
         kprintf("ksh_devmgr: no action specified\n");
         ksharg_free_parser_inst(parser);
         return;
@@ -132,6 +275,20 @@ void ksh_devmgr(list_t *arg_list) {
         prv_ksh_devmgr_list_pci();
     } else if (do_dump_pci) {
         prv_ksh_devmgr_dump_pci(pci_id_str);
+    } else if (do_bcache) {
+        prv_ksh_devmgr_bcache();
+    } else if (do_blktrace) {
+        prv_ksh_devmgr_blktrace();
+    } else if (do_ahci_ccc) {
+        prv_ksh_devmgr_ahci_ccc(ahci_ccc_str);
+    } else if (do_poll) {
+        prv_ksh_devmgr_poll(poll_str);
+    } else if (do_poll_stats) {
+        prv_ksh_devmgr_poll_stats();
+    } else if (do_linear) {
+        prv_ksh_devmgr_add_blkmap(linear_str, false);
+    } else if (do_striped) {
+        prv_ksh_devmgr_add_blkmap(striped_str, true);
     }
 
     ksharg_free_parser_inst(parser);
@@ -176,3 +333,189 @@ static void prv_ksh_devmgr_dump_pci(const char *id_str) {
         kprintf("ksh_devmgr: no PCI device with ID %" PRIu32 "\n", id);
     }
 }
+
+static void prv_ksh_devmgr_bcache(void) {
+    bcache_stats_t stats;
+    bcache_get_stats(&stats);
+
+    kprintf("read hits:    %llu\n", stats.read_hits);
+    kprintf("read misses:  %llu\n", stats.read_misses);
+    kprintf("writes:       %llu\n", stats.writes);
+    kprintf("write-backs:  %llu\n", stats.writebacks);
+    kprintf("evictions:    %llu\n", stats.evictions);
+    kprintf("dirty blocks: %zu/%u\n", stats.dirty_blocks, BCACHE_NUM_BLOCKS);
+    kprintf("read-ahead:   %llu sectors, %llu read\n", stats.readahead_sectors,
+            stats.readahead_hits);
+}
+
+static void prv_ksh_devmgr_blktrace(void) {
+    char buf[4 * BLKTRACE_LINE_LEN + 1];
+    size_t len;
+    while ((len = blktrace_read(buf, sizeof(buf) - 1)) > 0) {
+        buf[len] = '\0';
+        kprintf("%s", buf);
+    }
+    kprintf("%llu record(s) dropped\n", blktrace_num_dropped());
+}
+
+static void prv_ksh_devmgr_ahci_ccc(const char *arg_str) {
+    char *parts[3];
+    const size_t num_parts = string_split(arg_str, ',', false, parts, 3);
+
+    uint32_t vals[3];
+    bool ok = num_parts == 3;
+    for (size_t idx = 0; idx < num_parts && idx < 3; idx++) {
+        if (ok && !string_to_uint32(parts[idx], &vals[idx], 10)) {
+            kprintf("ksh_devmgr: bad integer '%s'\n", parts[idx]);
+            ok = false;
+        }
+        heap_free(parts[idx]);
+    }
+    if (num_parts != 3) {
+        kprintf("ksh_devmgr: expected ID,CMDS,MS, got '%s'\n", arg_str);
+    }
+    if (!ok) { return; }
+
+    if (vals[1] > 255 || vals[2] > 65535) {
+        kprintf("ksh_devmgr: CMDS must be at most 255, MS at most 65535\n");
+        return;
+    }
+
+    devmgr_dev_t *const dev = devmgr_get_by_id(vals[0]);
+    if (!dev || dev->driver_id != DEVMGR_DRIVER_AHCI_PORT) {
+        kprintf("ksh_devmgr: device %" PRIu32 " is not an AHCI port\n",
+                vals[0]);
+        return;
+    }
+
+    ahci_ctrl_ctx_t *const ctrl =
+        ahci_port_get_ctrl(dev->blkdev_dev.driver_ctx);
+    if (!ahci_ctrl_set_ccc(ctrl, vals[1], vals[2])) {
+        kprintf("ksh_devmgr: the controller does not support coalescing\n");
+    }
+}
+
+static void prv_ksh_devmgr_poll(const char *arg_str) {
+    char *parts[2];
+    const size_t num_parts = string_split(arg_str, ',', false, parts, 2);
+
+    uint32_t vals[2];
+    bool ok = num_parts == 2;
+    for (size_t idx = 0; idx < num_parts && idx < 2; idx++) {
+        if (ok && !string_to_uint32(parts[idx], &vals[idx], 10)) {
+            kprintf("ksh_devmgr: bad integer '%s'\n", parts[idx]);
+            ok = false;
+        }
+        heap_free(parts[idx]);
+    }
+    if (num_parts != 2) {
+        kprintf("ksh_devmgr: expected ID,US, got '%s'\n", arg_str);
+    }
+    if (!ok) { return; }
+
+    devmgr_dev_t *const dev = devmgr_get_by_id(vals[0]);
+    if (!dev || dev->dev_class != DEVMGR_CLASS_BLOCK) {
+        kprintf("ksh_devmgr: device %" PRIu32 " is not a block device\n",
+                vals[0]);
+        return;
+    }
+    if (!blkdev_set_poll(&dev->blkdev_dev, vals[1])) {
+        kprintf("ksh_devmgr: the driver of device %" PRIu32
+                " does not support polling\n",
+                vals[0]);
+    }
+}
+
+static void prv_ksh_devmgr_poll_stats(void) {
+    devmgr_iter_t dev_iter;
+    devmgr_iter_init(&dev_iter, DEVMGR_CLASS_BLOCK);
+
+    kprintf("id budget_us polled avg_us missed avg_us slept avg_us\n");
+    devmgr_dev_t *dev;
+    while ((dev = devmgr_iter_next(&dev_iter))) {
+        blkdev_poll_stats_t stats;
+        blkdev_get_poll_stats(&dev->blkdev_dev, &stats);
+        kprintf("%" PRIu32 " %" PRIu32 " %llu %llu %llu %llu %llu %llu\n",
+                dev->id, dev->blkdev_dev.poll_budget_us, stats.polled_waits,
+                prv_ksh_devmgr_avg(stats.polled_us, stats.polled_waits),
+                stats.missed_waits,
+                prv_ksh_devmgr_avg(stats.missed_us, stats.missed_waits),
+                stats.slept_waits,
+                prv_ksh_devmgr_avg(stats.slept_us, stats.slept_waits));
+    }
+}
+
+/// Returns @a total divided by @a count, zero if @a count is zero.
+static uint64_t prv_ksh_devmgr_avg(uint64_t total, uint64_t count) {
+    return count == 0 ? 0 : total / count;
+}
+
+/**
+ * Creates a mapped block device from the value of `--linear` or `--striped`.
+ * For the latter, the first value is the chunk size.
+ */
+static void prv_ksh_devmgr_add_blkmap(const char *arg_str, bool striped) {
+    const size_t max_parts = BLKMAP_MAX_LEGS + 1;
+    char *parts[BLKMAP_MAX_LEGS + 1];
+    const size_t num_parts =
+        string_split(arg_str, ',', false, parts, max_parts);
+
+    uint32_t vals[BLKMAP_MAX_LEGS + 1];
+    bool ok = true;
+    for (size_t idx = 0; idx < num_parts && idx < max_parts; idx++) {
+        if (ok && !string_to_uint32(parts[idx], &vals[idx], 10)) {
+            kprintf("ksh_devmgr: bad integer '%s'\n", parts[idx]);
+            ok = false;
+        }
+        heap_free(parts[idx]);
+    }
+    if (!ok) { return; }
+
+    const size_t first_leg = striped ? 1 : 0;
+    if (num_parts > max_parts || num_parts < first_leg + 2 ||
+        num_parts - first_leg > BLKMAP_MAX_LEGS) {
+        kprintf("ksh_devmgr: expected %s2 to %u device IDs, got '%s'\n",
+                striped ? "KIB and " : "", BLKMAP_MAX_LEGS, arg_str);
+        return;
+    }
+
+    blkdev_dev_t *legs[BLKMAP_MAX_LEGS];
+    const size_t num_legs = num_parts - first_leg;
+    for (size_t leg_idx = 0; leg_idx < num_legs; leg_idx++) {
+        const uint32_t id = vals[first_leg + leg_idx];
+        devmgr_dev_t *const dev = devmgr_get_by_id(id);
+        if (!dev || dev->dev_class == DEVMGR_CLASS_NONE ||
+            !dev->blkdev_dev.worker_task) {
+            kprintf("ksh_devmgr: device %" PRIu32
+                    " is not a running block device\n",
+                    id);
+            return;
+        }
+        for (size_t prev_idx = 0; prev_idx < leg_idx; prev_idx++) {
+            if (legs[prev_idx] == &dev->blkdev_dev) {
+                kprintf("ksh_devmgr: device %" PRIu32 " is given twice\n", id);
+                return;
+            }
+        }
+        legs[leg_idx] = &dev->blkdev_dev;
+    }
+
+    blkmap_ctx_t *map_ctx;
+    if (striped) {
+        // KiB to sectors.
+        if (vals[0] == 0 || vals[0] > UINT32_MAX / 2) {
+            kprintf("ksh_devmgr: bad chunk size %" PRIu32 " KiB\n", vals[0]);
+            return;
+        }
+        map_ctx = blkmap_new_striped(legs, num_legs, 2 * vals[0]);
+    } else {
+        map_ctx = blkmap_new_linear(legs, num_legs);
+    }
+    if (!map_ctx) {
+        kprintf("ksh_devmgr: could not create the device\n");
+        return;
+    }
+
+    devmgr_dev_t *const dev = devmgr_add_blkmap(map_ctx);
+    if (dev) { kprintf("created block device %" PRIu32 "\n", dev->id); }
+}
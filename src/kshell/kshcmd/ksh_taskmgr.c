@@ -147,7 +147,7 @@ static void prv_ksh_taskmgr_list(void) {
                 (uint32_t)p_task->tcb.p_kernel_stack->p_top_max,
                 (int32_t)p_task->tcb.p_kernel_stack->p_top_max -
                     (int32_t)p_task->tcb.p_kernel_stack->p_top,
-                p_task->is_blocked ? "YES" : "NO",
+                p_task->block_state != TASK_UNBLOCKED ? "YES" : "NO",
                 p_task->is_terminating ? "YES" : "NO");
     }
     taskmgr_unlock_all_tasks_list();
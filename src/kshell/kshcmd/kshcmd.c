@@ -7,6 +7,7 @@
 
 #include "assert.h"
 #include "kprintf.h"
+#include "kshell/kshcmd/ksh_blkbench.h"
 #include "kshell/kshcmd/ksh_clear.h"
 #include "kshell/kshcmd/ksh_devmgr.h"
 #include "kshell/kshcmd/ksh_help.h"
@@ -21,6 +22,7 @@
 static const kshell_cmd_t g_kshell_cmds[] = {
     // NOTE: these should be sorted alphabetically, so that the 'help' command
     // lists them in alphabetical order.
+    {"blkbench", ksh_blkbench, "benchmark block devices"},
     {"clear", ksh_clear, "clear the terminal"},
     {"devmgr", ksh_devmgr, "device manager"},
     {"help", ksh_help, "kshell help"},
@@ -7,11 +7,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arch_vmm.h"
 #include "kinttypes.h"
 #include "log.h"
 #include "panic.h"
 #include "pci.h"
 #include "pci_arch.h"
+#include "pmm.h"
 
 /**
  * Maximum number of _connected_ devices supported by the driver.
@@ -20,6 +22,62 @@
  */
 #define PCI_MAX_DEVS 32
 
+/**
+ * Maximum number of capabilities to visit when walking the capability list.
+ * Protects against a malformed list that loops.
+ */
+#define PCI_MAX_CAPS 48
+
+/// Offset of the Command register in the configuration space.
+#define PCI_REG_COMMAND 0x04
+/// Command register Interrupt Disable bit, see #pci_header_common_t.command.
+#define PCI_COMMAND_INT_DISABLE (1u << 10)
+/// Command register Memory Space bit.
+#define PCI_COMMAND_MEM_SPACE (1u << 1)
+/// Command register Bus Master bit.
+#define PCI_COMMAND_BUS_MASTER (1u << 2)
+
+/**
+ * MSI capability registers and Message Control bits, as seen in the first
+ * dword of the capability.
+ * Refer to section 6.8.1 MSI Capability Structure.
+ */
+#define PCI_MSI_REG_ADDR      0x04 //!< Message Address.
+#define PCI_MSI_REG_ADDR_HI   0x08 //!< Message Upper Address (64-bit).
+#define PCI_MSI_REG_DATA      0x08 //!< Message Data (32-bit).
+#define PCI_MSI_REG_DATA_64   0x0C //!< Message Data (64-bit).
+#define PCI_MSI_CTRL_ENABLE   (1u << 16)
+#define PCI_MSI_CTRL_MMC_SHFT 17 //!< Multiple Message Capable.
+#define PCI_MSI_CTRL_MME_SHFT 20 //!< Multiple Message Enable.
+#define PCI_MSI_CTRL_MM_MASK  0x7u
+#define PCI_MSI_CTRL_64BIT    (1u << 23)
+
+/**
+ * MSI-X capability registers and Message Control bits, as seen in the first
+ * dword of the capability.
+ * Refer to section 6.8.2 MSI-X Capability and Table Structure.
+ */
+#define PCI_MSIX_REG_TABLE       0x04 //!< Table Offset and BIR.
+#define PCI_MSIX_CTRL_SIZE_SHFT  16   //!< Table Size minus one.
+#define PCI_MSIX_CTRL_SIZE_MASK  0x7FFu
+#define PCI_MSIX_CTRL_FUN_MASK   (1u << 30)
+#define PCI_MSIX_CTRL_ENABLE     (1u << 31)
+#define PCI_MSIX_TABLE_BIR_MASK  0x7u
+#define PCI_MSIX_ENTRY_SIZE      16
+#define PCI_MSIX_ENTRY_ADDR      0  //!< Message Address dword.
+#define PCI_MSIX_ENTRY_ADDR_HI   1  //!< Message Upper Address dword.
+#define PCI_MSIX_ENTRY_DATA      2  //!< Message Data dword.
+#define PCI_MSIX_ENTRY_CTRL      3  //!< Vector Control dword.
+#define PCI_MSIX_ENTRY_CTRL_MASK 1u //!< Vector Control Mask Bit.
+
+/// Number of BARs in a type 00h header.
+#define PCI_NUM_BARS 6
+/// BAR bits, refer to section 6.2.5.1 Address Maps.
+#define PCI_BAR_IO            0x1u
+#define PCI_BAR_TYPE_MASK     0x6u
+#define PCI_BAR_TYPE_64       0x4u
+#define PCI_BAR_MEM_ADDR_MASK 0xFFFFFFF0u
+
 /**
  * Configuration Address Space (CAS) Address register.
  * Refer to section 3.2.2.3.2 Software Generation of Configuration Transactions.
@@ -41,6 +99,10 @@ static pci_dev_t g_pci_devs[PCI_MAX_DEVS];
 static size_t g_pci_num_devs;
 
 static void prv_pci_enumerate_bus(uint8_t bus_num);
+static volatile uint32_t *prv_pci_msix_table(const pci_dev_t *dev,
+                                             bool map);
+static uint32_t prv_pci_read(const pci_dev_t *dev, uint8_t offset);
+static void prv_pci_write(const pci_dev_t *dev, uint8_t offset, uint32_t val);
 
 void pci_init(void) {
     for (size_t bus_num = 0; bus_num < PCI_ENUM_BUSES; bus_num++) {
@@ -101,6 +163,165 @@ void pci_dump_dev_header(const pci_dev_t *dev) {
     LOG_DEBUG("max_lat = 0x%02X", dev->header.max_lat);
 }
 
+size_t pci_msi_max_vecs(const pci_dev_t *dev) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+    if (dev->msi_cap == 0) { return 0; }
+
+    const uint32_t ctrl = prv_pci_read(dev, dev->msi_cap);
+    return 1u << ((ctrl >> PCI_MSI_CTRL_MMC_SHFT) & PCI_MSI_CTRL_MM_MASK);
+}
+
+bool pci_enable_msi(const pci_dev_t *dev, uint8_t proc_num, uint8_t first_vec,
+                    size_t num_vecs) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+    if (num_vecs == 0 || (num_vecs & (num_vecs - 1)) != 0 ||
+        num_vecs > pci_msi_max_vecs(dev) || first_vec % num_vecs != 0) {
+        return false;
+    }
+
+    uint32_t msg_addr;
+    uint16_t msg_data;
+    pci_arch_msi_msg(proc_num, first_vec, &msg_addr, &msg_data);
+
+    uint32_t ctrl = prv_pci_read(dev, dev->msi_cap);
+    // The message must not be sent while it is being changed.
+    ctrl &= ~PCI_MSI_CTRL_ENABLE;
+    prv_pci_write(dev, dev->msi_cap, ctrl);
+
+    prv_pci_write(dev, dev->msi_cap + PCI_MSI_REG_ADDR, msg_addr);
+    if (ctrl & PCI_MSI_CTRL_64BIT) {
+        prv_pci_write(dev, dev->msi_cap + PCI_MSI_REG_ADDR_HI, 0);
+        prv_pci_write(dev, dev->msi_cap + PCI_MSI_REG_DATA_64, msg_data);
+    } else {
+        prv_pci_write(dev, dev->msi_cap + PCI_MSI_REG_DATA, msg_data);
+    }
+
+    const uint32_t mme = __builtin_ctz(num_vecs);
+    ctrl &= ~(PCI_MSI_CTRL_MM_MASK << PCI_MSI_CTRL_MME_SHFT);
+    ctrl |= (mme << PCI_MSI_CTRL_MME_SHFT) | PCI_MSI_CTRL_ENABLE;
+    prv_pci_write(dev, dev->msi_cap, ctrl);
+
+    // Mask the INTx# pin. The upper half is the Status register, whose error
+    // bits are cleared by writing 1s, so it is written with 0s.
+    uint32_t command = prv_pci_read(dev, PCI_REG_COMMAND) & 0xFFFF;
+    command |= PCI_COMMAND_INT_DISABLE;
+    prv_pci_write(dev, PCI_REG_COMMAND, command);
+
+    LOG_DEBUG("%u-%u-%u: MSI vectors 0x%02x..0x%02x on processor %u",
+              dev->bus_num, dev->dev_num, dev->fun_num, first_vec,
+              (unsigned)(first_vec + num_vecs - 1), proc_num);
+    return true;
+}
+
+uint8_t pci_find_cap(const pci_dev_t *dev, uint8_t cap_id, uint8_t after) {
+    if (!dev->header.common.status_bit.cap_list) { return 0; }
+
+    // The bottom two bits of the pointers are reserved.
+    uint8_t offset = dev->header.cap_ptr & 0xFC;
+    if (after != 0) { offset = (prv_pci_read(dev, after) >> 8) & 0xFC; }
+    for (size_t cnt = 0; cnt < PCI_MAX_CAPS && offset != 0; cnt++) {
+        const uint32_t cap = prv_pci_read(dev, offset);
+        if ((cap & 0xFF) == cap_id) { return offset; }
+        offset = (cap >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+uint32_t pci_read_config(const pci_dev_t *dev, uint8_t offset) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+    return prv_pci_read(dev, offset);
+}
+
+bool pci_map_bar(const pci_dev_t *dev, size_t bar_idx, uint32_t offset,
+                 uint32_t size, uintptr_t *out_addr) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+    if (bar_idx >= PCI_NUM_BARS) { return false; }
+
+    const uint32_t *const bars = &dev->header.bar0;
+    const uint32_t bar = bars[bar_idx];
+    if (bar & PCI_BAR_IO) { return false; }
+    if ((bar & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64 &&
+        (bar_idx + 1 == PCI_NUM_BARS || bars[bar_idx + 1] != 0)) {
+        return false;
+    }
+
+    const uint32_t start = (bar & PCI_BAR_MEM_ADDR_MASK) + offset;
+    for (uint32_t page = PMM_PAGE_ALIGN_DOWN(start);
+         page < PMM_PAGE_ALIGN_UP(start + size); page += PMM_PAGE_SIZE) {
+        vmm_map_kernel_page(page, page);
+    }
+
+    *out_addr = start;
+    return true;
+}
+
+void pci_enable_bus_master(const pci_dev_t *dev) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+
+    // See pci_enable_msi() for why the Status register is written with 0s.
+    uint32_t command = prv_pci_read(dev, PCI_REG_COMMAND) & 0xFFFF;
+    command |= PCI_COMMAND_MEM_SPACE | PCI_COMMAND_BUS_MASTER;
+    prv_pci_write(dev, PCI_REG_COMMAND, command);
+}
+
+size_t pci_msix_num_vecs(const pci_dev_t *dev) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+    if (dev->msix_cap == 0) { return 0; }
+
+    const uint32_t ctrl = prv_pci_read(dev, dev->msix_cap);
+    return ((ctrl >> PCI_MSIX_CTRL_SIZE_SHFT) & PCI_MSIX_CTRL_SIZE_MASK) + 1;
+}
+
+bool pci_enable_msix(const pci_dev_t *dev) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+    if (dev->msix_cap == 0) { return false; }
+
+    volatile uint32_t *const table = prv_pci_msix_table(dev, true);
+    if (!table) { return false; }
+
+    const size_t num_vecs = pci_msix_num_vecs(dev);
+    for (size_t entry = 0; entry < num_vecs; entry++) {
+        volatile uint32_t *const p_entry =
+            &table[entry * PCI_MSIX_ENTRY_SIZE / 4];
+        p_entry[PCI_MSIX_ENTRY_CTRL] |= PCI_MSIX_ENTRY_CTRL_MASK;
+    }
+
+    uint32_t ctrl = prv_pci_read(dev, dev->msix_cap);
+    ctrl &= ~PCI_MSIX_CTRL_FUN_MASK;
+    ctrl |= PCI_MSIX_CTRL_ENABLE;
+    prv_pci_write(dev, dev->msix_cap, ctrl);
+
+    uint32_t command = prv_pci_read(dev, PCI_REG_COMMAND) & 0xFFFF;
+    command |= PCI_COMMAND_INT_DISABLE;
+    prv_pci_write(dev, PCI_REG_COMMAND, command);
+
+    LOG_DEBUG("%u-%u-%u: MSI-X enabled, %zu entries", dev->bus_num,
+              dev->dev_num, dev->fun_num, num_vecs);
+    return true;
+}
+
+bool pci_set_msix_vec(const pci_dev_t *dev, size_t entry, uint8_t proc_num,
+                      uint8_t vec) {
+    if (!dev) { PANIC("invalid argument 'dev' value NULL"); }
+    if (entry >= pci_msix_num_vecs(dev)) { return false; }
+
+    volatile uint32_t *const table = prv_pci_msix_table(dev, false);
+    if (!table) { return false; }
+    volatile uint32_t *const p_entry = &table[entry * PCI_MSIX_ENTRY_SIZE / 4];
+
+    uint32_t msg_addr;
+    uint16_t msg_data;
+    pci_arch_msi_msg(proc_num, vec, &msg_addr, &msg_data);
+
+    // The entry must be masked while it is being changed.
+    p_entry[PCI_MSIX_ENTRY_CTRL] |= PCI_MSIX_ENTRY_CTRL_MASK;
+    p_entry[PCI_MSIX_ENTRY_ADDR] = msg_addr;
+    p_entry[PCI_MSIX_ENTRY_ADDR_HI] = 0;
+    p_entry[PCI_MSIX_ENTRY_DATA] = msg_data;
+    p_entry[PCI_MSIX_ENTRY_CTRL] &= ~PCI_MSIX_ENTRY_CTRL_MASK;
+    return true;
+}
+
 /**
  * Enumerates bus number @a bus_num and adds connected devices to #g_pci_devs.
  * @param bus_num PCI bus to enumerate (0..255).
@@ -151,9 +372,62 @@ static void prv_pci_enumerate_bus(uint8_t bus_num) {
                 (void *)((uint32_t)&dev->header + sizeof(pci_header_common_t)),
                 (sizeof(pci_header_00h_t) - sizeof(pci_header_common_t)) / 4);
 
+            dev->msi_cap = pci_find_cap(dev, PCI_CAP_MSI, 0);
+            dev->msix_cap = pci_find_cap(dev, PCI_CAP_MSIX, 0);
+
             g_pci_num_devs++;
         }
 
         if (g_pci_num_devs == PCI_MAX_DEVS) { break; }
     }
 }
+
+/**
+ * Returns the MSI-X table of device @a dev, `NULL` if it cannot be accessed.
+ * If @a map is `true`, the table is identity mapped, too.
+ */
+static volatile uint32_t *prv_pci_msix_table(const pci_dev_t *dev, bool map) {
+    const uint32_t table_reg =
+        prv_pci_read(dev, dev->msix_cap + PCI_MSIX_REG_TABLE);
+    const size_t bar_idx = table_reg & PCI_MSIX_TABLE_BIR_MASK;
+    const uint32_t offset = table_reg & ~PCI_MSIX_TABLE_BIR_MASK;
+
+    uintptr_t addr;
+    if (map) {
+        const uint32_t size = pci_msix_num_vecs(dev) * PCI_MSIX_ENTRY_SIZE;
+        if (!pci_map_bar(dev, bar_idx, offset, size, &addr)) { return NULL; }
+    } else {
+        const uint32_t *const bars = &dev->header.bar0;
+        if (bar_idx >= PCI_NUM_BARS || (bars[bar_idx] & PCI_BAR_IO)) {
+            return NULL;
+        }
+        addr = (bars[bar_idx] & PCI_BAR_MEM_ADDR_MASK) + offset;
+    }
+    return (volatile uint32_t *)addr;
+}
+
+/// Reads the configuration space dword at byte offset @a offset.
+static uint32_t prv_pci_read(const pci_dev_t *dev, uint8_t offset) {
+    pci_addr_t addr = {0};
+    addr.bit.enable = 1;
+    addr.bit.bus_num = dev->bus_num;
+    addr.bit.dev_num = dev->dev_num;
+    addr.bit.fun_num = dev->fun_num;
+    addr.bit.reg_num = offset / 4;
+
+    uint32_t val;
+    pci_arch_cas_read(addr.val, &val, 1);
+    return val;
+}
+
+/// Writes the configuration space dword at byte offset @a offset.
+static void prv_pci_write(const pci_dev_t *dev, uint8_t offset, uint32_t val) {
+    pci_addr_t addr = {0};
+    addr.bit.enable = 1;
+    addr.bit.bus_num = dev->bus_num;
+    addr.bit.dev_num = dev->dev_num;
+    addr.bit.fun_num = dev->fun_num;
+    addr.bit.reg_num = offset / 4;
+
+    pci_arch_cas_write(addr.val, val);
+}
@@ -10,3 +10,21 @@
  * @param num_dwords Number of dwords to read.
  */
 void pci_arch_cas_read(uint32_t start_addr, void *v_buf, size_t num_dwords);
+
+/**
+ * Writes one dword @a val to the CAS at address @a addr.
+ * @param addr Address.
+ * @param val  Value to write.
+ */
+void pci_arch_cas_write(uint32_t addr, uint32_t val);
+
+/**
+ * Composes an MSI message that raises interrupt vector @a vec on processor
+ * @a proc_num.
+ * @param proc_num Target processor number.
+ * @param vec      Interrupt vector.
+ * @param out_addr Output, Message Address.
+ * @param out_data Output, Message Data.
+ */
+void pci_arch_msi_msg(uint8_t proc_num, uint8_t vec, uint32_t *out_addr,
+                      uint16_t *out_data);
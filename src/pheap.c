@@ -0,0 +1,87 @@
+/**
+ * @file pheap.c
+ * Intrusive pairing heap implementation.
+ */
+
+#include <stddef.h>
+
+#include "pheap.h"
+
+static pheap_node_t *prv_pheap_meld(pheap_t *p_heap, pheap_node_t *p_a,
+                                    pheap_node_t *p_b);
+
+void pheap_init(pheap_t *p_heap, pheap_less_t f_less) {
+    p_heap->p_root = NULL;
+    p_heap->f_less = f_less;
+}
+
+void pheap_insert(pheap_t *p_heap, pheap_node_t *p_node) {
+    p_node->p_child = NULL;
+    p_node->p_sibling = NULL;
+    p_heap->p_root = prv_pheap_meld(p_heap, p_heap->p_root, p_node);
+}
+
+pheap_node_t *pheap_peek(const pheap_t *p_heap) {
+    return p_heap->p_root;
+}
+
+pheap_node_t *pheap_pop(pheap_t *p_heap) {
+    pheap_node_t *const p_root = p_heap->p_root;
+    if (!p_root) { return NULL; }
+
+    // First pass: meld the children in pairs from left to right. The results
+    // are chained in reverse order.
+    pheap_node_t *p_pairs = NULL;
+    pheap_node_t *p_node = p_root->p_child;
+    while (p_node) {
+        pheap_node_t *const p_first = p_node;
+        pheap_node_t *const p_second = p_node->p_sibling;
+        p_node = p_second ? p_second->p_sibling : NULL;
+
+        p_first->p_sibling = NULL;
+        if (p_second) { p_second->p_sibling = NULL; }
+
+        pheap_node_t *const p_pair = prv_pheap_meld(p_heap, p_first, p_second);
+        p_pair->p_sibling = p_pairs;
+        p_pairs = p_pair;
+    }
+
+    // Second pass: meld the pairs from right to left. It is done iteratively,
+    // so that a long chain of children does not exhaust the kernel stack.
+    pheap_node_t *p_new_root = NULL;
+    while (p_pairs) {
+        pheap_node_t *const p_next = p_pairs->p_sibling;
+        p_pairs->p_sibling = NULL;
+        p_new_root = prv_pheap_meld(p_heap, p_new_root, p_pairs);
+        p_pairs = p_next;
+    }
+
+    p_heap->p_root = p_new_root;
+    p_root->p_child = NULL;
+    return p_root;
+}
+
+bool pheap_is_empty(const pheap_t *p_heap) {
+    return p_heap->p_root == NULL;
+}
+
+/**
+ * Melds two heaps, making the greater root the first child of the other one.
+ * Neither root may have siblings.
+ * @returns The root of the melded heap.
+ */
+static pheap_node_t *prv_pheap_meld(pheap_t *p_heap, pheap_node_t *p_a,
+                                    pheap_node_t *p_b) {
+    if (!p_a) { return p_b; }
+    if (!p_b) { return p_a; }
+
+    if (p_heap->f_less(p_b, p_a)) {
+        pheap_node_t *const p_tmp = p_a;
+        p_a = p_b;
+        p_b = p_tmp;
+    }
+
+    p_b->p_sibling = p_a->p_child;
+    p_a->p_child = p_b;
+    return p_a;
+}
@@ -13,6 +13,7 @@
 
 static queue_node_t *new_node(queue_t *p_queue, void *p_data);
 static void free_node(queue_t *p_queue, queue_node_t *p_node);
+static void pop_node(queue_t *p_queue, void *p_buf, size_t item_size);
 
 void queue_init(queue_t *p_queue, size_t max_items, size_t item_size) {
     ASSERT(max_items % 32 == 0);
@@ -70,7 +71,17 @@ bool queue_write(queue_t *p_queue, void *p_data) {
 
 void queue_read(queue_t *p_queue, void *p_buf, size_t item_size) {
     semaphore_decrease(&p_queue->num_nodes);
+    pop_node(p_queue, p_buf, item_size);
+}
+
+bool queue_try_read(queue_t *p_queue, void *p_buf, size_t item_size) {
+    if (!semaphore_try_decrease(&p_queue->num_nodes)) { return false; }
+    pop_node(p_queue, p_buf, item_size);
+    return true;
+}
 
+/// Removes the head item, the caller must have taken it from num_nodes.
+static void pop_node(queue_t *p_queue, void *p_buf, size_t item_size) {
     for (;;) {
         queue_node_t *p_head = atomic_load(&p_queue->p_head);
         queue_node_t *p_tail = atomic_load(&p_queue->p_tail);
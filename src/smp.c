@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include "arch.h"
+#include "cpu.h"
 #include "heap.h"
 #include "kspinlock.h"
 #include "memfun.h"
@@ -151,6 +152,21 @@ void smp_tlb_shootdown_handler(void) {
     arch_ack_ipi();
 }
 
+void smp_send_resched(uint8_t proc_num) {
+    // An IRQ handler on this processor may send an IPI too, and an interrupt
+    // command is written in two parts.
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+    arch_send_ipi(proc_num, ARCH_VEC_RESCHED);
+    if (restore_int) { arch_enable_ints(); }
+}
+
+void smp_resched_handler(void) {
+    // Acknowledge first, since the scheduler may switch to another task.
+    arch_ack_ipi();
+    taskmgr_local_schedule();
+}
+
 [[gnu::noreturn]]
 void smp_ap_trampoline_c(void) {
     // NOTE: this function is called from arch_smp_ap_trampoline().
@@ -12,6 +12,7 @@
 #include "assert.h"
 #include "cpu.h"
 #include "heap.h"
+#include "kinttypes.h"
 #include "kstring.h"
 #include "list.h"
 #include "log.h"
@@ -47,9 +48,22 @@ static void wake_up_sleeping_tasks(void);
 static void prv_taskmgr_add_runnable_task(taskmgr_t *taskmgr, task_t *task);
 static void prv_taskmgr_add_sleeping_task(taskmgr_t *taskmgr, task_t *task);
 static task_t *prv_taskmgr_get_runnable_task(taskmgr_t *taskmgr);
+static void prv_taskmgr_enqueue(taskmgr_t *taskmgr, task_t *task);
+static void prv_taskmgr_push_inbox(taskmgr_t *taskmgr, task_t *task);
+static void prv_taskmgr_drain_inbox(taskmgr_t *taskmgr);
+static bool prv_taskmgr_keeps_caller(task_t *caller_task);
+static void prv_taskmgr_request_steal(taskmgr_t *taskmgr, bool is_idle);
+static void prv_taskmgr_serve_steal(taskmgr_t *taskmgr);
+static bool prv_taskmgr_can_migrate(const task_t *task, uint64_t now_ms);
+static void prv_taskmgr_wake_affine(task_t *task);
+static void prv_taskmgr_kick(taskmgr_t *taskmgr);
+static void prv_taskmgr_update_tick(taskmgr_t *taskmgr, const task_t *next_task,
+                                    uint64_t now_ms);
+static bool prv_taskmgr_wakes_earlier(const pheap_node_t *p_a,
+                                      const pheap_node_t *p_b);
 
 static task_t *new_task(const char *name, taskmgr_t *taskmgr,
-                        uint32_t entry_point);
+                        uint32_t entry_point, uint32_t entry_arg);
 static void map_user_stack(uint32_t *p_dir);
 
 [[gnu::noreturn]] static void idle_task(void);
@@ -84,27 +98,28 @@ void taskmgr_local_init([[gnu::noreturn]] void (*p_init_entry)(void)) {
     taskmgr->proc_num = proc->proc_num;
 
     list_init(&taskmgr->runnable_tasks, NULL);
-    list_init(&taskmgr->sleeping_tasks, NULL);
-    spinlock_init(&taskmgr->runnable_tasks_lock);
-    spinlock_init(&taskmgr->sleeping_tasks_lock);
+    pheap_init(&taskmgr->sleeping_tasks, prv_taskmgr_wakes_earlier);
 
     // Create an idle task.
-    taskmgr->idle_task = new_task("idle", taskmgr, (uint32_t)idle_task);
+    taskmgr->idle_task = new_task("idle", taskmgr, (uint32_t)idle_task, 0);
+    taskmgr->idle_task->is_pinned = true;
     prv_taskmgr_add_runnable_task(taskmgr, taskmgr->idle_task);
 
     // Create the deleter task. It is switched to when the running task needs to
     // be terminated.
     taskmgr->deleter_task =
-        new_task("deleter", taskmgr, (uint32_t)deleter_task);
-    taskmgr->deleter_task->is_blocked = true;
-
-    // Create the initial task.
-    taskmgr->init_task = new_task("init", taskmgr, (uint32_t)p_init_entry);
+        new_task("deleter", taskmgr, (uint32_t)deleter_task, 0);
+    taskmgr->deleter_task->block_state = TASK_BLOCKED;
+    taskmgr->deleter_task->is_pinned = true;
+
+    // Create the initial task. The initial tasks of APs run per-processor jobs,
+    // so they stay on their processors.
+    taskmgr->init_task = new_task("init", taskmgr, (uint32_t)p_init_entry, 0);
+    taskmgr->init_task->is_pinned = true;
+    taskmgr->init_task->tcb.on_cpu = 1;
     taskmgr->running_task = taskmgr->init_task;
-
-    // Initialize the list access spinlocks.
-    spinlock_init(&taskmgr->runnable_tasks_lock);
-    spinlock_init(&taskmgr->sleeping_tasks_lock);
+    taskmgr->next_balance_ms =
+        arch_timer_current_ms() + TASKMGR_BALANCE_PERIOD_MS;
 
     // If interrupts were enabled and PIT IRQ happened after the following line
     // and before the entry, some bad things would happen to the stack.
@@ -119,13 +134,21 @@ bool taskmgr_local_schedule(void) {
     taskmgr_t *const taskmgr = smp_get_running_taskmgr();
     if (!taskmgr) { return false; }
 
-    if (taskmgr->scheduler_lock > 0) { return false; }
+    if (atomic_load_explicit(&taskmgr->scheduler_lock, memory_order_relaxed) >
+        0) {
+        return false;
+    }
 
+    prv_taskmgr_drain_inbox(taskmgr);
     wake_up_sleeping_tasks();
+    prv_taskmgr_serve_steal(taskmgr);
 
+    const uint64_t now_ms = arch_timer_current_ms();
     task_t *const caller_task = taskmgr->running_task;
     task_t *next_task;
-    if (caller_task->is_terminating && !caller_task->is_blocked &&
+    if (caller_task->is_terminating &&
+        atomic_load_explicit(&caller_task->block_state,
+                             memory_order_relaxed) == TASK_UNBLOCKED &&
         caller_task->num_owned_mutexes == 0) {
         next_task = taskmgr->deleter_task;
         taskmgr->task_to_delete = caller_task;
@@ -134,19 +157,37 @@ bool taskmgr_local_schedule(void) {
         taskmgr_local_lock_scheduler();
     } else {
         next_task = prv_taskmgr_get_runnable_task(taskmgr);
+
+        const bool caller_runnable = prv_taskmgr_keeps_caller(caller_task);
+        const bool goes_idle =
+            (!next_task || next_task == taskmgr->idle_task) &&
+            (caller_task == taskmgr->idle_task || !caller_runnable);
+        if (goes_idle) {
+            // Nothing to do here, ask for work from the other processors.
+            prv_taskmgr_request_steal(taskmgr, true);
+        } else if (now_ms >= taskmgr->next_balance_ms) {
+            taskmgr->next_balance_ms = now_ms + TASKMGR_BALANCE_PERIOD_MS;
+            prv_taskmgr_request_steal(taskmgr, false);
+        }
+
         if (!next_task) {
-            if (caller_task->is_blocked) {
+            if (!caller_runnable) {
                 PANIC("no tasks to preempt the blocked running task");
             } else {
+                prv_taskmgr_update_tick(taskmgr, caller_task, now_ms);
                 return false;
             }
         }
 
-        if (!caller_task->is_blocked && !caller_task->is_sleeping) {
+        if (caller_runnable) {
             prv_taskmgr_add_runnable_task(taskmgr, caller_task);
         }
     }
 
+    prv_taskmgr_update_tick(taskmgr, next_task, now_ms);
+
+    caller_task->last_ran_ms = now_ms;
+    next_task->tcb.on_cpu = 1;
     taskmgr->running_task = next_task;
     arch_taskmgr_switch_tasks(caller_task, next_task);
 
@@ -166,9 +207,16 @@ bool taskmgr_local_reschedule(void) {
 }
 
 void taskmgr_local_lock_scheduler(void) {
+    // The running task may migrate to another processor between reading the
+    // task manager and locking it.
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+
     taskmgr_t *const taskmgr = smp_get_running_taskmgr();
     if (!taskmgr) { PANIC("running processor has no task manager"); }
     taskmgr_lock_scheduler(taskmgr);
+
+    if (restore_int) { arch_enable_ints(); }
 }
 
 void taskmgr_local_unlock_scheduler(void) {
@@ -193,12 +241,10 @@ task_t *taskmgr_local_new_user_task(const char *name, uint32_t *p_dir,
 
     map_user_stack(p_dir);
 
-    task_t *task = new_task(name, taskmgr, entry);
+    task_t *task = new_task(name, taskmgr, entry, 0);
     task->tcb.page_dir_phys = ((uint32_t)p_dir);
 
-    taskmgr_local_lock_scheduler();
-    prv_taskmgr_add_runnable_task(taskmgr, task);
-    taskmgr_local_unlock_scheduler();
+    prv_taskmgr_enqueue(taskmgr, task);
 
     return task;
 }
@@ -207,11 +253,20 @@ task_t *taskmgr_local_new_kernel_task(const char *name, uint32_t entry) {
     taskmgr_t *const taskmgr = smp_get_running_taskmgr();
     if (!taskmgr) { PANIC("running processor has no task manager"); }
 
-    task_t *const task = new_task(name, taskmgr, entry);
+    task_t *const task = new_task(name, taskmgr, entry, 0);
 
-    taskmgr_local_lock_scheduler();
-    prv_taskmgr_add_runnable_task(taskmgr, task);
-    taskmgr_local_unlock_scheduler();
+    prv_taskmgr_enqueue(taskmgr, task);
+    return task;
+}
+
+task_t *taskmgr_new_kernel_task(taskmgr_t *taskmgr, const char *name,
+                                uint32_t entry, void *arg) {
+    ASSERT(taskmgr);
+
+    task_t *const task = new_task(name, taskmgr, entry, (uint32_t)arg);
+    task->is_pinned = true;
+
+    prv_taskmgr_enqueue(taskmgr, task);
     return task;
 }
 
@@ -220,6 +275,11 @@ void taskmgr_local_go_usermode(uint32_t entry) {
 }
 
 void taskmgr_local_sleep_ms(uint32_t duration_ms) {
+    // The sleeping tasks are accessed with interrupts disabled. It also keeps
+    // the running task from being migrated while it is being put to sleep.
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
+
     taskmgr_t *const taskmgr = smp_get_running_proc()->taskmgr;
     if (!taskmgr) { PANIC("running processor has no task manager"); }
 
@@ -228,22 +288,21 @@ void taskmgr_local_sleep_ms(uint32_t duration_ms) {
     if (!taskmgr->running_task->is_terminating) {
         taskmgr->running_task->sleep_until_counter_ms =
             arch_timer_current_ms() + duration_ms;
-
-        taskmgr_local_lock_scheduler();
         taskmgr->running_task->is_sleeping = true;
         prv_taskmgr_add_sleeping_task(taskmgr, taskmgr->running_task);
-        taskmgr_local_unlock_scheduler();
     }
+    if (restore_int) { arch_enable_ints(); }
 
-    taskmgr_local_schedule();
+    taskmgr_local_reschedule();
 }
 
 void taskmgr_block_running_task(list_t *task_list) {
+    taskmgr_local_lock_scheduler();
+
     taskmgr_t *const taskmgr = smp_get_running_taskmgr();
     if (!taskmgr) { PANIC("running processor has no task manager"); }
 
-    taskmgr_lock_scheduler(taskmgr);
-    taskmgr->running_task->is_blocked = true;
+    atomic_store(&taskmgr->running_task->block_state, TASK_BLOCKING);
     list_append(task_list, &taskmgr->running_task->list_node);
     taskmgr_unlock_scheduler(taskmgr);
 }
@@ -285,10 +344,18 @@ task_t *taskmgr_get_task_by_id(uint32_t task_id) {
 }
 
 void taskmgr_unblock(task_t *task) {
-    taskmgr_lock_scheduler(task->taskmgr);
-    task->is_blocked = false;
-    prv_taskmgr_add_runnable_task(task->taskmgr, task);
-    taskmgr_unlock_scheduler(task->taskmgr);
+    // If the task has not been switched from yet, its scheduler keeps it
+    // runnable. See #task_t.block_state.
+    task_block_t state = TASK_BLOCKING;
+    if (atomic_compare_exchange_strong(&task->block_state, &state,
+                                       TASK_UNBLOCKED)) {
+        return;
+    }
+    ASSERT(state == TASK_BLOCKED);
+    atomic_store(&task->block_state, TASK_UNBLOCKED);
+
+    prv_taskmgr_wake_affine(task);
+    prv_taskmgr_enqueue(task->taskmgr, task);
 }
 
 /**
@@ -299,64 +366,316 @@ static void wake_up_sleeping_tasks(void) {
     taskmgr_t *const taskmgr = smp_get_running_taskmgr();
     if (!taskmgr) { PANIC("running processor has no task manager"); }
 
-    spinlock_acquire(&taskmgr->sleeping_tasks_lock);
+    // The heap is ordered by the wake-up time, so only the tasks that are due
+    // are looked at.
+    const uint64_t counter_ms = arch_timer_current_ms();
+    const pheap_node_t *p_node;
+    while ((p_node = pheap_peek(&taskmgr->sleeping_tasks))) {
+        task_t *const p_task = PHEAP_NODE_TO_STRUCT(p_node, task_t, sleep_node);
+        if (p_task->sleep_until_counter_ms > counter_ms) { break; }
+
+        pheap_pop(&taskmgr->sleeping_tasks);
+        p_task->is_sleeping = false;
+
+        // The running task is still being put to sleep, e.g., for 0 ms. Now
+        // that it is not sleeping, the scheduler keeps it runnable by itself.
+        if (p_task != taskmgr->running_task) {
+            prv_taskmgr_add_runnable_task(taskmgr, p_task);
+        }
+    }
+}
 
-    uint64_t counter_ms = arch_timer_current_ms();
-    list_t sleep_list_copy = taskmgr->sleeping_tasks;
-    list_clear(&taskmgr->sleeping_tasks);
+/**
+ * Appends @a task to the runnable tasks list of the local task manager
+ * @a taskmgr.
+ *
+ * The list is owned by the running processor, so no lock is taken. The count
+ * is only stored by this processor, so a relaxed load and store are enough,
+ * which are plain moves.
+ */
+static void prv_taskmgr_add_runnable_task(taskmgr_t *taskmgr, task_t *task) {
+    list_append(&taskmgr->runnable_tasks, &task->list_node);
+    const size_t num =
+        atomic_load_explicit(&taskmgr->num_runnable, memory_order_relaxed);
+    atomic_store_explicit(&taskmgr->num_runnable, num + 1,
+                          memory_order_relaxed);
+}
 
-    list_node_t *p_node = sleep_list_copy.p_first_node;
-    while (p_node != NULL) {
-        // Save the next node pointer because list_append() changes it below.
-        list_node_t *p_next = p_node->p_next;
+static void prv_taskmgr_add_sleeping_task(taskmgr_t *taskmgr, task_t *task) {
+    pheap_insert(&taskmgr->sleeping_tasks, &task->sleep_node);
+}
 
-        task_t *p_task = LIST_NODE_TO_STRUCT(p_node, task_t, list_node);
-        if (p_task->sleep_until_counter_ms <= counter_ms) {
-            taskmgr_unblock(p_task);
-        } else {
-            list_append(&taskmgr->sleeping_tasks, &p_task->list_node);
-        }
+/**
+ * Makes the task @a task runnable on the task manager @a taskmgr.
+ *
+ * The local task manager gets it in its runnable tasks list right away.
+ * Otherwise, it is pushed to the inbox of @a taskmgr.
+ */
+static void prv_taskmgr_enqueue(taskmgr_t *taskmgr, task_t *task) {
+    const bool restore_int = cpu_get_int_flag();
+    arch_disable_ints();
 
-        p_node = p_next;
+    if (taskmgr == smp_get_running_taskmgr()) {
+        prv_taskmgr_add_runnable_task(taskmgr, task);
+    } else {
+        prv_taskmgr_push_inbox(taskmgr, task);
+        prv_taskmgr_kick(taskmgr);
     }
 
-    spinlock_release(&taskmgr->sleeping_tasks_lock);
+    if (restore_int) { arch_enable_ints(); }
 }
 
-static void prv_taskmgr_add_runnable_task(taskmgr_t *taskmgr, task_t *task) {
-    spinlock_acquire(&taskmgr->runnable_tasks_lock);
-    list_append(&taskmgr->runnable_tasks, &task->list_node);
-    spinlock_release(&taskmgr->runnable_tasks_lock);
+/**
+ * Pushes @a task to the inbox of @a taskmgr.
+ * It is safe to call it on any processor at any time.
+ */
+static void prv_taskmgr_push_inbox(taskmgr_t *taskmgr, task_t *task) {
+    task_t *head = atomic_load_explicit(&taskmgr->inbox, memory_order_relaxed);
+    do {
+        task->inbox_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &taskmgr->inbox, &head, task, memory_order_release,
+        memory_order_relaxed));
 }
 
-static void prv_taskmgr_add_sleeping_task(taskmgr_t *taskmgr, task_t *task) {
-    spinlock_acquire(&taskmgr->sleeping_tasks_lock);
-    list_append(&taskmgr->sleeping_tasks, &task->list_node);
-    spinlock_release(&taskmgr->sleeping_tasks_lock);
+/**
+ * Moves the tasks from the inbox of the local task manager @a taskmgr to its
+ * runnable tasks list.
+ */
+static void prv_taskmgr_drain_inbox(taskmgr_t *taskmgr) {
+    // Most of the time the inbox is empty, and checking it is a plain load.
+    if (!atomic_load_explicit(&taskmgr->inbox, memory_order_relaxed)) {
+        return;
+    }
+
+    task_t *task =
+        atomic_exchange_explicit(&taskmgr->inbox, NULL, memory_order_acquire);
+
+    // The inbox is a stack. Reverse it, so that the tasks are run in the order
+    // they were pushed in.
+    task_t *first = NULL;
+    while (task) {
+        task_t *const next = task->inbox_next;
+        task->inbox_next = first;
+        first = task;
+        task = next;
+    }
+
+    for (task = first; task; task = task->inbox_next) {
+        prv_taskmgr_add_runnable_task(taskmgr, task);
+    }
 }
 
+/**
+ * Checks if the task @a caller_task that is being switched from stays
+ * runnable.
+ *
+ * A blocked task is marked as switched from here, unless it has been
+ * unblocked in the meantime. See #task_t.block_state.
+ */
+static bool prv_taskmgr_keeps_caller(task_t *caller_task) {
+    task_block_t state =
+        atomic_load_explicit(&caller_task->block_state, memory_order_relaxed);
+    if (state == TASK_BLOCKING &&
+        atomic_compare_exchange_strong(&caller_task->block_state, &state,
+                                       TASK_BLOCKED)) {
+        return false;
+    }
+
+    // On failure, the exchange has loaded the new state.
+    return state == TASK_UNBLOCKED && !caller_task->is_sleeping;
+}
+
+/**
+ * Sends a reschedule IPI to the processor of @a taskmgr, to which a runnable
+ * task has just been added, if the processor runs its idle task.
+ *
+ * There are no task priorities, so a processor that runs another task picks
+ * the new one up at its next tick as usual.
+ */
+static void prv_taskmgr_kick(taskmgr_t *taskmgr) {
+    if (taskmgr->running_task == taskmgr->idle_task) {
+        smp_send_resched(taskmgr->proc_num);
+    }
+}
+
+/**
+ * Stops the periodic tick if @a next_task is the idle task with nothing else
+ * to run, and restarts it otherwise.
+ *
+ * While the tick is stopped, the timer interrupts once at the earliest wake-up
+ * time of a sleeping task, but at least every #TASKMGR_BALANCE_PERIOD_MS to
+ * look for work on the other processors.
+ */
+static void prv_taskmgr_update_tick(taskmgr_t *taskmgr, const task_t *next_task,
+                                    uint64_t now_ms) {
+    const bool is_idle =
+        next_task == taskmgr->idle_task &&
+        atomic_load_explicit(&taskmgr->num_runnable, memory_order_relaxed) ==
+            0 &&
+        !atomic_load_explicit(&taskmgr->inbox, memory_order_relaxed);
+    if (!is_idle) {
+        if (taskmgr->is_tick_stopped) {
+            arch_timer_start_tick();
+            taskmgr->is_tick_stopped = false;
+        }
+        return;
+    }
+
+    uint64_t wake_ms = now_ms + TASKMGR_BALANCE_PERIOD_MS;
+    const pheap_node_t *const p_node = pheap_peek(&taskmgr->sleeping_tasks);
+    if (p_node) {
+        const task_t *const p_task =
+            PHEAP_NODE_TO_STRUCT(p_node, task_t, sleep_node);
+        if (p_task->sleep_until_counter_ms < wake_ms) {
+            wake_ms = p_task->sleep_until_counter_ms;
+        }
+    }
+
+    arch_timer_stop_tick(wake_ms > now_ms ? wake_ms - now_ms : 1);
+    taskmgr->is_tick_stopped = true;
+}
+
+/// Orders #taskmgr_t.sleeping_tasks by #task_t.sleep_until_counter_ms.
+static bool prv_taskmgr_wakes_earlier(const pheap_node_t *p_a,
+                                      const pheap_node_t *p_b) {
+    return PHEAP_NODE_TO_STRUCT(p_a, task_t, sleep_node)
+               ->sleep_until_counter_ms <
+           PHEAP_NODE_TO_STRUCT(p_b, task_t, sleep_node)
+               ->sleep_until_counter_ms;
+}
+
+/// Pops the first task from the runnable tasks list of the local @a taskmgr.
 static task_t *prv_taskmgr_get_runnable_task(taskmgr_t *taskmgr) {
     task_t *runnable_task = NULL;
 
-    spinlock_acquire(&taskmgr->runnable_tasks_lock);
     list_node_t *const runnable_node = list_pop_first(&taskmgr->runnable_tasks);
     if (runnable_node) {
         runnable_task = LIST_NODE_TO_STRUCT(runnable_node, task_t, list_node);
+        const size_t num =
+            atomic_load_explicit(&taskmgr->num_runnable, memory_order_relaxed);
+        atomic_store_explicit(&taskmgr->num_runnable, num - 1,
+                              memory_order_relaxed);
     }
-    spinlock_release(&taskmgr->runnable_tasks_lock);
 
     return runnable_task;
 }
 
+/**
+ * Asks the busiest other task manager for a runnable task, which it pushes to
+ * the inbox of @a taskmgr when it schedules next.
+ *
+ * The runnable tasks of a task manager are only accessed by its processor, so
+ * they cannot be taken from here directly.
+ *
+ * @param taskmgr Local task manager.
+ * @param is_idle `true` if @a taskmgr has nothing to run, then any waiting
+ *                task is worth taking. Otherwise, the busiest task manager
+ *                must have at least two runnable tasks more than @a taskmgr.
+ */
+static void prv_taskmgr_request_steal(taskmgr_t *taskmgr, bool is_idle) {
+    taskmgr_t *busiest = NULL;
+    size_t busiest_num = 0;
+    const uint8_t num_procs = smp_get_num_procs();
+    for (uint8_t proc_num = 0; proc_num < num_procs; proc_num++) {
+        const smp_proc_t *const proc = smp_get_proc(proc_num);
+        if (!proc || !proc->taskmgr || proc->taskmgr == taskmgr) { continue; }
+
+        const size_t num = atomic_load_explicit(&proc->taskmgr->num_runnable,
+                                                memory_order_relaxed);
+        if (num > busiest_num) {
+            busiest = proc->taskmgr;
+            busiest_num = num;
+        }
+    }
+
+    // The idle task is counted too, so a single runnable task is most likely
+    // the idle one or the one that is about to be run.
+    if (!busiest || busiest_num < 2) { return; }
+    if (!is_idle) {
+        const size_t local_num =
+            atomic_load_explicit(&taskmgr->num_runnable, memory_order_relaxed);
+        if (busiest_num < local_num + 2) { return; }
+    }
+
+    // A task manager serves one request at a time.
+    taskmgr_t *no_req = NULL;
+    atomic_compare_exchange_strong(&busiest->steal_req, &no_req, taskmgr);
+}
+
+/**
+ * Hands a runnable task of the local task manager @a taskmgr over to the task
+ * manager that has asked for it, if any.
+ * See #prv_taskmgr_request_steal().
+ */
+static void prv_taskmgr_serve_steal(taskmgr_t *taskmgr) {
+    if (!atomic_load_explicit(&taskmgr->steal_req, memory_order_relaxed)) {
+        return;
+    }
+    taskmgr_t *const thief = atomic_exchange(&taskmgr->steal_req, NULL);
+
+    const uint64_t now_ms = arch_timer_current_ms();
+    task_t *stolen_task;
+
+    // The first tasks have waited the longest and are the least cache-hot.
+    LIST_FIND(&taskmgr->runnable_tasks, stolen_task, task_t, list_node,
+              prv_taskmgr_can_migrate(p_task, now_ms), p_task);
+    if (!stolen_task) { return; }
+
+    list_remove(&taskmgr->runnable_tasks, &stolen_task->list_node);
+    const size_t num =
+        atomic_load_explicit(&taskmgr->num_runnable, memory_order_relaxed);
+    atomic_store_explicit(&taskmgr->num_runnable, num - 1,
+                          memory_order_relaxed);
+
+    LOG_FLOW("processor %u gives task %" PRIu32 " to processor %u",
+             taskmgr->proc_num, stolen_task->id, thief->proc_num);
+    stolen_task->taskmgr = thief;
+    prv_taskmgr_push_inbox(thief, stolen_task);
+    prv_taskmgr_kick(thief);
+}
+
+/**
+ * Checks if the runnable task @a task may be moved to another task manager.
+ * @param now_ms Current timer counter value.
+ */
+static bool prv_taskmgr_can_migrate(const task_t *task, uint64_t now_ms) {
+    if (task->is_pinned) { return false; }
+    return now_ms - task->last_ran_ms >= TASKMGR_CACHE_HOT_MS;
+}
+
+/**
+ * Moves the blocked task @a task to the running processor, if its own
+ * processor is busier.
+ *
+ * The woken up task is likely to consume the data that the waker has just
+ * produced, which is still in the cache of the running processor.
+ */
+static void prv_taskmgr_wake_affine(task_t *task) {
+    taskmgr_t *const taskmgr = smp_get_running_taskmgr();
+    if (!taskmgr || taskmgr == task->taskmgr) { return; }
+
+    // The task may be blocked, but its processor may not have switched from it
+    // yet.
+    if (task->is_pinned || task->tcb.on_cpu) { return; }
+
+    const size_t local_num =
+        atomic_load_explicit(&taskmgr->num_runnable, memory_order_relaxed);
+    const size_t owner_num = atomic_load_explicit(&task->taskmgr->num_runnable,
+                                                  memory_order_relaxed);
+    if (owner_num >= local_num + 2) { task->taskmgr = taskmgr; }
+}
+
 /**
  * Creates a new kernel-mode task with a kernel stack.
  * @param name        Task name (maximum length #TASK_NAME_LEN counting NUL).
  * @param taskmgr     Task manager that will be responsible for the task.
  * @param entry_point Kernel-mode entry point.
+ * @param entry_arg   Argument that @a entry_point sees as its first parameter.
  * @returns Task context pointer.
  */
 static task_t *new_task(const char *name, taskmgr_t *taskmgr,
-                        uint32_t entry_point) {
+                        uint32_t entry_point, uint32_t entry_arg) {
     task_t *task = heap_alloc(sizeof(*task));
     __builtin_memset(task, 0, sizeof(*task));
     task->id = (g_new_task_id++);
@@ -383,6 +702,10 @@ static task_t *new_task(const char *name, taskmgr_t *taskmgr,
     task->tcb.page_dir_phys = ((uint32_t)vmm_kvas_dir());
     task->tcb.p_kernel_stack = &task->kernel_stack;
 
+    // Set up the argument of the task entry function. Entries that take no
+    // arguments simply ignore it.
+    stack_push(&task->kernel_stack, entry_arg);
+
     // Set up the fake value that will be effectively a return address for the
     // task entry function. It is also the last return address that the stack
     // walker sees, if the EBP, which is pushed below, points to unmapped
@@ -437,9 +760,23 @@ static void map_user_stack(uint32_t *p_dir) {
  */
 [[gnu::noreturn]]
 static void idle_task(void) {
-    __asm__ volatile("sti");
+    taskmgr_t *const taskmgr = smp_get_running_taskmgr();
+    if (!taskmgr) { PANIC("running processor has no task manager"); }
+
     for (;;) {
-        __asm__ volatile("hlt");
+        // A task may be woken up by any interrupt, e.g., by an IRQ handler.
+        // Switch to it right away, since the tick may be stopped. STI delays
+        // interrupts until after HLT, so that no wake-up is missed in between.
+        arch_disable_ints();
+        const bool has_work =
+            atomic_load_explicit(&taskmgr->num_runnable,
+                                 memory_order_relaxed) > 0 ||
+            atomic_load_explicit(&taskmgr->inbox, memory_order_relaxed);
+        if (has_work && taskmgr_local_schedule()) {
+            // Check again, a task may have been added while the others ran.
+            continue;
+        }
+        __asm__ volatile("sti; hlt");
     }
 }
 
@@ -455,7 +792,8 @@ static void deleter_task(void) {
     for (;;) {
         ASSERT(taskmgr->task_to_delete);
         ASSERT(taskmgr->task_to_delete->is_terminating);
-        ASSERT(!taskmgr->task_to_delete->is_blocked);
+        ASSERT(atomic_load_explicit(&taskmgr->task_to_delete->block_state,
+                                    memory_order_relaxed) == TASK_UNBLOCKED);
         ASSERT(taskmgr->task_to_delete->num_owned_mutexes == 0);
 
         heap_free(taskmgr->task_to_delete->kernel_stack.p_bottom);
@@ -478,9 +816,10 @@ static void deleter_task(void) {
 
         // Mark the deleter task as 'blocked' so that it is not added to the
         // list of runnable tasks when it is switched from.
-        taskmgr->deleter_task->is_blocked = true;
+        atomic_store_explicit(&taskmgr->deleter_task->block_state,
+                              TASK_BLOCKED, memory_order_relaxed);
 
         taskmgr_local_unlock_scheduler();
-        taskmgr_local_schedule();
+        taskmgr_local_reschedule();
     }
 }
@@ -0,0 +1,188 @@
+/**
+ * @file virtio_pci.c
+ * Virtio over PCI transport implementation.
+ */
+
+#include "arch.h"
+#include "log.h"
+#include "virtio/virtio_pci.h"
+
+/// PCI device ID of a transitional device is this plus the device ID minus 1.
+#define VIRTIO_PCI_TRANS_BASE_ID 0x1000
+
+/**
+ * Virtio structure PCI capability fields, offsets from the capability start.
+ * Refer to section 4.1.4 Virtio Structure PCI Capabilities.
+ */
+#define VIRTIO_PCI_CAP_TYPE   3  //!< cfg_type (byte).
+#define VIRTIO_PCI_CAP_BAR    4  //!< bar (byte).
+#define VIRTIO_PCI_CAP_OFFSET 8  //!< offset (dword).
+#define VIRTIO_PCI_CAP_LENGTH 12 //!< length (dword).
+#define VIRTIO_PCI_CAP_MULT   16 //!< notify_off_multiplier (dword).
+
+/// Virtio structure types, see #VIRTIO_PCI_CAP_TYPE.
+typedef enum {
+    VIRTIO_PCI_CAP_COMMON_CFG = 1,
+    VIRTIO_PCI_CAP_NOTIFY_CFG = 2,
+    VIRTIO_PCI_CAP_ISR_CFG = 3,
+    VIRTIO_PCI_CAP_DEVICE_CFG = 4,
+} virtio_pci_cap_type_t;
+
+static bool prv_virtio_pci_map_cap(virtio_pci_dev_t *vdev, uint8_t cap);
+
+bool virtio_pci_is_dev(const pci_dev_t *pci_dev, virtio_dev_id_t dev_id) {
+    const pci_header_common_t *const header = &pci_dev->header.common;
+    return header->vendor_id == VIRTIO_PCI_VENDOR_ID &&
+           (header->device_id == VIRTIO_PCI_MODERN_BASE_ID + dev_id ||
+            header->device_id == VIRTIO_PCI_TRANS_BASE_ID + dev_id - 1);
+}
+
+bool virtio_pci_init(virtio_pci_dev_t *vdev, const pci_dev_t *pci_dev) {
+    vdev->pci_dev = pci_dev;
+    vdev->common = NULL;
+    vdev->notify_base = 0;
+    vdev->dev_cfg = NULL;
+    vdev->features = 0;
+
+    for (uint8_t cap = pci_find_cap(pci_dev, PCI_CAP_VENDOR, 0); cap != 0;
+         cap = pci_find_cap(pci_dev, PCI_CAP_VENDOR, cap)) {
+        if (!prv_virtio_pci_map_cap(vdev, cap)) { return false; }
+    }
+    if (!vdev->common || !vdev->notify_base || !vdev->dev_cfg) {
+        LOG_ERROR("%u-%u-%u: no modern virtio interface", pci_dev->bus_num,
+                  pci_dev->dev_num, pci_dev->fun_num);
+        return false;
+    }
+
+    pci_enable_bus_master(pci_dev);
+
+    // Refer to section 3.1.1 Driver Requirements: Device Initialization.
+    vdev->common->device_status = 0;
+    while (vdev->common->device_status != 0) { arch_pause_in_loop(); }
+    vdev->common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    vdev->common->device_status |= VIRTIO_STATUS_DRIVER;
+    return true;
+}
+
+bool virtio_pci_negotiate(virtio_pci_dev_t *vdev, uint64_t wanted) {
+    volatile virtio_pci_common_cfg_t *const common = vdev->common;
+
+    common->device_feature_select = 0;
+    uint64_t offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (uint64_t)common->device_feature << 32;
+
+    const uint64_t version_1 = 1ull << VIRTIO_F_VERSION_1;
+    if (!(offered & version_1)) { return false; }
+    const uint64_t accepted = (offered & wanted) | version_1;
+
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t)accepted;
+    common->driver_feature_select = 1;
+    common->driver_feature = (uint32_t)(accepted >> 32);
+
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) { return false; }
+
+    vdev->features = accepted;
+    return true;
+}
+
+bool virtio_pci_has_feature(const virtio_pci_dev_t *vdev, uint32_t bit) {
+    return (vdev->features >> bit) & 1;
+}
+
+uint16_t virtio_pci_num_queues(virtio_pci_dev_t *vdev) {
+    return vdev->common->num_queues;
+}
+
+bool virtio_pci_setup_queue(virtio_pci_dev_t *vdev, virtq_t *vq, uint16_t idx,
+                            uint16_t max_size, uint16_t msix_entry) {
+    volatile virtio_pci_common_cfg_t *const common = vdev->common;
+
+    common->queue_select = idx;
+    uint16_t size = common->queue_size;
+    if (size == 0) { return false; }
+    if (size > max_size) { size = max_size; }
+    // Split queues must have a power of two size.
+    while (size & (size - 1)) { size &= size - 1; }
+
+    const bool event_idx =
+        virtio_pci_has_feature(vdev, VIRTIO_F_RING_EVENT_IDX);
+    if (!virtq_init(vq, idx, size, event_idx)) { return false; }
+
+    common->queue_size = size;
+    common->queue_desc_lo = (uintptr_t)vq->desc;
+    common->queue_desc_hi = 0;
+    common->queue_driver_lo = (uintptr_t)vq->avail;
+    common->queue_driver_hi = 0;
+    common->queue_device_lo = (uintptr_t)vq->used;
+    common->queue_device_hi = 0;
+
+    common->queue_msix_vector = msix_entry;
+    if (common->queue_msix_vector != msix_entry) {
+        LOG_ERROR("virtio queue %u: MSI-X entry %u rejected", idx, msix_entry);
+        return false;
+    }
+
+    vq->notify = (IO16 *)(vdev->notify_base +
+                          common->queue_notify_off * vdev->notify_mult);
+    common->queue_enable = 1;
+    return true;
+}
+
+void virtio_pci_driver_ok(virtio_pci_dev_t *vdev) {
+    vdev->common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+void virtio_pci_fail(virtio_pci_dev_t *vdev) {
+    if (vdev->common) {
+        vdev->common->device_status |= VIRTIO_STATUS_FAILED;
+    }
+}
+
+/**
+ * Maps the structure described by vendor-specific capability @a cap.
+ * Structure types that the driver does not use are skipped.
+ * @returns `false` if the structure cannot be mapped.
+ */
+static bool prv_virtio_pci_map_cap(virtio_pci_dev_t *vdev, uint8_t cap) {
+    const pci_dev_t *const pci_dev = vdev->pci_dev;
+    const uint32_t dword0 = pci_read_config(pci_dev, cap);
+    const uint32_t dword1 = pci_read_config(pci_dev, cap + 4);
+    const uint8_t type = dword0 >> (8 * VIRTIO_PCI_CAP_TYPE);
+    const uint8_t bar = dword1 & 0xFF;
+    const uint32_t offset =
+        pci_read_config(pci_dev, cap + VIRTIO_PCI_CAP_OFFSET);
+    const uint32_t length =
+        pci_read_config(pci_dev, cap + VIRTIO_PCI_CAP_LENGTH);
+
+    // The first capability of each type is the preferred one.
+    uintptr_t addr;
+    switch (type) {
+    case VIRTIO_PCI_CAP_COMMON_CFG:
+        if (vdev->common) { return true; }
+        if (!pci_map_bar(pci_dev, bar, offset, length, &addr)) { break; }
+        vdev->common = (volatile virtio_pci_common_cfg_t *)addr;
+        return true;
+    case VIRTIO_PCI_CAP_NOTIFY_CFG:
+        if (vdev->notify_base) { return true; }
+        if (!pci_map_bar(pci_dev, bar, offset, length, &addr)) { break; }
+        vdev->notify_base = addr;
+        vdev->notify_mult =
+            pci_read_config(pci_dev, cap + VIRTIO_PCI_CAP_MULT);
+        return true;
+    case VIRTIO_PCI_CAP_DEVICE_CFG:
+        if (vdev->dev_cfg) { return true; }
+        if (!pci_map_bar(pci_dev, bar, offset, length, &addr)) { break; }
+        vdev->dev_cfg = (volatile void *)addr;
+        return true;
+    default:
+        // The ISR status is only used with INTx#, MSI-X does not need it.
+        return true;
+    }
+
+    LOG_ERROR("%u-%u-%u: cannot map virtio structure %u in BAR %u",
+              pci_dev->bus_num, pci_dev->dev_num, pci_dev->fun_num, type, bar);
+    return false;
+}
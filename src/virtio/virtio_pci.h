@@ -0,0 +1,129 @@
+/**
+ * @file virtio_pci.h
+ * Virtio over PCI transport.
+ *
+ * Only the modern (virtio 1.0 and later) interface is supported: the device
+ * registers are located through vendor-specific PCI capabilities, and queue
+ * interrupts are delivered with MSI-X.
+ *
+ * Refer to Virtual I/O Device (VIRTIO) Version 1.1, section 4.1 Virtio Over
+ * PCI Bus.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "types.h"
+#include "virtio/virtq.h"
+
+/// PCI vendor ID of virtio devices.
+#define VIRTIO_PCI_VENDOR_ID 0x1AF4
+/// PCI device ID of a modern device is this plus the virtio device ID.
+#define VIRTIO_PCI_MODERN_BASE_ID 0x1040
+
+/// Virtio device IDs, refer to section 5 Device Types.
+typedef enum {
+    VIRTIO_ID_BLOCK = 2,
+} virtio_dev_id_t;
+
+/// Feature bit: the device complies with virtio 1.0 or later.
+#define VIRTIO_F_VERSION_1 32
+
+/// MSI-X vector value that disables an interrupt.
+#define VIRTIO_PCI_NO_VECTOR 0xFFFF
+
+/// Device status bits, see #virtio_pci_common_cfg_t.device_status.
+typedef enum {
+    VIRTIO_STATUS_ACKNOWLEDGE = 1,
+    VIRTIO_STATUS_DRIVER = 2,
+    VIRTIO_STATUS_DRIVER_OK = 4,
+    VIRTIO_STATUS_FEATURES_OK = 8,
+    VIRTIO_STATUS_NEEDS_RESET = 64,
+    VIRTIO_STATUS_FAILED = 128,
+} virtio_status_t;
+
+/**
+ * Common configuration structure.
+ * Refer to section 4.1.4.3 Common configuration structure layout.
+ */
+typedef struct [[gnu::packed]] {
+    IO32 device_feature_select;
+    IO32 device_feature;
+    IO32 driver_feature_select;
+    IO32 driver_feature;
+    IO16 msix_config;
+    IO16 num_queues;
+    IO8 device_status;
+    IO8 config_generation;
+
+    IO16 queue_select;
+    IO16 queue_size;
+    IO16 queue_msix_vector;
+    IO16 queue_enable;
+    IO16 queue_notify_off;
+    IO32 queue_desc_lo;
+    IO32 queue_desc_hi;
+    IO32 queue_driver_lo;
+    IO32 queue_driver_hi;
+    IO32 queue_device_lo;
+    IO32 queue_device_hi;
+} virtio_pci_common_cfg_t;
+
+/// Virtio PCI device context.
+typedef struct {
+    const pci_dev_t *pci_dev;
+
+    volatile virtio_pci_common_cfg_t *common;
+    /// Base of the queue notification addresses.
+    uintptr_t notify_base;
+    /// Multiplier of #virtio_pci_common_cfg_t.queue_notify_off.
+    uint32_t notify_mult;
+    /// Device-specific configuration structure.
+    volatile void *dev_cfg;
+
+    /// Negotiated features, see #virtio_pci_negotiate().
+    uint64_t features;
+} virtio_pci_dev_t;
+
+/// Returns `true` if @a pci_dev is a virtio device with device ID @a dev_id.
+bool virtio_pci_is_dev(const pci_dev_t *pci_dev, virtio_dev_id_t dev_id);
+
+/**
+ * Maps the device registers, resets the device, and acknowledges it.
+ *
+ * @returns `false` if the device does not support the modern interface.
+ */
+bool virtio_pci_init(virtio_pci_dev_t *vdev, const pci_dev_t *pci_dev);
+
+/**
+ * Accepts the features of @a wanted that the device offers, together with
+ * #VIRTIO_F_VERSION_1.
+ *
+ * @returns `false` if the device rejects the features. The accepted features
+ * are saved to #virtio_pci_dev_t.features.
+ */
+bool virtio_pci_negotiate(virtio_pci_dev_t *vdev, uint64_t wanted);
+
+/// Returns `true` if feature @a bit has been negotiated.
+bool virtio_pci_has_feature(const virtio_pci_dev_t *vdev, uint32_t bit);
+
+/// Returns the number of queues the device has.
+uint16_t virtio_pci_num_queues(virtio_pci_dev_t *vdev);
+
+/**
+ * Sets up queue @a idx of at most @a max_size descriptors, and makes it raise
+ * MSI-X table entry @a msix_entry.
+ *
+ * @returns `false` if the queue is not available.
+ */
+bool virtio_pci_setup_queue(virtio_pci_dev_t *vdev, virtq_t *vq, uint16_t idx,
+                            uint16_t max_size, uint16_t msix_entry);
+
+/// Tells the device that the driver is ready, the queues become live.
+void virtio_pci_driver_ok(virtio_pci_dev_t *vdev);
+
+/// Tells the device that the driver has given up on it.
+void virtio_pci_fail(virtio_pci_dev_t *vdev);
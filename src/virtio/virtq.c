@@ -0,0 +1,116 @@
+/**
+ * @file virtq.c
+ * Virtio split virtqueue implementation.
+ */
+
+#include <stdatomic.h>
+
+#include "heap.h"
+#include "memfun.h"
+#include "virtio/virtq.h"
+
+/// Ring header: flags and idx (16-bit words).
+#define VIRTQ_RING_HDR 2
+/// Index of the idx field in a ring (16-bit words).
+#define VIRTQ_RING_IDX 1
+
+static bool prv_virtq_need_event(uint16_t event, uint16_t new_idx,
+                                 uint16_t old_idx);
+
+bool virtq_init(virtq_t *vq, uint16_t idx, uint16_t size, bool event_idx) {
+    if (size == 0 || (size & (size - 1)) != 0) { return false; }
+
+    kmemset(vq, 0, sizeof(*vq));
+    vq->idx = idx;
+    vq->size = size;
+    vq->event_idx = event_idx;
+
+    const size_t desc_size = size * sizeof(virtq_desc_t);
+    // flags, idx, ring[size], used_event
+    const size_t avail_size = (VIRTQ_RING_HDR + size + 1) * sizeof(uint16_t);
+    // flags, idx, ring[size], avail_event
+    const size_t used_size = VIRTQ_RING_HDR * sizeof(uint16_t) +
+                             size * sizeof(virtq_used_elem_t) +
+                             sizeof(uint16_t);
+
+    vq->desc = heap_alloc_aligned(desc_size, VIRTQ_DESC_ALIGN);
+    vq->avail = heap_alloc_aligned(avail_size, 2);
+    vq->used = heap_alloc_aligned(used_size, 4);
+    kmemset(vq->desc, 0, desc_size);
+    kmemset((void *)vq->avail, 0, avail_size);
+    kmemset((void *)vq->used, 0, used_size);
+
+    return true;
+}
+
+void virtq_add(virtq_t *vq, uint16_t head) {
+    vq->avail[VIRTQ_RING_HDR + (vq->avail_idx & (vq->size - 1))] = head;
+    vq->avail_idx++;
+
+    // The ring entry and the descriptors must be visible before the index.
+    atomic_thread_fence(memory_order_release);
+    vq->avail[VIRTQ_RING_IDX] = vq->avail_idx;
+}
+
+bool virtq_kick(virtq_t *vq) {
+    const uint16_t old_idx = vq->kicked_idx;
+    const uint16_t new_idx = vq->avail_idx;
+    if (old_idx == new_idx) { return false; }
+    vq->kicked_idx = new_idx;
+
+    // The index must be visible before the device's avail_event is read,
+    // otherwise both sides may decide that the other one is going to look.
+    atomic_thread_fence(memory_order_seq_cst);
+
+    bool notify;
+    if (vq->event_idx) {
+        const IO16 *const used_words = vq->used;
+        const size_t avail_event_word =
+            VIRTQ_RING_HDR + vq->size * sizeof(virtq_used_elem_t) / 2;
+        notify = prv_virtq_need_event(used_words[avail_event_word], new_idx,
+                                      old_idx);
+    } else {
+        // Used ring flags, bit 0 is VIRTQ_USED_F_NO_NOTIFY.
+        notify = !(vq->used[0] & 1);
+    }
+
+    if (notify) { *vq->notify = vq->idx; }
+    return notify;
+}
+
+bool virtq_pop_used(virtq_t *vq, virtq_used_elem_t *out_elem) {
+    if (vq->used_idx == vq->used[VIRTQ_RING_IDX]) { return false; }
+
+    // The element must not be read before the index.
+    atomic_thread_fence(memory_order_acquire);
+
+    const volatile virtq_used_elem_t *const ring =
+        (const volatile virtq_used_elem_t *)&vq->used[VIRTQ_RING_HDR];
+    const volatile virtq_used_elem_t *const elem =
+        &ring[vq->used_idx & (vq->size - 1)];
+    out_elem->id = elem->id;
+    out_elem->len = elem->len;
+    vq->used_idx++;
+    return true;
+}
+
+bool virtq_arm_used(virtq_t *vq) {
+    if (vq->event_idx) {
+        vq->avail[VIRTQ_RING_HDR + vq->size] = vq->used_idx;
+    }
+
+    // Same as in virtq_kick(), but the other way around.
+    atomic_thread_fence(memory_order_seq_cst);
+    return vq->used_idx == vq->used[VIRTQ_RING_IDX];
+}
+
+/**
+ * Returns `true` if the other side asked to be notified at index @a event,
+ * and the index has moved from @a old_idx past it to @a new_idx.
+ * Refer to section 2.6.7.2 Driver Requirements: Used Buffer Notification
+ * Suppression.
+ */
+static bool prv_virtq_need_event(uint16_t event, uint16_t new_idx,
+                                 uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
@@ -0,0 +1,110 @@
+/**
+ * @file virtq.h
+ * Virtio split virtqueue.
+ *
+ * The driver adds descriptor chains to the available ring with #virtq_add(),
+ * and notifies the device of a batch of them with #virtq_kick(). The device
+ * returns the chains in the used ring, see #virtq_pop_used().
+ *
+ * If #VIRTIO_F_RING_EVENT_IDX has been negotiated, both sides suppress the
+ * notifications that the other side does not need: the device tells how far
+ * it has read the available ring, and the driver tells how far it has
+ * consumed the used ring, see #virtq_arm_used().
+ *
+ * The functions do no locking, the caller serializes the access to a queue.
+ *
+ * Refer to Virtual I/O Device (VIRTIO) Version 1.1, section 2.6 Split
+ * Virtqueues.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/// Feature bit: descriptors may point to tables of descriptors.
+#define VIRTIO_F_RING_INDIRECT_DESC 28
+/// Feature bit: the used_event and avail_event fields are used.
+#define VIRTIO_F_RING_EVENT_IDX 29
+
+/// Descriptor flags, see #virtq_desc_t.flags.
+#define VIRTQ_DESC_F_NEXT     1 //!< The chain continues via the next field.
+#define VIRTQ_DESC_F_WRITE    2 //!< The buffer is written by the device.
+#define VIRTQ_DESC_F_INDIRECT 4 //!< The buffer is a table of descriptors.
+
+/// Alignment of a descriptor table, including indirect ones (bytes).
+#define VIRTQ_DESC_ALIGN 16
+
+typedef struct {
+    uint64_t addr; ///< Physical address of the buffer.
+    uint32_t len;  ///< Length of the buffer (bytes).
+    uint16_t flags;
+    uint16_t next; ///< Next descriptor if #VIRTQ_DESC_F_NEXT is set.
+} virtq_desc_t;
+
+typedef struct {
+    uint32_t id;  ///< Head descriptor of the returned chain.
+    uint32_t len; ///< Number of bytes written by the device.
+} virtq_used_elem_t;
+
+typedef struct {
+    /// Queue number, see #virtio_pci_setup_queue().
+    uint16_t idx;
+    /// Number of descriptors, a power of two.
+    uint16_t size;
+    bool event_idx;
+
+    /// Descriptor table.
+    virtq_desc_t *desc;
+    /**
+     * Available ring: flags, idx, ring[size], and used_event.
+     * Written by the driver.
+     */
+    IO16 *avail;
+    /**
+     * Used ring: flags, idx, ring[size] of #virtq_used_elem_t, and
+     * avail_event. Written by the device.
+     */
+    IO16 *used;
+    /// Address to write #virtq_t.idx to in order to notify the device.
+    IO16 *notify;
+
+    /// Available ring index of the next added chain.
+    uint16_t avail_idx;
+    /// #virtq_t.avail_idx at the time of the previous notification.
+    uint16_t kicked_idx;
+    /// Used ring index of the next chain to take from the device.
+    uint16_t used_idx;
+} virtq_t;
+
+/**
+ * Allocates the rings of a queue of @a size descriptors.
+ * @returns `false` if @a size is not a power of two.
+ */
+bool virtq_init(virtq_t *vq, uint16_t idx, uint16_t size, bool event_idx);
+
+/// Makes the chain starting at descriptor @a head available to the device.
+void virtq_add(virtq_t *vq, uint16_t head);
+
+/**
+ * Notifies the device of the chains added since the previous notification,
+ * unless the device has asked not to be notified yet.
+ * @returns `true` if the device has been notified.
+ */
+bool virtq_kick(virtq_t *vq);
+
+/**
+ * Takes the next chain returned by the device.
+ * @returns `false` if the device has not returned any more chains.
+ */
+bool virtq_pop_used(virtq_t *vq, virtq_used_elem_t *out_elem);
+
+/**
+ * Asks the device to interrupt once it returns the next chain.
+ *
+ * @returns `false` if the device has returned chains meanwhile. Those would
+ * not raise an interrupt, so the caller must pop them.
+ */
+bool virtq_arm_used(virtq_t *vq);
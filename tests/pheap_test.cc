@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <vector>
+
+extern "C" {
+#include "pheap.h"
+}
+
+struct item {
+    uint64_t key;
+    pheap_node_t node;
+};
+
+static bool item_less(const pheap_node_t *p_a, const pheap_node_t *p_b) {
+    return PHEAP_NODE_TO_STRUCT(p_a, item, node)->key <
+           PHEAP_NODE_TO_STRUCT(p_b, item, node)->key;
+}
+
+class PheapTest : public testing::Test {
+  protected:
+    void SetUp() override {
+        pheap_init(&heap, item_less);
+    }
+
+    void add_items(const std::vector<uint64_t> &keys) {
+        items.resize(keys.size());
+        for (size_t idx = 0; idx < keys.size(); idx++) {
+            items[idx].key = keys[idx];
+            pheap_insert(&heap, &items[idx].node);
+        }
+    }
+
+    std::vector<uint64_t> pop_all() {
+        std::vector<uint64_t> keys;
+        while (pheap_node_t *p_node = pheap_pop(&heap)) {
+            keys.push_back(PHEAP_NODE_TO_STRUCT(p_node, item, node)->key);
+        }
+        return keys;
+    }
+
+    pheap_t heap;
+    std::vector<item> items;
+};
+
+TEST_F(PheapTest, TestEmpty) {
+    EXPECT_TRUE(pheap_is_empty(&heap));
+    EXPECT_EQ(pheap_peek(&heap), nullptr);
+    EXPECT_EQ(pheap_pop(&heap), nullptr);
+}
+
+TEST_F(PheapTest, TestOne) {
+    add_items({42});
+    EXPECT_FALSE(pheap_is_empty(&heap));
+    EXPECT_EQ(pheap_peek(&heap), &items[0].node);
+    EXPECT_EQ(pheap_pop(&heap), &items[0].node);
+    EXPECT_TRUE(pheap_is_empty(&heap));
+}
+
+TEST_F(PheapTest, TestPeekIsMinimum) {
+    add_items({5, 3, 8, 1, 9});
+    EXPECT_EQ(pheap_peek(&heap), &items[3].node);
+    EXPECT_EQ(pheap_pop(&heap), &items[3].node);
+    EXPECT_EQ(pheap_peek(&heap), &items[1].node);
+}
+
+TEST_F(PheapTest, TestSorted) {
+    add_items({7, 2, 9, 2, 0, 14, 3, 3, 11, 1});
+    std::vector<uint64_t> exp = {7, 2, 9, 2, 0, 14, 3, 3, 11, 1};
+    std::sort(exp.begin(), exp.end());
+    EXPECT_EQ(pop_all(), exp);
+    EXPECT_TRUE(pheap_is_empty(&heap));
+}
+
+TEST_F(PheapTest, TestInterleaved) {
+    items.resize(4);
+    items[0].key = 10;
+    items[1].key = 20;
+    items[2].key = 5;
+    items[3].key = 15;
+
+    pheap_insert(&heap, &items[0].node);
+    pheap_insert(&heap, &items[1].node);
+    EXPECT_EQ(pheap_pop(&heap), &items[0].node);
+
+    pheap_insert(&heap, &items[2].node);
+    pheap_insert(&heap, &items[3].node);
+    EXPECT_EQ(pheap_pop(&heap), &items[2].node);
+
+    // A popped node may be inserted again.
+    items[0].key = 17;
+    pheap_insert(&heap, &items[0].node);
+    EXPECT_EQ(pop_all(), std::vector<uint64_t>({15, 17, 20}));
+}
+
+TEST_F(PheapTest, TestMany) {
+    std::vector<uint64_t> keys;
+    for (uint64_t idx = 0; idx < 1000; idx++) {
+        keys.push_back((idx * 7919) % 1009);
+    }
+    add_items(keys);
+
+    std::sort(keys.begin(), keys.end());
+    EXPECT_EQ(pop_all(), keys);
+}